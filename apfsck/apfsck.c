@@ -2,19 +2,32 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include "apfsck.h"
+#include "arena.h"
+#include "batch.h"
+#include "cache.h"
+#include "crypto.h"
+#include "errlog.h"
+#include "hugepage.h"
+#include "io.h"
+#include "journal.h"
+#include "parallel.h"
+#include "prescan.h"
+#include "progress.h"
+#include "stats.h"
+#include "trace.h"
 #include "super.h"
 
-int fd;
 unsigned int options;
-static bool weird_state;
+u64 max_memory;
+__thread struct check_context *curr_ctx;
 static char *progname;
 
 /**
@@ -22,7 +35,7 @@ static char *progname;
  */
 static void usage(void)
 {
-	fprintf(stderr, "usage: %s [-cuvw] device\n", progname);
+	fprintf(stderr, "usage: %s [-abCcDlmPsSuvw] [-A depth] [-B cache_mb] [-E max_errors] [-H hugepages] [-I backend] [-j jobs] [-J file] [-K kek] [-M max_mb] [-n snapshots] [-p fd] [-t trace] [-T trace] [-V volume] device...\n", progname);
 	exit(1);
 }
 
@@ -45,14 +58,31 @@ __attribute__((noreturn)) void system_error(void)
 }
 
 /**
- * report - Report the issue discovered and exit
+ * abort_check - End the check of the device after an issue was reported
+ *
+ * Jumps back to check_device() if it installed an abort point for the current
+ * context, so that the caller gets an exit code; the process exits otherwise.
+ */
+__attribute__((noreturn)) void abort_check(void)
+{
+	if (curr_ctx->c_abort)
+		longjmp(*curr_ctx->c_abort, 1);
+	exit(1);
+}
+
+/**
+ * report - Report the issue discovered and end the check
  * @context: structure where corruption was found (can be NULL)
  * @message: format string with a short explanation
+ *
+ * In collect-all-errors mode, the issue is just logged if there is a recovery
+ * point to go back to; the issues logged before get printed first otherwise.
  */
 __attribute__((noreturn, format(printf, 2, 3)))	void report(const char *context,
 							    const char *message,
 							    ...)
 {
+	static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
 	char buf[128];
 	va_list args;
 
@@ -60,12 +90,19 @@ __attribute__((noreturn, format(printf, 2, 3)))	void report(const char *context,
 	vsnprintf(buf, sizeof(buf), message, args);
 	va_end(args);
 
+	if (errlog_limit && curr_ctx->c_recovery)
+		errlog_recover(context, buf);
+
+	/* Only one thread gets to report, the rest must wait for the exit */
+	if (!curr_ctx->c_abort)
+		pthread_mutex_lock(&report_lock);
+	errlog_print();
 	if (context)
 		printf("%s: %s\n", context, buf);
 	else
 		printf("%s\n", buf);
 
-	exit(1);
+	abort_check();
 }
 
 /**
@@ -110,24 +147,155 @@ void report_weird(const char *context)
 	 * away.  Remember that an issue was found, for the exit code.
 	 */
 	printf("%s: odd inconsistency (may not be corruption).\n", context);
-	weird_state = true;
+	curr_ctx->c_weird_state = true;
+}
+
+/**
+ * check_device - Check the filesystem on a device or image
+ * @device: path to the device or image
+ *
+ * Returns the exit code for the check.  With a single thread, the issues found
+ * end the check but not the process; other threads have no way to stop the
+ * rest, so they still exit.  The global state of the checker is not reset, so
+ * this can't be called again after it returns.
+ */
+static int check_device(const char *device)
+{
+	struct check_context main_ctx = {0};
+	jmp_buf abort_env;
+	u64 start;
+
+	curr_ctx = &main_ctx;
+	curr_ctx->c_fd = io_open(device);
+	if (check_jobs == 1) {
+		if (setjmp(abort_env)) {
+			progress_end();
+			curr_ctx = NULL;
+			return 1;
+		}
+		curr_ctx->c_abort = &abort_env;
+	}
+
+	start = stats_start();
+	progress_start();
+	trace_load();
+	parse_filesystem();
+	if (journal_path && !errlog_count)
+		journal_save();
+	trace_save();
+	progress_end();
+	stats_print(start);
+	if (errlog_count) {
+		errlog_print();
+		printf("%u issues found.\n", errlog_count);
+		return 1;
+	}
+	if (curr_ctx->c_weird_state)
+		return 1;
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	char *filename;
+	char *endptr;
 
 	progname = argv[0];
 	while (1) {
-		int opt = getopt(argc, argv, "cuvw");
+		int opt = getopt(argc, argv, "A:B:E:H:I:j:J:K:M:n:p:t:T:V:abCcDlmPsSuvw");
 
 		if (opt == -1)
 			break;
 
 		switch (opt) {
+		case 'A':
+			cache_readahead = strtoul(optarg, &endptr, 0);
+			if (*endptr)
+				usage();
+			break;
+		case 'B':
+			cache_budget = strtoull(optarg, &endptr, 0) << 20;
+			if (*endptr)
+				usage();
+			break;
+		case 'E':
+			errlog_limit = strtoul(optarg, &endptr, 0);
+			if (*endptr || !errlog_limit)
+				usage();
+			break;
+		case 'H':
+			if (!hugepage_set_mode(optarg))
+				usage();
+			break;
+		case 'I':
+			io_backend_name = optarg;
+			break;
+		case 'j':
+			check_jobs = strtoul(optarg, &endptr, 0);
+			if (*endptr || !check_jobs)
+				usage();
+			break;
+		case 'J':
+			journal_path = optarg;
+			break;
+		case 'K':
+			if (!add_kek(optarg))
+				usage();
+			break;
+		case 'M':
+			max_memory = strtoull(optarg, &endptr, 0) << 20;
+			if (*endptr || !max_memory)
+				usage();
+			break;
+		case 'n':
+			scope_snapshots = strtoll(optarg, &endptr, 0);
+			if (*endptr || scope_snapshots < 0)
+				usage();
+			break;
+		case 'p':
+			progress_fd = strtol(optarg, &endptr, 0);
+			if (*endptr || progress_fd < 0)
+				usage();
+			break;
+		case 't':
+			trace_record_path = optarg;
+			break;
+		case 'T':
+			trace_replay_path = optarg;
+			break;
+		case 'V':
+			if (!add_scope_volume(optarg))
+				usage();
+			break;
+		case 'a':
+			stats_shape = true;
+			break;
+		case 'b':
+			batch_mode = true;
+			break;
+		case 'C':
+			scope_container_only = true;
+			break;
 		case 'c':
 			options |= OPT_REPORT_CRASH;
 			break;
+		case 'D':
+			io_direct = true;
+			break;
+		case 'l':
+			scope_latest_checkpoint = true;
+			break;
+		case 'm':
+			cache_mapped = true;
+			break;
+		case 'P':
+			prescan_enabled = true;
+			break;
+		case 's':
+			stats_format = STATS_TEXT;
+			break;
+		case 'S':
+			stats_format = STATS_JSON;
+			break;
 		case 'u':
 			options |= OPT_REPORT_UNKNOWN;
 			break;
@@ -141,16 +309,47 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind != argc - 1)
+	if (optind == argc || (!batch_mode && optind != argc - 1))
 		usage();
-	filename = argv[optind];
 
-	fd = open(filename, O_RDONLY);
-	if (fd == -1)
-		system_error();
+	/* The state file must only record complete checks */
+	if (journal_path && scope_is_partial())
+		usage();
+	/* And a single file can't hold the state for several devices */
+	if ((journal_path || trace_record_path || trace_replay_path) && batch_mode)
+		usage();
+	/* The reports for several checks would get mixed up */
+	if (progress_fd >= 0 && batch_mode)
+		usage();
 
-	parse_filesystem();
-	if (weird_state)
-		return 1;
-	return 0;
+	/* The analytics are part of the statistics, in text unless told otherwise */
+	if (stats_shape && !stats_format)
+		stats_format = STATS_TEXT;
+
+	/* The mapping would go through the page cache anyway */
+	if (io_direct && cache_mapped)
+		usage();
+
+	/*
+	 * Skipping a corrupted structure is only safe with a single thread.  In
+	 * batch mode the jobs are processes, and each of them is single-threaded
+	 * already.
+	 */
+	if (errlog_limit && !batch_mode)
+		check_jobs = 1;
+
+	/*
+	 * With a memory limit, a quarter goes to the block cache and half to
+	 * the in-memory records.  The rest is left for the allocation bitmap,
+	 * which gets compressed, and for everything else.
+	 */
+	if (max_memory) {
+		if (cache_budget > max_memory / 4)
+			cache_budget = max_memory / 4;
+		arena_spill_limit = max_memory / 2;
+	}
+
+	if (batch_mode)
+		return run_batch(argv + optind, argc - optind, check_device);
+	return check_device(argv[optind]);
 }
@@ -5,20 +5,73 @@
 #ifndef _APFSCK_H
 #define _APFSCK_H
 
+#include <setjmp.h>
 #include <stdbool.h>
+#include <apfs/types.h>
+
+struct bmap_log;
+struct recovery;
+
+/*
+ * State of an ongoing check.  Each thread works under its own context, so
+ * that separate volumes, snapshots or devices can be checked concurrently.
+ */
+struct check_context {
+	struct super_block	 *c_sb;		/* Container superblock */
+	struct volume_superblock *c_vsb;	/* Volume superblock (or NULL) */
+	u64			 c_xid;		/* Transaction being checked */
+	int			 c_fd;		/* File descriptor for the device */
+	bool			 c_weird_state;	/* Weird issue reported? */
+
+	/* Container bitmap updates to replay later (or NULL) */
+	struct bmap_log		 *c_bmap_log;
+
+	/* Where to resume after an issue, in collect-all-errors mode (or NULL) */
+	struct recovery		 *c_recovery;
+
+	/* Where to end the check after an issue, instead of exiting (or NULL) */
+	jmp_buf			 *c_abort;
+};
 
 /* Declarations for global variables */
 extern unsigned int options;		/* Command line options */
-extern struct super_block *sb;		/* Filesystem superblock */
-extern struct volume_superblock *vsb;	/* Volume superblock */
-extern int fd;				/* File descriptor for the device */
-extern bool ongoing_query;		/* Are we currently running a query? */
+extern u64 max_memory;			/* Memory limit in bytes, or zero */
+extern __thread struct check_context *curr_ctx; /* Context for the thread */
+
+/**
+ * curr_sb - Get the container superblock for the current context
+ */
+static inline struct super_block *curr_sb(void)
+{
+	return curr_ctx->c_sb;
+}
+
+/**
+ * curr_vsb - Get the volume superblock for the current context (or NULL)
+ */
+static inline struct volume_superblock *curr_vsb(void)
+{
+	return curr_ctx->c_vsb;
+}
+
+/**
+ * forbid_recovery - Make the next report() end the whole process
+ *
+ * For issues found while some shared state is left inconsistent, like the
+ * block cache with a read still in flight.
+ */
+static inline void forbid_recovery(void)
+{
+	curr_ctx->c_recovery = NULL;
+	curr_ctx->c_abort = NULL;
+}
 
 /* Option flags */
 #define	OPT_REPORT_CRASH	1 /* Report on-disk signs of a past crash */
 #define OPT_REPORT_UNKNOWN	2 /* Report unknown or unsupported features */
 #define OPT_REPORT_WEIRD	4 /* Report issues that may not be corruption */
 
+extern __attribute__((noreturn)) void abort_check(void);
 extern __attribute__((noreturn, format(printf, 2, 3)))
 		void report(const char *context, const char *message, ...);
 extern void report_crash(const char *context);
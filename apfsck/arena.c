@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "apfsck.h"
+#include "arena.h"
+
+size_t arena_spill_limit;	/* Arena memory before the spill, zero for none */
+static size_t arena_total;	/* Arena memory currently allocated */
+
+/* Unlinked file that receives the arena chunks past the limit */
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static int spill_fd = -1;
+static off_t spill_size;
+
+/*
+ * Header for each chunk of memory in an arena
+ */
+struct arena_chunk {
+	struct arena_chunk	*ac_next;	/* Previous chunk in the arena */
+	size_t			ac_size;	/* Size of the whole chunk */
+	bool			ac_spilled;	/* Is the chunk mapped from disk? */
+	char			ac_data[] __attribute__((aligned(16)));
+};
+
+/**
+ * spill_alloc - Allocate an arena chunk from the spill file
+ * @size: size of the chunk, a multiple of the page size
+ *
+ * The chunk is a shared mapping of a temporary file, so the kernel can write
+ * it back and drop it from memory under pressure, instead of running out.
+ */
+static void *spill_alloc(size_t size)
+{
+	void *ret = NULL;
+	off_t off;
+
+	pthread_mutex_lock(&spill_lock);
+	if (spill_fd < 0) {
+		const char *dir = getenv("TMPDIR");
+		char path[256];
+
+		snprintf(path, sizeof(path), "%s/apfsck-XXXXXX",
+			 dir ? dir : "/tmp");
+		spill_fd = mkstemp(path);
+		if (spill_fd < 0)
+			system_error();
+		unlink(path);
+	}
+	off = spill_size;
+	spill_size += size;
+	if (ftruncate(spill_fd, spill_size))
+		system_error();
+	pthread_mutex_unlock(&spill_lock);
+
+	ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, off);
+	if (ret == MAP_FAILED)
+		system_error();
+	return ret;
+}
+
+/**
+ * arena_add_chunk - Add a new chunk of memory to an arena
+ * @arena:	the arena
+ * @size:	minimum size for the allocation that needs the chunk
+ */
+static void arena_add_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = NULL;
+	size_t chunk_size = arena->a_chunk_size;
+
+	if (chunk_size < ARENA_MIN_CHUNK)
+		chunk_size = ARENA_MIN_CHUNK;
+	if (chunk_size < size)
+		chunk_size = size;
+
+	if (arena_spill_limit && __atomic_load_n(&arena_total, __ATOMIC_RELAXED) +
+					chunk_size > arena_spill_limit) {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t size = sizeof(*chunk) + chunk_size;
+
+		size = (size + page_size - 1) & ~(page_size - 1);
+		chunk = spill_alloc(size);
+		chunk->ac_size = size;
+		chunk->ac_spilled = true;
+	} else {
+		chunk = calloc(1, sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			system_error();
+		chunk->ac_size = sizeof(*chunk) + chunk_size;
+		__atomic_add_fetch(&arena_total, chunk->ac_size,
+				   __ATOMIC_RELAXED);
+	}
+	chunk->ac_next = arena->a_chunks;
+	arena->a_chunks = chunk;
+	arena->a_next = chunk->ac_data;
+	arena->a_left = chunk_size;
+
+	/* Grow the chunks along with the arena, to keep their number down */
+	arena->a_chunk_size = chunk_size << 1;
+	if (arena->a_chunk_size > ARENA_MAX_CHUNK)
+		arena->a_chunk_size = ARENA_MAX_CHUNK;
+}
+
+/**
+ * arena_alloc - Allocate zeroed memory from an arena
+ * @arena:	the arena
+ * @size:	number of bytes required
+ *
+ * Returns a pointer to the memory, aligned to eight bytes.  It will remain
+ * valid until the arena is released.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ret = NULL;
+
+	size = (size + 7) & ~(size_t)7;
+	if (size > arena->a_left)
+		arena_add_chunk(arena, size);
+
+	ret = arena->a_next;
+	arena->a_next += size;
+	arena->a_left -= size;
+	return ret;
+}
+
+/**
+ * arena_release - Free all the memory allocated from an arena
+ * @arena: the arena
+ *
+ * The arena is left empty, and can be used again.
+ */
+void arena_release(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->a_chunks;
+
+	while (chunk) {
+		struct arena_chunk *next = chunk->ac_next;
+
+		if (chunk->ac_spilled) {
+			munmap(chunk, chunk->ac_size);
+		} else {
+			__atomic_sub_fetch(&arena_total, chunk->ac_size,
+					   __ATOMIC_RELAXED);
+			free(chunk);
+		}
+		chunk = next;
+	}
+	memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * arena_str_hash - Hash a string for arena_strdup()
+ * @str:	the string
+ * @len:	length of @str, including the null termination
+ *
+ * This is 64-bit FNV-1a, which is good enough for short names.
+ */
+u64 arena_str_hash(const char *str, u16 len)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	u16 i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * arena_strdup - Make a copy of a string in an arena
+ * @arena:	the arena
+ * @str:	the string
+ * @len:	length of @str, including the null termination
+ *
+ * Returns the copy, which will remain valid until the arena is released.
+ */
+struct arena_str *arena_strdup(struct arena *arena, const char *str, u16 len)
+{
+	struct arena_str *ret;
+
+	ret = arena_alloc(arena, sizeof(*ret) + len);
+	ret->as_hash = arena_str_hash(str, len);
+	ret->as_len = len;
+	memcpy(ret->as_str, str, len);
+	return ret;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <apfs/types.h>
+
+#define ARENA_MIN_CHUNK	(4 * 1024)	/* Size of the first chunk */
+#define ARENA_MAX_CHUNK	(1024 * 1024)	/* Chunks stop growing at this size */
+
+struct arena_chunk;
+
+/*
+ * Bump allocator for small in-memory records that all go away together.  The
+ * memory it returns is zeroed, and can't be freed on its own: the whole arena
+ * is released at once with arena_release().  Once all arenas together go over
+ * arena_spill_limit, their new chunks are mapped from a temporary file.
+ */
+struct arena {
+	struct arena_chunk	*a_chunks;	/* Linked list of chunks */
+	char			*a_next;	/* Next free byte in the chunk */
+	size_t			a_left;		/* Free bytes left in the chunk */
+	size_t			a_chunk_size;	/* Size for the next chunk */
+};
+
+/*
+ * String allocated from an arena, with its hash and length in front
+ */
+struct arena_str {
+	u64	as_hash;	/* Hash of the string */
+	u16	as_len;		/* Length, including the null termination */
+	char	as_str[];	/* The string itself */
+};
+
+/**
+ * arena_str_equal - Check if two arena strings are the same
+ * @a:	first string
+ * @b:	second string
+ *
+ * The hashes are compared first, so that a mismatch rarely needs to look at
+ * the strings themselves.
+ */
+static inline bool arena_str_equal(const struct arena_str *a,
+				   const struct arena_str *b)
+{
+	if (a->as_hash != b->as_hash || a->as_len != b->as_len)
+		return false;
+	return memcmp(a->as_str, b->as_str, a->as_len) == 0;
+}
+
+extern size_t arena_spill_limit;	/* Arena memory before spilling to disk */
+
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern void arena_release(struct arena *arena);
+extern u64 arena_str_hash(const char *str, u16 len);
+extern struct arena_str *arena_strdup(struct arena *arena, const char *str,
+				      u16 len);
+
+#endif	/* _ARENA_H */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Batch mode, to check many devices or images from a single invocation.  This
+ * is a pool of processes, not of threads.  The checker keeps plenty of global
+ * state that is never reset, so each device is checked by a forked child: this
+ * way nothing leaks from one check to the next, and a crash only takes down
+ * its own device.  Up to check_jobs children run at the same
+ * time, and the result for each device is printed as a line of JSON as soon
+ * as its check ends.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "apfsck.h"
+#include "batch.h"
+#include "parallel.h"
+#include "stats.h"
+
+bool batch_mode;
+
+/*
+ * A check running in a child process
+ */
+struct batch_slot {
+	pid_t		s_pid;		/* Process id of the child (0 if unused) */
+	int		s_fd;		/* Read end of the pipe for its output */
+	const char	*s_device;	/* Device being checked */
+	char		*s_out;		/* Output collected so far */
+	size_t		s_len;		/* Length of the output */
+	size_t		s_size;		/* Size of the output buffer */
+};
+
+/*
+ * List of all devices to check, in order
+ */
+struct batch_list {
+	char		**l_devices;
+	int		l_count;	/* Number of devices in the list */
+	int		l_size;		/* Number of entries allocated for */
+};
+
+/**
+ * batch_add - Add a copy of a device name at the end of the list
+ * @list:	the list
+ * @device:	the device
+ */
+static void batch_add(struct batch_list *list, const char *device)
+{
+	if (list->l_count == list->l_size) {
+		list->l_size = list->l_size ? 2 * list->l_size : 64;
+		list->l_devices = realloc(list->l_devices,
+					  list->l_size * sizeof(*list->l_devices));
+		if (!list->l_devices)
+			system_error();
+	}
+	list->l_devices[list->l_count] = strdup(device);
+	if (!list->l_devices[list->l_count])
+		system_error();
+	++list->l_count;
+}
+
+/**
+ * read_batch_list - Add the devices listed in the standard input to the list
+ * @list: the list
+ *
+ * The list has one device per line, and empty lines are ignored.
+ */
+static void read_batch_list(struct batch_list *list)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &size, stdin)) != -1) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (!len)
+			continue;
+		batch_add(list, line);
+	}
+	if (ferror(stdin))
+		system_error();
+	free(line);
+}
+
+/**
+ * batch_start - Start the check for a device in a child process
+ * @slots:	array of slots for all the children
+ * @slot:	the free slot for this child
+ * @device:	the device to check
+ * @check:	function that checks a device and returns its exit code
+ */
+static void batch_start(struct batch_slot *slots, struct batch_slot *slot,
+			const char *device, int (*check)(const char *device))
+{
+	int fds[2];
+	pid_t pid;
+	int i;
+
+	if (pipe(fds))
+		system_error();
+
+	/* Don't let the child inherit the unflushed output */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid < 0)
+		system_error();
+
+	if (!pid) {
+		for (i = 0; i < check_jobs; ++i) {
+			if (slots[i].s_pid)
+				close(slots[i].s_fd);
+		}
+		close(fds[0]);
+		if (dup2(fds[1], STDOUT_FILENO) < 0 ||
+		    dup2(fds[1], STDERR_FILENO) < 0)
+			system_error();
+		close(fds[1]);
+
+		/* The children are single-threaded, the pool is the parallelism */
+		check_jobs = 1;
+		exit(check(device));
+	}
+
+	close(fds[1]);
+	slot->s_pid = pid;
+	slot->s_fd = fds[0];
+	slot->s_device = device;
+	slot->s_len = 0;
+}
+
+/**
+ * batch_read - Collect the output of a child, if there is any
+ * @slot: the slot for the child
+ *
+ * Returns false once the child closes its end of the pipe.
+ */
+static bool batch_read(struct batch_slot *slot)
+{
+	ssize_t ret;
+
+	if (slot->s_size - slot->s_len < 4096) {
+		slot->s_size = slot->s_size ? 2 * slot->s_size : 8192;
+		slot->s_out = realloc(slot->s_out, slot->s_size);
+		if (!slot->s_out)
+			system_error();
+	}
+
+	ret = read(slot->s_fd, slot->s_out + slot->s_len,
+		   slot->s_size - slot->s_len - 1);
+	if (ret < 0)
+		system_error();
+	slot->s_len += ret;
+	return ret != 0;
+}
+
+/**
+ * batch_finish - Wait for a child and print the result of its check
+ * @slot: the slot for the child, which already closed its output
+ *
+ * Returns the exit code for the check: the one from the child, or 128 plus
+ * the signal number if it was killed.
+ */
+static int batch_finish(struct batch_slot *slot)
+{
+	int status, code;
+
+	close(slot->s_fd);
+	if (waitpid(slot->s_pid, &status, 0) < 0)
+		system_error();
+	slot->s_pid = 0;
+
+	if (WIFEXITED(status))
+		code = WEXITSTATUS(status);
+	else
+		code = 128 + WTERMSIG(status);
+
+	slot->s_out[slot->s_len] = 0;
+	printf("{\"device\": ");
+	print_json_string(stdout, slot->s_device);
+	printf(", \"exit\": %d, \"output\": ", code);
+	print_json_string(stdout, slot->s_out);
+	printf("}\n");
+	fflush(stdout);
+	return code;
+}
+
+/**
+ * run_batch - Check a list of devices, on up to check_jobs child processes
+ * @devices:	devices from the command line, with "-" for the standard input
+ * @count:	number of devices in @devices
+ * @check:	function that checks a device and returns its exit code
+ *
+ * Returns zero if no issues were found at all, or 1 otherwise.
+ */
+int run_batch(char **devices, int count, int (*check)(const char *device))
+{
+	struct batch_slot *slots;
+	struct pollfd *polls;
+	struct batch_list list = {0};
+	int next, running = 0;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (strcmp(devices[i], "-"))
+			batch_add(&list, devices[i]);
+		else
+			read_batch_list(&list);
+	}
+
+	slots = calloc(check_jobs, sizeof(*slots));
+	polls = calloc(check_jobs, sizeof(*polls));
+	if (!slots || !polls)
+		system_error();
+
+	next = 0;
+	while (next < list.l_count || running) {
+		int nfds = 0;
+
+		for (i = 0; i < check_jobs && next < list.l_count; ++i) {
+			if (slots[i].s_pid)
+				continue;
+			batch_start(slots, &slots[i], list.l_devices[next++], check);
+			++running;
+		}
+
+		for (i = 0; i < check_jobs; ++i) {
+			if (!slots[i].s_pid)
+				continue;
+			polls[nfds].fd = slots[i].s_fd;
+			polls[nfds].events = POLLIN;
+			++nfds;
+		}
+		if (poll(polls, nfds, -1) < 0)
+			system_error();
+
+		nfds = 0;
+		for (i = 0; i < check_jobs; ++i) {
+			if (!slots[i].s_pid)
+				continue;
+			if (!polls[nfds++].revents)
+				continue;
+			if (batch_read(&slots[i]))
+				continue;
+			if (batch_finish(&slots[i]))
+				ret = 1;
+			--running;
+		}
+	}
+
+	for (i = 0; i < check_jobs; ++i)
+		free(slots[i].s_out);
+	free(slots);
+	free(polls);
+	for (i = 0; i < list.l_count; ++i)
+		free(list.l_devices[i]);
+	free(list.l_devices);
+	return ret;
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdbool.h>
+
+extern bool batch_mode;		/* Check a list of devices? */
+
+extern int run_batch(char **devices, int count,
+		     int (*check)(const char *device));
+
+#endif	/* _BATCH_H */
@@ -3,27 +3,32 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <apfs/bitmap.h>
 #include <apfs/raw.h>
+#include <apfs/thread.h>
 #include <apfs/types.h>
 #include "apfsck.h"
 #include "btree.h"
+#include "cache.h"
 #include "dir.h"
+#include "errlog.h"
 #include "extents.h"
 #include "htable.h"
 #include "inode.h"
 #include "key.h"
 #include "object.h"
+#include "parallel.h"
+#include "progress.h"
 #include "snapshot.h"
 #include "spaceman.h"
+#include "stats.h"
 #include "super.h"
 #include "xattr.h"
 
-bool ongoing_query;
-
 /**
  * node_min_table_size - Return the minimum size for a node's table of contents
  * @node: the node
@@ -53,7 +58,7 @@ static int node_min_table_size(struct node *node)
 	}
 
 	/* The footer of root nodes is ignored for some reason */
-	space = sb->s_blocksize - sizeof(struct apfs_btree_node_phys);
+	space = curr_sb()->s_blocksize - sizeof(struct apfs_btree_node_phys);
 	count = space / (key_size + val_size + toc_size);
 	return count * toc_size;
 }
@@ -78,7 +83,7 @@ static bool node_is_valid(struct node *node)
 	if (node->toc != sizeof(struct apfs_btree_node_phys))
 		return false; /* The table of contents follows the header */
 
-	if (node->data > sb->s_blocksize -
+	if (node->data > curr_sb()->s_blocksize -
 		(node_is_root(node) ? sizeof(struct apfs_btree_info) : 0))
 		return false; /* The value area must start before it ends... */
 
@@ -107,14 +112,14 @@ static void node_parse_key_free_list(struct node *node)
 	int off;
 
 	/* Each bit represents a byte in the key area */
-	node->free_key_bmap = malloc((area_len + 7) / 8);
+	node->free_key_bmap = malloc(BITMAP_WORDS(area_len) * sizeof(u64));
 	if (!node->free_key_bmap)
 		system_error();
-	memset(node->free_key_bmap, 0xFF, (area_len + 7) / 8);
+	memset(node->free_key_bmap, 0xFF, BITMAP_WORDS(area_len) * sizeof(u64));
 
 	off = le16_to_cpu(free->off);
 	while (total > 0) {
-		int len, i;
+		int len;
 
 		/* Tiny free areas may not be in the list */
 		if (off == APFS_BTOFF_INVALID)
@@ -132,15 +137,10 @@ static void node_parse_key_free_list(struct node *node)
 		if (off + len > area_len)
 			report("B-tree node", "free key is out-of-bounds.");
 
-		for (i = off; i < off + len; ++i) {
-			u8 *byte = node->free_key_bmap + i / 8;
-			u8 flag = 1 << i % 8;
-
-			if (!(*byte & flag))
-				report("B-tree node",
-				       "byte listed twice in free key list.");
-			*byte ^= flag;
-		}
+		if (bitmap_count_range(node->free_key_bmap, off, len) != len)
+			report("B-tree node",
+			       "byte listed twice in free key list.");
+		bitmap_clear_range(node->free_key_bmap, off, len);
 		total -= len;
 
 		off = le16_to_cpu(free->off);
@@ -165,19 +165,19 @@ static void node_parse_val_free_list(struct node *node)
 	int off;
 
 	/* Only the root has a footer */
-	area_len = sb->s_blocksize - node->data -
+	area_len = curr_sb()->s_blocksize - node->data -
 		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 	end_raw = (void *)node->raw + node->data + area_len;
 
 	/* Each bit represents a byte in the value area */
-	node->free_val_bmap = malloc((area_len + 7) / 8);
+	node->free_val_bmap = malloc(BITMAP_WORDS(area_len) * sizeof(u64));
 	if (!node->free_val_bmap)
 		system_error();
-	memset(node->free_val_bmap, 0xFF, (area_len + 7) / 8);
+	memset(node->free_val_bmap, 0xFF, BITMAP_WORDS(area_len) * sizeof(u64));
 
 	off = le16_to_cpu(free->off);
 	while (total > 0) {
-		int len, i;
+		int len;
 
 		/* Tiny free areas may not be in the list */
 		if (off == APFS_BTOFF_INVALID)
@@ -195,15 +195,10 @@ static void node_parse_val_free_list(struct node *node)
 		if (area_len < off || len > off)
 			report("B-tree node", "free value is out-of-bounds.");
 
-		for (i = area_len - off; i < area_len - off + len; ++i) {
-			u8 *byte = node->free_val_bmap + i / 8;
-			u8 flag = 1 << i % 8;
-
-			if (!(*byte & flag))
-				report("B-tree node",
-				       "byte listed twice in free value list.");
-			*byte ^= flag;
-		}
+		if (bitmap_count_range(node->free_val_bmap, area_len - off, len) != len)
+			report("B-tree node",
+			       "byte listed twice in free value list.");
+		bitmap_clear_range(node->free_val_bmap, area_len - off, len);
 		total -= len;
 
 		off = le16_to_cpu(free->off);
@@ -236,16 +231,16 @@ static void node_prepare_bitmaps(struct node *node)
 	keys_len = node->free - node->key;
 
 	/* Each bit represents a byte in the key area */
-	node->used_key_bmap = calloc(1, (keys_len + 7) / 8);
+	node->used_key_bmap = calloc(BITMAP_WORDS(keys_len), sizeof(u64));
 	if (!node->used_key_bmap)
 		system_error();
 
 	/* Only the root has a footer */
-	values_len = sb->s_blocksize - node->data -
+	values_len = curr_sb()->s_blocksize - node->data -
 		     (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 
 	/* Each bit represents a byte in the value area */
-	node->used_val_bmap = calloc(1, (values_len + 7) / 8);
+	node->used_val_bmap = calloc(BITMAP_WORDS(values_len), sizeof(u64));
 	if (!node->used_val_bmap)
 		system_error();
 
@@ -253,16 +248,58 @@ static void node_prepare_bitmaps(struct node *node)
 	node_parse_val_free_list(node);
 }
 
+/**
+ * node_parse_header - Read the fields of a node header, and check their sanity
+ * @node: the node, with the raw block already set
+ */
+static void node_parse_header(struct node *node)
+{
+	struct apfs_btree_node_phys *raw = node->raw;
+
+	node->level = le16_to_cpu(raw->btn_level);
+	node->flags = le16_to_cpu(raw->btn_flags);
+	node->records = le32_to_cpu(raw->btn_nkeys);
+	node->toc = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off);
+	node->key = node->toc + le16_to_cpu(raw->btn_table_space.len);
+	node->free = node->key + le16_to_cpu(raw->btn_free_space.off);
+	node->data = node->free + le16_to_cpu(raw->btn_free_space.len);
+
+	if (!node_is_valid(node)) {
+		report("B-tree node", "block 0x%llx is not sane.",
+		       (unsigned long long)node->object.block_nr);
+	}
+}
+
+/**
+ * node_is_simple_fixed_leaf - Check if a leaf can go through parse_fixed_leaf()
+ * @node: the node, with the header already parsed
+ *
+ * This is the case for leaves of trees with their own fixed size parser, as
+ * long as the free lists are empty: the node then has no unused space other
+ * than the free area, so the allocation totals can be checked arithmetically.
+ */
+static bool node_is_simple_fixed_leaf(struct node *node)
+{
+	struct apfs_btree_node_phys *raw = node->raw;
+
+	if (!node->btree->fixed_leaf)
+		return false;
+	if (!node_is_leaf(node) || !node_has_fixed_kv_size(node))
+		return false;
+	return !raw->btn_key_free_list.len && !raw->btn_val_free_list.len &&
+	       le16_to_cpu(raw->btn_key_free_list.off) == APFS_BTOFF_INVALID &&
+	       le16_to_cpu(raw->btn_val_free_list.off) == APFS_BTOFF_INVALID;
+}
+
 /**
  * read_node - Read a node header from disk
  * @oid:	object id for the node
- * @btree:	tree structure, with the omap_table already set
+ * @btree:	tree structure, with the omap_index already set
  *
  * Returns a pointer to the resulting node structure.
  */
 static struct node *read_node(u64 oid, struct btree *btree)
 {
-	struct apfs_btree_node_phys *raw;
 	struct node *node;
 	u32 obj_type, obj_subtype;
 
@@ -273,23 +310,10 @@ static struct node *read_node(u64 oid, struct btree *btree)
 
 	/* The free-space queue is the only tree with ephemeral nodes so far */
 	if (btree_is_free_queue(btree))
-		raw = read_ephemeral_object(oid, &node->object);
+		node->raw = read_ephemeral_object(oid, &node->object);
 	else
-		raw = read_object(oid, btree->omap_table, &node->object);
-	node->raw = raw;
-
-	node->level = le16_to_cpu(raw->btn_level);
-	node->flags = le16_to_cpu(raw->btn_flags);
-	node->records = le32_to_cpu(raw->btn_nkeys);
-	node->toc = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off);
-	node->key = node->toc + le16_to_cpu(raw->btn_table_space.len);
-	node->free = node->key + le16_to_cpu(raw->btn_free_space.off);
-	node->data = node->free + le16_to_cpu(raw->btn_free_space.len);
-
-	if (!node_is_valid(node)) {
-		report("B-tree node", "block 0x%llx is not sane.",
-		       (unsigned long long)node->object.block_nr);
-	}
+		node->raw = read_object(oid, btree->omap_index, &node->object);
+	node_parse_header(node);
 
 	obj_type = node->object.type;
 	if (node_is_root(node) && obj_type != APFS_OBJECT_TYPE_BTREE)
@@ -314,7 +338,9 @@ static struct node *read_node(u64 oid, struct btree *btree)
 	if (btree_is_snapshots(btree) && obj_subtype != APFS_OBJECT_TYPE_OMAP_SNAPSHOT)
 		report("Omap snapshot tree node", "wrong object subtype.");
 
-	node_prepare_bitmaps(node);
+	/* Simple leaves are checked without bitmaps, see parse_fixed_leaf() */
+	if (!node_is_simple_fixed_leaf(node))
+		node_prepare_bitmaps(node);
 
 	return node;
 }
@@ -330,7 +356,7 @@ static void node_free(struct node *node)
 {
 	if (node_is_root(node))
 		return;	/* The root nodes are needed by the sb until the end */
-	munmap(node->raw, sb->s_blocksize);
+	release_block(node->raw);
 	free(node->free_key_bmap);
 	free(node->free_val_bmap);
 	free(node->used_key_bmap);
@@ -381,26 +407,25 @@ static int node_locate_key(struct node *node, int index, int *off)
 }
 
 /**
- * node_locate_data - Locate the data of a node record
+ * __node_locate_data - Locate the data of a node record, without any checks
  * @node:	node to be searched
- * @index:	number of the entry to locate
+ * @index:	number of the entry to locate, must be in range
  * @off:	on return will hold the offset in the block
+ * @area_len:	on return will hold the length of the value area
  *
- * Returns the length of the data. The function checks that this length fits
- * within the value area; callers must use the returned value to make sure they
- * never operate outside its bounds.
+ * Returns the length of the data, or -1 for a free queue record that has no
+ * value, in which case @off is left unset.  Nothing gets reported here, so the
+ * caller must check the offset against @area_len before using it.
  */
-static int node_locate_data(struct node *node, int index, int *off)
+static int __node_locate_data(struct node *node, int index, int *off,
+			      int *area_len)
 {
 	struct apfs_btree_node_phys *raw;
-	int len, off_in_area, area_len;
-
-	if (index >= node->records)
-		report("B-tree", "requested index out-of-bounds.");
+	int len, off_in_area;
 
 	/* Only the root has a footer */
-	area_len = sb->s_blocksize - node->data -
-		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
+	*area_len = curr_sb()->s_blocksize - node->data -
+		    (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 
 	raw = node->raw;
 	if (node_has_fixed_kv_size(node)) {
@@ -413,7 +438,7 @@ static int node_locate_data(struct node *node, int index, int *off)
 		if (btree_is_free_queue(btree)) {
 			/* A free-space queue record may have no value */
 			if (le16_to_cpu(entry->v) == APFS_BTOFF_INVALID)
-				return 0;
+				return -1;
 			len = 8;
 		}
 		if (btree_is_omap(btree))
@@ -422,7 +447,7 @@ static int node_locate_data(struct node *node, int index, int *off)
 			len = node_is_leaf(node) ? sizeof(struct apfs_omap_snapshot) : 8;
 
 		/* Value offsets are backwards from the end of the value area */
-		off_in_area = area_len - le16_to_cpu(entry->v);
+		off_in_area = *area_len - le16_to_cpu(entry->v);
 	} else {
 		/* These node types have variable length keys and data */
 		struct apfs_kvloc *entry;
@@ -431,11 +456,34 @@ static int node_locate_data(struct node *node, int index, int *off)
 		len = le16_to_cpu(entry->v.len);
 
 		/* Value offsets are backwards from the end of the value area */
-		off_in_area = area_len - le16_to_cpu(entry->v.off);
+		off_in_area = *area_len - le16_to_cpu(entry->v.off);
 	}
 
 	*off = node->data + off_in_area;
-	if (*off < node->data || off_in_area >= area_len)
+	return len;
+}
+
+/**
+ * node_locate_data - Locate the data of a node record
+ * @node:	node to be searched
+ * @index:	number of the entry to locate
+ * @off:	on return will hold the offset in the block
+ *
+ * Returns the length of the data. The function checks that this length fits
+ * within the value area; callers must use the returned value to make sure they
+ * never operate outside its bounds.
+ */
+static int node_locate_data(struct node *node, int index, int *off)
+{
+	int len, area_len;
+
+	if (index >= node->records)
+		report("B-tree", "requested index out-of-bounds.");
+
+	len = __node_locate_data(node, index, off, &area_len);
+	if (len < 0)
+		return 0;
+	if (*off < node->data || *off - node->data >= area_len)
 		report("B-tree", "value is out-of-bounds.");
 
 	return len;
@@ -447,20 +495,11 @@ static int node_locate_data(struct node *node, int index, int *off)
  * @off:	offset of the region, relative to its area in the node
  * @len:	length of the region in the node
  */
-static void bmap_mark_as_used(u8 *bitmap, int off, int len)
+static void bmap_mark_as_used(u64 *bitmap, int off, int len)
 {
-	u8 *byte;
-	u8 flag;
-	int i;
-
-	for (i = off; i < off + len; ++i) {
-		byte = bitmap + i / 8;
-		flag = 1 << i % 8;
-
-		if (*byte & flag)
-			report("B-tree node", "overlapping record data.");
-		*byte |= flag;
-	}
+	if (bitmap_test_range_any(bitmap, off, len))
+		report("B-tree node", "overlapping record data.");
+	bitmap_set_range(bitmap, off, len);
 }
 
 /**
@@ -473,37 +512,11 @@ static void bmap_mark_as_used(u8 *bitmap, int off, int len)
  * total number of free bytes (including those not counted in @free_bmap due
  * to fragmentation).
  */
-static int compare_bmaps(u8 *free_bmap, u8 *used_bmap, int area_len)
+static int compare_bmaps(u64 *free_bmap, u64 *used_bmap, int area_len)
 {
-	int unused = 0;
-	int i, j;
-
-	for (i = 0; i < area_len / 8; ++i) {
-		for (j = 0; j < 8; ++j) {
-			u8 mask = 1 << j;
-
-			if (!(used_bmap[i] & mask))
-				++unused;
-		}
-
-		if ((free_bmap[i] | used_bmap[i]) != free_bmap[i])
-			report("B-tree node",
-			       "used record space listed as free.");
-	}
-
-	/* Last byte has some undefined bits by the end, so be careful */
-	for (j = 0; j < area_len % 8; ++j) {
-		u8 mask = 1 << j;
-
-		if (!(used_bmap[area_len / 8] & mask))
-			++unused;
-		if (used_bmap[area_len / 8] & mask &&
-		    !(free_bmap[area_len / 8] & mask))
-			report("B-tree node",
-			       "used record space listed as free.");
-	}
-
-	return unused;
+	if (!bitmap_is_subset(used_bmap, free_bmap, area_len))
+		report("B-tree node", "used record space listed as free.");
+	return area_len - bitmap_count_range(used_bmap, 0, area_len);
 }
 
 /**
@@ -538,7 +551,7 @@ static void node_compare_bmaps(struct node *node)
 	free_head = &node->raw->btn_val_free_list;
 
 	/* Only the root has a footer */
-	area_len = sb->s_blocksize - node->data -
+	area_len = curr_sb()->s_blocksize - node->data -
 		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 	free_count = compare_bmaps(node->free_val_bmap, node->used_val_bmap,
 				   area_len);
@@ -547,6 +560,95 @@ static void node_compare_bmaps(struct node *node)
 		report("B-tree", "wrong free space total for value area.");
 }
 
+/* Protects the object map tables, which may be shared by several threads */
+pthread_mutex_t omap_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Catalog records collected by a worker thread, in key order.  Each one is
+ * stored as a header followed by copies of the raw key and value.
+ */
+struct record_log {
+	void	*r_data;	/* Records in the log */
+	size_t	r_len;		/* Number of bytes in use */
+	size_t	r_size;		/* Number of bytes allocated */
+};
+
+/*
+ * Header for a record in the log
+ */
+struct record_log_entry {
+	u16	e_key_len;	/* Length of the key */
+	u16	e_val_len;	/* Length of the value */
+};
+
+/**
+ * record_log_entry_size - Space taken in the log by a record and its header
+ * @key_len:	length of the raw key
+ * @val_len:	length of the raw value
+ *
+ * The sizes are rounded up, so that the next header is aligned.
+ */
+static inline size_t record_log_entry_size(int key_len, int val_len)
+{
+	return ROUND_UP(sizeof(struct record_log_entry) + key_len + val_len,
+			_Alignof(struct record_log_entry));
+}
+
+/**
+ * log_cat_record - Keep a copy of a catalog record to be parsed later
+ * @log:	the record log
+ * @key:	pointer to the raw key
+ * @key_len:	length of the raw key
+ * @val:	pointer to the raw value
+ * @val_len:	length of the raw value
+ */
+static void log_cat_record(struct record_log *log, void *key, int key_len,
+			   void *val, int val_len)
+{
+	struct record_log_entry *entry;
+	size_t needed = record_log_entry_size(key_len, val_len);
+
+	if (log->r_len + needed > log->r_size) {
+		if (!log->r_size)
+			log->r_size = 64 * 1024;
+		while (log->r_len + needed > log->r_size)
+			log->r_size *= 2;
+		log->r_data = realloc(log->r_data, log->r_size);
+		if (!log->r_data)
+			system_error();
+	}
+
+	entry = log->r_data + log->r_len;
+	entry->e_key_len = key_len;
+	entry->e_val_len = val_len;
+	memcpy((void *)(entry + 1), key, key_len);
+	memcpy((void *)(entry + 1) + key_len, val, val_len);
+	log->r_len += needed;
+}
+
+static void parse_cat_record(void *key, void *val, int len);
+
+/**
+ * replay_record_log - Parse all catalog records from a log, in order
+ * @log: the record log, which gets emptied
+ */
+static void replay_record_log(struct record_log *log)
+{
+	size_t off = 0;
+
+	while (off < log->r_len) {
+		struct record_log_entry *entry = log->r_data + off;
+		void *key = (void *)(entry + 1);
+		void *val = key + entry->e_key_len;
+
+		parse_cat_record(key, val, entry->e_val_len);
+		off += record_log_entry_size(entry->e_key_len, entry->e_val_len);
+	}
+	free(log->r_data);
+	log->r_data = NULL;
+	log->r_len = log->r_size = 0;
+}
+
 /**
  * parse_cat_record - Parse a catalog record value and check for corruption
  * @key:	pointer to the raw key
@@ -591,140 +693,184 @@ static void parse_cat_record(void *key, void *val, int len)
 }
 
 /**
- * free_omap_record - Free an object map record list after a final check
- * @entry: the entry to free
+ * alloc_omap_index - Allocate an empty index for the records of an omap
  */
-static void free_omap_record_list(struct htable_entry *entry)
+struct omap_index *alloc_omap_index(void)
 {
-	struct omap_record_list *list = (struct omap_record_list *)entry;
-	struct omap_record *curr_rec = list->o_records;
-	int unseen = 0;
+	struct omap_index *index = NULL;
 
-	while (curr_rec) {
-		struct omap_record *next_rec = NULL;
-
-		if (curr_rec->flags & APFS_OMAP_VAL_DELETED) {
-			if (curr_rec->seen)
-				report("Omap record", "deleted but still in use.");
-		} else if (!curr_rec->seen) {
-			/*
-			 * I've encountered a single leaked extended snap meta
-			 * block in some ios images. No idea... (TODO)
-			 */
-			if (vsb && unseen == 0 && curr_rec->xid < sb->s_xid) {
-				struct apfs_obj_phys *raw = NULL;
-				struct object obj = {0};
-
-				raw = read_object_nocheck(curr_rec->bno, &obj);
-				if (obj.type != OBJECT_TYPE_SNAP_META_EXT || obj.subtype != APFS_OBJECT_TYPE_INVALID)
-					report("Leaked omap record", "unexpected object type.");
-				container_bmap_mark_as_used(curr_rec->bno, 1);
-				++vsb->v_block_count;
-				munmap(raw, sb->s_blocksize);
-				++unseen;
-			} else {
-				report("Omap record", "oid-xid combination is never used.");
-			}
-		}
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		system_error();
+	return index;
+}
 
-		next_rec = curr_rec->next;
-		free(curr_rec);
-		curr_rec = next_rec;
-	}
+/**
+ * alloc_omap_seen - Allocate a bitmap of omap records seen by a snapshot
+ * @index: the omap index, already complete
+ *
+ * Each snapshot gets a bitmap of its own for the records of the volume omap,
+ * so that several of them can be checked at once.  The bitmap stays untouched
+ * outside the records used by the snapshot, so most of it is never even
+ * faulted in.
+ */
+u64 *alloc_omap_seen(struct omap_index *index)
+{
+	u64 *bmap;
 
-	free(entry);
+	bmap = calloc((index->oi_count + 63) >> 6, sizeof(*bmap));
+	if (!bmap && index->oi_count)
+		system_error();
+	return bmap;
 }
 
 /**
- * free_omap_table - Free a hash table for omap records, and all its entries
- * @table: table to free
+ * check_unseen_omap_record - Check an omap record that was never used
+ * @index:	the omap index
+ * @i:		position of the record
+ * @unseen:	number of unseen records found so far for the same oid
  */
-void free_omap_table(struct htable_entry **table)
+static void check_unseen_omap_record(struct omap_index *index, u64 i, int unseen)
 {
-	free_htable(table, free_omap_record_list);
+	struct apfs_obj_phys *raw = NULL;
+	struct object obj = {0};
+	u64 bno = index->oi_bnos[i];
+
+	/*
+	 * I've encountered a single leaked extended snap meta block in some
+	 * ios images. No idea... (TODO)
+	 */
+	if (!curr_vsb() || unseen != 0 || index->oi_xids[i] >= curr_ctx->c_xid)
+		report("Omap record", "oid-xid combination is never used.");
+
+	raw = read_object_nocheck_crypto(bno, &obj, omap_record_key(index, i));
+	if (obj.type != OBJECT_TYPE_SNAP_META_EXT || obj.subtype != APFS_OBJECT_TYPE_INVALID)
+		report("Leaked omap record", "unexpected object type.");
+	container_bmap_mark_as_used(bno, 1);
+	++curr_vsb()->v_block_count;
+	release_block(raw);
 }
 
 /**
- * omap_list_clear_seen_for_snap - Clear seen_for_snap for all omap recs in list
- * @entry: a list of omap records
+ * free_omap_index - Free an index of omap records after some final checks
+ * @index: the index to free
  */
-static void omap_list_clear_seen_for_snap(struct htable_entry *entry)
+void free_omap_index(struct omap_index *index)
 {
-	struct omap_record_list *list = (struct omap_record_list *)entry;
-	struct omap_record *rec = NULL;
+	int unseen = 0;
+	u64 i;
+
+	for (i = 0; i < index->oi_count; ++i) {
+		bool seen = omap_index_test(index->oi_seen, i);
 
-	for (rec = list->o_records; rec; rec = rec->next)
-		rec->seen_for_snap = false;
+		if (i == 0 || index->oi_oids[i] != index->oi_oids[i - 1])
+			unseen = 0;
+
+		if (index->oi_flags[i] & APFS_OMAP_VAL_DELETED) {
+			if (seen)
+				report("Omap record", "deleted but still in use.");
+		} else if (!seen) {
+			/* The records may belong to the skipped snapshots */
+			if (curr_vsb() && curr_vsb()->v_snaps_skipped)
+				continue;
+			check_unseen_omap_record(index, i, unseen);
+			++unseen;
+		}
+	}
+
+	free(index->oi_oids);
+	free(index->oi_xids);
+	free(index->oi_bnos);
+	free(index->oi_flags);
+	free(index->oi_seen);
+	free(index->oi_seen_for_latest);
+	free(index);
 }
 
 /**
- * omap_htable_clear_seen_for_snap - Clear seen_for_snap on all omap recs
- * @table: the hash table of omap records to be cleared
+ * omap_index_grow - Make room for more records in an omap index
+ * @index: the omap index
  */
-void omap_htable_clear_seen_for_snap(struct htable_entry **table)
+static void omap_index_grow(struct omap_index *index)
 {
-	return apply_on_htable(table, omap_list_clear_seen_for_snap);
+	u64 old_words = (index->oi_size + 63) >> 6;
+	u64 new_words;
+
+	index->oi_size = index->oi_size ? index->oi_size << 1 : 64;
+	new_words = (index->oi_size + 63) >> 6;
+
+	index->oi_oids = realloc(index->oi_oids, index->oi_size * sizeof(u64));
+	index->oi_xids = realloc(index->oi_xids, index->oi_size * sizeof(u64));
+	index->oi_bnos = realloc(index->oi_bnos, index->oi_size * sizeof(u64));
+	index->oi_flags = realloc(index->oi_flags, index->oi_size);
+	index->oi_seen = realloc(index->oi_seen, new_words * sizeof(u64));
+	index->oi_seen_for_latest = realloc(index->oi_seen_for_latest, new_words * sizeof(u64));
+	if (!index->oi_oids || !index->oi_xids || !index->oi_bnos ||
+	    !index->oi_flags || !index->oi_seen || !index->oi_seen_for_latest)
+		system_error();
+
+	memset(index->oi_seen + old_words, 0, (new_words - old_words) * sizeof(u64));
+	memset(index->oi_seen_for_latest + old_words, 0, (new_words - old_words) * sizeof(u64));
 }
 
 /**
- * get_omap_record - Find or create an omap record structure in a hash table
+ * omap_index_append - Add a new record at the end of an omap index
+ * @index:	the omap index
  * @oid:	object id to be mapped
  * @xid:	transaction id
- * @table:	the hash table of omap records to be searched
  *
- * Returns the omap record structure, after creating it if necessary.
+ * Returns the position of the new record.  Records must be added in order.
  */
-static struct omap_record *get_omap_record(u64 oid, u64 xid, struct htable_entry **table)
+static u64 omap_index_append(struct omap_index *index, u64 oid, u64 xid)
 {
-	struct omap_record_list *list = NULL;
-	struct omap_record **omap_p = NULL;
-	struct omap_record *omap = NULL;
-	struct omap_record *new = NULL;
-
-	list = (struct omap_record_list *)get_htable_entry(oid, sizeof(struct omap_record), table);
-
-	omap_p = &list->o_records;
-	omap = *omap_p;
-	while (omap) {
-		if (xid == omap->xid)
-			return omap;
-		if (xid < omap->xid)
-			break;
-		omap_p = &omap->next;
-		omap = *omap_p;
+	u64 last = index->oi_count - 1;
+
+	if (index->oi_count) {
+		if (oid < index->oi_oids[last])
+			report("Object map", "records are out of order.");
+		if (oid == index->oi_oids[last]) {
+			if (xid == index->oi_xids[last])
+				report("Object map", "two entries with the same oid-xid.");
+			if (xid < index->oi_xids[last])
+				report("Object map", "records are out of order.");
+		}
 	}
-	new = calloc(1, sizeof(*new));
-	if (!new)
-		system_error();
-	new->xid = xid;
-	new->oid = oid;
-	new->next = omap;
-	*omap_p = new;
-	return new;
+
+	if (index->oi_count == index->oi_size)
+		omap_index_grow(index);
+	index->oi_oids[index->oi_count] = oid;
+	index->oi_xids[index->oi_count] = xid;
+	return index->oi_count++;
 }
 
 /**
- * get_latest_omap_record - Find the most recent omap record before a given xid
+ * omap_index_lookup - Find the most recent omap record before a given xid
+ * @index:	the omap index to be searched
  * @oid:	object id to be mapped
  * @xid:	transaction id
- * @table:	the hash table of omap records to be searched
  *
- * Returns the omap record structure, or NULL if there is none matches.
+ * Returns the position of the record in the index, or OMAP_INDEX_NONE if no
+ * record matches.
  */
-struct omap_record *get_latest_omap_record(u64 oid, u64 xid, struct htable_entry **table)
+u64 omap_index_lookup(struct omap_index *index, u64 oid, u64 xid)
 {
-	struct omap_record_list *list = NULL;
-	struct omap_record *omap = NULL, *prev_omap = NULL;
+	u64 lo = 0, hi = index->oi_count;
 
-	list = (struct omap_record_list *)get_htable_entry(oid, sizeof(struct omap_record), table);
-	omap = list->o_records;
-	while (omap) {
-		if (xid < omap->xid)
-			break;
-		prev_omap = omap;
-		omap = prev_omap->next;
+	/* Find the first record that comes after (oid, xid) */
+	while (lo < hi) {
+		u64 mid = lo + ((hi - lo) >> 1);
+		u64 mid_oid = index->oi_oids[mid];
+
+		if (mid_oid < oid || (mid_oid == oid && index->oi_xids[mid] <= xid))
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return prev_omap;
+
+	/* The record right before it is the one we want, if the oid matches */
+	if (lo == 0 || index->oi_oids[lo - 1] != oid)
+		return OMAP_INDEX_NONE;
+	return lo - 1;
 }
 
 /**
@@ -738,7 +884,8 @@ struct omap_record *get_latest_omap_record(u64 oid, u64 xid, struct htable_entry
 static void parse_omap_record(struct apfs_omap_key *key,
 			      struct apfs_omap_val *val, int len)
 {
-	struct omap_record *omap_rec;
+	struct omap_index *index = NULL;
+	u64 pos;
 	u32 flags;
 	u32 size;
 
@@ -749,37 +896,400 @@ static void parse_omap_record(struct apfs_omap_key *key,
 	if (len != sizeof(*val))
 		report("Omap record", "wrong size of value.");
 
-	if (vsb) {
-		/* We are parsing a volume's object map */
-		omap_rec = get_omap_record(le64_to_cpu(key->ok_oid), le64_to_cpu(key->ok_xid), vsb->v_omap_table);
-	} else {
-		/* We are parsing the container's object map */
-		omap_rec = get_omap_record(le64_to_cpu(key->ok_oid), le64_to_cpu(key->ok_xid), sb->s_omap_table);
-	}
-
-	if (omap_rec->bno)
-		report("Object map", "two entries with the same oid-xid.");
-	omap_rec->bno = le64_to_cpu(val->ov_paddr);
+	/* We are parsing either a volume's object map, or the container's */
+	index = curr_vsb() ? curr_vsb()->v_omap_index : curr_sb()->s_omap_index;
+	pos = omap_index_append(index, le64_to_cpu(key->ok_oid), le64_to_cpu(key->ok_xid));
 
-	omap_rec->flags = flags = le32_to_cpu(val->ov_flags);
+	index->oi_bnos[pos] = le64_to_cpu(val->ov_paddr);
+	flags = le32_to_cpu(val->ov_flags);
 	if ((flags & APFS_OMAP_VAL_FLAGS_VALID_MASK) != flags)
 		report("Omap record", "invalid flag in use.");
+	index->oi_flags[pos] = flags;
 	if (flags & APFS_OMAP_VAL_SAVED)
 		report("Omap record", "saved flag is set.");
 	if (flags & APFS_OMAP_VAL_NOHEADER)
 		report_unknown("Virtual objects with no header");
-	if ((bool)(flags & APFS_OMAP_VAL_ENCRYPTED) != (vsb && vsb->v_encrypted))
+	if ((bool)(flags & APFS_OMAP_VAL_ENCRYPTED) != (curr_vsb() && curr_vsb()->v_encrypted))
 		report("Omap record", "wrong encryption flag.");
 	if (flags & APFS_OMAP_VAL_CRYPTO_GENERATION)
 		report_unknown("Crypto generation flag");
 
 	size = le32_to_cpu(val->ov_size);
-	if (size & (sb->s_blocksize - 1))
+	if (size & (curr_sb()->s_blocksize - 1))
 		report("Omap record", "size isn't multiple of block size.");
-	if (size != sb->s_blocksize)
+	if (size != curr_sb()->s_blocksize)
 		report_unknown("Objects with more than one block");
 }
 
+/**
+ * node_prefetch_child - Start reading the child of an index node in advance
+ * @node:	the index node
+ * @index:	index of the child record
+ *
+ * Nothing gets reported here: a corrupted record is just skipped, so that the
+ * issue can be reported in order, once the traversal gets to it.
+ */
+static void node_prefetch_child(struct node *node, int index)
+{
+	struct btree *btree = node->btree;
+	u64 child_id, pos;
+	int off, len, area_len;
+
+	if (index >= node->records || node_is_leaf(node))
+		return;
+	/* Don't bother with the checkpoint mappings of the free queues */
+	if (btree_is_free_queue(btree))
+		return;
+
+	len = __node_locate_data(node, index, &off, &area_len);
+	if (len != 8 || off < node->data || off - node->data + len > area_len)
+		return;
+	child_id = le64_to_cpu(*(__le64 *)((void *)node->raw + off));
+
+	/* The index is never modified after the omap is parsed, no need to lock */
+	if (btree->omap_index) {
+		pos = omap_index_lookup(btree->omap_index, child_id,
+					curr_ctx->c_xid);
+		child_id = pos != OMAP_INDEX_NONE ? btree->omap_index->oi_bnos[pos] : 0;
+		if (!child_id)
+			return;
+	}
+	if (child_id < curr_sb()->s_block_count)
+		cache_prefetch(child_id);
+}
+
+/**
+ * node_prefetch_snapshots - Start reading the snapshot superblocks of a leaf
+ * @node: leaf node of the snapshot metadata tree
+ *
+ * Each snapshot is checked as soon as its record is parsed, so make sure that
+ * the superblocks for the following ones are already on their way.
+ */
+static void node_prefetch_snapshots(struct node *node)
+{
+	int i;
+
+	for (i = 0; i < node->records; ++i) {
+		struct apfs_key_header *hdr;
+		struct apfs_snap_metadata_val *val;
+		u64 bno;
+		int off, len;
+
+		len = node_locate_key(node, i, &off);
+		if (len < sizeof(*hdr))
+			continue;
+		hdr = (void *)node->raw + off;
+		if (cat_type(hdr) != APFS_TYPE_SNAP_METADATA)
+			continue;
+
+		len = node_locate_data(node, i, &off);
+		if (len < sizeof(*val))
+			continue;
+		val = (void *)node->raw + off;
+		bno = le64_to_cpu(val->sblock_oid);
+		if (bno && bno < curr_sb()->s_block_count)
+			cache_prefetch(bno);
+	}
+}
+
+static void parse_child(struct btree *btree, struct node *parent, u64 child_id,
+			struct key *last_key, char *name_buf);
+
+/*
+ * Record handlers for the leaves of a tree with fixed size keys and values.
+ * The object maps and free queues can be very big, so their leaves get a
+ * parser of their own that works with whole entries instead of bytes.
+ */
+struct fixed_leaf_ops {
+	int	key_len;	/* Size of each key */
+	int	val_len;	/* Size of each value */
+	bool	ghosts;		/* Can records have no value? */
+
+	/* Read and check a key of @node */
+	void (*read_key)(struct node *node, void *raw, struct key *key);
+	/* Parse a record, with a NULL @val for ghosts */
+	void (*parse)(struct btree *btree, void *key, void *val, int len);
+};
+
+/* Entries in a fixed size area, for the largest possible block */
+#define FIXED_SLOT_WORDS	BITMAP_WORDS(APFS_NX_MAXIMUM_BLOCK_SIZE / 8)
+
+/**
+ * fixed_slot_mark_as_used - Mark an entry of a node area as used
+ * @slots:	bitmap for the entries of the area
+ * @off:	offset of the entry, relative to its area in the node
+ * @len:	length of each entry in the area
+ */
+static inline void fixed_slot_mark_as_used(u64 *slots, int off, int len)
+{
+	int slot = off / len;
+	u64 mask = 1ULL << (slot & 63);
+
+	if (slots[slot >> 6] & mask)
+		report("B-tree node", "overlapping record data.");
+	slots[slot >> 6] |= mask;
+}
+
+/**
+ * node_fixed_toc_is_aligned - Check that all entries in a leaf are aligned
+ * @node: leaf node with fixed size entries
+ *
+ * Entries that straddle two slots are legal, as far as I know, but they never
+ * happen in practice; they are left for the generic parser to deal with.
+ */
+static bool node_fixed_toc_is_aligned(struct node *node)
+{
+	const struct fixed_leaf_ops *ops = node->btree->fixed_leaf;
+	struct apfs_kvoff *toc = (struct apfs_kvoff *)node->raw->btn_data;
+	int i;
+
+	for (i = 0; i < node->records; ++i) {
+		u16 v = le16_to_cpu(toc[i].v);
+
+		if (le16_to_cpu(toc[i].k) % ops->key_len)
+			return false;
+		if (ops->ghosts && v == APFS_BTOFF_INVALID)
+			continue;
+		if (v % ops->val_len)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * node_add_shape - Add a node to the analytics for the shape of its tree
+ * @node: the node, already checked
+ *
+ * The sizes of the keys and values are left for the caller.
+ */
+static void node_add_shape(struct node *node)
+{
+	struct apfs_btree_node_phys *raw = node->raw;
+	struct stat_shape *shape = &node->btree->shape;
+	int toc_entry, toc_len, key_len, val_len;
+	int space, used, listed, fill;
+
+	if (node_has_fixed_kv_size(node))
+		toc_entry = sizeof(struct apfs_kvoff);
+	else
+		toc_entry = sizeof(struct apfs_kvloc);
+	toc_len = node->key - node->toc;
+	key_len = node->free - node->key;
+	val_len = curr_sb()->s_blocksize - node->data -
+		  (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
+	space = curr_sb()->s_blocksize - sizeof(*raw) -
+		(node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
+
+	/* The totals for the free lists have been checked already */
+	listed = le16_to_cpu(raw->btn_key_free_list.len) +
+		 le16_to_cpu(raw->btn_val_free_list.len);
+	used = node->records * toc_entry + key_len + val_len - listed;
+
+	++shape->sh_levels[node->level < SHAPE_LEVELS ? node->level : SHAPE_LEVELS - 1];
+	fill = used * SHAPE_FILL_BUCKETS / space;
+	++shape->sh_fill[fill < SHAPE_FILL_BUCKETS ? fill : SHAPE_FILL_BUCKETS - 1];
+	shape->sh_space += space;
+	shape->sh_used += used;
+	shape->sh_free_gap += node->data - node->free;
+	if (toc_len > node->records * toc_entry)
+		shape->sh_free_toc += toc_len - node->records * toc_entry;
+	shape->sh_free_listed += listed;
+
+	if (node_is_leaf(node))
+		stats_shape_leaf(shape, node->object.block_nr);
+}
+
+/**
+ * parse_fixed_leaf - Parse a simple leaf with fixed size keys and values
+ * @node:	the leaf, which passed node_is_simple_fixed_leaf()
+ * @last_key:	parent key, that must come before all the keys in this node;
+ *		on return, this will hold the last key of this node
+ *
+ * Runs the same checks as parse_subtree(), in the same order; but the table of
+ * contents is walked directly, and the allocation is tracked one entry at a
+ * time.  Since the free lists are empty, the used space must fill both areas.
+ */
+static void parse_fixed_leaf(struct node *node, struct key *last_key)
+{
+	const struct fixed_leaf_ops *ops = node->btree->fixed_leaf;
+	struct btree *btree = node->btree;
+	struct apfs_kvoff *toc = (struct apfs_kvoff *)node->raw->btn_data;
+	u64 used_keys[FIXED_SLOT_WORDS] = {0};
+	u64 used_vals[FIXED_SLOT_WORDS] = {0};
+	void *raw = node->raw;
+	struct key curr_key;
+	int key_area, val_area;
+	int val_count = 0;
+	int i, cmp;
+
+	key_area = node->free - node->key;
+	/* Only the root has a footer */
+	val_area = curr_sb()->s_blocksize - node->data -
+		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
+
+	if (node->records && ops->key_len > btree->longest_key)
+		btree->longest_key = ops->key_len;
+
+	for (i = 0; i < node->records; ++i) {
+		int k = le16_to_cpu(toc[i].k);
+		int v = le16_to_cpu(toc[i].v);
+		void *raw_key, *raw_val = NULL;
+		int len = 0;
+
+		if (k + ops->key_len > key_area)
+			report("B-tree", "key is out-of-bounds.");
+		fixed_slot_mark_as_used(used_keys, k, ops->key_len);
+		raw_key = raw + node->key + k;
+
+		ops->read_key(node, raw_key, &curr_key);
+		cmp = keycmp(last_key, &curr_key);
+		if (cmp > 0)
+			report("B-tree", "keys are out of order.");
+		if (!i && !node_is_root(node) && cmp)
+			report("B-tree", "index key absent from child node.");
+		if (i != 0 && !cmp)
+			report("B-tree", "leaf keys are repeated.");
+		*last_key = curr_key;
+
+		/* A free-space queue record may have no value */
+		if (!ops->ghosts || v != APFS_BTOFF_INVALID) {
+			/* Value offsets are backwards from the end of the area */
+			if (v > val_area || v == 0)
+				report("B-tree", "value is out-of-bounds.");
+			fixed_slot_mark_as_used(used_vals, val_area - v,
+						ops->val_len);
+			raw_val = raw + node->data + val_area - v;
+			len = ops->val_len;
+			++val_count;
+		}
+		ops->parse(btree, raw_key, raw_val, len);
+	}
+
+	if (val_count && ops->val_len > btree->longest_val)
+		btree->longest_val = ops->val_len;
+
+	if (key_area != node->records * ops->key_len)
+		report("B-tree", "wrong free space total for key area.");
+	if (val_area != val_count * ops->val_len)
+		report("B-tree", "wrong free space total for value area.");
+
+	if (stats_shape) {
+		btree->shape.sh_key_sizes[stats_log_bucket(ops->key_len)] += node->records;
+		btree->shape.sh_val_sizes[stats_log_bucket(ops->val_len)] += val_count;
+		node_add_shape(node);
+	}
+}
+
+static void omap_leaf_read_key(struct node *node, void *raw, struct key *key)
+{
+	read_omap_key(raw, sizeof(struct apfs_omap_key), key);
+
+	/* When a key is added, the node is updated */
+	if (key->number > node->object.xid)
+		report("Object map", "node xid is older than key xid.");
+}
+
+static void omap_leaf_parse(struct btree *btree, void *key, void *val, int len)
+{
+	parse_omap_record(key, val, len);
+}
+
+static const struct fixed_leaf_ops omap_leaf_ops = {
+	.key_len	= sizeof(struct apfs_omap_key),
+	.val_len	= sizeof(struct apfs_omap_val),
+	.ghosts		= false,
+	.read_key	= omap_leaf_read_key,
+	.parse		= omap_leaf_parse,
+};
+
+static void free_queue_leaf_read_key(struct node *node, void *raw,
+				     struct key *key)
+{
+	read_free_queue_key(raw, sizeof(struct apfs_spaceman_free_queue_key), key);
+}
+
+static void free_queue_leaf_parse(struct btree *btree, void *key, void *val,
+				  int len)
+{
+	parse_free_queue_record(key, val, len, btree);
+}
+
+static const struct fixed_leaf_ops free_queue_leaf_ops = {
+	.key_len	= sizeof(struct apfs_spaceman_free_queue_key),
+	.val_len	= sizeof(__le64),
+	.ghosts		= true,
+	.read_key	= free_queue_leaf_read_key,
+	.parse		= free_queue_leaf_parse,
+};
+
+static void snapshots_leaf_read_key(struct node *node, void *raw,
+				    struct key *key)
+{
+	read_omap_snap_key(raw, sizeof(__le64), key);
+}
+
+static void snapshots_leaf_parse(struct btree *btree, void *key, void *val,
+				 int len)
+{
+	parse_omap_snap_record(key, val, len);
+}
+
+static const struct fixed_leaf_ops snapshots_leaf_ops = {
+	.key_len	= sizeof(__le64),
+	.val_len	= sizeof(struct apfs_omap_snapshot),
+	.ghosts		= false,
+	.read_key	= snapshots_leaf_read_key,
+	.parse		= snapshots_leaf_parse,
+};
+static void cat_pool_consume(struct cat_pool *pool, int index, u64 child_id,
+			     struct key *last_key, char *name_buf);
+
+/**
+ * extref_index_grow - Make room for more extents in an extentref index
+ * @index: the extentref index
+ */
+static void extref_index_grow(struct extref_index *index)
+{
+	index->ei_size = index->ei_size ? index->ei_size << 1 : 64;
+
+	index->ei_paddrs = realloc(index->ei_paddrs, index->ei_size * sizeof(u64));
+	index->ei_blocks = realloc(index->ei_blocks, index->ei_size * sizeof(u64));
+	index->ei_owners = realloc(index->ei_owners, index->ei_size * sizeof(u64));
+	index->ei_refcnts = realloc(index->ei_refcnts, index->ei_size * sizeof(u32));
+	index->ei_updates = realloc(index->ei_updates, index->ei_size * sizeof(bool));
+	if (!index->ei_paddrs || !index->ei_blocks || !index->ei_owners ||
+	    !index->ei_refcnts || !index->ei_updates)
+		system_error();
+}
+
+/**
+ * extref_index_append - Add a physical extent record to an extentref index
+ * @index:	the extentref index
+ * @key:	pointer to the raw key
+ * @val:	pointer to the raw value
+ *
+ * The record must have been checked already by parse_phys_ext_record(), which
+ * also makes sure that the extents come in order and don't overlap.
+ */
+static void extref_index_append(struct extref_index *index,
+				struct apfs_phys_ext_key *key,
+				struct apfs_phys_ext_val *val)
+{
+	u64 len_and_kind = le64_to_cpu(val->len_and_kind);
+	u64 i = index->ei_count;
+
+	if (index->ei_count == index->ei_size)
+		extref_index_grow(index);
+
+	/* The physical address is used as the id in the extentref tree */
+	index->ei_paddrs[i] = cat_cnid(&key->hdr);
+	index->ei_blocks[i] = len_and_kind & APFS_PEXT_LEN_MASK;
+	index->ei_owners[i] = le64_to_cpu(val->owning_obj_id);
+	index->ei_refcnts[i] = le32_to_cpu(val->refcnt);
+	index->ei_updates[i] = (len_and_kind >> APFS_PEXT_KIND_SHIFT) == APFS_KIND_UPDATE;
+	++index->ei_count;
+}
+
 /**
  * parse_subtree - Parse a subtree and check for corruption
  * @root:	root node of the subtree
@@ -794,7 +1304,7 @@ static void parse_subtree(struct node *root,
 {
 	struct btree *btree = root->btree;
 	struct key curr_key;
-	int i;
+	int i, cmp;
 
 	if (node_is_leaf(root)) {
 		if (root->level != 0)
@@ -802,6 +1312,7 @@ static void parse_subtree(struct node *root,
 		btree->key_count += root->records;
 	}
 	++btree->node_count;
+	progress_node(root);
 
 	if (btree_is_omap(btree) && !node_has_fixed_kv_size(root))
 		report("Object map", "key size should be fixed.");
@@ -818,18 +1329,34 @@ static void parse_subtree(struct node *root,
 	if (btree_is_extentref(btree) && node_has_fixed_kv_size(root))
 		report("Extent reference tree", "key size shouldn't be fixed.");
 
+	/* Keep the device busy while the records are parsed */
+	for (i = 0; i < cache_readahead; ++i)
+		node_prefetch_child(root, i);
+	if (cache_readahead && node_is_leaf(root) && btree_is_snap_meta(btree))
+		node_prefetch_snapshots(root);
+
+	if (!root->used_key_bmap) {
+		if (node_fixed_toc_is_aligned(root)) {
+			parse_fixed_leaf(root, last_key);
+			return;
+		}
+		node_prepare_bitmaps(root);
+	}
+
 	for (i = 0; i < root->records; ++i) {
-		struct node *child;
 		void *raw = root->raw;
 		void *raw_key, *raw_val;
-		int off, len;
+		int off, len, key_len;
 		u64 child_id;
 
 		len = node_locate_key(root, i, &off);
 		if (len > btree->longest_key)
 			btree->longest_key = len;
+		if (stats_shape)
+			++btree->shape.sh_key_sizes[stats_log_bucket(len)];
 		bmap_mark_as_used(root->used_key_bmap, off - root->key, len);
 		raw_key = raw + off;
+		key_len = len;
 
 		if (btree_is_omap(btree)) {
 			read_omap_key(raw_key, len, &curr_key);
@@ -850,13 +1377,12 @@ static void parse_subtree(struct node *root,
 		if (btree_is_snapshots(btree))
 			read_omap_snap_key(raw_key, len, &curr_key);
 
-		if (keycmp(last_key, &curr_key) > 0)
+		cmp = keycmp(last_key, &curr_key);
+		if (cmp > 0)
 			report("B-tree", "keys are out of order.");
-		if (!i && !node_is_root(root) && keycmp(last_key, &curr_key))
+		if (!i && !node_is_root(root) && cmp)
 			report("B-tree", "index key absent from child node.");
-
-		if (i != 0 && node_is_leaf(root) &&
-		    !keycmp(last_key, &curr_key))
+		if (i != 0 && node_is_leaf(root) && !cmp)
 			report("B-tree", "leaf keys are repeated.");
 		*last_key = curr_key;
 
@@ -867,17 +1393,26 @@ static void parse_subtree(struct node *root,
 		if (node_is_leaf(root)) {
 			if (len > btree->longest_val)
 				btree->longest_val = len;
-			if (btree_is_catalog(btree))
+			if (stats_shape)
+				++btree->shape.sh_val_sizes[stats_log_bucket(len)];
+			if (btree_is_catalog(btree) && btree->rec_log)
+				log_cat_record(btree->rec_log, raw_key, key_len,
+					       raw_val, len);
+			else if (btree_is_catalog(btree))
 				parse_cat_record(raw_key, raw_val, len);
 			if (btree_is_omap(btree))
 				parse_omap_record(raw_key, raw_val, len);
 			if (btree_is_free_queue(btree))
 				parse_free_queue_record(raw_key, raw_val, len,
 							btree);
-			if (btree_is_extentref(btree))
+			if (btree_is_extentref(btree)) {
 				/* Physical extents must not overlap */
 				last_key->id = parse_phys_ext_record(raw_key,
 								raw_val, len);
+				key_pack(last_key);
+				extref_index_append(btree->extref_index,
+						    raw_key, raw_val);
+			}
 			if (btree_is_snap_meta(btree))
 				parse_snap_record(raw_key, raw_val, len);
 			if (btree_is_snapshots(btree))
@@ -888,24 +1423,19 @@ static void parse_subtree(struct node *root,
 		if (len != 8)
 			report("B-tree", "wrong size of nonleaf record value.");
 		child_id = le64_to_cpu(*(__le64 *)(raw_val));
-		child = read_node(child_id, btree);
-
-		if (child->level != root->level - 1)
-			report("B-tree", "node levels are corrupted.");
-		if (node_is_root(child))
-			report("B-tree", "nonroot node is flagged as root.");
-
-		/* If a physical node changes, the parent must update the bno */
-		if ((btree_is_omap(btree) || btree_is_extentref(btree) || btree_is_snap_meta(btree) || btree_is_snapshots(btree)) && root->object.xid < child->object.xid)
-			report("Physical tree",
-			       "xid of node is older than xid of its child.");
-
-		parse_subtree(child, last_key, name_buf);
-		node_free(child);
+		if (btree->cat_pool && root == btree->root) {
+			cat_pool_consume(btree->cat_pool, i, child_id,
+					 last_key, name_buf);
+			continue;
+		}
+		node_prefetch_child(root, i + cache_readahead);
+		parse_child(btree, root, child_id, last_key, name_buf);
 	}
 
 	/* All records of @root are processed, so it's a good time for this */
 	node_compare_bmaps(root);
+	if (stats_shape)
+		node_add_shape(root);
 
 	/*
 	 * last_key->name is just a pointer to the memory-mapped on-disk name
@@ -918,6 +1448,333 @@ static void parse_subtree(struct node *root,
 	}
 }
 
+/**
+ * __parse_child - Parse the subtree for a child of an index node
+ * @btree:	tree structure for the child
+ * @parent:	the index node
+ * @child_id:	object id for the child
+ * @last_key:	parent key for the child, as in parse_subtree()
+ * @name_buf:	buffer to store the name of @last_key, as in parse_subtree()
+ */
+static void __parse_child(struct btree *btree, struct node *parent, u64 child_id,
+			  struct key *last_key, char *name_buf)
+{
+	struct node *child;
+
+	child = read_node(child_id, btree);
+
+	if (child->level != parent->level - 1)
+		report("B-tree", "node levels are corrupted.");
+	if (node_is_root(child))
+		report("B-tree", "nonroot node is flagged as root.");
+
+	/* If a physical node changes, the parent must update the bno */
+	if ((btree_is_omap(btree) || btree_is_extentref(btree) || btree_is_snap_meta(btree) || btree_is_snapshots(btree)) && parent->object.xid < child->object.xid)
+		report("Physical tree",
+		       "xid of node is older than xid of its child.");
+
+	parse_subtree(child, last_key, name_buf);
+	node_free(child);
+}
+
+/**
+ * btree_node_desc - Get a description for the nodes of a tree, for the reports
+ * @btree: the tree
+ */
+static const char *btree_node_desc(struct btree *btree)
+{
+	if (btree_is_catalog(btree))
+		return "catalog node";
+	if (btree_is_omap(btree))
+		return "object map node";
+	if (btree_is_extentref(btree))
+		return "extent reference node";
+	if (btree_is_free_queue(btree))
+		return "free queue node";
+	if (btree_is_snap_meta(btree))
+		return "snapshot metadata node";
+	return "omap snapshot node";
+}
+
+/**
+ * parse_child - Parse the subtree for a child of an index node
+ * @btree:	tree structure for the child
+ * @parent:	the index node
+ * @child_id:	object id for the child
+ * @last_key:	parent key for the child, as in parse_subtree()
+ * @name_buf:	buffer to store the name of @last_key, as in parse_subtree()
+ *
+ * In collect-all-errors mode, a corrupted subtree is skipped and @last_key is
+ * left as it was, so the check goes on with the next child.  The nodes of the
+ * subtree are only referenced from the stack, so their blocks get released.
+ */
+static void parse_child(struct btree *btree, struct node *parent, u64 child_id,
+			struct key *last_key, char *name_buf)
+{
+	struct recovery rec;
+	struct key parent_key;
+	char parent_name[256];
+
+	if (!errlog_limit) {
+		__parse_child(btree, parent, child_id, last_key, name_buf);
+		return;
+	}
+
+	/*
+	 * The name may be in @name_buf already, and the subtree may overwrite
+	 * it, so it needs a copy of its own.  The parent node may also get
+	 * freed before the next comparison.
+	 */
+	parent_key = *last_key;
+	if (parent_key.name) {
+		strcpy(parent_name, parent_key.name);
+		parent_key.name = parent_name;
+	}
+
+	push_recovery(&rec, btree_node_desc(btree), child_id, &parent_key,
+		      true /* release */);
+	if (setjmp(rec.r_env)) {
+		pop_recovery(&rec);
+		*last_key = parent_key;
+		if (last_key->name) {
+			strcpy(name_buf, parent_name);
+			last_key->name = name_buf;
+		}
+		return;
+	}
+	__parse_child(btree, parent, child_id, last_key, name_buf);
+	pop_recovery(&rec);
+}
+
+/* States for the tasks of a parallel catalog walk */
+#define CAT_TASK_PENDING	0	/* Not yet claimed by any thread */
+#define CAT_TASK_RUNNING	1	/* Claimed by a worker */
+#define CAT_TASK_DONE		2	/* Results are ready to be merged */
+
+/*
+ * Walk of the subtree for one child of the catalog root, by a worker thread
+ */
+struct cat_task {
+	int			t_state;	/* State of the task */
+	struct btree		t_btree;	/* Copy of the tree, for the stats */
+	struct key		t_last_key;	/* Last key in the subtree */
+	char			t_name_buf[256]; /* Name for the last key */
+	struct record_log	t_records;	/* Records, to parse in order */
+	struct bmap_log		t_bmap_log;	/* Container bitmap updates */
+	bool			t_weird_state;	/* Weird issue reported? */
+};
+
+/*
+ * Shared state for a parallel catalog walk.  Only the node reads and checks
+ * run in parallel: the workers just log the leaf records, and the thread
+ * that owns the tree parses all of them serially, in key order, so none of
+ * the tables are sharded.  The children of the root are claimed in order,
+ * but each worker goes ahead with the next one as soon as it's done, so that
+ * the threads stay busy no matter how uneven the subtrees are.  The owner
+ * also takes over the next task itself if the workers fall behind.
+ */
+struct cat_pool {
+	struct node		*p_root;	/* Root node of the catalog */
+	struct check_context	*p_parent;	/* Context of the owner thread */
+	struct cat_task		*p_tasks;	/* One task for each child */
+	int			p_next;		/* Next task to be claimed */
+	int			p_merged;	/* Number of tasks merged */
+	int			p_window;	/* Limit on unmerged tasks */
+	pthread_mutex_t		p_lock;
+	pthread_cond_t		p_cond;		/* A task changed its state */
+
+	struct thread_group	p_threads;	/* Worker threads */
+};
+
+/**
+ * cat_task_run - Walk the subtree for a catalog task
+ * @pool:	the pool
+ * @index:	index of the task, and of the child in the root node
+ *
+ * Corruption in the root record is left for the owner thread to report.
+ */
+static void cat_task_run(struct cat_pool *pool, int index)
+{
+	struct cat_task *task = &pool->p_tasks[index];
+	struct node *root = pool->p_root;
+	struct btree *btree = &task->t_btree;
+	u64 child_id;
+	int off, len;
+
+	*btree = *root->btree;
+	btree->key_count = btree->node_count = 0;
+	btree->longest_key = btree->longest_val = 0;
+	memset(&btree->shape, 0, sizeof(btree->shape));
+	btree->cat_pool = NULL;
+	btree->rec_log = &task->t_records;
+	curr_ctx->c_bmap_log = &task->t_bmap_log;
+	curr_ctx->c_weird_state = false;
+
+	len = node_locate_key(root, index, &off);
+	read_cat_key((void *)root->raw + off, len, &task->t_last_key);
+	len = node_locate_data(root, index, &off);
+	if (len != 8)
+		return;
+	child_id = le64_to_cpu(*(__le64 *)((void *)root->raw + off));
+
+	node_prefetch_child(root, index + cache_readahead);
+	parse_child(btree, root, child_id, &task->t_last_key, task->t_name_buf);
+	task->t_weird_state = curr_ctx->c_weird_state;
+}
+
+/**
+ * cat_worker - Run catalog tasks from the pool until none are left
+ * @arg: the pool
+ */
+static void *cat_worker(void *arg)
+{
+	struct cat_pool *pool = arg;
+	struct check_context worker_ctx = *pool->p_parent;
+	int count = pool->p_root->records;
+	int index;
+
+	curr_ctx = &worker_ctx;
+
+	pthread_mutex_lock(&pool->p_lock);
+	while (1) {
+		/* Don't let unmerged results pile up in memory */
+		while (pool->p_next < count &&
+		       pool->p_next >= pool->p_merged + pool->p_window)
+			pthread_cond_wait(&pool->p_cond, &pool->p_lock);
+		if (pool->p_next >= count)
+			break;
+		index = pool->p_next++;
+		pool->p_tasks[index].t_state = CAT_TASK_RUNNING;
+		pthread_mutex_unlock(&pool->p_lock);
+
+		cat_task_run(pool, index);
+
+		pthread_mutex_lock(&pool->p_lock);
+		pool->p_tasks[index].t_state = CAT_TASK_DONE;
+		pthread_cond_broadcast(&pool->p_cond);
+	}
+	pthread_mutex_unlock(&pool->p_lock);
+	return NULL;
+}
+
+/**
+ * cat_task_merge - Merge the results of a catalog task into the whole tree
+ * @task:	the task
+ * @btree:	the catalog tree
+ * @last_key:	on return, the last key of the subtree
+ * @name_buf:	buffer to store the name of @last_key
+ */
+static void cat_task_merge(struct cat_task *task, struct btree *btree,
+			   struct key *last_key, char *name_buf)
+{
+	btree->key_count += task->t_btree.key_count;
+	btree->node_count += task->t_btree.node_count;
+	if (task->t_btree.longest_key > btree->longest_key)
+		btree->longest_key = task->t_btree.longest_key;
+	if (task->t_btree.longest_val > btree->longest_val)
+		btree->longest_val = task->t_btree.longest_val;
+	if (stats_shape)
+		stats_shape_merge(&btree->shape, &task->t_btree.shape);
+
+	/* The record checks rely on key order, so they run only now */
+	replay_record_log(&task->t_records);
+	replay_bmap_log(&task->t_bmap_log);
+	if (task->t_weird_state)
+		curr_ctx->c_weird_state = true;
+
+	*last_key = task->t_last_key;
+	if (last_key->name) {
+		strcpy(name_buf, last_key->name);
+		last_key->name = name_buf;
+	}
+}
+
+/**
+ * cat_pool_consume - Get the results for a child of the catalog root
+ * @pool:	the pool
+ * @index:	index of the child in the root node
+ * @child_id:	object id for the child
+ * @last_key:	parent key for the child, as in parse_subtree()
+ * @name_buf:	buffer to store the name of @last_key, as in parse_subtree()
+ *
+ * Has the same effect as walking the subtree for the child right here.
+ */
+static void cat_pool_consume(struct cat_pool *pool, int index, u64 child_id,
+			     struct key *last_key, char *name_buf)
+{
+	struct cat_task *task = &pool->p_tasks[index];
+	struct node *root = pool->p_root;
+
+	pthread_mutex_lock(&pool->p_lock);
+	if (task->t_state == CAT_TASK_PENDING) {
+		/* The workers fell behind, so take this one */
+		assert(pool->p_next == index);
+		++pool->p_next;
+		task->t_state = CAT_TASK_DONE;
+		pthread_mutex_unlock(&pool->p_lock);
+
+		node_prefetch_child(root, index + cache_readahead);
+		parse_child(root->btree, root, child_id, last_key, name_buf);
+	} else {
+		while (task->t_state != CAT_TASK_DONE)
+			pthread_cond_wait(&pool->p_cond, &pool->p_lock);
+		pthread_mutex_unlock(&pool->p_lock);
+
+		cat_task_merge(task, root->btree, last_key, name_buf);
+	}
+
+	pthread_mutex_lock(&pool->p_lock);
+	pool->p_merged = index + 1;
+	pthread_cond_broadcast(&pool->p_cond);
+	pthread_mutex_unlock(&pool->p_lock);
+}
+
+/**
+ * start_cat_pool - Start a parallel walk for a catalog tree, if it's worth it
+ * @cat: the catalog tree, with the root already read
+ */
+static void start_cat_pool(struct btree *cat)
+{
+	struct cat_pool *pool;
+
+	if (check_jobs <= 1 || node_is_leaf(cat->root) || cat->root->records < 2)
+		return;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		system_error();
+	pool->p_tasks = calloc(cat->root->records, sizeof(*pool->p_tasks));
+	if (!pool->p_tasks)
+		system_error();
+	pool->p_root = cat->root;
+	pool->p_parent = curr_ctx;
+	pool->p_window = 2 * check_jobs;
+	pthread_mutex_init(&pool->p_lock, NULL);
+	pthread_cond_init(&pool->p_cond, NULL);
+	cat->cat_pool = pool;
+
+	/* If no thread can be created, the owner will just do all the work */
+	start_threads(&pool->p_threads, check_jobs - 1, cat_worker, pool);
+}
+
+/**
+ * stop_cat_pool - Wait for the workers of a parallel catalog walk and clean up
+ * @cat: the catalog tree
+ */
+static void stop_cat_pool(struct btree *cat)
+{
+	struct cat_pool *pool = cat->cat_pool;
+
+	if (!pool)
+		return;
+	join_threads(&pool->p_threads);
+	pthread_mutex_destroy(&pool->p_lock);
+	pthread_cond_destroy(&pool->p_cond);
+	free(pool->p_tasks);
+	free(pool);
+	cat->cat_pool = NULL;
+}
+
 /**
  * check_btree_footer_flags - Check consistency of b-tree footer flags
  * @flags:	the flags
@@ -986,8 +1843,8 @@ static void check_btree_footer(struct btree *btree)
 	if (!node_is_root(root))
 		report(ctx, "wrong flag in root node.");
 
-	info = (void *)root->raw + sb->s_blocksize - sizeof(*info);
-	if (le32_to_cpu(info->bt_fixed.bt_node_size) != sb->s_blocksize)
+	info = (void *)root->raw + curr_sb()->s_blocksize - sizeof(*info);
+	if (le32_to_cpu(info->bt_fixed.bt_node_size) != curr_sb()->s_blocksize)
 		report_unknown("Objects with more than one block");
 
 	check_btree_footer_flags(le32_to_cpu(info->bt_fixed.bt_flags),
@@ -1100,7 +1957,8 @@ struct free_queue *parse_free_queue_btree(u64 oid, int index)
 	sfq->sfq_index = index;
 
 	btree->type = BTREE_TYPE_FREE_QUEUE;
-	btree->omap_table = NULL; /* These are ephemeral objects */
+	btree->omap_index = NULL; /* These are ephemeral objects */
+	btree->fixed_leaf = &free_queue_leaf_ops;
 	btree->root = read_node(oid, btree);
 	parse_subtree(btree->root, &last_key, NULL /* name_buf */);
 
@@ -1124,7 +1982,7 @@ struct btree *parse_snap_meta_btree(u64 oid)
 	if (!snap)
 		system_error();
 	snap->type = BTREE_TYPE_SNAP_META;
-	snap->omap_table = NULL; /* These are physical objects */
+	snap->omap_index = NULL; /* These are physical objects */
 	snap->root = read_node(oid, snap);
 
 	parse_subtree(snap->root, &last_key, name_buf);
@@ -1136,11 +1994,11 @@ struct btree *parse_snap_meta_btree(u64 oid)
 /**
  * parse_cat_btree - Parse a catalog tree and check for corruption
  * @oid:	object id for the catalog root
- * @omap_table:	hash table of object map records for the b-tree
+ * @omap_index:	index of the object map records for the b-tree
  *
  * Returns a pointer to the btree struct for the catalog.
  */
-struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table)
+struct btree *parse_cat_btree(u64 oid, struct omap_index *omap_index)
 {
 	struct btree *cat;
 	struct key last_key = {0};
@@ -1151,10 +2009,12 @@ struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table)
 		system_error();
 
 	cat->type = BTREE_TYPE_CATALOG;
-	cat->omap_table = omap_table;
+	cat->omap_index = omap_index;
 	cat->root = read_node(oid, cat);
 
+	start_cat_pool(cat);
 	parse_subtree(cat->root, &last_key, name_buf);
+	stop_cat_pool(cat);
 
 	check_btree_footer(cat);
 	return cat;
@@ -1173,9 +2033,9 @@ static void check_omap_flags(u32 flags)
 		     APFS_OMAP_KEYROLLING | APFS_OMAP_CRYPTO_GENERATION))
 		report_unknown("Omap encryption");
 
-	if (vsb && (flags & APFS_OMAP_MANUALLY_MANAGED))
+	if (curr_vsb() && (flags & APFS_OMAP_MANUALLY_MANAGED))
 		report("Volume object map", "is manually managed.");
-	if (!vsb && !(flags & APFS_OMAP_MANUALLY_MANAGED))
+	if (!curr_vsb() && !(flags & APFS_OMAP_MANUALLY_MANAGED))
 		report("Container object map", "isn't manually managed.");
 }
 
@@ -1189,7 +2049,8 @@ static struct btree *parse_snapshot_tree(u64 oid)
 		system_error();
 
 	snaps->type = BTREE_TYPE_SNAPSHOTS;
-	snaps->omap_table = NULL;
+	snaps->omap_index = NULL;
+	snaps->fixed_leaf = &snapshots_leaf_ops;
 	snaps->root = read_node(oid, snaps);
 
 	parse_subtree(snaps->root, &last_key, NULL);
@@ -1212,7 +2073,7 @@ struct btree *parse_omap_btree(u64 oid)
 	struct object obj;
 
 	/* Many checks are missing, of course */
-	raw = read_object(oid, NULL /* omap_table */, &obj);
+	raw = read_object(oid, NULL /* omap_index */, &obj);
 	if (obj.type != APFS_OBJECT_TYPE_OMAP)
 		report("Object map", "wrong object type.");
 	if (obj.subtype != APFS_OBJECT_TYPE_INVALID)
@@ -1221,12 +2082,13 @@ struct btree *parse_omap_btree(u64 oid)
 	check_omap_flags(le32_to_cpu(raw->om_flags));
 
 	if (raw->om_snapshot_tree_oid) {
-		if (!vsb)
+		if (!curr_vsb())
 			report("Container omap", "has snapshot tree.");
-		vsb->v_snapshots = parse_snapshot_tree(le64_to_cpu(raw->om_snapshot_tree_oid));
-		if (vsb->v_snapshots->key_count != le32_to_cpu(raw->om_snap_count))
+		curr_vsb()->v_snapshots =
+			parse_snapshot_tree(le64_to_cpu(raw->om_snapshot_tree_oid));
+		if (curr_vsb()->v_snapshots->key_count != le32_to_cpu(raw->om_snap_count))
 			report("Omap snapshot tree", "snap count doesn't match keys.");
-		if (vsb->v_snap_max_xid != le64_to_cpu(raw->om_most_recent_snap))
+		if (curr_vsb()->v_snap_max_xid != le64_to_cpu(raw->om_most_recent_snap))
 			report("Omap snapshot tree", "latest xid doesn't match keys.");
 	} else if (raw->om_snap_count || raw->om_most_recent_snap) {
 		report("Object map", "has snapshots but no snapshot tree.");
@@ -1244,7 +2106,8 @@ struct btree *parse_omap_btree(u64 oid)
 	if (!omap)
 		system_error();
 	omap->type = BTREE_TYPE_OMAP;
-	omap->omap_table = NULL; /* The omap doesn't have an omap of its own */
+	omap->omap_index = NULL; /* The omap doesn't have an omap of its own */
+	omap->fixed_leaf = &omap_leaf_ops;
 	omap->root = read_node(le64_to_cpu(raw->om_tree_oid), omap);
 
 	/* The tree type reported by the omap must match the root node */
@@ -1254,7 +2117,7 @@ struct btree *parse_omap_btree(u64 oid)
 	parse_subtree(omap->root, &last_key, NULL /* name_buf */);
 
 	check_btree_footer(omap);
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 	return omap;
 }
 
@@ -1273,7 +2136,10 @@ struct btree *parse_extentref_btree(u64 oid)
 	if (!extref)
 		system_error();
 	extref->type = BTREE_TYPE_EXTENTREF;
-	extref->omap_table = NULL; /* These are physical objects */
+	extref->omap_index = NULL; /* These are physical objects */
+	extref->extref_index = calloc(1, sizeof(*extref->extref_index));
+	if (!extref->extref_index)
+		system_error();
 	extref->root = read_node(oid, extref);
 
 	parse_subtree(extref->root, &last_key, NULL /* name_buf */);
@@ -1282,88 +2148,38 @@ struct btree *parse_extentref_btree(u64 oid)
 	return extref;
 }
 
-/**
- * child_from_query - Read the child id found by a successful nonleaf query
- * @query:	the query that found the record
- *
- * Returns the child id in the nonleaf node record.
- */
-static u64 child_from_query(struct query *query)
-{
-	void *raw = query->node->raw;
-
-	/* This check is actually redundant, at least for now */
-	if (query->len != 8) /* The data on a nonleaf node is the child id */
-		report("B-tree", "wrong size of nonleaf record value.");
-
-	return le64_to_cpu(*(__le64 *)(raw + query->off));
-}
-
-/**
- * extref_rec_from_query - Read the info found by a successful extentref query
- * @query:	the query for the extent reference record
- * @extref:	extent reference record struct to receive the result
- */
-static void extref_rec_from_query(struct query *query,
-				  struct extref_record *extref)
-{
-	struct apfs_phys_ext_val *extref_val;
-	struct apfs_phys_ext_key *extref_key;
-	void *raw = query->node->raw;
-	int kind;
-
-	if (query->len != sizeof(*extref_val))
-		report("Extent reference record", "wrong size of value.");
-
-	extref_val = (struct apfs_phys_ext_val *)(raw + query->off);
-	extref_key = (struct apfs_phys_ext_key *)(raw + query->key_off);
-
-	/* The physical address is used as the id in the extentref tree */
-	extref->phys_addr = cat_cnid(&extref_key->hdr);
-	extref->blocks = le64_to_cpu(extref_val->len_and_kind) &
-							APFS_PEXT_LEN_MASK;
-	extref->owner = le64_to_cpu(extref_val->owning_obj_id);
-	extref->refcnt = le32_to_cpu(extref_val->refcnt);
-
-	kind = le64_to_cpu(extref_val->len_and_kind) >> APFS_PEXT_KIND_SHIFT;
-	extref->update = kind == APFS_KIND_UPDATE;
-}
-
 /**
  * extentref_tree_lookup - Find best match for an extent in an extentref tree
- * @tbl:	root of the extent reference tree to be searched
+ * @index:	index of the extent reference tree to be searched
  * @bno:	first block number for the extent
  * @extref:	extentref record struct to receive the result
  *
+ * The best match is the last physical extent that starts at or before @bno.
  * Returns 0 on success, or -1 if nothing was found.
  */
-static int extentref_tree_lookup(struct node *tbl, u64 bno, struct extref_record *extref)
+static int extentref_tree_lookup(struct extref_index *index, u64 bno, struct extref_record *extref)
 {
-	struct query *query;
-	struct key key;
-	int ret = -1;
+	u64 lo = 0, hi = index->ei_count;
 
-	query = alloc_query(tbl, NULL /* parent */);
+	/* Find the first extent that starts after @bno */
+	while (lo < hi) {
+		u64 mid = lo + ((hi - lo) >> 1);
 
-	init_extref_key(bno, &key);
-	query->key = &key;
-	query->flags |= QUERY_EXTENTREF;
-
-	/*
-	 * The extentref nodes have already been parsed, and the allocation
-	 * bitmap has been updated accordingly.  This global variable tells
-	 * read_object() to ignore the bitmap this time.
-	 */
-	ongoing_query = true;
-	if (btree_query(&query))
-		goto fail;
-	ongoing_query = false;
-
-	extref_rec_from_query(query, extref);
-	ret = 0;
-fail:
-	free_query(query);
-	return ret;
+		if (index->ei_paddrs[mid] <= bno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return -1;
+	--lo;
+
+	extref->phys_addr = index->ei_paddrs[lo];
+	extref->blocks = index->ei_blocks[lo];
+	extref->owner = index->ei_owners[lo];
+	extref->refcnt = index->ei_refcnts[lo];
+	extref->update = index->ei_updates[lo];
+	return 0;
 }
 
 /**
@@ -1377,8 +2193,8 @@ void extentref_lookup(u64 bno, struct extref_record *extref)
 	int32_t refcnt_update = 0;
 	int ret;
 
-	if (!vsb->v_in_snapshot) {
-		ret = extentref_tree_lookup(vsb->v_extent_ref->root, bno, extref);
+	if (!curr_vsb()->v_in_snapshot) {
+		ret = extentref_tree_lookup(curr_vsb()->v_extent_ref->extref_index, bno, extref);
 		if (ret == 0 && extref->phys_addr <= bno && extref->phys_addr + extref->blocks > bno) {
 			if (extref->update) {
 				refcnt_update += (int32_t)extref->refcnt;
@@ -1389,8 +2205,8 @@ void extentref_lookup(u64 bno, struct extref_record *extref)
 	}
 
 	/* We look at the most recent snapshots first */
-	for (ext_tree = vsb->v_snap_extrefs; ext_tree; ext_tree = ext_tree->next) {
-		ret = extentref_tree_lookup(ext_tree->btree->root, bno, extref);
+	for (ext_tree = curr_vsb()->v_snap_extrefs; ext_tree; ext_tree = ext_tree->next) {
+		ret = extentref_tree_lookup(ext_tree->btree->extref_index, bno, extref);
 		if (ret == 0 && extref->phys_addr <= bno && extref->phys_addr + extref->blocks > bno) {
 			if (extref->update) {
 				refcnt_update += (int32_t)extref->refcnt;
@@ -1403,274 +2219,3 @@ void extentref_lookup(u64 bno, struct extref_record *extref)
 
 	report("Extent record", "not covered by physical extents.");
 }
-
-/**
- * alloc_query - Allocates a query structure
- * @node:	node to be searched
- * @parent:	query for the parent node
- *
- * Callers other than btree_query() should set @parent to NULL, and @node
- * to the root of the b-tree. They should also initialize most of the query
- * fields themselves; when @parent is not NULL the query will inherit them.
- *
- * Returns the allocated query.
- */
-struct query *alloc_query(struct node *node, struct query *parent)
-{
-	struct query *query;
-
-	query = malloc(sizeof(*query));
-	if (!query)
-		system_error();
-
-	query->node = node;
-	query->key = parent ? parent->key : NULL;
-	query->flags = parent ? parent->flags & ~(QUERY_DONE | QUERY_NEXT) : 0;
-	query->parent = parent;
-	/* Start the search with the last record and go backwards */
-	query->index = node->records;
-	query->depth = parent ? parent->depth + 1 : 0;
-
-	return query;
-}
-
-/**
- * free_query - Free a query structure
- * @query:	query to free
- *
- * Also frees the ancestor queries, if they are kept.
- */
-void free_query(struct query *query)
-{
-	while (query) {
-		struct query *parent = query->parent;
-
-		node_free(query->node);
-		free(query);
-		query = parent;
-	}
-}
-
-/**
- * key_from_query - Read the current key from a query structure
- * @query:	the query, with @query->key_off and @query->key_len already set
- * @key:	return parameter for the key
- *
- * Reads the key into @key after some basic sanity checks.
- */
-static void key_from_query(struct query *query, struct key *key)
-{
-	void *raw = query->node->raw;
-	void *raw_key = (void *)(raw + query->key_off);
-
-	switch (query->flags & QUERY_TREE_MASK) {
-	case QUERY_CAT:
-		read_cat_key(raw_key, query->key_len, key);
-		break;
-	case QUERY_OMAP:
-		read_omap_key(raw_key, query->key_len, key);
-		break;
-	case QUERY_EXTENTREF:
-		read_extentref_key(raw_key, query->key_len, key);
-		break;
-	default:
-		report(NULL, "Bug!");
-	}
-
-	if (query->flags & QUERY_MULTIPLE) {
-		/* A multiple query must ignore these fields */
-		key->number = 0;
-		key->name = NULL;
-	}
-}
-
-/**
- * node_next - Find the next matching record in the current node
- * @query:	multiple query in execution
- *
- * Returns 0 on success, -EAGAIN if the next record is in another node, and
- * -ENODATA if no more matching records exist.
- */
-static int node_next(struct query *query)
-{
-	struct node *node = query->node;
-	struct key curr_key;
-	int cmp;
-	u64 bno = node->object.block_nr;
-
-	if (query->flags & QUERY_DONE)
-		/* Nothing left to search; the query failed */
-		return -ENODATA;
-
-	if (!query->index) /* The next record may be in another node */
-		return -EAGAIN;
-	--query->index;
-
-	query->key_len = node_locate_key(node, query->index, &query->key_off);
-	key_from_query(query, &curr_key);
-
-	cmp = keycmp(&curr_key, query->key);
-
-	if (cmp > 0)
-		report("B-tree", "records are out of order.");
-
-	if (cmp != 0 && node_is_leaf(node) && query->flags & QUERY_EXACT)
-		return -ENODATA;
-
-	query->len = node_locate_data(node, query->index, &query->off);
-	if (query->len == 0) {
-		report("B-tree", "corrupted record value in node 0x%llx.",
-		       (unsigned long long)bno);
-	}
-
-	if (cmp != 0) {
-		/*
-		 * This is the last entry that can be relevant in this node.
-		 * Keep searching the children, but don't return to this level.
-		 */
-		query->flags |= QUERY_DONE;
-	}
-
-	return 0;
-}
-
-/**
- * node_query - Execute a query on a single node
- * @query:	the query to execute
- *
- * The search will start at index @query->index, looking for the key that comes
- * right before @query->key, according to the order given by keycmp().
- *
- * The @query->index will be updated to the last index checked. This is
- * important when searching for multiple entries, since the query may need
- * to remember where it was on this level. If we are done with this node, the
- * query will be flagged as QUERY_DONE, and the search will end in failure
- * as soon as we return to this level. The function may also return -EAGAIN,
- * to signal that the search should go on in a different branch.
- *
- * On success returns 0; the offset of the data within the block will be saved
- * in @query->off, and its length in @query->len. The function checks that this
- * length fits within the block; callers must use the returned value to make
- * sure they never operate outside its bounds.
- *
- * -ENODATA will be returned if no appropriate entry was found.
- */
-static int node_query(struct query *query)
-{
-	struct node *node = query->node;
-	int left, right;
-	int cmp;
-	u64 bno = node->object.block_nr;
-
-	if (query->flags & QUERY_NEXT)
-		return node_next(query);
-
-	/* Search by bisection */
-	cmp = 1;
-	left = 0;
-	do {
-		struct key curr_key;
-		if (cmp > 0) {
-			right = query->index - 1;
-			if (right < left)
-				return -ENODATA;
-			query->index = (left + right) / 2;
-		} else {
-			left = query->index;
-			query->index = DIV_ROUND_UP(left + right, 2);
-		}
-
-		query->key_len = node_locate_key(node, query->index,
-						 &query->key_off);
-		key_from_query(query, &curr_key);
-
-		cmp = keycmp(&curr_key, query->key);
-		if (cmp == 0 && !(query->flags & QUERY_MULTIPLE))
-			break;
-	} while (left != right);
-
-	if (cmp > 0)
-		return -ENODATA;
-
-	if (cmp != 0 && node_is_leaf(query->node) && query->flags & QUERY_EXACT)
-		return -ENODATA;
-
-	if (query->flags & QUERY_MULTIPLE) {
-		if (cmp != 0) /* Last relevant entry in level */
-			query->flags |= QUERY_DONE;
-		query->flags |= QUERY_NEXT;
-	}
-
-	query->len = node_locate_data(node, query->index, &query->off);
-	if (query->len == 0) {
-		report("B-tree", "corrupted record value in node 0x%llx.",
-		       (unsigned long long)bno);
-	}
-	return 0;
-}
-
-/**
- * btree_query - Execute a query on a b-tree
- * @query:	the query to execute
- *
- * Searches the b-tree starting at @query->index in @query->node, looking for
- * the record corresponding to @query->key.
- *
- * Returns 0 in case of success and sets the @query->len, @query->off and
- * @query->index fields to the results of the query. @query->node will now
- * point to the leaf node holding the record.
- *
- * In case of failure returns -ENODATA.
- */
-int btree_query(struct query **query)
-{
-	struct node *node = (*query)->node;
-	struct query *parent;
-	struct btree *btree = node->btree;
-	u64 child_id;
-	int err;
-
-	assert(ongoing_query);
-
-next_node:
-	if ((*query)->depth >= 12) {
-		/* This is the maximum depth allowed by the module */
-		report("B-tree", "is too deep.");
-	}
-
-	err = node_query(*query);
-	if (err == -EAGAIN) {
-		if (!(*query)->parent) /* We are at the root of the tree */
-			return -ENODATA;
-
-		/* Move back up one level and continue the query */
-		parent = (*query)->parent;
-		(*query)->parent = NULL; /* Don't free the parent */
-		free_query(*query);
-		*query = parent;
-		goto next_node;
-	}
-	if (err)
-		return err;
-	if (node_is_leaf((*query)->node)) /* All done */
-		return 0;
-
-	/* Now go a level deeper and search the child */
-	child_id = child_from_query(*query);
-	node = read_node(child_id, btree);
-
-	if ((*query)->flags & QUERY_MULTIPLE) {
-		/*
-		 * We are looking for multiple entries, so we must remember
-		 * the parent node and index to continue the search later.
-		 */
-		*query = alloc_query(node, *query);
-	} else {
-		/* Reuse the same query structure to search the child */
-		node_free((*query)->node);
-		(*query)->node = node;
-		(*query)->index = node->records;
-		(*query)->depth++;
-	}
-	goto next_node;
-}
@@ -5,42 +5,85 @@
 #ifndef _BTREE_H
 #define _BTREE_H
 
+#include <pthread.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "htable.h"
 #include "object.h"
+#include "stats.h"
 
 struct super_block;
 struct extref_record;
 struct free_queue;
+struct record_log;
+struct cat_pool;
 
 /*
- * Omap record data in memory
+ * Index of all the records in an object map, sorted by oid and then by xid.
+ * The trees are parsed in order, so the records just get appended.  Each field
+ * gets an array of its own; lookups only need to touch the oids and xids.
  */
-struct omap_record {
-	struct omap_record *next; /* Next entry in linked list */
-
-	u64	xid;	/* Transaction id */
-	u64	oid;	/* Virtual object id */
-	u64	bno;	/* Block number */
-	u32	flags;	/* Omap record flags */
-
-	/* Was this oid-xid pair ever seen in use? */
-	bool	seen;
-	/* Was it ever seen in use for the latest checkpoint? */
-	bool	seen_for_latest;
-	/* If we are currently checking a snapshot, was it seen in use for it? */
-	bool	seen_for_snap;
+struct omap_index {
+	u64	*oi_oids;	/* Virtual object ids */
+	u64	*oi_xids;	/* Transaction ids */
+	u64	*oi_bnos;	/* Block numbers */
+	u8	*oi_flags;	/* Omap record flags, they all fit in a byte */
+
+	/* Bitmap: was this oid-xid pair ever seen in use? */
+	u64	*oi_seen;
+	/* Bitmap: was it ever seen in use for the latest checkpoint? */
+	u64	*oi_seen_for_latest;
+
+	u64	oi_count;	/* Number of records in the index */
+	u64	oi_size;	/* Number of records allocated for */
 };
 
 /*
- * List of all omap records for a given oid
+ * Index of the physical extents in an extentref tree, sorted by their first
+ * block.  Built while the tree is parsed, so that later lookups don't need to
+ * query the tree again.
  */
-struct omap_record_list {
-	struct htable_entry	o_htable;	/* Hash table entry header */
-	struct omap_record 	*o_records;	/* Linked list of records */
+struct extref_index {
+	u64	*ei_paddrs;	/* First block number of each extent */
+	u64	*ei_blocks;	/* Block counts */
+	u64	*ei_owners;	/* Owning object ids */
+	u32	*ei_refcnts;	/* Reference counts */
+	bool	*ei_updates;	/* Is this an update record? */
+
+	u64	ei_count;	/* Number of extents in the index */
+	u64	ei_size;	/* Number of extents allocated for */
 };
 
+/* Returned by omap_index_lookup() when no record matches */
+#define OMAP_INDEX_NONE	(~0ULL)
+
+/**
+ * omap_index_test - Check a record's bit in one of the index bitmaps
+ * @bmap:	the bitmap
+ * @index:	position of the record
+ */
+static inline bool omap_index_test(u64 *bmap, u64 index)
+{
+	return bmap[index >> 6] & (1ULL << (index & 63));
+}
+
+/**
+ * omap_index_test_and_set - Set a record's bit in one of the index bitmaps
+ * @bmap:	the bitmap
+ * @index:	position of the record
+ *
+ * Returns the previous value of the bit.  The caller must hold omap_index_lock
+ * if other threads may be using the same index.
+ */
+static inline bool omap_index_test_and_set(u64 *bmap, u64 index)
+{
+	u64 mask = 1ULL << (index & 63);
+	bool ret = bmap[index >> 6] & mask;
+
+	bmap[index >> 6] |= mask;
+	return ret;
+}
+
 /*
  * In-memory representation of an APFS node
  */
@@ -54,10 +97,10 @@ struct node {
 	int free;		/* Offset of the free area in the block */
 	int data;		/* Offset of the data area in the block */
 
-	u8 *free_key_bmap;	/* Free space bitmap for the key area */
-	u8 *free_val_bmap;	/* Free space bitmap for the value area */
-	u8 *used_key_bmap;	/* Used space bitmap for the key area */
-	u8 *used_val_bmap;	/* Used space bitmap for the value area */
+	u64 *free_key_bmap;	/* Free space bitmap for the key area */
+	u64 *free_val_bmap;	/* Free space bitmap for the value area */
+	u64 *used_key_bmap;	/* Used space bitmap for the key area */
+	u64 *used_val_bmap;	/* Used space bitmap for the value area */
 
 	struct btree *btree;			/* Btree the node belongs to */
 	struct apfs_btree_node_phys *raw;	/* Raw node in memory */
@@ -92,37 +135,6 @@ static inline bool node_has_fixed_kv_size(struct node *node)
 	return (node->flags & APFS_BTNODE_FIXED_KV_SIZE) != 0;
 }
 
-/* Flags for the query structure */
-#define QUERY_TREE_MASK		0007	/* Which b-tree we query */
-#define QUERY_OMAP		0001	/* This is a b-tree object map query */
-#define QUERY_CAT		0002	/* This is a catalog tree query */
-#define QUERY_EXTENTREF		0004	/* This is an extentref tree query */
-#define QUERY_MULTIPLE		0010	/* Search for multiple matches */
-#define QUERY_NEXT		0020	/* Find next of multiple matches */
-#define QUERY_EXACT		0040	/* Search for an exact match */
-#define QUERY_DONE		0100	/* The search at this level is over */
-
-/*
- * Structure used to retrieve data from an APFS B-Tree. For now only used
- * on the calalog and the object map.
- */
-struct query {
-	struct node *node;		/* Node being searched */
-	struct key *key;		/* What the query is looking for */
-
-	struct query *parent;		/* Query for parent node */
-	unsigned int flags;
-
-	/* Set by the query on success */
-	int index;			/* Index of the entry in the node */
-	int key_off;			/* Offset of the key in the node */
-	int key_len;			/* Length of the key */
-	int off;			/* Offset of the data in the node */
-	int len;			/* Length of the data */
-
-	int depth;			/* Put a limit on recursion */
-};
-
 /* In-memory tree types */
 #define BTREE_TYPE_OMAP		1 /* The tree is an object map */
 #define BTREE_TYPE_CATALOG	2 /* The tree is a catalog */
@@ -131,19 +143,32 @@ struct query {
 #define BTREE_TYPE_FREE_QUEUE	5 /* The tree is for a free-space queue */
 #define BTREE_TYPE_SNAPSHOTS	6 /* The tree is for omap snapshots */
 
+struct fixed_leaf_ops;
+
 /* In-memory structure representing a b-tree */
 struct btree {
 	u8 type;		/* Type of the tree */
 	struct node *root;	/* Root of this b-tree */
 
-	/* Hash table for the tree's object map (can be NULL) */
-	struct htable_entry **omap_table;
+	/* Index of the tree's object map records (can be NULL) */
+	struct omap_index *omap_index;
+
+	/* Index of the physical extents, only for extentref trees */
+	struct extref_index *extref_index;
 
 	/* B-tree stats as measured by the fsck */
 	u64 key_count;		/* Number of keys */
 	u64 node_count;		/* Number of nodes */
 	int longest_key;	/* Length of longest key */
 	int longest_val;	/* Length of longest value */
+	struct stat_shape shape;	/* Only measured for the analytics */
+
+	/* State for a parallel walk of the catalog (can be NULL) */
+	struct cat_pool *cat_pool;
+	/* Catalog records to be parsed later, in key order (can be NULL) */
+	struct record_log *rec_log;
+	/* Record handlers for leaves with fixed size entries (can be NULL) */
+	const struct fixed_leaf_ops *fixed_leaf;
 };
 
 /**
@@ -196,18 +221,18 @@ static inline bool btree_is_extentref(struct btree *btree)
 	return btree->type == BTREE_TYPE_EXTENTREF;
 }
 
+extern pthread_mutex_t omap_index_lock;
+
 extern struct free_queue *parse_free_queue_btree(u64 oid, int index);
 extern struct btree *parse_snap_meta_btree(u64 oid);
 extern struct btree *parse_extentref_btree(u64 oid);
 extern struct btree *parse_omap_btree(u64 oid);
-extern struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table);
-extern struct query *alloc_query(struct node *node, struct query *parent);
-extern void free_query(struct query *query);
-extern int btree_query(struct query **query);
+extern struct btree *parse_cat_btree(u64 oid, struct omap_index *omap_index);
 extern struct node *omap_read_node(u64 id);
-extern void free_omap_table(struct htable_entry **table);
-extern struct omap_record *get_latest_omap_record(u64 oid, u64 xid, struct htable_entry **table);
+extern struct omap_index *alloc_omap_index(void);
+extern u64 *alloc_omap_seen(struct omap_index *index);
+extern void free_omap_index(struct omap_index *index);
+extern u64 omap_index_lookup(struct omap_index *index, u64 oid, u64 xid);
 extern void extentref_lookup(u64 bno, struct extref_record *extref);
-extern void omap_htable_clear_seen_for_snap(struct htable_entry **table);
 
 #endif	/* _BTREE_H */
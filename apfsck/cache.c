@@ -0,0 +1,696 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Cache for the metadata blocks read from the device.  All users of a block
+ * get the same read-only buffer, and must release it once they are done.
+ * Released blocks stay in memory until the clock hand finds them idle and
+ * hands their buffer over to some other block.
+ *
+ * Alternatively, the whole device can be mapped in memory at once (in large
+ * windows for 32-bit hosts), and the block buffers are then just pointers
+ * into the mapping.
+ *
+ * The cache is shared by all checker threads, so it's protected by a single
+ * lock.  The lock is dropped for synchronous reads, but not while waiting on
+ * the asynchronous backend, which is only ever used under the lock.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <apfs/aes.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "cache.h"
+#include "errlog.h"
+#include "io.h"
+#include "stats.h"
+#include "super.h"
+#include "trace.h"
+
+/*
+ * In-memory header for a block buffer.  It's stored at the end of the same
+ * allocation as the block, so that it can be found from the data pointer.
+ */
+struct cache_block {
+	struct cache_block	*b_next;	/* Next block in the hash chain */
+	u64			b_bno;		/* Block number */
+	int			b_refcnt;	/* Number of active users */
+	bool			b_recent;	/* Used since the hand last passed? */
+	bool			b_verified;	/* Checksum already verified? */
+	bool			b_cached;	/* Is the block in the cache? */
+	bool			b_pending;	/* Is a read still in flight? */
+	bool			b_queued;	/* Is the read in the i/o backend? */
+	struct io_request	b_req;		/* Request for asynchronous reads */
+};
+
+/*
+ * Mapped region of the device, in whole-device mapping mode
+ */
+struct map_window {
+	void	*w_data;	/* Start of the mapping (NULL if unused) */
+	u64	w_first;	/* First block number in the window */
+	u64	w_count;	/* Number of blocks in the window */
+	int	w_refcnt;	/* Number of block buffers in use */
+};
+
+/* Window size for hosts that can't map the whole device at once */
+#define MAP_WINDOW_SIZE		(256ULL << 20)
+#define MAP_WINDOW_COUNT	16
+
+u64 cache_budget = CACHE_DEFAULT_BUDGET;
+bool cache_mapped;
+unsigned int cache_readahead = CACHE_DEFAULT_READAHEAD;
+
+static struct cache_block **cache_htable;	/* Hash chains for the blocks */
+static u64 cache_hmask;				/* Hash mask for the table */
+static struct cache_block **cache_ring;		/* Slots for the clock hand */
+static u64 cache_slots;				/* Maximum number of slots */
+static u64 cache_used;				/* Number of slots in use */
+static u64 cache_hand;				/* Current slot for the hand */
+
+static struct map_window map_windows[MAP_WINDOW_COUNT];
+static u64 map_window_blocks;		/* Block count for a full window */
+static u64 map_device_blocks;		/* Block count for the device */
+static int map_advice = MADV_NORMAL;	/* Access pattern for the mappings */
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_read_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * block_header - Get the in-memory header for a block buffer
+ * @data: the block buffer
+ */
+static inline struct cache_block *block_header(void *data)
+{
+	return data + curr_sb()->s_blocksize;
+}
+
+/**
+ * block_data - Get the buffer for an in-memory block header
+ * @blk: the block header
+ */
+static inline void *block_data(struct cache_block *blk)
+{
+	return (void *)blk - curr_sb()->s_blocksize;
+}
+
+/**
+ * cache_init - Set up the block cache, according to the memory budget
+ *
+ * Must be called once the container block size is known.
+ */
+void cache_init(void)
+{
+	u64 buckets = 1;
+
+	assert(curr_sb()->s_blocksize);
+	assert(!cache_ring);
+
+	io_init();
+
+	if (cache_mapped) {
+		map_device_blocks = get_device_size(curr_sb()->s_blocksize);
+		if (sizeof(void *) < 8)
+			map_window_blocks = MAP_WINDOW_SIZE / curr_sb()->s_blocksize;
+		else
+			map_window_blocks = map_device_blocks;
+		if (!map_window_blocks)
+			cache_mapped = false;
+	}
+
+	cache_slots = cache_budget / (curr_sb()->s_blocksize + sizeof(struct cache_block));
+	while (buckets < cache_slots)
+		buckets <<= 1;
+	cache_hmask = buckets - 1;
+
+	cache_htable = calloc(buckets, sizeof(*cache_htable));
+	cache_ring = calloc(cache_slots ? cache_slots : 1, sizeof(*cache_ring));
+	if (!cache_htable || !cache_ring)
+		system_error();
+}
+
+/**
+ * alloc_block - Allocate a new block buffer and its header
+ * @bno: block number
+ */
+static struct cache_block *alloc_block(u64 bno)
+{
+	struct cache_block *blk;
+	void *data;
+
+	/* Keep the buffer aligned, in case the device wants direct reads */
+	if (posix_memalign(&data, curr_sb()->s_blocksize,
+			   curr_sb()->s_blocksize + sizeof(*blk)))
+		system_error();
+	blk = block_header(data);
+	blk->b_next = NULL;
+	blk->b_bno = bno;
+	blk->b_refcnt = 0;
+	blk->b_recent = false;
+	blk->b_verified = false;
+	blk->b_cached = false;
+	blk->b_pending = false;
+	blk->b_queued = false;
+	return blk;
+}
+
+/**
+ * cache_unhash - Remove a block from its hash chain
+ * @blk: the block
+ */
+static void cache_unhash(struct cache_block *blk)
+{
+	struct cache_block **entry_p = &cache_htable[blk->b_bno & cache_hmask];
+
+	while (*entry_p != blk)
+		entry_p = &(*entry_p)->b_next;
+	*entry_p = blk->b_next;
+	blk->b_next = NULL;
+}
+
+/**
+ * cache_evict - Run the clock hand to find an idle block to reuse
+ *
+ * Returns the block header, already removed from the hash table; or NULL if
+ * all cached blocks are in use.
+ */
+static struct cache_block *cache_evict(void)
+{
+	u64 i;
+
+	/* Two full turns, because the first one may just clear the flags */
+	for (i = 0; i < 2 * cache_used; ++i) {
+		struct cache_block *blk = cache_ring[cache_hand];
+
+		cache_hand = (cache_hand + 1) % cache_used;
+		if (blk->b_refcnt)
+			continue;
+		if (blk->b_recent) {
+			blk->b_recent = false;
+			continue;
+		}
+		cache_unhash(blk);
+		return blk;
+	}
+	return NULL;
+}
+
+/**
+ * cache_alloc - Get a block header and buffer for a block not in the cache
+ * @bno: block number
+ *
+ * If the memory budget is exhausted and every cached block is busy, the new
+ * block will be left out of the cache and freed once released.
+ */
+static struct cache_block *cache_alloc(u64 bno)
+{
+	struct cache_block **bucket = &cache_htable[bno & cache_hmask];
+	struct cache_block *blk;
+
+	if (cache_used < cache_slots) {
+		blk = alloc_block(bno);
+		cache_ring[cache_used++] = blk;
+	} else {
+		blk = cache_used ? cache_evict() : NULL;
+		if (!blk)
+			return alloc_block(bno);
+		blk->b_bno = bno;
+		blk->b_verified = false;
+	}
+
+	blk->b_cached = true;
+	blk->b_next = *bucket;
+	*bucket = blk;
+	return blk;
+}
+
+/**
+ * cache_lookup - Find a block in the cache
+ * @bno: block number
+ *
+ * Returns the block header, or NULL if the block is not cached.
+ */
+static struct cache_block *cache_lookup(u64 bno)
+{
+	struct cache_block *blk = cache_htable[bno & cache_hmask];
+
+	while (blk && blk->b_bno != bno)
+		blk = blk->b_next;
+	return blk;
+}
+
+/**
+ * map_window_of - Find the mapping window that holds a block buffer
+ * @data: the block buffer
+ *
+ * Returns NULL if the buffer is not part of a mapping.
+ */
+static struct map_window *map_window_of(void *data)
+{
+	int i;
+
+	if (!cache_mapped)
+		return NULL;
+	for (i = 0; i < MAP_WINDOW_COUNT; ++i) {
+		struct map_window *win = &map_windows[i];
+
+		if (!win->w_data)
+			continue;
+		if (data >= win->w_data &&
+		    data < win->w_data + win->w_count * curr_sb()->s_blocksize)
+			return win;
+	}
+	return NULL;
+}
+
+/**
+ * map_window_get - Get the mapping window for a block, mapping it if needed
+ * @bno: block number
+ *
+ * Returns NULL if all windows are busy, so the caller must fall back to the
+ * block cache.
+ */
+static struct map_window *map_window_get(u64 bno)
+{
+	struct map_window *win = NULL;
+	u64 first = bno - bno % map_window_blocks;
+	int i;
+
+	for (i = 0; i < MAP_WINDOW_COUNT; ++i) {
+		struct map_window *curr = &map_windows[i];
+
+		if (curr->w_data && curr->w_first == first)
+			return curr;
+		if (!win && (!curr->w_data || !curr->w_refcnt))
+			win = curr;
+	}
+	if (!win)
+		return NULL;
+
+	if (win->w_data)
+		munmap(win->w_data, win->w_count * curr_sb()->s_blocksize);
+	win->w_first = first;
+	win->w_count = map_window_blocks;
+	if (win->w_count > map_device_blocks - first)
+		win->w_count = map_device_blocks - first;
+	win->w_data = mmap(NULL, win->w_count * curr_sb()->s_blocksize, PROT_READ,
+			   MAP_PRIVATE, curr_ctx->c_fd, first * curr_sb()->s_blocksize);
+	if (win->w_data == MAP_FAILED)
+		system_error();
+	madvise(win->w_data, win->w_count * curr_sb()->s_blocksize, map_advice);
+	return win;
+}
+
+/**
+ * map_read_block - Get a block buffer from the device mapping
+ * @bno: block number
+ *
+ * Returns NULL if the block couldn't be mapped.
+ */
+static void *map_read_block(u64 bno)
+{
+	struct map_window *win;
+
+	if (bno >= map_device_blocks) {
+		/* The block cache is left inconsistent, so this is fatal */
+		forbid_recovery();
+		report(NULL, "Block 0x%llx is out of range.",
+		       (unsigned long long)bno);
+	}
+
+	win = map_window_get(bno);
+	if (!win)
+		return NULL;
+	++win->w_refcnt;
+	return win->w_data + (bno - win->w_first) * curr_sb()->s_blocksize;
+}
+
+/**
+ * cache_wait_pending - Wait until a block is no longer being read
+ * @blk: the block header
+ *
+ * Must be called with the cache lock held.
+ */
+static void cache_wait_pending(struct cache_block *blk)
+{
+	while (blk->b_pending) {
+		if (blk->b_queued)
+			io_wait();
+		else
+			pthread_cond_wait(&cache_read_done, &cache_lock);
+	}
+}
+
+/*
+ * Block buffers in use by this thread, in the order they were taken.  This is
+ * only kept in collect-all-errors mode, so that the buffers held by a skipped
+ * structure can be released; see cache_release_held().
+ */
+static __thread void **held_blocks;
+static __thread u64 held_count;
+static __thread u64 held_size;
+
+/**
+ * hold_block - Add a block buffer to the list of those in use by this thread
+ * @data: the block buffer
+ *
+ * Returns @data.
+ */
+static void *hold_block(void *data)
+{
+	if (!errlog_limit)
+		return data;
+	if (held_count == held_size) {
+		held_size = held_size ? 2 * held_size : 64;
+		held_blocks = realloc(held_blocks, held_size * sizeof(*held_blocks));
+		if (!held_blocks)
+			system_error();
+	}
+	held_blocks[held_count++] = data;
+	return data;
+}
+
+/**
+ * unhold_block - Remove a block buffer from the list of those in use
+ * @data: the block buffer
+ *
+ * The buffers are mostly released in reverse order, so the search starts from
+ * the end.  The order of the others is preserved.
+ */
+static void unhold_block(void *data)
+{
+	u64 i;
+
+	if (!errlog_limit)
+		return;
+	for (i = held_count; i > 0; --i) {
+		if (held_blocks[i - 1] == data)
+			break;
+	}
+	assert(i > 0);
+	memmove(&held_blocks[i - 1], &held_blocks[i],
+		(held_count - i) * sizeof(*held_blocks));
+	--held_count;
+}
+
+/**
+ * cache_held_count - Number of block buffers in use by this thread
+ *
+ * Only meaningful in collect-all-errors mode.
+ */
+u64 cache_held_count(void)
+{
+	return held_count;
+}
+
+/**
+ * cache_release_held - Release the block buffers taken by this thread lately
+ * @count: number of buffers to keep, as returned by cache_held_count()
+ *
+ * In collect-all-errors mode, this releases all the buffers that this thread
+ * took after @count was sampled, and didn't release yet.
+ */
+void cache_release_held(u64 count)
+{
+	while (held_count > count)
+		release_block(held_blocks[held_count - 1]);
+}
+
+/**
+ * read_block - Get a read-only buffer with the contents of a block
+ * @bno: block number
+ *
+ * The buffer must be released with release_block() after use.
+ */
+void *read_block(u64 bno)
+{
+	struct cache_block *blk;
+
+	trace_read(bno);
+	pthread_mutex_lock(&cache_lock);
+
+	if (cache_mapped) {
+		void *data = map_read_block(bno);
+
+		if (data) {
+			pthread_mutex_unlock(&cache_lock);
+			return hold_block(data);
+		}
+	}
+
+	blk = cache_lookup(bno);
+	if (!blk) {
+		stats_add(STAT_CACHE_MISSES, 1);
+		blk = cache_alloc(bno);
+
+		/* Other threads will wait for the read to complete */
+		blk->b_pending = true;
+		++blk->b_refcnt;
+		pthread_mutex_unlock(&cache_lock);
+		io_read(bno, 1 /* count */, block_data(blk));
+		pthread_mutex_lock(&cache_lock);
+		blk->b_pending = false;
+		--blk->b_refcnt;
+		pthread_cond_broadcast(&cache_read_done);
+	} else {
+		stats_add(STAT_CACHE_HITS, 1);
+	}
+	cache_wait_pending(blk);
+
+	++blk->b_refcnt;
+	blk->b_recent = true;
+	pthread_mutex_unlock(&cache_lock);
+	return hold_block(block_data(blk));
+}
+
+/**
+ * read_block_decrypt - Get a buffer with the decrypted contents of a block
+ * @bno:	block number
+ * @ctx:	expanded keys for the volume that owns the block
+ *
+ * Like read_block(), but for blocks under software encryption.  The cached
+ * buffer is shared with every other user of the block, like the prefetcher,
+ * so it always keeps the ciphertext; each caller gets the plaintext in a
+ * private buffer, which goes away once released.
+ */
+void *read_block_decrypt(u64 bno, const struct aes_xts_ctx *ctx)
+{
+	u64 sector = bno * (curr_sb()->s_blocksize / AES_XTS_SECTOR_SIZE);
+	struct cache_block *blk;
+	void *data;
+
+	data = read_block(bno);
+	blk = alloc_block(bno);
+	blk->b_refcnt = 1;
+	aes_xts_decrypt_sectors(ctx, sector, data, curr_sb()->s_blocksize,
+				block_data(blk));
+	release_block(data);
+	return hold_block(block_data(blk));
+}
+
+/**
+ * release_block - Drop a reference to a block buffer
+ * @data: the block buffer
+ */
+void release_block(void *data)
+{
+	struct map_window *win;
+	struct cache_block *blk;
+
+	unhold_block(data);
+	pthread_mutex_lock(&cache_lock);
+
+	win = map_window_of(data);
+	if (win) {
+		assert(win->w_refcnt > 0);
+		--win->w_refcnt;
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	blk = block_header(data);
+	assert(blk->b_refcnt > 0);
+	--blk->b_refcnt;
+	if (!blk->b_refcnt && !blk->b_cached)
+		free(data);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * block_verified - Check if the checksum of a cached block was verified
+ * @data: the block buffer
+ */
+bool block_verified(void *data)
+{
+	bool verified = false;
+
+	/* Mapped blocks have no header, so they get verified on every read */
+	pthread_mutex_lock(&cache_lock);
+	if (!map_window_of(data))
+		verified = block_header(data)->b_verified;
+	pthread_mutex_unlock(&cache_lock);
+	return verified;
+}
+
+/**
+ * set_block_verified - Remember that the checksum of a block was verified
+ * @data: the block buffer
+ */
+void set_block_verified(void *data)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (!map_window_of(data))
+		block_header(data)->b_verified = true;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * cache_add_verified - Put a block in the cache, with a verified checksum
+ * @bno:	block number
+ * @data:	contents of the block, already verified
+ *
+ * The block is copied into the cache only if there is still room in the
+ * budget; nothing gets evicted for it.  Does nothing if the block is already
+ * cached, or if the whole device is mapped.
+ */
+void cache_add_verified(u64 bno, void *data)
+{
+	struct cache_block *blk;
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_mapped || cache_used >= cache_slots || cache_lookup(bno))
+		goto out;
+	blk = cache_alloc(bno);
+	memcpy(block_data(blk), data, curr_sb()->s_blocksize);
+	blk->b_verified = true;
+out:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * cache_advise - Set the expected access pattern for the device mapping
+ * @advice: MADV_RANDOM, MADV_SEQUENTIAL or MADV_NORMAL
+ *
+ * Does nothing unless the whole device is mapped.
+ */
+void cache_advise(int advice)
+{
+	int i;
+
+	if (!cache_mapped)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	map_advice = advice;
+	for (i = 0; i < MAP_WINDOW_COUNT; ++i) {
+		struct map_window *win = &map_windows[i];
+
+		if (win->w_data)
+			madvise(win->w_data, win->w_count * curr_sb()->s_blocksize,
+				advice);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * __cache_willneed - Warn that a range of blocks will be read soon
+ * @bno:	first block number
+ * @count:	number of blocks
+ *
+ * Must be called with the cache lock held.
+ */
+static void __cache_willneed(u64 bno, u64 count)
+{
+	struct map_window *win = NULL;
+
+	if (cache_mapped && bno < map_device_blocks &&
+	    count <= map_device_blocks - bno)
+		win = map_window_get(bno);
+
+	/* Unmapped ranges are still worth reading into the page cache */
+	if (win && bno + count <= win->w_first + win->w_count) {
+		void *start = win->w_data + (bno - win->w_first) * curr_sb()->s_blocksize;
+
+		madvise(start, count * curr_sb()->s_blocksize, MADV_WILLNEED);
+	} else if (!io_direct) {
+		posix_fadvise(curr_ctx->c_fd, bno * curr_sb()->s_blocksize,
+			      count * curr_sb()->s_blocksize, POSIX_FADV_WILLNEED);
+	}
+}
+
+/**
+ * cache_willneed - Warn that a range of blocks will be read soon
+ * @bno:	first block number
+ * @count:	number of blocks
+ */
+void cache_willneed(u64 bno, u64 count)
+{
+	pthread_mutex_lock(&cache_lock);
+	__cache_willneed(bno, count);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * cache_end_prefetch - Finish the asynchronous read of a cached block
+ * @req: the read request
+ */
+static void cache_end_prefetch(struct io_request *req)
+{
+	struct cache_block *blk = req->r_priv;
+
+	blk->b_pending = false;
+	blk->b_queued = false;
+	--blk->b_refcnt;
+	pthread_cond_broadcast(&cache_read_done);
+}
+
+/**
+ * cache_prefetch - Start reading a block that will be needed soon
+ * @bno: block number
+ *
+ * Does nothing if the block is already in the cache.  If the i/o backend is
+ * asynchronous, the block is read into the cache in the background; if not,
+ * the kernel is asked to do the read-ahead.
+ */
+void cache_prefetch(u64 bno)
+{
+	struct cache_block *blk;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if (cache_mapped || !io_is_async()) {
+		if (cache_mapped || !cache_lookup(bno))
+			__cache_willneed(bno, 1);
+		goto out;
+	}
+
+	if (cache_lookup(bno))
+		goto out;
+	blk = cache_alloc(bno);
+	if (!blk->b_cached) {
+		/* No room in the cache, don't bother */
+		free(block_data(blk));
+		__cache_willneed(bno, 1);
+		goto out;
+	}
+
+	/* Keep the block pinned until the read completes */
+	stats_add(STAT_PREFETCHES, 1);
+	blk->b_pending = true;
+	blk->b_queued = true;
+	blk->b_recent = true;
+	++blk->b_refcnt;
+	blk->b_req.r_bno = bno;
+	blk->b_req.r_buf = block_data(blk);
+	blk->b_req.r_count = 1;
+	blk->b_req.r_priv = blk;
+	blk->b_req.r_end_io = cache_end_prefetch;
+	io_submit_read(&blk->b_req);
+out:
+	pthread_mutex_unlock(&cache_lock);
+}
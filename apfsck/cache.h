@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <apfs/aes.h>
+#include <apfs/types.h>
+
+/* Default memory budget for the block cache, in bytes */
+#define CACHE_DEFAULT_BUDGET	(64ULL << 20)
+/* Default number of child nodes to read ahead in a b-tree traversal */
+#define CACHE_DEFAULT_READAHEAD	8
+
+extern u64 cache_budget;	/* Memory budget for the block cache */
+extern bool cache_mapped;	/* Map the whole device in memory? */
+extern unsigned int cache_readahead; /* Read-ahead depth for child nodes */
+
+extern void cache_init(void);
+extern void *read_block(u64 bno);
+extern void *read_block_decrypt(u64 bno, const struct aes_xts_ctx *ctx);
+extern void release_block(void *data);
+extern u64 cache_held_count(void);
+extern void cache_release_held(u64 count);
+extern bool block_verified(void *data);
+extern void set_block_verified(void *data);
+extern void cache_add_verified(u64 bno, void *data);
+extern void cache_advise(int advice);
+extern void cache_willneed(u64 bno, u64 count);
+extern void cache_prefetch(u64 bno);
+
+#endif	/* _CACHE_H */
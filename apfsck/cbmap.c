@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <apfs/bitmap.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "cbmap.h"
+#include "hugepage.h"
+
+/**
+ * group_max_runs - Maximum number of runs before a group switches to dense
+ * @map: the compressed bitmap
+ *
+ * Beyond this point the list of runs would take more memory than the bitmap.
+ */
+static inline u32 group_max_runs(struct cbmap *map)
+{
+	return map->m_group_bits / 64;
+}
+
+/**
+ * group_make_dense - Switch a group to a plain bitmap
+ * @map:	the compressed bitmap
+ * @group:	the group
+ */
+static void group_make_dense(struct cbmap *map, struct cbmap_group *group)
+{
+	struct cbmap_run *runs = group->g_data;
+	u64 *bmap;
+	u32 i;
+
+	if (map->m_dense) {
+		bmap = map->m_dense + (group - map->m_groups) * BITMAP_WORDS(map->m_group_bits);
+	} else {
+		bmap = calloc(BITMAP_WORDS(map->m_group_bits), sizeof(*bmap));
+		if (!bmap)
+			system_error();
+	}
+	for (i = 0; i < group->g_runs; ++i)
+		bitmap_set_range(bmap, runs[i].r_start, runs[i].r_len);
+
+	free(runs);
+	group->g_data = bmap;
+	group->g_runs = CBMAP_DENSE;
+	group->g_size = 0;
+}
+
+/**
+ * group_lower_run - Find the first run that ends after a given bit
+ * @group:	the group, which must keep a list of runs
+ * @bit:	the bit
+ *
+ * Returns the index of the run, or the run count if there is none.
+ */
+static u32 group_lower_run(struct cbmap_group *group, u32 bit)
+{
+	struct cbmap_run *runs = group->g_data;
+	u32 lo = 0, hi = group->g_runs;
+
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		if (runs[mid].r_start + runs[mid].r_len > bit)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/**
+ * group_test_range_any - Check if any bit of a range is set in a group
+ * @group:	the group
+ * @start:	first bit of the range, relative to the group
+ * @len:	length of the range, which must not leave the group
+ */
+static bool group_test_range_any(struct cbmap_group *group, u32 start, u32 len)
+{
+	struct cbmap_run *runs = group->g_data;
+	u32 i;
+
+	if (!group->g_data)
+		return false;
+	if (group->g_runs == CBMAP_DENSE)
+		return bitmap_test_range_any(group->g_data, start, len);
+
+	i = group_lower_run(group, start);
+	return i < group->g_runs && runs[i].r_start < start + len;
+}
+
+/**
+ * group_set_range - Set a range of bits in a group
+ * @map:	the compressed bitmap
+ * @group:	the group
+ * @start:	first bit of the range, relative to the group
+ * @len:	length of the range, which must not leave the group
+ */
+static void group_set_range(struct cbmap *map, struct cbmap_group *group,
+			    u32 start, u32 len)
+{
+	struct cbmap_run *runs;
+	u32 end = start + len;
+	u32 lo, hi;
+
+	if (!group->g_data && !map->m_compress) {
+		group_make_dense(map, group);
+	} else if (!group->g_data) {
+		group->g_size = 4;
+		group->g_data = malloc(group->g_size * sizeof(*runs));
+		if (!group->g_data)
+			system_error();
+	}
+	if (group->g_runs == CBMAP_DENSE) {
+		bitmap_set_range(group->g_data, start, len);
+		return;
+	}
+	runs = group->g_data;
+
+	/* Runs in [lo, hi) overlap with the range or are next to it */
+	lo = start ? group_lower_run(group, start - 1) : 0;
+	for (hi = lo; hi < group->g_runs && runs[hi].r_start <= end; ++hi)
+		;
+
+	if (lo != hi) {
+		u32 last_end = runs[hi - 1].r_start + runs[hi - 1].r_len;
+
+		if (runs[lo].r_start < start)
+			start = runs[lo].r_start;
+		if (last_end > end)
+			end = last_end;
+		runs[lo].r_start = start;
+		runs[lo].r_len = end - start;
+		memmove(&runs[lo + 1], &runs[hi],
+			(group->g_runs - hi) * sizeof(*runs));
+		group->g_runs -= hi - lo - 1;
+		return;
+	}
+
+	if (group->g_runs == group_max_runs(map)) {
+		group_make_dense(map, group);
+		bitmap_set_range(group->g_data, start, len);
+		return;
+	}
+	if (group->g_runs == group->g_size) {
+		group->g_size *= 2;
+		runs = realloc(runs, group->g_size * sizeof(*runs));
+		if (!runs)
+			system_error();
+		group->g_data = runs;
+	}
+	memmove(&runs[lo + 1], &runs[lo], (group->g_runs - lo) * sizeof(*runs));
+	runs[lo].r_start = start;
+	runs[lo].r_len = len;
+	++group->g_runs;
+}
+
+/**
+ * cbmap_init - Set up an empty compressed bitmap
+ * @map:	the compressed bitmap
+ * @nbits:	number of bits in the bitmap
+ * @group_bits:	number of bits per group, a multiple of 64
+ * @compress:	keep the groups as run lists while they are small?
+ */
+void cbmap_init(struct cbmap *map, u64 nbits, u32 group_bits, bool compress)
+{
+	map->m_group_bits = group_bits;
+	map->m_group_count = DIV_ROUND_UP(nbits, group_bits);
+	map->m_compress = compress;
+
+	map->m_groups = huge_calloc(map->m_group_count, sizeof(*map->m_groups));
+	map->m_dense = NULL;
+	if (!compress && hugepage_mode != HUGEPAGE_OFF)
+		map->m_dense = huge_calloc(map->m_group_count, BITMAP_WORDS(group_bits) * sizeof(u64));
+	map->m_scratch = malloc(BITMAP_WORDS(group_bits) * sizeof(u64));
+	if (!map->m_scratch)
+		system_error();
+}
+
+/**
+ * cbmap_free - Free all memory used by a compressed bitmap
+ * @map: the compressed bitmap
+ */
+void cbmap_free(struct cbmap *map)
+{
+	u64 i;
+
+	if (!map->m_groups)
+		return;
+	if (!map->m_dense) {
+		for (i = 0; i < map->m_group_count; ++i)
+			free(map->m_groups[i].g_data);
+	}
+	huge_free(map->m_groups);
+	huge_free(map->m_dense);
+	free(map->m_scratch);
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+ * cbmap_test_range_any - Check if any bit of a range is set
+ * @map:	the compressed bitmap
+ * @start:	first bit of the range
+ * @len:	length of the range
+ *
+ * The caller must make sure that the range is inside the bitmap.
+ */
+bool cbmap_test_range_any(struct cbmap *map, u64 start, u64 len)
+{
+	u32 bits = map->m_group_bits;
+
+	while (len) {
+		u64 index = start / bits;
+		u32 off = start % bits;
+		u32 count = len < bits - off ? len : bits - off;
+
+		if (group_test_range_any(&map->m_groups[index], off, count))
+			return true;
+		start += count;
+		len -= count;
+	}
+	return false;
+}
+
+/**
+ * cbmap_set_range - Set a range of bits
+ * @map:	the compressed bitmap
+ * @start:	first bit of the range
+ * @len:	length of the range
+ *
+ * The caller must make sure that the range is inside the bitmap.
+ */
+void cbmap_set_range(struct cbmap *map, u64 start, u64 len)
+{
+	u32 bits = map->m_group_bits;
+
+	while (len) {
+		u64 index = start / bits;
+		u32 off = start % bits;
+		u32 count = len < bits - off ? len : bits - off;
+
+		group_set_range(map, &map->m_groups[index], off, count);
+		start += count;
+		len -= count;
+	}
+}
+
+/**
+ * cbmap_group_words - Get the plain bitmap for a group
+ * @map:	the compressed bitmap
+ * @group:	index of the group
+ *
+ * Returns a pointer to the bitmap, which remains valid until the next call
+ * to one of the cbmap functions.
+ */
+const u64 *cbmap_group_words(struct cbmap *map, u64 group)
+{
+	struct cbmap_group *grp = &map->m_groups[group];
+	u32 words = BITMAP_WORDS(map->m_group_bits);
+	struct cbmap_run *runs = grp->g_data;
+	u32 i;
+
+	if (grp->g_runs == CBMAP_DENSE)
+		return grp->g_data;
+
+	memset(map->m_scratch, 0, words * sizeof(u64));
+	for (i = 0; i < grp->g_runs; ++i)
+		bitmap_set_range(map->m_scratch, runs[i].r_start, runs[i].r_len);
+	return map->m_scratch;
+}
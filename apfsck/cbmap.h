@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _CBMAP_H
+#define _CBMAP_H
+
+#include <apfs/types.h>
+
+/* Value of g_runs for groups that keep a plain bitmap */
+#define CBMAP_DENSE	(~0U)
+
+/*
+ * A run of consecutive set bits inside a group
+ */
+struct cbmap_run {
+	u32	r_start;	/* First bit, relative to the group */
+	u32	r_len;		/* Number of bits */
+};
+
+/*
+ * A fixed-size section of a compressed bitmap.  Groups with no bits set take
+ * no memory; the others keep a sorted list of runs until that list would get
+ * bigger than a plain bitmap, and then they switch to a plain bitmap.
+ */
+struct cbmap_group {
+	void	*g_data;	/* Runs or plain bitmap (NULL if empty) */
+	u32	g_runs;		/* Number of runs, or CBMAP_DENSE */
+	u32	g_size;		/* Number of runs allocated for */
+};
+
+/*
+ * Compressed bitmap, split in groups of the same size.  If compression is
+ * off, groups are made dense as soon as they get their first bit.  With huge
+ * pages, their bitmaps are then taken from a single array.
+ */
+struct cbmap {
+	struct cbmap_group	*m_groups;	/* Array of groups */
+	u64			m_group_count;	/* Number of groups */
+	u32			m_group_bits;	/* Bits per group */
+	bool			m_compress;	/* Keep groups as run lists? */
+	u64			*m_scratch;	/* Buffer to expand a group */
+	u64			*m_dense;	/* Bitmaps for all groups (or NULL) */
+};
+
+extern void cbmap_init(struct cbmap *map, u64 nbits, u32 group_bits,
+		       bool compress);
+extern void cbmap_free(struct cbmap *map);
+extern bool cbmap_test_range_any(struct cbmap *map, u64 start, u64 len);
+extern void cbmap_set_range(struct cbmap *map, u64 start, u64 len);
+extern const u64 *cbmap_group_words(struct cbmap *map, u64 group);
+
+#endif	/* _CBMAP_H */
@@ -1,18 +1,121 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <apfs/aes.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "apfsck.h"
+#include "cache.h"
 #include "crypto.h"
 #include "spaceman.h"
 #include "super.h"
 
-static void check_volume_key_entry(const u8 *keydata, u16 keylen)
+/* Length of a wrapped volume encryption key, a 256-bit key for XTS */
+#define WRAPPED_VEK_SIZE	0x28
+
+/* Key encryption keys given by the user, to unwrap the volume keys */
+static u8 (*crypto_keks)[16];
+int crypto_kek_count;
+
+/**
+ * add_kek - Add a key encryption key given by the user
+ * @hex: the key, as 32 hexadecimal digits
+ *
+ * Returns false if @hex is not a valid key.
+ */
+bool add_kek(const char *hex)
+{
+	u8 *kek;
+	int i;
+
+	if (strlen(hex) != 32 || strspn(hex, "0123456789abcdefABCDEF") != 32)
+		return false;
+
+	crypto_keks = realloc(crypto_keks, (crypto_kek_count + 1) * sizeof(*crypto_keks));
+	if (!crypto_keks)
+		system_error();
+	kek = crypto_keks[crypto_kek_count++];
+	for (i = 0; i < 16; ++i)
+		sscanf(hex + 2 * i, "%2hhx", &kek[i]);
+	return true;
+}
+
+/**
+ * unwrap_volume_key - Try to unwrap a volume key with the user's keks
+ * @uuid:	uuid of the volume
+ * @keydata:	the wrapped key
+ *
+ * If one of the keks works, the key gets added to the list for the container;
+ * otherwise the volume will be left encrypted.
+ */
+static void unwrap_volume_key(const char *uuid, const u8 *keydata)
 {
-	if (keylen != 0x28)
+	struct volume_key *key;
+	u8 vek[32];
+	int i;
+
+	for (i = 0; i < crypto_kek_count; ++i) {
+		if (!aes_unwrap(crypto_keks[i], sizeof(vek) / 8, keydata, vek))
+			break;
+	}
+	if (i == crypto_kek_count) {
+		memset(vek, 0, sizeof(vek));
+		return;
+	}
+
+	if (get_volume_key(uuid))
+		report("Container keybag", "two keys for the same volume.");
+
+	key = malloc(sizeof(*key));
+	if (!key)
+		system_error();
+	memcpy(key->k_uuid, uuid, sizeof(key->k_uuid));
+	aes_xts_init(&key->k_ctx, vek, vek + 16);
+	memset(vek, 0, sizeof(vek));
+	key->k_next = curr_sb()->s_volume_keys;
+	curr_sb()->s_volume_keys = key;
+}
+
+/**
+ * get_volume_key - Find the unwrapped encryption key for a volume
+ * @uuid: uuid of the volume
+ *
+ * Returns NULL if the key is not known.
+ */
+const struct aes_xts_ctx *get_volume_key(const char *uuid)
+{
+	struct volume_key *key;
+
+	for (key = curr_sb()->s_volume_keys; key; key = key->k_next) {
+		if (!memcmp(key->k_uuid, uuid, sizeof(key->k_uuid)))
+			return &key->k_ctx;
+	}
+	return NULL;
+}
+
+/**
+ * free_volume_keys - Wipe and free all the unwrapped volume keys
+ */
+void free_volume_keys(void)
+{
+	struct volume_key *key = curr_sb()->s_volume_keys;
+
+	while (key) {
+		struct volume_key *next = key->k_next;
+
+		aes_xts_wipe(&key->k_ctx);
+		free(key);
+		key = next;
+	}
+	curr_sb()->s_volume_keys = NULL;
+}
+
+static void check_volume_key_entry(const char *uuid, const u8 *keydata, u16 keylen)
+{
+	if (keylen != WRAPPED_VEK_SIZE)
 		report("Volume key entry in keybag", "wrong size.");
+	if (crypto_kek_count)
+		unwrap_volume_key(uuid, keydata);
 }
 
 static void check_volume_unlock_records_entry(const u8 *keydata, u16 keylen)
@@ -72,7 +175,7 @@ static u16 check_keybag_entry(struct apfs_keybag_entry *entry, u16 remaining)
 
 	switch (le16_to_cpu(entry->ke_tag)) {
 	case KB_TAG_VOLUME_KEY:
-		check_volume_key_entry(keydata, keylen);
+		check_volume_key_entry(entry->ke_uuid, keydata, keylen);
 		break;
 	case KB_TAG_VOLUME_UNLOCK_RECORDS:
 		check_volume_unlock_records_entry(keydata, keylen);
@@ -120,7 +223,7 @@ static void check_keybag_locker(struct apfs_kb_locker *locker)
 
 	nkeys = le16_to_cpu(locker->kl_nkeys);
 	nbytes = le32_to_cpu(locker->kl_nbytes);
-	if (nbytes > sb->s_blocksize - sizeof(*locker))
+	if (nbytes > curr_sb()->s_blocksize - sizeof(*locker))
 		report("Keybag locker", "won't fit in block.");
 
 	entry = &locker->kl_entries[0];
@@ -157,7 +260,7 @@ static void check_keybag_plaintext(void *raw)
 	if (obj->o_subtype != 0)
 		report("Keybag header", "wrong subtype.");
 
-	if (!obj->o_xid || le64_to_cpu(obj->o_xid) > sb->s_xid)
+	if (!obj->o_xid || le64_to_cpu(obj->o_xid) > curr_sb()->s_xid)
 		report("Keybag header", "bad transaction id.");
 
 	check_keybag_locker(raw + sizeof(*obj));
@@ -167,13 +270,9 @@ static void check_keybag_plaintext_block(u64 bno)
 {
 	u8 *plain = NULL;
 
-	plain = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE, fd, bno * sb->s_blocksize);
-	if (plain == MAP_FAILED)
-		system_error();
-
+	plain = read_block(bno);
 	check_keybag_plaintext(plain);
-
-	munmap(plain, sb->s_blocksize);
+	release_block(plain);
 	plain = NULL;
 }
 
@@ -185,7 +284,7 @@ static void check_keybag_plaintext_block(u64 bno)
  */
 static void check_keybag_ciphertext_block(u64 bno)
 {
-	u8 *uuid = (u8 *)sb->s_raw->nx_uuid;
+	u8 *uuid = (u8 *)curr_sb()->s_raw->nx_uuid;
 	u8 *cipher = NULL, *plain = NULL;
 	u64 sector;
 
@@ -193,23 +292,21 @@ static void check_keybag_ciphertext_block(u64 bno)
 	 * The sector number is used for the XTS tweak value. Sectors are
 	 * always 512 bytes.
 	 */
-	sector = bno * (sb->s_blocksize / 0x200);
+	sector = bno * (curr_sb()->s_blocksize / 0x200);
 
-	cipher = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE, fd, bno * sb->s_blocksize);
-	if (cipher == MAP_FAILED)
-		system_error();
+	cipher = read_block(bno);
 
-	plain = calloc(1, sb->s_blocksize);
+	plain = calloc(1, curr_sb()->s_blocksize);
 	if (!plain)
 		system_error();
 
-	if (aes_xts_decrypt(uuid, uuid, sector, cipher, sb->s_blocksize, plain))
+	if (aes_xts_decrypt(uuid, uuid, sector, cipher, curr_sb()->s_blocksize, plain))
 		report("Container keybag", "decryption failed.");
 	check_keybag_plaintext(plain);
 
 	free(plain);
 	plain = NULL;
-	munmap(cipher, sb->s_blocksize);
+	release_block(cipher);
 	cipher = NULL;
 }
 
@@ -218,14 +315,12 @@ static bool is_plaintext_obj(u64 bno)
 	void *raw = NULL;
 	bool ret;
 
-	raw = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE, fd, bno * sb->s_blocksize);
-	if (raw == MAP_FAILED)
-		system_error();
+	raw = read_block(bno);
 
 	/* It's impossible for the 64-bit checksum to randomly match */
 	ret = obj_verify_csum(raw);
 
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 	return ret;
 }
 
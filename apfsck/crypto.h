@@ -5,6 +5,21 @@
 #include <apfs/raw.h>
 #include <apfs/types.h>
 
+/*
+ * Volume encryption key from the container keybag, unwrapped with one of the
+ * key encryption keys given by the user
+ */
+struct volume_key {
+	u8			k_uuid[16];	/* Uuid of the volume */
+	struct aes_xts_ctx	k_ctx;		/* Expanded key */
+	struct volume_key	*k_next;	/* Next key in the list */
+};
+
+extern int crypto_kek_count;	/* Number of key encryption keys */
+
+extern bool add_kek(const char *hex);
 extern void check_keybag(u64 bno, u64 count);
+extern const struct aes_xts_ctx *get_volume_key(const char *uuid);
+extern void free_volume_keys(void);
 
 #endif	/* _CRYPTO_H */
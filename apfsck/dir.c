@@ -160,9 +160,8 @@ void parse_dentry_record(void *key, struct apfs_drec_val *val, int len)
 	if (parent_ino == APFS_PURGEABLE_DIR_INO_NUM) {
 		if (inode->i_purg_name)
 			report("Inode", "has two purgeable dentry records.");
-		inode->i_purg_name = strdup(name);
-		if (!inode->i_purg_name)
-			system_error();
+		inode->i_purg_name = arena_strdup(&curr_vsb()->v_inode_table->t_arena,
+						  name, strlen(name) + 1);
 	}
 
 	check_inode_ids(ino, parent_ino);
@@ -178,10 +177,8 @@ void parse_dentry_record(void *key, struct apfs_drec_val *val, int len)
 	/* The purgeable dentry is never reported as inode name and parent id */
 	if (parent_ino != APFS_PURGEABLE_DIR_INO_NUM && !inode->i_first_name) {
 		/* No dentry for this inode has been seen before */
-		inode->i_first_name = malloc(namelen);
-		if (!inode->i_first_name)
-			system_error();
-		strcpy(inode->i_first_name, name);
+		inode->i_first_name = arena_strdup(&curr_vsb()->v_inode_table->t_arena,
+						   name, strlen(name) + 1);
 		inode->i_first_parent = parent_ino;
 	}
 
@@ -216,20 +213,20 @@ void parse_dentry_record(void *key, struct apfs_drec_val *val, int len)
 	if (parent_ino == APFS_PRIV_DIR_INO_NUM) {
 		switch (dtype << 12) {
 		case S_IFREG:
-			vsb->v_file_count--;
+			curr_vsb()->v_file_count--;
 			break;
 		case S_IFDIR:
 			if (inode->i_ino >= APFS_MIN_USER_INO_NUM)
-				vsb->v_dir_count--;
+				curr_vsb()->v_dir_count--;
 			break;
 		case S_IFLNK:
-			vsb->v_symlink_count--;
+			curr_vsb()->v_symlink_count--;
 			break;
 		case S_IFSOCK:
 		case S_IFBLK:
 		case S_IFCHR:
 		case S_IFIFO:
-			vsb->v_special_count--;
+			curr_vsb()->v_special_count--;
 			break;
 		default:
 			report("Dentry record", "invalid file mode.");
@@ -251,7 +248,7 @@ static void free_dirstat(struct htable_entry *entry)
 	struct dirstat *stats = (struct dirstat *)entry;
 
 	/* The inodes must be parsed before the dirstats */
-	assert(!vsb->v_inode_table);
+	assert(!curr_vsb()->v_inode_table);
 
 	if (!stats->ds_origin_seen)
 		report("Directory stats", "have no inode.");
@@ -262,11 +259,9 @@ static void free_dirstat(struct htable_entry *entry)
 		report("Directory stats", "wrong total size.");
 	if (stats->ds_chained_key)
 		report_unknown("Chained key in directory stats");
-
-	free(entry);
 }
 
-void free_dirstat_table(struct htable_entry **table)
+void free_dirstat_table(struct htable *table)
 {
 	free_htable(table, free_dirstat);
 }
@@ -275,7 +270,7 @@ struct dirstat *get_dirstat(u64 oid)
 {
 	struct htable_entry *entry;
 
-	entry = get_htable_entry(oid, sizeof(struct dirstat), vsb->v_dirstat_table);
+	entry = get_htable_entry(oid, sizeof(struct dirstat), curr_vsb()->v_dirstat_table);
 	return (struct dirstat *)entry;
 }
 
@@ -32,6 +32,6 @@ struct dirstat {
 extern void parse_dentry_record(void *key, struct apfs_drec_val *val, int len);
 extern void parse_dir_stats_record(void *key, struct apfs_dir_stats_val *val, int len);
 extern struct dirstat *get_dirstat(u64 oid);
-extern void free_dirstat_table(struct htable_entry **table);
+extern void free_dirstat_table(struct htable *table);
 
 #endif	/* _DIR_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Log of issues for the collect-all-errors mode.  Instead of exiting, report()
+ * records the issue here and jumps back to the innermost recovery point: the
+ * structure that was being parsed gets skipped, and the check goes on with
+ * the rest of the filesystem.  All issues are printed together at the end.
+ *
+ * The state left behind by the skipped structure is not cleaned up, and the
+ * later checks may complain about the parts that are missing.  The exception
+ * are the block buffers taken by a skipped subtree: they would stay pinned in
+ * the cache forever, so they are released.  A recovery point must never be
+ * set while a lock is held, and the mode only works with a single thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <apfs/raw.h>
+#include "apfsck.h"
+#include "cache.h"
+#include "errlog.h"
+#include "key.h"
+
+unsigned int errlog_limit;
+unsigned int errlog_count;
+unsigned int errlog_skips;
+
+/*
+ * Issue collected in the log
+ */
+struct errlog_entry {
+	char	e_text[192];	/* The report itself */
+	char	e_where[128];	/* What was skipped because of it */
+};
+
+static struct errlog_entry *errlog;
+
+/**
+ * push_recovery - Set a new recovery point for the current context
+ * @rec:	the recovery point, with r_env still unset
+ * @what:	description of the structure that would be skipped
+ * @id:		object id or number for the structure
+ * @key:	key of the parent record for the structure (can be NULL)
+ * @release:	release the block buffers taken by the structure on error?
+ *
+ * Only set @release if the structure keeps no references to its blocks once
+ * it's skipped; the volumes and snapshots, for example, leave their superblock
+ * and root nodes behind.  The caller must call setjmp() on @rec->r_env right after this, and remove the
+ * recovery point with pop_recovery() once the structure is parsed, or once
+ * setjmp() returns nonzero.
+ */
+void push_recovery(struct recovery *rec, const char *what, u64 id,
+		   const struct key *key, bool release)
+{
+	rec->r_what = what;
+	rec->r_id = id;
+	rec->r_has_key = key != NULL;
+	if (key) {
+		rec->r_key_id = key->id;
+		rec->r_key_number = key->number;
+		rec->r_key_type = key->type;
+	}
+
+	rec->r_release = release;
+	rec->r_held = cache_held_count();
+
+	rec->r_ctx = curr_ctx;
+	rec->r_bmap_log = curr_ctx->c_bmap_log;
+	rec->r_prev = curr_ctx->c_recovery;
+	curr_ctx->c_recovery = rec;
+}
+
+/**
+ * pop_recovery - Remove the innermost recovery point for the current context
+ * @rec: the recovery point
+ */
+void pop_recovery(struct recovery *rec)
+{
+	curr_ctx->c_recovery = rec->r_prev;
+}
+
+/**
+ * errlog_add - Add an issue to the log, unless it's already there
+ * @entry: the issue
+ *
+ * Returns false if the log became full.
+ */
+static bool errlog_add(struct errlog_entry *entry)
+{
+	unsigned int i;
+
+	/* Structures shared between snapshots may get skipped several times */
+	for (i = 0; i < errlog_count; ++i) {
+		if (!strcmp(errlog[i].e_text, entry->e_text) &&
+		    !strcmp(errlog[i].e_where, entry->e_where))
+			return true;
+	}
+
+	if (!errlog) {
+		errlog = calloc(errlog_limit, sizeof(*errlog));
+		if (!errlog)
+			system_error();
+	}
+	errlog[errlog_count++] = *entry;
+	return errlog_count < errlog_limit;
+}
+
+/**
+ * errlog_recover - Log an issue and resume from the innermost recovery point
+ * @context:	structure where corruption was found (can be NULL)
+ * @message:	short explanation, already formatted
+ *
+ * Must only be called if the current context has a recovery point.  If the
+ * log gets full, all the issues are printed and the check ends right away.
+ */
+__attribute__((noreturn)) void errlog_recover(const char *context,
+					      const char *message)
+{
+	struct recovery *rec = curr_ctx->c_recovery;
+	struct errlog_entry entry;
+	int len;
+
+	if (context)
+		snprintf(entry.e_text, sizeof(entry.e_text), "%s: %s", context, message);
+	else
+		snprintf(entry.e_text, sizeof(entry.e_text), "%s", message);
+
+	len = snprintf(entry.e_where, sizeof(entry.e_where), "skipped %s 0x%llx",
+		       rec->r_what, (unsigned long long)rec->r_id);
+	if (rec->r_has_key && len < sizeof(entry.e_where)) {
+		snprintf(entry.e_where + len, sizeof(entry.e_where) - len,
+			 ", after key 0x%llx type %u number 0x%llx",
+			 (unsigned long long)rec->r_key_id, rec->r_key_type,
+			 (unsigned long long)rec->r_key_number);
+	}
+
+	if (!errlog_add(&entry)) {
+		errlog_print();
+		printf("Too many issues found, giving up.\n");
+		abort_check();
+	}
+
+	++errlog_skips;
+	if (rec->r_release)
+		cache_release_held(rec->r_held);
+	curr_ctx = rec->r_ctx;
+	curr_ctx->c_bmap_log = rec->r_bmap_log;
+	longjmp(rec->r_env, 1);
+}
+
+/**
+ * errlog_print - Print all the issues collected so far
+ */
+void errlog_print(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < errlog_count; ++i)
+		printf("%s\n    (%s)\n", errlog[i].e_text, errlog[i].e_where);
+}
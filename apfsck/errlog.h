@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _ERRLOG_H
+#define _ERRLOG_H
+
+#include <setjmp.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+
+struct bmap_log;
+struct key;
+
+/*
+ * Place to resume the check from, in the collect-all-errors mode, if the
+ * structure being parsed turns out to be corrupted.  The structure is then
+ * skipped, and the check goes on from its caller.
+ */
+struct recovery {
+	jmp_buf			r_env;		/* Where to resume */
+	const char		*r_what;	/* Description of the structure */
+	u64			r_id;		/* Its object id or number */
+
+	/* Key of the parent record for the structure, if it has one */
+	bool			r_has_key;
+	u64			r_key_id;
+	u64			r_key_number;
+	u8			r_key_type;
+
+	/* Block buffers to release on error, see cache_release_held() */
+	bool			r_release;	/* Release them at all? */
+	u64			r_held;		/* Buffers to keep */
+
+	/* State of the context to restore on error */
+	struct check_context	*r_ctx;
+	struct bmap_log		*r_bmap_log;
+	struct recovery		*r_prev;	/* Outer recovery point, or NULL */
+};
+
+extern unsigned int errlog_limit;	/* Most issues to collect, or zero */
+extern unsigned int errlog_count;	/* Issues collected so far */
+extern unsigned int errlog_skips;	/* Structures skipped so far */
+
+extern void push_recovery(struct recovery *rec, const char *what, u64 id,
+			  const struct key *key, bool release);
+extern void pop_recovery(struct recovery *rec);
+extern __attribute__((noreturn)) void errlog_recover(const char *context,
+						     const char *message);
+extern void errlog_print(void);
+
+#endif	/* _ERRLOG_H */
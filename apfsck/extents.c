@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <apfs/raw.h>
 #include "apfsck.h"
 #include "btree.h"
@@ -14,6 +15,22 @@
 #include "key.h"
 #include "super.h"
 
+/*
+ * Reference from a dstream to a physical extent.  The references from all the
+ * dstreams of a volume get sorted together, so that they can be counted in a
+ * single pass.
+ */
+struct extent_ref {
+	u64	r_paddr;	/* First block of the physical extent */
+	u64	r_owner;	/* Owner id of the dstream */
+	u8	r_obj_type;	/* Type of the owner objects */
+};
+
+/* References from the dstreams, collected by free_dstream() */
+static __thread struct extent_ref *extent_refs;
+static __thread u64 extent_ref_count;
+static __thread u64 extent_ref_size;
+
 /**
  * calculate_total_refcnt - Fill in the e_total_refcnt field of an extent
  * @extent: the physical extent
@@ -40,22 +57,20 @@ static void free_extent(struct htable_entry *entry)
 	struct extent *extent = (struct extent *)entry;
 
 	if (!extent->e_update) {
-		vsb->v_block_count += extent->e_blocks;
+		curr_vsb()->v_block_count += extent->e_blocks;
 		container_bmap_mark_as_used(extent->e_bno, extent->e_blocks);
 	}
 
 	calculate_total_refcnt(extent);
 	if (extent->e_total_refcnt != extent->e_references)
 		report("Physical extent record", "bad reference count.");
-
-	free(entry);
 }
 
 /**
  * free_extent_table - Free the extent hash table and all its entries
  * @table: table to free
  */
-void free_extent_table(struct htable_entry **table)
+void free_extent_table(struct htable *table)
 {
 	free_htable(table, free_extent);
 }
@@ -71,7 +86,7 @@ static struct extent *get_extent(u64 bno)
 	struct htable_entry *entry;
 
 	entry = get_htable_entry(bno, sizeof(struct extent),
-				 vsb->v_extent_table);
+				 curr_vsb()->v_extent_table);
 	return (struct extent *)entry;
 }
 
@@ -85,7 +100,7 @@ static void check_dstream_stats(struct dstream *dstream)
 		report("Data stream", "has no references.");
 	if (dstream->d_id < APFS_MIN_USER_INO_NUM)
 		report("Data stream", "invalid or reserved id.");
-	if (dstream->d_id >= vsb->v_next_obj_id)
+	if (dstream->d_id >= curr_vsb()->v_next_obj_id)
 		report("Data stream", "free id in use.");
 
 	if (dstream->d_obj_type == APFS_TYPE_XATTR) {
@@ -121,6 +136,55 @@ static void check_dstream_stats(struct dstream *dstream)
 	}
 }
 
+/**
+ * u64_cmp - Compare two block numbers, for qsort()
+ * @a:	the first block number
+ * @b:	the second block number
+ */
+static int u64_cmp(const void *a, const void *b)
+{
+	u64 n1 = *(const u64 *)a;
+	u64 n2 = *(const u64 *)b;
+
+	return n1 < n2 ? -1 : n1 > n2;
+}
+
+/**
+ * extent_ref_cmp - Compare two extent references by address, then by owner
+ * @a:	the first reference
+ * @b:	the second reference
+ */
+static int extent_ref_cmp(const void *a, const void *b)
+{
+	const struct extent_ref *r1 = a;
+	const struct extent_ref *r2 = b;
+
+	if (r1->r_paddr != r2->r_paddr)
+		return r1->r_paddr < r2->r_paddr ? -1 : 1;
+	return r1->r_owner < r2->r_owner ? -1 : r1->r_owner > r2->r_owner;
+}
+
+/**
+ * add_extent_ref - Add a reference to the list for the volume
+ * @paddr:	first block of the physical extent
+ * @dstream:	dstream with the reference
+ */
+static void add_extent_ref(u64 paddr, struct dstream *dstream)
+{
+	struct extent_ref *ref;
+
+	if (extent_ref_count == extent_ref_size) {
+		extent_ref_size = extent_ref_size ? extent_ref_size << 1 : 1024;
+		extent_refs = realloc(extent_refs, extent_ref_size * sizeof(*extent_refs));
+		if (!extent_refs)
+			system_error();
+	}
+	ref = &extent_refs[extent_ref_count++];
+	ref->r_paddr = paddr;
+	ref->r_owner = dstream->d_owner;
+	ref->r_obj_type = dstream->d_obj_type;
+}
+
 /**
  * free_dstream - Free a dstream structure after performing some final checks
  * @entry: the entry to free
@@ -129,50 +193,74 @@ static void free_dstream(struct htable_entry *entry)
 {
 	struct dstream *dstream = (struct dstream *)entry;
 	struct listed_cnid *cnid;
-	struct listed_extent *curr_extent = dstream->d_extents;
+	u64 *extents = dstream->d_extents;
+	u32 i;
 
 	/* The dstreams must be freed before the cnids */
-	assert(vsb->v_cnid_table);
+	assert(curr_vsb()->v_cnid_table);
 
 	/* To check for reuse, put all filesystem object ids in a list */
 	cnid = get_listed_cnid(dstream->d_id);
 	cnid_set_state_flag(cnid, CNID_IN_DSTREAM);
 
-	/* Increase the refcount of each physical extent used by the dstream */
-	while (curr_extent) {
-		struct listed_extent *next_extent;
-		struct extent *extent;
+	/* Each physical extent is referenced once by the dstream, at most */
+	if (dstream->d_extent_count > 1)
+		qsort(extents, dstream->d_extent_count, sizeof(*extents), u64_cmp);
+	for (i = 0; i < dstream->d_extent_count; ++i) {
+		if (i == 0 || extents[i] != extents[i - 1])
+			add_extent_ref(extents[i], dstream);
+	}
+
+	check_dstream_stats(dstream);
+}
 
-		extent = get_extent(curr_extent->paddr);
-		if (extent->e_references) {
-			if (extent->e_obj_type != dstream->d_obj_type)
+/**
+ * count_extent_refs - Set the reference counts for all physical extents
+ *
+ * The references are sorted first, so that each extent only needs to be found
+ * in the hash table once.
+ */
+static void count_extent_refs(void)
+{
+	u64 i;
+
+	/* The array is still NULL if there are no references at all */
+	if (extent_ref_count)
+		qsort(extent_refs, extent_ref_count, sizeof(*extent_refs), extent_ref_cmp);
+
+	for (i = 0; i < extent_ref_count; ) {
+		struct extent_ref *first = &extent_refs[i];
+		struct extent *extent = get_extent(first->r_paddr);
+
+		for (; i < extent_ref_count && extent_refs[i].r_paddr == first->r_paddr; ++i) {
+			struct extent_ref *ref = &extent_refs[i];
+
+			if (ref->r_obj_type != first->r_obj_type)
 				report("Physical extent record",
 				       "owners have inconsistent types.");
 			/* Only count the extent once for each owner */
-			if (extent->e_latest_owner != dstream->d_owner)
+			if (ref == first || ref->r_owner != ref[-1].r_owner)
 				extent->e_references++;
-		} else {
-			extent->e_references++;
 		}
-		extent->e_obj_type = dstream->d_obj_type;
-		extent->e_latest_owner = dstream->d_owner;
-
-		next_extent = curr_extent->next;
-		free(curr_extent);
-		curr_extent = next_extent;
+		extent->e_obj_type = first->r_obj_type;
 	}
 
-	check_dstream_stats(dstream);
-	free(entry);
+	free(extent_refs);
+	extent_refs = NULL;
+	extent_ref_count = extent_ref_size = 0;
 }
 
 /**
  * free_dstream_table - Free the dstream hash table and all its entries
  * @table: table to free
+ *
+ * This also counts the references to each physical extent, so it must be
+ * called before free_extent_table().
  */
-void free_dstream_table(struct htable_entry **table)
+void free_dstream_table(struct htable *table)
 {
 	free_htable(table, free_dstream);
+	count_extent_refs();
 }
 
 /**
@@ -186,10 +274,36 @@ struct dstream *get_dstream(u64 id)
 	struct htable_entry *entry;
 
 	entry = get_htable_entry(id, sizeof(struct dstream),
-				 vsb->v_dstream_table);
+				 curr_vsb()->v_dstream_table);
 	return (struct dstream *)entry;
 }
 
+/**
+ * dstream_add_extent - Add a physical extent to the array for a dstream
+ * @dstream:	the dstream
+ * @paddr:	first block of the physical extent
+ *
+ * The arrays come from the arena of the dstream table, so the old ones just
+ * stay there when they need to grow; that never wastes more than the final
+ * size of the array.
+ */
+static void dstream_add_extent(struct dstream *dstream, u64 paddr)
+{
+	if (dstream->d_extent_count == dstream->d_extent_size) {
+		u32 new_size = dstream->d_extent_size ? dstream->d_extent_size << 1 : 2;
+		u64 *new;
+
+		if (new_size < dstream->d_extent_size)
+			report("Data stream", "too many extents.");
+		new = htable_alloc(curr_vsb()->v_dstream_table, new_size * sizeof(*new));
+		if (dstream->d_extent_count)
+			memcpy(new, dstream->d_extents, dstream->d_extent_count * sizeof(*new));
+		dstream->d_extents = new;
+		dstream->d_extent_size = new_size;
+	}
+	dstream->d_extents[dstream->d_extent_count++] = paddr;
+}
+
 /**
  * attach_prange_to_dstream - Attach a physical range to a dstream structure
  * @paddr:	physical address of the range
@@ -199,9 +313,6 @@ struct dstream *get_dstream(u64 id)
 static void attach_extent_to_dstream(u64 paddr, u64 blk_count,
 				     struct dstream *dstream)
 {
-	struct listed_extent **ext_p = NULL;
-	struct listed_extent *ext = NULL;
-	struct listed_extent *new;
 	struct extref_record extref;
 	u64 paddr_end;
 
@@ -214,33 +325,10 @@ static void attach_extent_to_dstream(u64 paddr, u64 blk_count,
 		extentref_lookup(paddr, &extref);
 		paddr = extref.phys_addr;
 
-		/*
-		 * Each iteration will go through the whole extent list, but
-		 * looping more than once seems too rare to optimize it.
-		 */
-		ext_p = &dstream->d_extents;
-		ext = *ext_p;
-
-		/* Entries are ordered by their physical address */
-		while (ext) {
-			/* Count physical extents only once for each owner */
-			if (paddr == ext->paddr)
-				goto next;
-
-			if (paddr < ext->paddr)
-				break;
-			ext_p = &ext->next;
-			ext = *ext_p;
-		}
-
-		new = malloc(sizeof(*new));
-		if (!new)
-			system_error();
-
-		new->paddr = paddr;
-		new->next = ext;
-		*ext_p = new;
-next:
+		/* Repeats get removed later, but the obvious ones go now */
+		if (!dstream->d_extent_count ||
+		    dstream->d_extents[dstream->d_extent_count - 1] != paddr)
+			dstream_add_extent(dstream, paddr);
 		paddr += extref.blocks;
 	}
 }
@@ -270,7 +358,7 @@ void parse_extent_record(struct apfs_file_extent_key *key,
 	length = le64_to_cpu(val->len_and_flags) & APFS_FILE_EXTENT_LEN_MASK;
 	if (!length)
 		report("Extent record", "length is zero.");
-	if (length & (sb->s_blocksize - 1))
+	if (length & (curr_sb()->s_blocksize - 1))
 		report("Extent record", "length isn't multiple of block size.");
 
 	flags = le64_to_cpu(val->len_and_flags) & APFS_FILE_EXTENT_FLAG_MASK;
@@ -291,7 +379,7 @@ void parse_extent_record(struct apfs_file_extent_key *key,
 		return;
 	}
 	attach_extent_to_dstream(le64_to_cpu(val->phys_block_num),
-				 length >> sb->s_blocksize_bits, dstream);
+				 length >> curr_sb()->s_blocksize_bits, dstream);
 }
 
 /**
@@ -357,7 +445,7 @@ u64 parse_phys_ext_record(struct apfs_phys_ext_key *key,
 			report("Physical extent record", "valid owner id for UPDATE.");
 		if (owner < APFS_MIN_USER_INO_NUM)
 			report("Physical extent record", "reserved id.");
-		if (owner >= vsb->v_next_obj_id)
+		if (owner >= curr_vsb()->v_next_obj_id)
 			report("Physical extent record", "free id in use.");
 	}
 
@@ -390,15 +478,13 @@ static void free_crypto_state(struct htable_entry *entry)
 
 	if (crypto->c_refcnt != crypto->c_references)
 		report("Crypto state record", "bad reference count.");
-
-	free(crypto);
 }
 
 /**
  * free_crypto_table - Free the crypto state hash table and all its entries
  * @table: table to free
  */
-void free_crypto_table(struct htable_entry **table)
+void free_crypto_table(struct htable *table)
 {
 	free_htable(table, free_crypto_state);
 }
@@ -413,7 +499,7 @@ struct crypto_state *get_crypto_state(u64 id)
 {
 	struct htable_entry *entry;
 
-	entry = get_htable_entry(id, sizeof(struct crypto_state), vsb->v_crypto_table);
+	entry = get_htable_entry(id, sizeof(struct crypto_state), curr_vsb()->v_crypto_table);
 	return (struct crypto_state *)entry;
 }
 
@@ -431,7 +517,7 @@ void parse_crypto_state_record(struct apfs_crypto_state_key *key, struct apfs_cr
 	struct crypto_state *crypto;
 	u16 key_len;
 
-	if (!vsb->v_encrypted)
+	if (!curr_vsb()->v_encrypted)
 		report("Unencrypted volume", "has crypto state records.");
 
 	if (len < sizeof(*val))
@@ -39,28 +39,23 @@ struct extent {
 	/* Extent stats measured by the fsck */
 	u32		e_references;	/* Number of references to extent */
 	u32		e_total_refcnt; /* Total refcnt, considering updates */
-	u64		e_latest_owner;	/* Last owner counted on e_references */
 };
 #define e_bno	e_htable.h_id		/* First physical block in the extent */
 
-/*
- * Structure used to register each physical extent for a dstream, so that the
- * references can later be counted.  The same extent structure might be shared
- * by several dstreams.
- */
-struct listed_extent {
-	u64			paddr;	 /* Physical address for the extent */
-	struct listed_extent	*next;	 /* Next entry in linked list */
-};
-
 /*
  * Dstream data in memory
  */
 struct dstream {
 	struct htable_entry d_htable; /* Hash table entry header */
 
-	/* Linked list of physical extents for dstream */
-	struct listed_extent *d_extents;
+	/*
+	 * Physical extents used by the dstream, so that the references can
+	 * later be counted.  The same extent might be shared by several
+	 * dstreams.  Not sorted, and repeats are possible.
+	 */
+	u64		*d_extents;
+	u32		d_extent_count;	/* Number of entries in @d_extents */
+	u32		d_extent_size;	/* Number of entries allocated for */
 
 	u8		d_obj_type;	/* Type of the owner objects */
 	u64		d_owner;	/* Owner id for the extentref tree */
@@ -96,8 +91,8 @@ struct crypto_state {
 };
 #define c_id	c_htable.h_id		/* Crypto id */
 
-extern void free_dstream_table(struct htable_entry **table);
-extern void free_extent_table(struct htable_entry **table);
+extern void free_dstream_table(struct htable *table);
+extern void free_extent_table(struct htable *table);
 extern struct dstream *get_dstream(u64 ino);
 extern void parse_extent_record(struct apfs_file_extent_key *key,
 				struct apfs_file_extent_val *val, int len);
@@ -105,7 +100,7 @@ extern void parse_dstream_id_record(struct apfs_dstream_id_key *key,
 				    struct apfs_dstream_id_val *val, int len);
 extern u64 parse_phys_ext_record(struct apfs_phys_ext_key *key,
 				 struct apfs_phys_ext_val *val, int len);
-extern void free_crypto_table(struct htable_entry **table);
+extern void free_crypto_table(struct htable *table);
 extern struct crypto_state *get_crypto_state(u64 id);
 extern void parse_crypto_state_record(struct apfs_crypto_state_key *key, struct apfs_crypto_state_val *val, int len);
 
@@ -7,41 +7,120 @@
 #include <apfs/types.h>
 #include "apfsck.h"
 #include "htable.h"
+#include "hugepage.h"
+#include "stats.h"
 #include "super.h"
 
+/* Source for the hash seeds, so that each table gets its own */
+static u64 htable_seed_count;
+
+/**
+ * htable_mix - Mix the bits of a 64-bit integer
+ * @id: the integer to mix
+ *
+ * This is the finalizer from MurmurHash3; cnids, oids and block numbers tend
+ * to be sequential, so the low bits alone would cluster badly.
+ */
+static inline u64 htable_mix(u64 id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	id *= 0xc4ceb9fe1a85ec53ULL;
+	id ^= id >> 33;
+	return id;
+}
+
+/**
+ * htable_hash - Find the home slot of an id, before masking
+ * @table:	the hash table
+ * @id:		the id to hash
+ *
+ * Each table uses a different seed.  Entries are often moved from one table
+ * to another in the slot order of the first; with a shared hash, they would
+ * then land in long runs of consecutive slots.
+ */
+static inline u64 htable_hash(struct htable *table, u64 id)
+{
+	return htable_mix(id ^ table->t_seed);
+}
+
+/**
+ * alloc_htable_slots - Set up an empty slot array for a hash table
+ * @table:	the hash table
+ * @count:	number of slots, must be a power of two
+ */
+static void alloc_htable_slots(struct htable *table, u64 count)
+{
+	table->t_slots = huge_calloc(count, sizeof(*table->t_slots));
+	table->t_mask = count - 1;
+	table->t_count = 0;
+}
+
 /**
  * alloc_htable - Allocates and returns an empty hash table
  */
-struct htable_entry **alloc_htable(void)
+struct htable *alloc_htable(void)
 {
-	struct htable_entry **table;
+	struct htable *table;
+	u64 seed;
 
-	table = calloc(HTABLE_BUCKETS, sizeof(*table));
+	table = calloc(1, sizeof(*table));
 	if (!table)
 		system_error();
+	seed = __atomic_add_fetch(&htable_seed_count, 1, __ATOMIC_RELAXED);
+	table->t_seed = htable_mix(seed);
+	alloc_htable_slots(table, HTABLE_MIN_SLOTS);
 	return table;
 }
 
+/**
+ * htable_collect - Make a list of all entries in a hash table
+ * @table:	the hash table
+ *
+ * Returns a NULL-terminated array, to be freed by the caller.  Working on a
+ * copy of the list allows callers to add more entries to the table while they
+ * go through it; those new entries won't be visited.
+ */
+static struct htable_entry **htable_collect(struct htable *table)
+{
+	struct htable_entry **entries = NULL;
+	u64 i, count = 0;
+
+	entries = malloc((table->t_count + 1) * sizeof(*entries));
+	if (!entries)
+		system_error();
+	for (i = 0; i <= table->t_mask; ++i) {
+		if (table->t_slots[i].s_entry)
+			entries[count++] = table->t_slots[i].s_entry;
+	}
+	entries[count] = NULL;
+	return entries;
+}
+
 /**
  * free_htable - Free a hash table and all its entries
  * @table:	the catalog table to free
- * @free_entry:	function that checks and frees an entry
+ * @free_entry:	function that checks an entry before it goes away (or NULL)
+ *
+ * The entries, and anything else allocated with htable_alloc(), are released
+ * all at once after @free_entry has been called on each of them.
  */
-void free_htable(struct htable_entry **table,
+void free_htable(struct htable *table,
 		 void (*free_entry)(struct htable_entry *))
 {
-	struct htable_entry *current;
-	struct htable_entry *next;
-	int i;
-
-	for (i = 0; i < HTABLE_BUCKETS; ++i) {
-		current = table[i];
-		while (current) {
-			next = current->h_next;
-			free_entry(current);
-			current = next;
-		}
+	struct htable_entry **entries = NULL;
+	struct htable_entry **current = NULL;
+
+	if (free_entry) {
+		entries = htable_collect(table);
+		for (current = entries; *current; ++current)
+			free_entry(*current);
+		free(entries);
 	}
+
+	arena_release(&table->t_arena);
+	huge_free(table->t_slots);
 	free(table);
 }
 
@@ -50,20 +129,77 @@ void free_htable(struct htable_entry **table,
  * @table:	the hash table
  * @fn:		function to apply
  */
-void apply_on_htable(struct htable_entry **table, void (*fn)(struct htable_entry *))
+void apply_on_htable(struct htable *table, void (*fn)(struct htable_entry *))
+{
+	struct htable_entry **entries = NULL;
+	struct htable_entry **current = NULL;
+
+	entries = htable_collect(table);
+	for (current = entries; *current; ++current)
+		fn(*current);
+	free(entries);
+}
+
+/**
+ * htable_insert_slot - Put an entry in a hash table, with no size checks
+ * @table:	the hash table
+ * @id:		id of the entry
+ * @entry:	the entry
+ *
+ * The caller must make sure that the id is not already in the table.
+ */
+static void htable_insert_slot(struct htable *table, u64 id, struct htable_entry *entry)
 {
-	struct htable_entry *current;
-	struct htable_entry *next;
-	int i;
-
-	for (i = 0; i < HTABLE_BUCKETS; ++i) {
-		current = table[i];
-		while (current) {
-			next = current->h_next;
-			fn(current);
-			current = next;
+	struct htable_slot new = {.s_id = id, .s_entry = entry};
+	u64 index = htable_hash(table, id) & table->t_mask;
+	u64 dist = 0;
+
+	while (table->t_slots[index].s_entry) {
+		struct htable_slot *slot = &table->t_slots[index];
+		u64 slot_dist = (index - htable_hash(table, slot->s_id)) & table->t_mask;
+
+		/* Robin hood: take the place of entries closer to their home */
+		if (slot_dist < dist) {
+			struct htable_slot tmp = *slot;
+
+			*slot = new;
+			new = tmp;
+			dist = slot_dist;
 		}
+		index = (index + 1) & table->t_mask;
+		++dist;
 	}
+	table->t_slots[index] = new;
+	++table->t_count;
+}
+
+/**
+ * htable_grow - Double the number of slots in a hash table
+ * @table: the hash table
+ */
+static void htable_grow(struct htable *table)
+{
+	struct htable_slot *old_slots = table->t_slots;
+	u64 old_count = table->t_mask + 1;
+	u64 i;
+
+	alloc_htable_slots(table, old_count << 1);
+	for (i = 0; i < old_count; ++i) {
+		if (old_slots[i].s_entry)
+			htable_insert_slot(table, old_slots[i].s_id, old_slots[i].s_entry);
+	}
+	huge_free(old_slots);
+}
+
+/**
+ * htable_count_probe - Update the statistics for a finished lookup
+ * @dist: number of slots probed beyond the first one
+ */
+static inline void htable_count_probe(u64 dist)
+{
+	stats_add(STAT_HTABLE_LOOKUPS, 1);
+	stats_add(STAT_HTABLE_PROBES, dist);
+	stats_max(STAT_HTABLE_MAX_PROBE, dist);
 }
 
 /**
@@ -75,34 +211,50 @@ void apply_on_htable(struct htable_entry **table, void (*fn)(struct htable_entry
  * Returns the entry, after creating it if necessary.
  */
 struct htable_entry *get_htable_entry(u64 id, int size,
-				      struct htable_entry **table)
+				      struct htable *table)
 {
-	int index = id % HTABLE_BUCKETS; /* Trivial hash function */
-	struct htable_entry **entry_p = table + index;
-	struct htable_entry *entry = *entry_p;
+	u64 index = htable_hash(table, id) & table->t_mask;
 	struct htable_entry *new;
+	u64 dist = 0;
 
-	/* In each linked list, entries are ordered by id */
-	while (entry) {
-		if (id == entry->h_id)
-			return entry;
-		if (id < entry->h_id)
-			break;
+	while (table->t_slots[index].s_entry) {
+		struct htable_slot *slot = &table->t_slots[index];
 
-		entry_p = &entry->h_next;
-		entry = *entry_p;
+		if (slot->s_id == id) {
+			htable_count_probe(dist);
+			return slot->s_entry;
+		}
+		/* If the id were here, it would have displaced this entry */
+		if (((index - htable_hash(table, slot->s_id)) & table->t_mask) < dist)
+			break;
+		index = (index + 1) & table->t_mask;
+		++dist;
 	}
+	htable_count_probe(dist);
 
-	new = calloc(1, size);
-	if (!new)
-		system_error();
-
+	new = arena_alloc(&table->t_arena, size);
 	new->h_id = id;
-	new->h_next = entry;
-	*entry_p = new;
+
+	/* Keep the load factor under 3/4, so that probes stay short */
+	if ((table->t_count + 1) * 4 > (table->t_mask + 1) * 3)
+		htable_grow(table);
+	htable_insert_slot(table, id, new);
 	return new;
 }
 
+/**
+ * htable_alloc - Allocate memory that lives as long as a hash table
+ * @table:	the hash table
+ * @size:	number of bytes required
+ *
+ * Meant for small structures attached to the entries, which can then be left
+ * for free_htable() to release together with the table.  Returns zeroed memory.
+ */
+void *htable_alloc(struct htable *table, size_t size)
+{
+	return arena_alloc(&table->t_arena, size);
+}
+
 static void free_cnid(struct htable_entry *entry)
 {
 	struct listed_cnid *cnid = (struct listed_cnid *)entry;
@@ -111,8 +263,6 @@ static void free_cnid(struct htable_entry *entry)
 		if (cnid->c_state & ~CNID_IN_SIBLING_LINK)
 			report("Catalog", "sibling link oid reused elsewhere.");
 	}
-
-	free(entry);
 }
 
 /**
@@ -122,9 +272,8 @@ static void free_cnid(struct htable_entry *entry)
  * Also performs some consistency checks that can only be done after the whole
  * catalog has been parsed.
  */
-void free_cnid_table(struct htable_entry **table)
+void free_cnid_table(struct htable *table)
 {
-	/* No checks needed here, just call free() on each entry */
 	free_htable(table, free_cnid);
 }
 
@@ -139,6 +288,6 @@ struct listed_cnid *get_listed_cnid(u64 id)
 	struct htable_entry *entry;
 
 	entry = get_htable_entry(id, sizeof(struct listed_cnid),
-				 vsb->v_cnid_table);
+				 curr_vsb()->v_cnid_table);
 	return (struct listed_cnid *)entry;
 }
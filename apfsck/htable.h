@@ -5,18 +5,41 @@
 #ifndef _HTABLE_H
 #define _HTABLE_H
 
+#include <stddef.h>
 #include <apfs/types.h>
+#include "arena.h"
 
-#define HTABLE_BUCKETS	512	/* So the hash table array fits in 4k */
+#define HTABLE_MIN_SLOTS	64	/* Initial size of the slot array */
 
 /*
  * Structure of the common header for hash table entries
  */
 struct htable_entry {
-	struct htable_entry	*h_next;	/* Next entry in linked list */
 	u64			h_id;		/* Catalog object id of entry */
 };
 
+/*
+ * A slot in the hash table.  The id is kept next to the entry pointer, so that
+ * probing never needs to dereference entries that don't match.
+ */
+struct htable_slot {
+	u64			s_id;		/* Id of the entry */
+	struct htable_entry	*s_entry;	/* The entry, or NULL if free */
+};
+
+/*
+ * Hash table with open addressing and robin hood probing.  The table grows as
+ * needed; the entries themselves are allocated separately, so pointers to them
+ * remain valid for as long as the table exists.
+ */
+struct htable {
+	struct htable_slot	*t_slots;	/* Array of slots */
+	u64			t_mask;		/* Number of slots, minus one */
+	u64			t_count;	/* Number of entries in the table */
+	u64			t_seed;		/* Seed for the hash function */
+	struct arena		t_arena;	/* Memory for entries and their data */
+};
+
 /* State of the in-memory listed cnid structure */
 #define CNID_UNUSED		0 /* The cnid is unused */
 #define CNID_IN_SIBLING_LINK	1 /* The cnid was seen in a sibling link */
@@ -39,13 +62,14 @@ static inline void cnid_set_state_flag(struct listed_cnid *cnid, u8 flag)
 	cnid->c_state |= flag;
 }
 
-extern struct htable_entry **alloc_htable();
-extern void free_htable(struct htable_entry **table,
+extern struct htable *alloc_htable(void);
+extern void free_htable(struct htable *table,
 			void (*free_entry)(struct htable_entry *));
-extern void apply_on_htable(struct htable_entry **table, void (*fn)(struct htable_entry *));
+extern void apply_on_htable(struct htable *table, void (*fn)(struct htable_entry *));
 extern struct htable_entry *get_htable_entry(u64 id, int size,
-					     struct htable_entry **table);
-extern void free_cnid_table(struct htable_entry **table);
+					     struct htable *table);
+extern void *htable_alloc(struct htable *table, size_t size);
+extern void free_cnid_table(struct htable *table);
 extern struct listed_cnid *get_listed_cnid(u64 id);
 
 #endif	/* _HTABLE_H */
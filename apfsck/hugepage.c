@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Allocations for the big arrays that get accessed at random: the hash tables,
+ * the allocation bitmaps.  On large containers they take gigabytes, and with
+ * regular pages most of their accesses miss the TLB.  If the user asks for it,
+ * these arrays are mapped on huge pages instead.  The reserved pool is tried
+ * first if requested, then transparent huge pages, and then regular pages;
+ * small arrays just go to calloc().
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "hugepage.h"
+#include "stats.h"
+
+int hugepage_mode = HUGEPAGE_OFF;
+
+/* Kinds of allocation, to know how to free them */
+#define HUGE_KIND_HEAP	0	/* From calloc() */
+#define HUGE_KIND_MMAP	1	/* From mmap() */
+
+/*
+ * Header in front of each allocation.  It takes a whole cache line, so that
+ * the array that follows stays aligned.
+ */
+struct huge_header {
+	size_t	h_len;		/* Length of the mapping, including the header */
+	int	h_kind;		/* HUGE_KIND_HEAP or HUGE_KIND_MMAP */
+} __attribute__((aligned(64)));
+
+/**
+ * hugepage_set_mode - Set the backend for the large allocations
+ * @name: name of the backend, as given by the user
+ *
+ * Returns false if the name is not known.
+ */
+bool hugepage_set_mode(const char *name)
+{
+	if (!strcmp(name, "off"))
+		hugepage_mode = HUGEPAGE_OFF;
+	else if (!strcmp(name, "thp"))
+		hugepage_mode = HUGEPAGE_THP;
+	else if (!strcmp(name, "hugetlb"))
+		hugepage_mode = HUGEPAGE_HUGETLB;
+	else
+		return false;
+	return true;
+}
+
+/**
+ * huge_map_thp - Map anonymous memory aligned to the huge page size
+ * @len: length of the mapping, a multiple of the huge page size
+ *
+ * Returns NULL on failure.
+ */
+static void *huge_map_thp(size_t len)
+{
+	char *map, *start;
+	size_t head, tail;
+
+	/* Map a little more, to be able to trim it to the alignment */
+	map = mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	start = (char *)(((uintptr_t)map + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1));
+	head = start - map;
+	tail = HUGEPAGE_SIZE - head;
+	if (head)
+		munmap(map, head);
+	if (tail)
+		munmap(start + len, tail);
+
+	/* Without THP support this fails, and regular pages get used */
+	if (madvise(start, len, MADV_HUGEPAGE))
+		stats_add(STAT_HUGE_FALLBACKS, 1);
+	else
+		stats_add(STAT_HUGE_BYTES, len);
+	return start;
+}
+
+/**
+ * huge_calloc - Allocate a zeroed array, on huge pages if possible
+ * @count:	number of elements
+ * @size:	size of each element
+ *
+ * The array must be freed with huge_free().
+ */
+void *huge_calloc(size_t count, size_t size)
+{
+	struct huge_header *hdr = NULL;
+	size_t len;
+
+	if (size && count > (SIZE_MAX - sizeof(*hdr) - HUGEPAGE_SIZE) / size)
+		system_error();
+	len = sizeof(*hdr) + count * size;
+
+	if (hugepage_mode == HUGEPAGE_OFF || len < HUGEPAGE_SIZE) {
+		hdr = calloc(1, len);
+		if (!hdr)
+			system_error();
+		hdr->h_kind = HUGE_KIND_HEAP;
+		hdr->h_len = len;
+		return hdr + 1;
+	}
+
+	len = (len + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+	if (hugepage_mode == HUGEPAGE_HUGETLB) {
+		hdr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (hdr == MAP_FAILED) {
+			/* The pool is probably empty */
+			stats_add(STAT_HUGE_FALLBACKS, 1);
+			hdr = NULL;
+		} else {
+			stats_add(STAT_HUGE_BYTES, len);
+		}
+	}
+	if (!hdr)
+		hdr = huge_map_thp(len);
+	if (!hdr)
+		system_error();
+
+	hdr->h_kind = HUGE_KIND_MMAP;
+	hdr->h_len = len;
+	return hdr + 1;
+}
+
+/**
+ * huge_free - Free an array allocated with huge_calloc()
+ * @ptr: the array (can be NULL)
+ */
+void huge_free(void *ptr)
+{
+	struct huge_header *hdr;
+
+	if (!ptr)
+		return;
+	hdr = (struct huge_header *)ptr - 1;
+	if (hdr->h_kind == HUGE_KIND_HEAP)
+		free(hdr);
+	else
+		munmap(hdr, hdr->h_len);
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _HUGEPAGE_H
+#define _HUGEPAGE_H
+
+#include <stddef.h>
+#include <apfs/types.h>
+
+/* Backends for the large allocations */
+#define HUGEPAGE_OFF		0	/* Plain calloc() */
+#define HUGEPAGE_THP		1	/* Transparent huge pages, via madvise() */
+#define HUGEPAGE_HUGETLB	2	/* Reserved huge pages, or else THP */
+
+/* Size of a huge page, and minimum size for an allocation to use them */
+#define HUGEPAGE_SIZE		(2 * 1024 * 1024)
+
+extern int hugepage_mode;	/* Backend requested by the user */
+
+extern bool hugepage_set_mode(const char *name);
+extern void *huge_calloc(size_t count, size_t size);
+extern void huge_free(void *ptr);
+
+#endif	/* _HUGEPAGE_H */
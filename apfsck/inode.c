@@ -65,7 +65,7 @@ static void check_inode_stats(struct inode *inode)
 	struct dstream *dstream;
 
 	/* The inodes must be freed before the dstreams */
-	assert(vsb->v_dstream_table);
+	assert(curr_vsb()->v_dstream_table);
 
 	if ((inode->i_mode & S_IFMT) == S_IFDIR) {
 		if (inode->i_link_count != 1)
@@ -135,7 +135,7 @@ static void check_purgeable_name(struct inode *inode)
 	if (buflen < 0)
 		system_error();
 
-	if (strcmp(inode->i_purg_name, buf) != 0)
+	if (strcmp(inode->i_purg_name->as_str, buf) != 0)
 		report("Purgeable inode", "wrong name for purgeable dentry.");
 
 	free(buf);
@@ -161,7 +161,7 @@ static void free_inode_names(struct inode *inode)
 
 	if (inode->i_flags & APFS_INODE_ACTIVE_FILE_TRIMMED) {
 		/* No idea if any of this is actually required */
-		if (strcmp(inode->i_name, ".overprovisioning_file"))
+		if (strcmp(inode->i_name->as_str, ".overprovisioning_file"))
 			report("Overprovisioning file", "wrong name.");
 		if (inode->i_link_count != 1)
 			report("Overprovisioning file", "has hard links.");
@@ -169,15 +169,20 @@ static void free_inode_names(struct inode *inode)
 
 	if (inode->i_purg_name) {
 		check_purgeable_name(inode);
-		free(inode->i_purg_name);
 		inode->i_purg_name = NULL;
 	}
 
 	if (current) {
-		/* Primary link has lowest id, so it comes first in the list */
-		if (strcmp(inode->i_name, (char *)current->s_name))
+		struct sibling *primary = current;
+
+		/* Primary link has lowest id, but the list is unordered */
+		for (next = current->s_next; next; next = next->s_next) {
+			if (next->s_id < primary->s_id)
+				primary = next;
+		}
+		if (!arena_str_equal(inode->i_name, primary->s_name))
 			report("Inode record", "wrong name for primary link.");
-		if (inode->i_parent_id != current->s_parent_ino)
+		if (inode->i_parent_id != primary->s_parent_ino)
 			report("Inode record", "bad parent for primary link.");
 	} else if (inode->i_first_parent != APFS_PRIV_DIR_INO_NUM) {
 		/*
@@ -185,15 +190,11 @@ static void free_inode_names(struct inode *inode)
 		 * Files moved to the private directory preserve their original
 		 * name and parent_id, so there's nothing to check.
 		 */
-		if (strcmp(inode->i_name, inode->i_first_name))
+		if (!arena_str_equal(inode->i_name, inode->i_first_name))
 			report("Inode record", "wrong name for only link.");
 		if (inode->i_parent_id != inode->i_first_parent)
 			report("Inode record", "bad parent for only link.");
 	}
-	free(inode->i_name);
-	inode->i_name = NULL;
-	free(inode->i_first_name);
-	inode->i_first_name = NULL;
 
 	while (current) {
 		struct listed_cnid *cnid;
@@ -208,8 +209,6 @@ static void free_inode_names(struct inode *inode)
 			report("Catalog", "no sibling map for link.");
 
 		next = current->s_next;
-		free(current->s_name);
-		free(current);
 		current = next;
 		++count;
 	}
@@ -239,9 +238,9 @@ static void free_inode(struct htable_entry *entry)
 	struct listed_cnid *cnid;
 
 	/* All of these must still be around for the inodes to access */
-	assert(vsb->v_cnid_table);
-	assert(vsb->v_dirstat_table);
-	assert(vsb->v_dstream_table);
+	assert(curr_vsb()->v_cnid_table);
+	assert(curr_vsb()->v_dirstat_table);
+	assert(curr_vsb()->v_dstream_table);
 
 	/* To check for reuse, put all filesystem object ids in a list */
 	cnid = get_listed_cnid(inode->i_ino);
@@ -249,7 +248,6 @@ static void free_inode(struct htable_entry *entry)
 
 	check_inode_stats(inode);
 	free_inode_names(inode);
-	free(entry);
 }
 
 static void collect_dirstats(struct htable_entry *entry)
@@ -289,7 +287,7 @@ static void collect_dirstats(struct htable_entry *entry)
  * Also performs some consistency checks that can only be done after the whole
  * catalog has been parsed.
  */
-void free_inode_table(struct htable_entry **table)
+void free_inode_table(struct htable *table)
 {
 	/*
 	 * Collect directory statistics, and check that descendant directories
@@ -310,7 +308,7 @@ struct inode *get_inode(u64 ino)
 {
 	struct htable_entry *entry;
 
-	entry = get_htable_entry(ino, sizeof(struct inode), vsb->v_inode_table);
+	entry = get_htable_entry(ino, sizeof(struct inode), curr_vsb()->v_inode_table);
 	return (struct inode *)entry;
 }
 
@@ -355,7 +353,7 @@ static int read_document_id_xfield(char *xval, int len, struct inode *inode)
 
 	if (id < APFS_MIN_DOC_ID)
 		report("Document id xfield", "invalid id in use.");
-	if (id >= vsb->v_next_doc_id)
+	if (id >= curr_vsb()->v_next_doc_id)
 		report("Document id xfield", "free id in use.");
 
 	return sizeof(*id_raw);
@@ -402,10 +400,7 @@ static int read_name_xfield(char *xval, int len, struct inode *inode)
 	if (xval[xlen - 1] != 0)
 		report("Name xfield", "name with no null termination");
 
-	inode->i_name = malloc(xlen);
-	if (!inode->i_name)
-		system_error();
-	strcpy(inode->i_name, xval);
+	inode->i_name = arena_strdup(&curr_vsb()->v_inode_table->t_arena, xval, xlen);
 
 	return xlen;
 }
@@ -767,7 +762,7 @@ static bool inos_valid_for_sysvol_in_group(u64 ino, u64 parent_ino)
  */
 void check_inode_ids(u64 ino, u64 parent_ino)
 {
-	if (ino >= vsb->v_next_obj_id || parent_ino >= vsb->v_next_obj_id)
+	if (ino >= curr_vsb()->v_next_obj_id || parent_ino >= curr_vsb()->v_next_obj_id)
 		report("Inode record", "free inode number in use.");
 
 	if (ino < APFS_MIN_USER_INO_NUM) {
@@ -847,9 +842,9 @@ void parse_inode_record(struct apfs_inode_key *key,
 	}
 
 	if (inode->i_ino == APFS_ROOT_DIR_INO_NUM)
-		vsb->v_has_root = true;
+		curr_vsb()->v_has_root = true;
 	if (inode->i_ino == APFS_PRIV_DIR_INO_NUM)
-		vsb->v_has_priv = true;
+		curr_vsb()->v_has_priv = true;
 
 	inode->i_flags = le64_to_cpu(val->internal_flags);
 	check_inode_internal_flags(inode->i_flags);
@@ -870,20 +865,20 @@ void parse_inode_record(struct apfs_inode_key *key,
 
 	switch (filetype) {
 	case S_IFREG:
-		vsb->v_file_count++;
+		curr_vsb()->v_file_count++;
 		break;
 	case S_IFDIR:
 		if (inode->i_ino >= APFS_MIN_USER_INO_NUM)
-			vsb->v_dir_count++;
+			curr_vsb()->v_dir_count++;
 		break;
 	case S_IFLNK:
-		vsb->v_symlink_count++;
+		curr_vsb()->v_symlink_count++;
 		break;
 	case S_IFSOCK:
 	case S_IFBLK:
 	case S_IFCHR:
 	case S_IFIFO:
-		vsb->v_special_count++;
+		curr_vsb()->v_special_count++;
 		break;
 	default:
 		report("Inode record", "invalid file mode.");
@@ -906,34 +901,40 @@ void parse_inode_record(struct apfs_inode_key *key,
  * @id:		sibling id
  * @inode:	the inode
  *
- * Returns the sibling structure, after creating it if necessary.
+ * Returns the sibling structure, after creating it if necessary.  Files can
+ * have a huge number of hard links, so the siblings for the whole volume go
+ * in a hash table; the inode only keeps them in an unordered list.
  */
 struct sibling *get_sibling(u64 id, struct inode *inode)
 {
-	struct sibling **entry_p = &inode->i_siblings;
-	struct sibling *entry = *entry_p;
-	struct sibling *new;
-
-	/* Siblings are ordered by id in the inode's linked list */
-	while (entry) {
-		if (id == entry->s_id)
-			return entry;
-		if (id < entry->s_id)
-			break;
-
-		entry_p = &entry->s_next;
-		entry = *entry_p;
+	struct htable *table = curr_vsb()->v_sibling_table;
+	struct sibling *entry;
+	u64 count = table->t_count;
+
+	entry = (struct sibling *)get_htable_entry(id, sizeof(*entry), table);
+	if (table->t_count == count) {
+		/* Sibling ids come from the same pool as inode numbers */
+		if (entry->s_ino != inode->i_ino)
+			report("Catalog", "sibling id is used by two inodes.");
+		return entry;
 	}
 
-	new = calloc(1, sizeof(*new));
-	if (!new)
-		system_error();
+	entry->s_ino = inode->i_ino;
+	entry->s_next = inode->i_siblings;
+	inode->i_siblings = entry;
+	return entry;
+}
 
-	new->s_checked = false;
-	new->s_id = id;
-	new->s_next = entry;
-	*entry_p = new;
-	return new;
+/**
+ * free_sibling_table - Free the sibling hash table and all its entries
+ * @table: table to free
+ *
+ * The siblings get checked along with their inodes, so the inode table must
+ * be freed first.
+ */
+void free_sibling_table(struct htable *table)
+{
+	free_htable(table, NULL);
 }
 
 /**
@@ -953,18 +954,15 @@ void set_or_check_sibling(u64 parent_id, int namelen, u8 *name,
 	if (!sibling->s_name) {
 		sibling->s_parent_ino = parent_id;
 		sibling->s_name_len = namelen;
-
-		sibling->s_name = malloc(namelen);
-		if (!sibling->s_name)
-			system_error();
-		strcpy((char *)sibling->s_name, (char *)name);
+		sibling->s_name = arena_strdup(&curr_vsb()->v_sibling_table->t_arena,
+					       (char *)name, strlen((char *)name) + 1);
 		return;
 	}
 
 	/* Fields already set, check them */
 	if (sibling->s_name_len != namelen)
 		report("Sibling record", "name length doesn't match dentry's.");
-	if (strcmp((char *)sibling->s_name, (char *)name))
+	if (strcmp(sibling->s_name->as_str, (char *)name))
 		report("Sibling record", "name doesn't match dentry's.");
 	if (sibling->s_parent_ino != parent_id)
 		report("Sibling record", "parent id doesn't match dentry's.");
@@ -1005,7 +1003,7 @@ void parse_sibling_record(struct apfs_sibling_link_key *key,
 	/* It seems that sibling ids come from the same pool as inode numbers */
 	if (sibling->s_id < APFS_MIN_USER_INO_NUM)
 		report("Sibling record", "invalid sibling id.");
-	if (sibling->s_id >= vsb->v_next_obj_id)
+	if (sibling->s_id >= curr_vsb()->v_next_obj_id)
 		report("Sibling record", "free id in use.");
 
 	set_or_check_sibling(le64_to_cpu(val->parent_id), namelen, val->name,
@@ -37,11 +37,11 @@ struct inode {
 	u64		i_sparse_bytes;	/* Number of sparse bytes */
 	u64		i_flags;	/* Internal flags */
 	u32		i_rdev;		/* Device ID */
-	char		*i_name;	/* Name of primary link */
+	struct arena_str *i_name;	/* Name of primary link (or NULL) */
 	u64		i_parent_id;	/* Parent id for the primary link */
 	struct dstream	*i_dstream;	/* The inode's dstream (can be NULL) */
 	u64		i_purg_flags;	/* Inode purgeable flags */
-	char		*i_purg_name;	/* Purgeable dentry name (can be NULL) */
+	struct arena_str *i_purg_name;	/* Purgeable dentry name (can be NULL) */
 	u32		i_owner;	/* Id of the owner user */
 	struct dirstat	*i_dirstat;	/* Directory statistics (can be NULL) */
 
@@ -50,9 +50,9 @@ struct inode {
 	u16		i_xfield_bmap;	/* Bitmap of xfields for inode */
 	u32		i_child_count;	/* Number of children of directory */
 	u32		i_link_count;	/* Number of dentries for file */
-	char		*i_first_name;	/* Name of first dentry encountered */
+	struct arena_str *i_first_name;	/* Name of first dentry encountered */
 	u64		i_first_parent;	/* Parent id of the first dentry seen */
-	struct sibling	*i_siblings;	/* Linked list of siblings for inode */
+	struct sibling	*i_siblings;	/* Unordered list of siblings for inode */
 };
 #define i_ino	i_htable.h_id		/* Inode number */
 
@@ -60,22 +60,25 @@ struct inode {
  * Sibling link data in memory
  */
 struct sibling {
-	struct sibling	*s_next;	/* Next sibling in linked list */
-	u64		s_id;		/* Sibling id */
+	struct htable_entry s_htable;	/* Must always be first */
+	struct sibling	*s_next;	/* Next sibling in the inode's list */
+	u64		s_ino;		/* Inode number for the file */
 	bool		s_checked;	/* Has this sibling been checked? */
 	bool		s_mapped;	/* Has the sibling map been seen? */
 
 	u64		s_parent_ino;	/* Inode number for parent */
 	u16		s_name_len;	/* Name length */
-	u8		*s_name;	/* In-memory copy of the name */
+	struct arena_str *s_name;	/* Name (or NULL if not set yet) */
 };
+#define s_id	s_htable.h_id		/* Sibling id */
 
-extern void free_inode_table(struct htable_entry **table);
+extern void free_inode_table(struct htable *table);
 extern struct inode *get_inode(u64 ino);
 extern void check_inode_ids(u64 ino, u64 parent_ino);
 extern void parse_inode_record(struct apfs_inode_key *key,
 			       struct apfs_inode_val *val, int len);
 extern struct sibling *get_sibling(u64 id, struct inode *inode);
+extern void free_sibling_table(struct htable *table);
 extern void set_or_check_sibling(u64 parent_id, int namelen, u8 *name,
 				 struct sibling *sibling);
 extern void parse_sibling_record(struct apfs_sibling_link_key *key,
@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Backends for the reads from the device.  Synchronous reads always go
+ * through pread(), but asynchronous requests are queued to io_uring when the
+ * kernel supports it.  Otherwise they are just completed on submission.
+ *
+ * Synchronous reads may run from any thread, but callers must serialize the
+ * asynchronous requests; the block cache does it with its own lock.
+ *
+ * In direct mode the reads bypass the page cache, so that the check doesn't
+ * evict the working set of other programs on the host.  Where O_DIRECT is not
+ * supported, the pages are dropped from the page cache after each read.
+ */
+
+#define _GNU_SOURCE	/* For O_DIRECT */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "apfsck.h"
+#include "io.h"
+#include "progress.h"
+#include "stats.h"
+#include "super.h"
+
+/*
+ * Operations for an i/o backend
+ */
+struct io_backend {
+	const char *name;
+
+	/* Set up the backend; returns false if it's not supported */
+	bool (*init)(void);
+	/* Queue a read; the request may complete right away */
+	void (*submit)(struct io_request *req);
+	/* Wait for at least one of the queued reads to complete */
+	void (*wait)(void);
+};
+
+char *io_backend_name;
+bool io_direct;
+
+static struct io_backend *io_backend;
+static unsigned int io_inflight;	/* Number of requests in flight */
+static bool io_drop_pages;		/* Drop the pages after each read? */
+
+/**
+ * io_open - Open the device to check
+ * @path: path to the device or image file
+ *
+ * Returns the file descriptor.
+ */
+int io_open(const char *path)
+{
+	int fd;
+
+	if (io_direct) {
+		fd = open(path, O_RDONLY | O_DIRECT);
+		if (fd != -1)
+			return fd;
+		/* Tmpfs, for example, doesn't support direct i/o */
+		io_drop_pages = true;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		system_error();
+	return fd;
+}
+
+/**
+ * io_drop - Drop a range of the device from the page cache, if requested
+ * @offset:	start of the range in bytes
+ * @len:	length of the range in bytes
+ */
+static void io_drop(off_t offset, size_t len)
+{
+	if (!io_drop_pages)
+		return;
+	posix_fadvise(curr_ctx->c_fd, offset, len, POSIX_FADV_DONTNEED);
+	stats_add(STAT_SYSCALLS, 1);
+}
+
+/**
+ * io_read - Read a range of blocks from the device, synchronously
+ * @bno:	first block number
+ * @count:	number of blocks
+ * @buf:	buffer to receive the blocks
+ */
+void io_read(u64 bno, u32 count, void *buf)
+{
+	size_t len = (size_t)count * curr_sb()->s_blocksize;
+	off_t offset = bno * curr_sb()->s_blocksize;
+	ssize_t ret;
+
+	/* All block buffers are aligned, as needed for direct reads */
+	assert(!io_direct || !((uintptr_t)buf & (curr_sb()->s_blocksize - 1)));
+
+	stats_add(STAT_BLOCKS_READ, count);
+	stats_add(STAT_BYTES_READ, len);
+	progress_read(len);
+	while (len) {
+		ret = pread(curr_ctx->c_fd, buf, len, offset);
+		stats_add(STAT_SYSCALLS, 1);
+		if (ret < 0)
+			system_error();
+		if (ret == 0) {
+			/* The block cache is left inconsistent, so this is fatal */
+			forbid_recovery();
+			report(NULL, "Block 0x%llx is out of range.",
+			       (unsigned long long)bno);
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	io_drop(bno * curr_sb()->s_blocksize, (size_t)count * curr_sb()->s_blocksize);
+}
+
+/**
+ * io_end_request - Finish an asynchronous read request
+ * @req:	the request
+ * @done:	number of bytes already read by the backend
+ */
+static void io_end_request(struct io_request *req, size_t done)
+{
+	size_t len = (size_t)req->r_count * curr_sb()->s_blocksize;
+
+	stats_add(STAT_BLOCKS_READ, req->r_count);
+	stats_add(STAT_BYTES_READ, len);
+	progress_read(len);
+
+	/* Reads may be short, so finish them the slow way */
+	if (done < len) {
+		void *buf = req->r_buf;
+		off_t offset = req->r_bno * curr_sb()->s_blocksize;
+		ssize_t ret;
+
+		buf += done;
+		offset += done;
+		len -= done;
+		while (len) {
+			ret = pread(curr_ctx->c_fd, buf, len, offset);
+			stats_add(STAT_SYSCALLS, 1);
+			if (ret < 0)
+				system_error();
+			if (ret == 0) {
+				/* The block cache is left inconsistent, so this is fatal */
+				forbid_recovery();
+				report(NULL, "Block 0x%llx is out of range.",
+				       (unsigned long long)req->r_bno);
+			}
+			buf += ret;
+			len -= ret;
+			offset += ret;
+		}
+	}
+	io_drop(req->r_bno * curr_sb()->s_blocksize,
+		(size_t)req->r_count * curr_sb()->s_blocksize);
+
+	--io_inflight;
+	req->r_end_io(req);
+}
+
+/**
+ * sync_submit - Run a read request right away
+ * @req: the request
+ */
+static void sync_submit(struct io_request *req)
+{
+	io_end_request(req, 0 /* done */);
+}
+
+/**
+ * sync_init - Set up the synchronous backend
+ */
+static bool sync_init(void)
+{
+	return true;
+}
+
+/**
+ * sync_wait - Wait for a read under the synchronous backend
+ *
+ * Nothing to do here, the requests already completed on submission.
+ */
+static void sync_wait(void)
+{
+}
+
+static struct io_backend sync_backend = {
+	.name	= "sync",
+	.init	= sync_init,
+	.submit	= sync_submit,
+	.wait	= sync_wait,
+};
+
+/*
+ * State of the io_uring instance.  Glibc has no wrappers for this, and we
+ * don't want to depend on liburing, so use the syscalls directly.
+ */
+static int uring_fd = -1;
+static unsigned int *uring_sq_head, *uring_sq_tail, *uring_sq_mask;
+static unsigned int *uring_sq_array, uring_sq_entries;
+static unsigned int *uring_cq_head, *uring_cq_tail, *uring_cq_mask;
+static struct io_uring_sqe *uring_sqes;
+static struct io_uring_cqe *uring_cqes;
+static unsigned int uring_unsubmitted;	/* Queued entries not yet submitted */
+
+/**
+ * uring_init - Set up the io_uring backend
+ */
+static bool uring_init(void)
+{
+	struct io_uring_params params = {0};
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+
+	uring_fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+	if (uring_fd < 0)
+		return false;
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(u32);
+	cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sq_ring = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+	cq_ring = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+	uring_sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || uring_sqes == MAP_FAILED) {
+		close(uring_fd);
+		uring_fd = -1;
+		return false;
+	}
+
+	uring_sq_head = sq_ring + params.sq_off.head;
+	uring_sq_tail = sq_ring + params.sq_off.tail;
+	uring_sq_mask = sq_ring + params.sq_off.ring_mask;
+	uring_sq_array = sq_ring + params.sq_off.array;
+	uring_sq_entries = params.sq_entries;
+	uring_cq_head = cq_ring + params.cq_off.head;
+	uring_cq_tail = cq_ring + params.cq_off.tail;
+	uring_cq_mask = cq_ring + params.cq_off.ring_mask;
+	uring_cqes = cq_ring + params.cq_off.cqes;
+	return true;
+}
+
+/**
+ * uring_enter - Submit the queued entries and maybe wait for completions
+ * @min_complete: number of completions to wait for
+ */
+static void uring_enter(unsigned int min_complete)
+{
+	unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, uring_fd, uring_unsubmitted, min_complete, flags, NULL, 0);
+	stats_add(STAT_SYSCALLS, 1);
+	if (ret < 0)
+		system_error();
+	uring_unsubmitted -= ret;
+}
+
+/**
+ * uring_reap - Complete all requests found in the completion queue
+ *
+ * Returns the number of requests completed.
+ */
+static int uring_reap(void)
+{
+	unsigned int head, tail;
+	int count = 0;
+
+	head = *uring_cq_head;
+	tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uring_cqes[head & *uring_cq_mask];
+		struct io_request *req = (void *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		/* Release the entry before the callback, it may queue more */
+		++head;
+		__atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+
+		if (res < 0) {
+			/* The block cache is left inconsistent, so this is fatal */
+			forbid_recovery();
+			report(NULL, "Read of block 0x%llx failed: %s.",
+			       (unsigned long long)req->r_bno, strerror(-res));
+		}
+		io_end_request(req, res);
+		++count;
+		tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+	}
+	return count;
+}
+
+/**
+ * uring_wait - Wait for at least one read under the io_uring backend
+ */
+static void uring_wait(void)
+{
+	while (!uring_reap())
+		uring_enter(1 /* min_complete */);
+}
+
+/**
+ * uring_submit - Queue a read request to io_uring and submit it
+ * @req: the request
+ */
+static void uring_submit(struct io_request *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	tail = *uring_sq_tail;
+	while (tail - __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE) >= uring_sq_entries)
+		uring_enter(0 /* min_complete */);
+
+	req->r_iov.iov_base = req->r_buf;
+	req->r_iov.iov_len = (size_t)req->r_count * curr_sb()->s_blocksize;
+
+	index = tail & *uring_sq_mask;
+	sqe = &uring_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = curr_ctx->c_fd;
+	sqe->addr = (uintptr_t)&req->r_iov;
+	sqe->len = 1;
+	sqe->off = req->r_bno * curr_sb()->s_blocksize;
+	sqe->user_data = (uintptr_t)req;
+	uring_sq_array[index] = index;
+	__atomic_store_n(uring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++uring_unsubmitted;
+
+	/* The whole point is to get the device busy right away */
+	uring_enter(0 /* min_complete */);
+}
+
+static struct io_backend uring_backend = {
+	.name	= "uring",
+	.init	= uring_init,
+	.submit	= uring_submit,
+	.wait	= uring_wait,
+};
+
+static struct io_backend *io_backends[] = {
+	&uring_backend,
+	&sync_backend,
+	NULL,
+};
+
+/**
+ * io_init - Set up the requested i/o backend, or the best available
+ *
+ * Falls back to synchronous reads if the requested backend is not supported
+ * by the system.
+ */
+void io_init(void)
+{
+	struct io_backend **curr;
+
+	for (curr = io_backends; *curr; ++curr) {
+		if (io_backend_name && strcmp(io_backend_name, (*curr)->name))
+			continue;
+		if ((*curr)->init()) {
+			io_backend = *curr;
+			return;
+		}
+		if (io_backend_name)
+			break;
+	}
+
+	if (io_backend_name && !*curr) {
+		fprintf(stderr, "Unknown i/o backend: %s\n", io_backend_name);
+		exit(1);
+	}
+	io_backend = &sync_backend;
+}
+
+/**
+ * io_is_async - Are submitted requests really processed in the background?
+ */
+bool io_is_async(void)
+{
+	return io_backend != &sync_backend;
+}
+
+/**
+ * io_submit_read - Queue an asynchronous read request
+ * @req: the request
+ *
+ * The end_io callback of the request will be called once the read is done,
+ * from inside io_wait() or io_submit_read().
+ */
+void io_submit_read(struct io_request *req)
+{
+	/* Don't let requests pile up beyond the queue depth */
+	while (io_inflight >= IO_QUEUE_DEPTH)
+		io_backend->wait();
+	++io_inflight;
+	io_backend->submit(req);
+}
+
+/**
+ * io_wait - Wait for at least one of the queued requests to complete
+ */
+void io_wait(void)
+{
+	if (io_inflight)
+		io_backend->wait();
+}
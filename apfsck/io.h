@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _IO_H
+#define _IO_H
+
+#include <sys/uio.h>
+#include <apfs/types.h>
+
+/* Maximum number of reads in flight for the asynchronous backends */
+#define IO_QUEUE_DEPTH	64
+
+/*
+ * Structure for a single asynchronous read request
+ */
+struct io_request {
+	u64		r_bno;		/* First block to read */
+	void		*r_buf;		/* Buffer to receive the blocks */
+	u32		r_count;	/* Number of blocks to read */
+	struct iovec	r_iov;		/* Vector for the backend's use */
+	void		*r_priv;	/* Private data for the caller */
+
+	/* Function called when the read is complete */
+	void (*r_end_io)(struct io_request *req);
+};
+
+extern char *io_backend_name;	/* Name of the backend requested by user */
+extern bool io_direct;		/* Keep the reads out of the page cache? */
+
+extern int io_open(const char *path);
+extern void io_init(void);
+extern bool io_is_async(void);
+extern void io_read(u64 bno, u32 count, void *buf);
+extern void io_submit_read(struct io_request *req);
+extern void io_wait(void);
+
+#endif	/* _IO_H */
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * State file for incremental checks.  For each volume that was found sound,
+ * the file records the identity of its superblock and the container blocks
+ * that its check marked as used.  On the next run, a volume whose superblock
+ * is still the same is not walked again: its earlier bitmap updates are just
+ * replayed, so that the space manager checks still cover it.
+ *
+ * The volume is the smallest unit that can be skipped.  The catalog checks
+ * match inodes, dentries, dstreams and extents from all over the tree, so
+ * the records of a single unchanged subtree can't be left out.  Any change
+ * to a volume gets a new superblock, with a new transaction id and checksum.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <apfs/checksum.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "crypto.h"
+#include "journal.h"
+#include "spaceman.h"
+#include "super.h"
+
+char *journal_path;
+
+#define JOURNAL_MAGIC	0x314c4e524a4b4346ULL	/* "FCKJRNL1" */
+#define JOURNAL_VERSION	1
+
+/* Number of 64-bit words in the file header, and in each volume header */
+#define JOURNAL_HDR_WORDS	8
+#define JOURNAL_VOL_WORDS	5
+
+/*
+ * Record for a volume that was checked and found sound
+ */
+struct journal_volume {
+	u64		jv_bno;		/* Block number of the volume superblock */
+	u64		jv_xid;		/* Transaction id of the volume superblock */
+	u64		jv_cksum;	/* Checksum of the volume superblock */
+	bool		jv_decrypted;	/* Was the catalog checked decrypted? */
+	struct bmap_log	jv_log;		/* Container blocks used by the volume */
+};
+
+/* Records from the previous run, and for the next one */
+static struct journal_volume *old_vols, *new_vols;
+static u64 old_count, new_count, new_size;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool journal_loaded;
+static char journal_uuid[16];	/* Uuid of the container */
+static u64 journal_blocks;	/* Block count of the container */
+static u64 journal_xid;		/* Latest checkpoint that was checked */
+
+/**
+ * journal_parse - Parse the contents of the state file from a previous run
+ * @words:	the contents, as 64-bit words
+ * @count:	number of words
+ *
+ * Returns false if the file is corrupted, or if it was written for a different
+ * container or for different options.  The records are only trusted after
+ * the whole file was parsed.
+ */
+static bool journal_parse(__le64 *words, u64 count)
+{
+	u64 vol_count, pos, i, j;
+
+	if (count < JOURNAL_HDR_WORDS + 1)
+		return false;
+	if (le64_to_cpu(words[count - 1]) != crc32c(~0, words, (count - 1) * 8))
+		return false;
+	--count;
+
+	if (le64_to_cpu(words[0]) != JOURNAL_MAGIC ||
+	    le64_to_cpu(words[1]) != JOURNAL_VERSION)
+		return false;
+	if (memcmp(&words[2], journal_uuid, sizeof(journal_uuid)) ||
+	    le64_to_cpu(words[4]) != journal_blocks)
+		return false;
+	/* Some issues only get reported with the right options */
+	if (le64_to_cpu(words[6]) != options)
+		return false;
+	vol_count = le64_to_cpu(words[7]);
+	if (vol_count > APFS_NX_MAX_FILE_SYSTEMS * 1024)
+		return false;
+
+	old_vols = calloc(vol_count, sizeof(*old_vols));
+	if (!old_vols)
+		system_error();
+	pos = JOURNAL_HDR_WORDS;
+	for (i = 0; i < vol_count; ++i) {
+		struct journal_volume *jv = &old_vols[i];
+		struct bmap_log *log = &jv->jv_log;
+
+		if (count - pos < JOURNAL_VOL_WORDS)
+			return false;
+		jv->jv_bno = le64_to_cpu(words[pos++]);
+		jv->jv_xid = le64_to_cpu(words[pos++]);
+		jv->jv_cksum = le64_to_cpu(words[pos++]);
+		jv->jv_decrypted = le64_to_cpu(words[pos++]);
+		log->l_count = le64_to_cpu(words[pos++]);
+		if ((count - pos) / 2 < log->l_count)
+			return false;
+
+		log->l_size = log->l_count;
+		log->l_entries = calloc(log->l_count, sizeof(*log->l_entries));
+		if (log->l_count && !log->l_entries)
+			system_error();
+		for (j = 0; j < log->l_count; ++j) {
+			log->l_entries[j].e_paddr = le64_to_cpu(words[pos++]);
+			log->l_entries[j].e_length = le64_to_cpu(words[pos++]);
+		}
+		++old_count;
+	}
+	return pos == count;
+}
+
+/**
+ * journal_free_volumes - Free an array of volume records
+ * @vols:	the array
+ * @count:	number of records
+ */
+static void journal_free_volumes(struct journal_volume *vols, u64 count)
+{
+	u64 i;
+
+	for (i = 0; i < count; ++i)
+		free(vols[i].jv_log.l_entries);
+	free(vols);
+}
+
+/**
+ * journal_load - Read the state file from a previous run, if any
+ *
+ * Must be called for each checkpoint, before the volumes are checked.  A state
+ * file that can't be used is just ignored, and will be replaced at the end.
+ */
+void journal_load(void)
+{
+	struct stat st;
+	__le64 *words;
+	FILE *file;
+
+	journal_xid = curr_sb()->s_xid;
+	if (journal_loaded)
+		return;
+	journal_loaded = true;
+	memcpy(journal_uuid, curr_sb()->s_raw->nx_uuid, sizeof(journal_uuid));
+	journal_blocks = curr_sb()->s_block_count;
+
+	file = fopen(journal_path, "r");
+	if (!file)
+		return;
+	if (fstat(fileno(file), &st))
+		system_error();
+	if (!st.st_size || st.st_size % 8) {
+		fclose(file);
+		return;
+	}
+
+	words = malloc(st.st_size);
+	if (!words)
+		system_error();
+	if (fread(words, st.st_size, 1, file) != 1)
+		system_error();
+	fclose(file);
+
+	if (!journal_parse(words, st.st_size / 8)) {
+		journal_free_volumes(old_vols, old_count);
+		old_vols = NULL;
+		old_count = 0;
+	}
+	free(words);
+}
+
+/**
+ * journal_find_volume - Find the record from the previous run for a volume
+ * @decrypted:	can the catalog be decrypted in this run?
+ *
+ * Returns NULL if the current volume superblock was not checked before.
+ */
+static struct journal_volume *journal_find_volume(bool decrypted)
+{
+	u64 i;
+
+	for (i = 0; i < old_count; ++i) {
+		struct journal_volume *jv = &old_vols[i];
+
+		if (jv->jv_bno != curr_vsb()->v_obj.block_nr || jv->jv_xid != curr_vsb()->v_obj.xid)
+			continue;
+		if (jv->jv_cksum != le64_to_cpu(curr_vsb()->v_raw->apfs_o.o_cksum))
+			continue;
+		/* A check without the key couldn't look inside the catalog */
+		if (decrypted && !jv->jv_decrypted)
+			continue;
+		return jv;
+	}
+	return NULL;
+}
+
+/**
+ * bmap_log_entry_cmp - Compare two container bitmap updates by block number
+ * @a:	first update
+ * @b:	second update
+ */
+static int bmap_log_entry_cmp(const void *a, const void *b)
+{
+	const struct bmap_log_entry *e1 = a, *e2 = b;
+
+	if (e1->e_paddr != e2->e_paddr)
+		return e1->e_paddr < e2->e_paddr ? -1 : 1;
+	return 0;
+}
+
+/**
+ * journal_add_volume - Add a record for the current volume to the next file
+ * @decrypted:	was the catalog decrypted?
+ * @log:	container blocks used by the volume (this is copied)
+ */
+static void journal_add_volume(bool decrypted, struct bmap_log *log)
+{
+	struct journal_volume *jv;
+	u64 i, j;
+
+	pthread_mutex_lock(&journal_lock);
+
+	/* Volumes that didn't change get checked again for each checkpoint */
+	for (i = 0; i < new_count; ++i) {
+		jv = &new_vols[i];
+		if (jv->jv_bno == curr_vsb()->v_obj.block_nr &&
+		    jv->jv_xid == curr_vsb()->v_obj.xid &&
+		    jv->jv_cksum == le64_to_cpu(curr_vsb()->v_raw->apfs_o.o_cksum))
+			goto out;
+	}
+
+	if (new_count == new_size) {
+		new_size = new_size ? 2 * new_size : 16;
+		new_vols = realloc(new_vols, new_size * sizeof(*new_vols));
+		if (!new_vols)
+			system_error();
+	}
+	jv = &new_vols[new_count++];
+	jv->jv_bno = curr_vsb()->v_obj.block_nr;
+	jv->jv_xid = curr_vsb()->v_obj.xid;
+	jv->jv_cksum = le64_to_cpu(curr_vsb()->v_raw->apfs_o.o_cksum);
+	jv->jv_decrypted = decrypted;
+	jv->jv_log.l_count = jv->jv_log.l_size = log->l_count;
+	jv->jv_log.l_entries = malloc(log->l_count * sizeof(*log->l_entries));
+	if (log->l_count && !jv->jv_log.l_entries)
+		system_error();
+	memcpy(jv->jv_log.l_entries, log->l_entries, log->l_count * sizeof(*log->l_entries));
+
+	/*
+	 * The ranges were all checked for overlaps already, so their order no
+	 * longer matters; sort them to merge the ones that are contiguous.
+	 */
+	qsort(jv->jv_log.l_entries, jv->jv_log.l_count, sizeof(*jv->jv_log.l_entries),
+	      bmap_log_entry_cmp);
+	for (i = 0, j = 0; i < jv->jv_log.l_count; ++i) {
+		struct bmap_log_entry *entries = jv->jv_log.l_entries;
+
+		if (j && entries[j - 1].e_paddr + entries[j - 1].e_length == entries[i].e_paddr)
+			entries[j - 1].e_length += entries[i].e_length;
+		else
+			entries[j++] = entries[i];
+	}
+	jv->jv_log.l_count = j;
+out:
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * journal_check_volume - Check the current volume, unless it didn't change
+ *
+ * Replaces check_volume_super() when a state file is in use.
+ */
+void journal_check_volume(void)
+{
+	struct bmap_log log = {0};
+	struct bmap_log *outer_log = curr_ctx->c_bmap_log;
+	bool outer_weird = curr_ctx->c_weird_state;
+	bool decrypted = get_volume_key(curr_vsb()->v_raw->apfs_vol_uuid);
+	struct journal_volume *jv;
+	u64 i;
+
+	jv = journal_find_volume(decrypted);
+	if (jv) {
+		for (i = 0; i < jv->jv_log.l_count; ++i)
+			container_bmap_mark_as_used(jv->jv_log.l_entries[i].e_paddr,
+						    jv->jv_log.l_entries[i].e_length);
+		journal_add_volume(jv->jv_decrypted, &jv->jv_log);
+		return;
+	}
+
+	/* Keep the updates for this volume apart, to save them for later */
+	curr_ctx->c_bmap_log = &log;
+	curr_ctx->c_weird_state = false;
+	check_volume_super();
+	curr_ctx->c_bmap_log = outer_log;
+
+	/* Volumes with weird issues must get reported again next time */
+	if (!curr_ctx->c_weird_state)
+		journal_add_volume(decrypted, &log);
+	curr_ctx->c_weird_state |= outer_weird;
+	replay_bmap_log(&log);
+}
+
+/**
+ * journal_put_u64 - Append a word to the contents of the state file
+ * @words:	the contents
+ * @count:	number of words in use, gets incremented
+ * @size:	number of words allocated
+ * @value:	the new word
+ */
+static void journal_put_u64(__le64 **words, u64 *count, u64 *size, u64 value)
+{
+	if (*count == *size) {
+		*size = *size ? 2 * *size : 1024;
+		*words = realloc(*words, *size * sizeof(**words));
+		if (!*words)
+			system_error();
+	}
+	(*words)[(*count)++] = cpu_to_le64(value);
+}
+
+/**
+ * journal_save - Replace the state file with the results of this run
+ *
+ * Must only be called if the check was successful.  The file is written
+ * elsewhere first, so that a crash never leaves a partial file behind.
+ */
+void journal_save(void)
+{
+	__le64 *words = NULL;
+	u64 count = 0, size = 0;
+	char *tmp_path;
+	FILE *file;
+	u64 i, j;
+
+	if (!journal_loaded)
+		return;
+
+	journal_put_u64(&words, &count, &size, JOURNAL_MAGIC);
+	journal_put_u64(&words, &count, &size, JOURNAL_VERSION);
+	/* The uuid is just copied as is, without byte swapping */
+	journal_put_u64(&words, &count, &size, 0);
+	journal_put_u64(&words, &count, &size, 0);
+	memcpy(&words[2], journal_uuid, sizeof(journal_uuid));
+	journal_put_u64(&words, &count, &size, journal_blocks);
+	journal_put_u64(&words, &count, &size, journal_xid);
+	journal_put_u64(&words, &count, &size, options);
+	journal_put_u64(&words, &count, &size, new_count);
+	for (i = 0; i < new_count; ++i) {
+		struct journal_volume *jv = &new_vols[i];
+		struct bmap_log *log = &jv->jv_log;
+
+		journal_put_u64(&words, &count, &size, jv->jv_bno);
+		journal_put_u64(&words, &count, &size, jv->jv_xid);
+		journal_put_u64(&words, &count, &size, jv->jv_cksum);
+		journal_put_u64(&words, &count, &size, jv->jv_decrypted);
+		journal_put_u64(&words, &count, &size, log->l_count);
+		for (j = 0; j < log->l_count; ++j) {
+			journal_put_u64(&words, &count, &size, log->l_entries[j].e_paddr);
+			journal_put_u64(&words, &count, &size, log->l_entries[j].e_length);
+		}
+	}
+	journal_put_u64(&words, &count, &size, crc32c(~0, words, count * 8));
+
+	tmp_path = malloc(strlen(journal_path) + 5);
+	if (!tmp_path)
+		system_error();
+	strcpy(tmp_path, journal_path);
+	strcat(tmp_path, ".tmp");
+	file = fopen(tmp_path, "w");
+	if (!file)
+		system_error();
+	if (fwrite(words, count * 8, 1, file) != 1)
+		system_error();
+	if (fflush(file) || fsync(fileno(file)) || fclose(file))
+		system_error();
+	if (rename(tmp_path, journal_path))
+		system_error();
+
+	free(tmp_path);
+	free(words);
+	journal_free_volumes(old_vols, old_count);
+	journal_free_volumes(new_vols, new_count);
+	old_vols = new_vols = NULL;
+	old_count = new_count = new_size = 0;
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+extern char *journal_path;	/* State file from the -J option, or NULL */
+
+extern void journal_load(void);
+extern void journal_check_volume(void);
+extern void journal_save(void);
+
+#endif	/* _JOURNAL_H */
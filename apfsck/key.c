@@ -2,10 +2,12 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <apfs/checksum.h>
+#include <apfs/query.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include <apfs/unicode.h>
@@ -13,6 +15,24 @@
 #include "key.h"
 #include "super.h"
 
+/**
+ * key_from_query - Set an in-memory key from one decoded by the library
+ * @qkey:	the decoded key
+ * @key:	key structure to store the result
+ *
+ * The omap, catalog and extentref keys are decoded by the query interface of
+ * libapfs, so that there is a single decoder for each of them; the checks that
+ * only make sense for the fsck are done here on top.
+ */
+static void key_from_query(struct apfs_query_key *qkey, struct key *key)
+{
+	key->id = qkey->id;
+	key->type = qkey->type;
+	key->number = qkey->number;
+	key->name = qkey->name;
+	key_pack(key);
+}
+
 /**
  * read_omap_key - Parse an on-disk object map key
  * @raw:	pointer to the raw key
@@ -21,19 +41,13 @@
  */
 void read_omap_key(void *raw, int size, struct key *key)
 {
-	u64 xid;
+	struct apfs_query_key qkey;
 
-	if (size != sizeof(struct apfs_omap_key))
+	if (apfs_read_omap_key(raw, size, &qkey))
 		report("Object map", "wrong size of key.");
-
-	xid = le64_to_cpu(((struct apfs_omap_key *)raw)->ok_xid);
-	if (!xid)
+	if (!qkey.number)
 		report("Object map", "transaction id for key is zero.");
-
-	key->id = le64_to_cpu(((struct apfs_omap_key *)raw)->ok_oid);
-	key->type = 0;
-	key->number = xid;
-	key->name = NULL;
+	key_from_query(&qkey, key);
 }
 
 /**
@@ -59,6 +73,7 @@ void read_free_queue_key(void *raw, int size, struct key *key)
 	key->type = 0;
 	key->number = le64_to_cpu(sfqk->sfqk_paddr);
 	key->name = NULL;
+	key_pack(key);
 }
 
 /**
@@ -71,10 +86,8 @@ void read_free_queue_key(void *raw, int size, struct key *key)
  */
 int keycmp(struct key *k1, struct key *k2)
 {
-	if (k1->id != k2->id)
-		return k1->id < k2->id ? -1 : 1;
-	if (k1->type != k2->type)
-		return k1->type < k2->type ? -1 : 1;
+	if (k1->packed != k2->packed)
+		return k1->packed < k2->packed ? -1 : 1;
 	if (k1->number != k2->number)
 		return k1->number < k2->number ? -1 : 1;
 	if (!k1->name) /* Keys of this type have no name */
@@ -93,120 +106,46 @@ static u32 dentry_hash(const char *name)
 	struct unicursor cursor;
 	bool case_fold = apfs_is_case_insensitive();
 	u32 hash = 0xFFFFFFFF;
+	unicode_t utf32[64];
+	int count = 0;
+
+	/* Plain ASCII can only change with case folding, so skip the tries */
+	if (is_ascii_string(name)) {
+		for (; *name; ++name) {
+			utf32[count] = case_fold ? tolower(*name) : *name;
+			if (++count == sizeof(utf32) / sizeof(utf32[0])) {
+				hash = crc32c_utf32(hash, utf32, count);
+				count = 0;
+			}
+		}
+		goto done;
+	}
 
 	init_unicursor(&cursor, name);
 
+	/* Hash the normalized characters in batches, not one by one */
 	while (1) {
-		unicode_t utf32;
-
-		utf32 = normalize_next(&cursor, case_fold);
-		if (!utf32)
+		utf32[count] = normalize_next(&cursor, case_fold);
+		if (!utf32[count])
 			break;
-
-		hash = crc32c(hash, &utf32, sizeof(utf32));
+		if (++count == sizeof(utf32) / sizeof(utf32[0])) {
+			hash = crc32c_utf32(hash, utf32, count);
+			count = 0;
+		}
 	}
+done:
+	hash = crc32c_utf32(hash, utf32, count);
 
 	/* Leave room for the filename length */
 	return (hash & 0x3FFFFF) << 10;
 }
 
-/**
- * read_dir_rec_key - Parse an on-disk dentry key and check its consistency
- * @raw:	pointer to the raw key
- * @size:	size of the raw key
- * @key:	key structure to store the result
- */
-static void read_dir_rec_key(void *raw, int size, struct key *key)
-{
-	bool hashed = apfs_is_normalization_insensitive();
-	int namelen;
-
-	if (hashed && size < sizeof(struct apfs_drec_hashed_key) + 1)
-		report("Hashed directory record", "wrong size of key.");
-	if (!hashed && size < sizeof(struct apfs_drec_key) + 1)
-		report("Unhashed directory record", "wrong size of key.");
-
-	if (*((char *)raw + size - 1) != 0)
-		report("Directory record", "filename lacks NULL-termination.");
-
-	if (hashed) {
-		struct apfs_drec_hashed_key *raw_key = raw;
-
-		/* The filename length is ignored for the ordering, so mask it away */
-		key->number = le32_to_cpu(raw_key->name_len_and_hash) & ~0x3FFU;
-		key->name = (char *)raw_key->name;
-		if (key->number != dentry_hash(key->name))
-			report("Directory record", "filename hash is corrupted.");
-		namelen = le32_to_cpu(raw_key->name_len_and_hash) & 0x3FFU;
-		if (size != sizeof(*raw_key) + namelen) {
-			report("Hashed directory record",
-			       "size of key doesn't match the name length.");
-		}
-	} else {
-		struct apfs_drec_key *raw_key = raw;
-
-		key->number = 0;
-		key->name = (char *)raw_key->name;
-		namelen = le16_to_cpu(raw_key->name_len);
-		if (size != sizeof(*raw_key) + namelen) {
-			report("Unhashed directory record",
-			       "size of key doesn't match the name length.");
-		}
-	}
-
-	if (namelen > 256) {
-		/* The name must fit in name_buf from parse_subtree() */
-		report("Directory record", "name is too long.");
-	}
-	if (strlen(key->name) + 1 != namelen) {
-		/* APFS counts the NULL termination for the filename length */
-		report("Directory record", "wrong name length in key.");
-	}
-}
-
-/**
- * read_xattr_key - Parse an on-disk xattr key and check its consistency
- * @raw:	pointer to the raw key
- * @size:	size of the raw key
- * @key:	key structure to store the result
- */
-static void read_xattr_key(void *raw, int size, struct key *key)
-{
-	struct apfs_xattr_key *raw_key;
-	int namelen;
-
-	if (size < sizeof(struct apfs_xattr_key) + 1)
-		report("Xattr record", "wrong size of key.");
-	if (*((char *)raw + size - 1) != 0)
-		report("Xattr record", "name lacks NULL-termination.");
-	raw_key = raw;
-
-	key->number = 0;
-	key->name = (char *)raw_key->name;
-
-	namelen = le16_to_cpu(raw_key->name_len);
-	if (namelen > 256) {
-		/* The name must fit in name_buf from parse_subtree() */
-		report("Xattr record", "name is too long.");
-	}
-	if (strlen(key->name) + 1 != namelen) {
-		/* APFS counts the NULL termination in the string length */
-		report("Xattr record", "wrong name length.");
-	}
-	if (size != sizeof(struct apfs_xattr_key) + namelen) {
-		report("Xattr record",
-		       "size of key doesn't match the name length.");
-	}
-}
-
 /**
  * read_snap_name_key - Parse an on-disk snapshot name key and check its
  *			consistency
  * @raw:	pointer to the raw key
  * @size:	size of the raw key
  * @key:	key structure to store the result
- *
- * TODO: this is the same as read_xattr_key(), maybe they could be merged.
  */
 static void read_snap_name_key(void *raw, int size, struct key *key)
 {
@@ -238,43 +177,99 @@ static void read_snap_name_key(void *raw, int size, struct key *key)
 }
 
 /**
- * read_file_extent_key - Parse an on-disk extent key and check its consistency
+ * report_cat_key - Report the issue with a catalog key rejected by libapfs
  * @raw:	pointer to the raw key
  * @size:	size of the raw key
- * @key:	key structure to store the result
+ * @hashed:	are the dentry keys hashed?
  */
-static void read_file_extent_key(void *raw, int size, struct key *key)
+static __attribute__((noreturn)) void report_cat_key(void *raw, int size,
+						     bool hashed)
 {
-	struct apfs_file_extent_key *raw_key;
+	int hdr_len, namelen;
 
-	if (size != sizeof(struct apfs_file_extent_key))
-		report("Extent record", "wrong size of key.");
-	raw_key = raw;
-
-	key->number = le64_to_cpu(raw_key->logical_addr);
-	key->name = NULL;
+	if (size < sizeof(struct apfs_key_header))
+		report("Catalog tree", "key is too small.");
 
-	if (key->number & (sb->s_blocksize - 1))
-		report("Extent record", "offset isn't multiple of block size.");
+	switch (cat_type(raw)) {
+	case APFS_TYPE_DIR_REC:
+		if (hashed) {
+			struct apfs_drec_hashed_key *raw_key = raw;
+
+			hdr_len = sizeof(*raw_key);
+			if (size < hdr_len + 1)
+				report("Hashed directory record", "wrong size of key.");
+			if (*((char *)raw + size - 1) != 0)
+				report("Directory record", "filename lacks NULL-termination.");
+			if ((le32_to_cpu(raw_key->name_len_and_hash) & ~0x3FFU) !=
+			    dentry_hash((char *)raw_key->name))
+				report("Directory record", "filename hash is corrupted.");
+			namelen = le32_to_cpu(raw_key->name_len_and_hash) & 0x3FFU;
+		} else {
+			struct apfs_drec_key *raw_key = raw;
+
+			hdr_len = sizeof(*raw_key);
+			if (size < hdr_len + 1)
+				report("Unhashed directory record", "wrong size of key.");
+			if (*((char *)raw + size - 1) != 0)
+				report("Directory record", "filename lacks NULL-termination.");
+			namelen = le16_to_cpu(raw_key->name_len);
+		}
+		if (size != hdr_len + namelen) {
+			report(hashed ? "Hashed directory record" : "Unhashed directory record",
+			       "size of key doesn't match the name length.");
+		}
+		break;
+	case APFS_TYPE_XATTR:
+		if (size < sizeof(struct apfs_xattr_key) + 1)
+			report("Xattr record", "wrong size of key.");
+		if (*((char *)raw + size - 1) != 0)
+			report("Xattr record", "name lacks NULL-termination.");
+		namelen = le16_to_cpu(((struct apfs_xattr_key *)raw)->name_len);
+		if (namelen > 256)
+			report("Xattr record", "name is too long.");
+		if (strlen((char *)raw + sizeof(struct apfs_xattr_key)) + 1 != namelen)
+			report("Xattr record", "wrong name length.");
+		if (size != sizeof(struct apfs_xattr_key) + namelen) {
+			report("Xattr record",
+			       "size of key doesn't match the name length.");
+		}
+		break;
+	case APFS_TYPE_FILE_EXTENT:
+		report("Extent record", "wrong size of key.");
+	case APFS_TYPE_SIBLING_LINK:
+		report("Siblink link record", "wrong size of key.");
+	case APFS_TYPE_EXTENT:
+		report("Catalog tree", "has extent reference record.");
+	case APFS_TYPE_SNAP_METADATA:
+		report("Catalog tree", "has snapshot metadata record.");
+	case APFS_TYPE_SNAP_NAME:
+		report("Catalog tree", "has snapshot name record.");
+	default:
+		if (!cat_type(raw) || cat_type(raw) > APFS_TYPE_MAX_VALID)
+			report("Catalog tree", "invalid key type.");
+		/* All other key types are just the header */
+		report("Catalog tree record", "wrong size of key.");
+	}
+	report(NULL, "Bug!");
 }
 
 /**
- * read_sibling_link_key - Parse an on-disk sibling link key and check its
- *			   consistency
- * @raw:	pointer to the raw key
- * @size:	size of the raw key
- * @key:	key structure to store the result
+ * check_key_name - Check the name of a catalog key, after decoding
+ * @key:	the decoded key
+ * @namelen:	length of the name according to the key, with the termination
+ * @what:	type of record, for the report
  */
-static void read_sibling_link_key(void *raw, int size, struct key *key)
+static void check_key_name(struct key *key, int namelen, const char *what)
 {
-	struct apfs_sibling_link_key *raw_key;
-
-	if (size != sizeof(struct apfs_sibling_link_key))
-		report("Siblink link record", "wrong size of key.");
-	raw_key = raw;
-
-	key->number = le64_to_cpu(raw_key->sibling_id); /* Only guessing */
-	key->name = NULL;
+	if (namelen > 256) {
+		/* The name must fit in name_buf from parse_subtree() */
+		report(what, "name is too long.");
+	}
+	if (strlen(key->name) + 1 != namelen) {
+		/* APFS counts the NULL termination for the name length */
+		report(what, key->type == APFS_TYPE_DIR_REC ?
+			     "wrong name length in key." : "wrong name length.");
+	}
 }
 
 /**
@@ -285,39 +280,29 @@ static void read_sibling_link_key(void *raw, int size, struct key *key)
  */
 void read_cat_key(void *raw, int size, struct key *key)
 {
-	if (size < sizeof(struct apfs_key_header))
-		report("Catalog tree", "key is too small.");
-	key->id = cat_cnid((struct apfs_key_header *)raw);
-	key->type = cat_type((struct apfs_key_header *)raw);
+	bool hashed = apfs_is_normalization_insensitive();
+	struct apfs_query_key qkey;
 
-	if (!key->type || key->type > APFS_TYPE_MAX_VALID)
-		report("Catalog tree", "invalid key type.");
+	if (apfs_read_cat_key(raw, size, hashed, &qkey))
+		report_cat_key(raw, size, hashed);
+	key_from_query(&qkey, key);
 
+	/* The library already checked that the name fills the rest of the key */
 	switch (key->type) {
 	case APFS_TYPE_DIR_REC:
-		read_dir_rec_key(raw, size, key);
+		if (hashed && key->number != dentry_hash(key->name))
+			report("Directory record", "filename hash is corrupted.");
+		check_key_name(key, size - (hashed ? sizeof(struct apfs_drec_hashed_key) :
+						     sizeof(struct apfs_drec_key)),
+			       "Directory record");
 		return;
 	case APFS_TYPE_XATTR:
-		read_xattr_key(raw, size, key);
+		check_key_name(key, size - sizeof(struct apfs_xattr_key),
+			       "Xattr record");
 		return;
 	case APFS_TYPE_FILE_EXTENT:
-		read_file_extent_key(raw, size, key);
-		return;
-	case APFS_TYPE_SIBLING_LINK:
-		read_sibling_link_key(raw, size, key);
-		return;
-	case APFS_TYPE_EXTENT:
-		report("Catalog tree", "has extent reference record.");
-	case APFS_TYPE_SNAP_METADATA:
-		report("Catalog tree", "has snapshot metadata record.");
-	case APFS_TYPE_SNAP_NAME:
-		report("Catalog tree", "has snapshot name record.");
-	default:
-		/* All other key types are just the header */
-		if (size != sizeof(struct apfs_key_header))
-			report("Catalog tree record", "wrong size of key.");
-		key->number = 0;
-		key->name = NULL;
+		if (key->number & (curr_sb()->s_blocksize - 1))
+			report("Extent record", "offset isn't multiple of block size.");
 		return;
 	}
 }
@@ -330,19 +315,14 @@ void read_cat_key(void *raw, int size, struct key *key)
  */
 void read_extentref_key(void *raw, int size, struct key *key)
 {
-	int type;
+	struct apfs_query_key qkey;
 
-	if (size != sizeof(struct apfs_phys_ext_key))
-		report("Extent reference tree", "wrong size of key.");
-
-	type = cat_type((struct apfs_key_header *)raw);
-	if (type != APFS_TYPE_EXTENT)
+	if (apfs_read_extentref_key(raw, size, &qkey)) {
+		if (size != sizeof(struct apfs_phys_ext_key))
+			report("Extent reference tree", "wrong size of key.");
 		report("Extent reference tree", "wrong record type.");
-
-	key->id = cat_cnid((struct apfs_key_header *)raw);
-	key->type = type;
-	key->number = 0;
-	key->name = NULL;
+	}
+	key_from_query(&qkey, key);
 }
 
 /**
@@ -357,6 +337,7 @@ void read_snap_key(void *raw, int size, struct key *key)
 		report("Snapshot metadata tree", "key is too small.");
 	key->id = cat_cnid((struct apfs_key_header *)raw);
 	key->type = cat_type((struct apfs_key_header *)raw);
+	key_pack(key);
 
 	switch (key->type) {
 	case APFS_TYPE_SNAP_METADATA:
@@ -386,4 +367,5 @@ void read_omap_snap_key(void *raw, int size, struct key *key)
 	key->type = 0;
 	key->number = 0;
 	key->name = NULL;
+	key_pack(key);
 }
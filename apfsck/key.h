@@ -17,8 +17,34 @@ struct key {
 	u64		number;	/* Extent offset or name hash */
 	const char	*name;	/* On-disk name string */
 	u8		type;	/* Record type (0 for the omap) */
+
+	/*
+	 * The id and type packed so that they sort as a single integer, set by
+	 * key_pack().  Along with the number, this is a 128-bit prefix of the
+	 * key, and only ties need to look at the name.
+	 */
+	u64		packed;
 };
 
+/**
+ * key_pack - Set the packed sort prefix of a key, after its id and type
+ * @key: the key
+ *
+ * Record types take four bits, and the ids that go with them are cnids, which
+ * take the other 60.  Untyped keys keep their whole id.  The id of a query may
+ * not fit in a cnid, but then it sorts after the ids of all on-disk records,
+ * so it just finds no exact match.
+ */
+static inline void key_pack(struct key *key)
+{
+	if (!key->type)
+		key->packed = key->id;
+	else if (key->id > APFS_OBJ_ID_MASK)
+		key->packed = ~0ULL;
+	else
+		key->packed = key->id << 4 | key->type;
+}
+
 /**
  * init_omap_key - Initialize an in-memory key for an omap query
  * @oid:	object id
@@ -31,6 +57,7 @@ static inline void init_omap_key(u64 oid, u64 xid, struct key *key)
 	key->type = 0;
 	key->number = xid;
 	key->name = NULL;
+	key_pack(key);
 }
 
 /**
@@ -44,6 +71,7 @@ static inline void init_extref_key(u64 bno, struct key *key)
 	key->type = APFS_TYPE_EXTENT;
 	key->number = 0;
 	key->name = NULL;
+	key_pack(key);
 }
 
 /**
@@ -57,6 +85,7 @@ static inline void init_inode_key(u64 ino, struct key *key)
 	key->type = APFS_TYPE_INODE;
 	key->number = 0;
 	key->name = NULL;
+	key_pack(key);
 }
 
 /**
@@ -71,6 +100,7 @@ static inline void init_file_extent_key(u64 id, u64 offset, struct key *key)
 	key->type = APFS_TYPE_FILE_EXTENT;
 	key->number = offset;
 	key->name = NULL;
+	key_pack(key);
 }
 
 /**
@@ -85,6 +115,7 @@ static inline void init_xattr_key(u64 ino, const char *name, struct key *key)
 	key->type = APFS_TYPE_XATTR;
 	key->number = 0;
 	key->name = name;
+	key_pack(key);
 }
 
 /**
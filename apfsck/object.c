@@ -3,45 +3,54 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <apfs/checksum.h>
 #include <apfs/raw.h>
 #include "apfsck.h"
 #include "btree.h"
+#include "cache.h"
 #include "htable.h"
 #include "object.h"
+#include "stats.h"
 #include "super.h"
 
 int obj_verify_csum(struct apfs_obj_phys *obj)
 {
 	return  (le64_to_cpu(obj->o_cksum) ==
 		 fletcher64((char *) obj + APFS_MAX_CKSUM_SIZE,
-			    sb->s_blocksize - APFS_MAX_CKSUM_SIZE));
+			    curr_sb()->s_blocksize - APFS_MAX_CKSUM_SIZE));
 }
 
 /**
- * read_object_nocheck - Read an object header from disk
- * @bno: block number for the object
- * @obj: object struct to receive the results
+ * read_object_nocheck_crypto - Read an object header from disk, decrypting it
+ * @bno:	block number for the object
+ * @obj:	object struct to receive the results
+ * @key:	expanded keys for the object, or NULL if it's not encrypted
  *
  * Returns a pointer to the raw data of the object in memory, without running
- * any checks other than the Fletcher verification.
+ * any checks other than the Fletcher verification.  The caller must release
+ * it with release_block() when done.
  */
-void *read_object_nocheck(u64 bno, struct object *obj)
+void *read_object_nocheck_crypto(u64 bno, struct object *obj,
+				 const struct aes_xts_ctx *key)
 {
 	struct apfs_obj_phys *raw;
 
-	raw = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-		   fd, bno * sb->s_blocksize);
-	if (raw == MAP_FAILED)
-		system_error();
+	raw = key ? read_block_decrypt(bno, key) : read_block(bno);
 
-	/* This one check is always needed */
-	if (!obj_verify_csum(raw)) {
-		report("Object header", "bad checksum in block 0x%llx.",
-		       (unsigned long long)bno);
+	/* This one check is always needed, but only once for each block */
+	if (!block_verified(raw)) {
+		u64 start = stats_now();
+
+		if (!obj_verify_csum(raw)) {
+			report("Object header", "bad checksum in block 0x%llx.",
+			       (unsigned long long)bno);
+		}
+		set_block_verified(raw);
+		stats_add(STAT_CKSUM_BLOCKS, 1);
+		stats_add(STAT_CKSUM_NS, stats_now() - start);
 	}
 
 	obj->oid = le64_to_cpu(raw->o_oid);
@@ -54,6 +63,35 @@ void *read_object_nocheck(u64 bno, struct object *obj)
 	return raw;
 }
 
+/**
+ * read_object_nocheck - Read an object header from disk
+ * @bno: block number for the object
+ * @obj: object struct to receive the results
+ *
+ * Same as read_object_nocheck_crypto(), for objects that are never encrypted.
+ */
+void *read_object_nocheck(u64 bno, struct object *obj)
+{
+	return read_object_nocheck_crypto(bno, obj, NULL /* key */);
+}
+
+/**
+ * omap_record_key - Get the keys to decrypt the object for an omap record
+ * @omap_index:	index of the object map records
+ * @pos:	position of the record in the index
+ *
+ * Returns NULL unless the object is under software encryption, and the key
+ * for its volume is known.
+ */
+const struct aes_xts_ctx *omap_record_key(struct omap_index *omap_index, u64 pos)
+{
+	if (!curr_vsb() || !curr_vsb()->v_vek)
+		return NULL;
+	if (!(omap_index->oi_flags[pos] & APFS_OMAP_VAL_ENCRYPTED))
+		return NULL;
+	return curr_vsb()->v_vek;
+}
+
 /**
  * parse_object_flags - Check consistency of object flags
  * @flags:	the flags
@@ -71,8 +109,9 @@ u32 parse_object_flags(u32 flags, bool encrypted)
 		report("Object header", "noheader flag is set.");
 
 	/*
-	 * So-called encrypted objects don't actually appear to be encrypted at
-	 * all, no idea what this is about.
+	 * With hardware encryption, so-called encrypted objects don't actually
+	 * appear to be encrypted at all, no idea what this is about.  Under
+	 * software encryption they get decrypted as they are read.
 	 */
 	if ((bool)(flags & APFS_OBJ_ENCRYPTED) != encrypted)
 		report("Object header", "wrong encryption flag.");
@@ -83,58 +122,72 @@ u32 parse_object_flags(u32 flags, bool encrypted)
 /**
  * read_object - Read an object header from disk and run some checks
  * @oid:	object id
- * @omap_table:	hash table for the object map (NULL if no translation is needed)
+ * @omap_index:	index of the object map records (NULL if no translation is needed)
  * @obj:	object struct to receive the results
  *
  * Returns a pointer to the raw data of the object in memory, after checking
  * the consistency of some of its fields.
  */
-void *read_object(u64 oid, struct htable_entry **omap_table, struct object *obj)
+void *read_object(u64 oid, struct omap_index *omap_index, struct object *obj)
 {
 	struct apfs_obj_phys *raw;
-	struct omap_record *omap_rec = NULL;
+	const struct aes_xts_ctx *key = NULL;
+	u64 pos = OMAP_INDEX_NONE;
 	u64 bno;
 	u64 xid;
 	u32 storage_type;
+	bool seen;
 
-	if (omap_table) {
-		omap_rec = get_latest_omap_record(oid, sb->s_xid, omap_table);
-		if (!omap_rec || !omap_rec->bno)
+	if (omap_index) {
+		pos = omap_index_lookup(omap_index, oid, curr_ctx->c_xid);
+		if (pos == OMAP_INDEX_NONE || !omap_index->oi_bnos[pos])
 			report("Object map", "record missing for id 0x%llx.", (unsigned long long)oid);
-		if (vsb && vsb->v_in_snapshot) {
-			if (omap_rec->seen_for_snap)
-				report("Object map record", "oid used twice for same snapshot.");
-			omap_rec->seen_for_snap = true;
+
+		/*
+		 * The seen bitmaps may be shared with other threads.  Issues are
+		 * not reported under the lock, so that the check can go on in
+		 * collect-all-errors mode.
+		 */
+		pthread_mutex_lock(&omap_index_lock);
+		if (curr_vsb() && curr_vsb()->v_in_snapshot) {
+			assert(omap_index == curr_vsb()->v_omap_index);
+			seen = omap_index_test_and_set(curr_vsb()->v_omap_seen, pos);
 		} else {
-			if (omap_rec->seen_for_latest)
-				report("Object map record", "oid used twice in latest checkpoint.");
-			omap_rec->seen_for_latest = true;
+			seen = omap_index_test_and_set(omap_index->oi_seen_for_latest, pos);
 		}
-		bno = omap_rec->bno;
+		bno = omap_index->oi_bnos[pos];
+		pthread_mutex_unlock(&omap_index_lock);
+		if (seen && curr_vsb() && curr_vsb()->v_in_snapshot)
+			report("Object map record", "oid used twice for same snapshot.");
+		else if (seen)
+			report("Object map record", "oid used twice in latest checkpoint.");
+		key = omap_record_key(omap_index, pos);
 	} else {
 		bno = oid;
 	}
 
-	raw = read_object_nocheck(bno, obj);
-	if (!ongoing_query) { /* Query code will revisit already parsed nodes */
-		if ((obj->type == APFS_OBJECT_TYPE_SPACEMAN_CIB) ||
-		     (obj->type == APFS_OBJECT_TYPE_SPACEMAN_CAB)) {
-			ip_bmap_mark_as_used(bno, 1 /* length */);
-		} else if (omap_table) {
-			/* Virtual objects may be shared between snapshots */
-			if (!omap_rec->seen) {
-				container_bmap_mark_as_used(bno, 1 /* length */);
-				/* The volume super itself doesn't count here */
-				if (vsb && obj->type != APFS_OBJECT_TYPE_FS)
-					++vsb->v_block_count;
-			}
-			omap_rec->seen = true;
-		} else {
+	/* Catch bad pointers here, where there is no lock to leave held */
+	if (bno >= curr_sb()->s_block_count)
+		report("Object header", "block 0x%llx is out of range.",
+		       (unsigned long long)bno);
+	raw = read_object_nocheck_crypto(bno, obj, key);
+
+	if ((obj->type == APFS_OBJECT_TYPE_SPACEMAN_CIB) ||
+	     (obj->type == APFS_OBJECT_TYPE_SPACEMAN_CAB)) {
+		ip_bmap_mark_as_used(bno, 1 /* length */);
+	} else {
+		/* Other threads may be walking the same volume */
+		pthread_mutex_lock(&omap_index_lock);
+		/* Virtual objects may be shared between snapshots */
+		seen = omap_index && omap_index_test_and_set(omap_index->oi_seen, pos);
+		/* Volume superblocks don't count here, not even for snapshots */
+		if (!seen && curr_vsb() && obj->type != APFS_OBJECT_TYPE_FS)
+			++curr_vsb()->v_block_count;
+		pthread_mutex_unlock(&omap_index_lock);
+
+		/* Each thread logs its own bitmap updates, if there are others */
+		if (!seen)
 			container_bmap_mark_as_used(bno, 1 /* length */);
-			/* Volume superblocks in snapshots don't count either */
-			if (vsb && obj->type != APFS_OBJECT_TYPE_FS)
-				++vsb->v_block_count;
-		}
 	}
 
 	if (oid != obj->oid)
@@ -143,35 +196,37 @@ void *read_object(u64 oid, struct htable_entry **omap_table, struct object *obj)
 	if (oid < APFS_OID_RESERVED_COUNT)
 		report("Object header", "reserved object id in block 0x%llx.",
 		       (unsigned long long)bno);
-	if (omap_table && oid >= sb->s_next_oid)
+	if (omap_index && oid >= curr_sb()->s_next_oid)
 		report("Object header", "unassigned object id in block 0x%llx.",
 		       (unsigned long long)bno);
 
 	xid = obj->xid;
 	if (!xid)
 		report("Object header", "null transaction id in block 0x%llx.", (unsigned long long)bno);
-	if (sb->s_xid < xid) {
+	if (curr_ctx->c_xid < xid) {
 		/*
 		 * When a snapshot is deleted, the following one is given its
 		 * physical extents; so its extent reference tree gets altered
 		 * under the current transaction.
 		 */
-		if (!vsb->v_in_snapshot || obj->subtype != APFS_OBJECT_TYPE_BLOCKREFTREE)
+		if (!curr_vsb()->v_in_snapshot || obj->subtype != APFS_OBJECT_TYPE_BLOCKREFTREE)
 			report("Object header", "bad transaction id in block 0x%llx.", (unsigned long long)bno);
 	}
-	if (vsb && vsb->v_first_xid > xid)
+	if (curr_vsb() && curr_vsb()->v_first_xid > xid)
 		report_weird("Transaction id in block is older than volume");
-	if (omap_table && xid != omap_rec->xid)
+	if (omap_index && xid != omap_index->oi_xids[pos])
 		report("Object header",
 		       "transaction id in omap key doesn't match block 0x%llx.",
 		       (unsigned long long)bno);
 
-	storage_type = parse_object_flags(obj->flags, vsb && vsb->v_encrypted && obj->subtype == APFS_OBJECT_TYPE_FSTREE);
+	storage_type = parse_object_flags(obj->flags,
+					  curr_vsb() && curr_vsb()->v_encrypted &&
+					  obj->subtype == APFS_OBJECT_TYPE_FSTREE);
 
 	/* Ephemeral objects are handled by read_ephemeral_object() */
-	if (omap_table && storage_type != APFS_OBJ_VIRTUAL)
+	if (omap_index && storage_type != APFS_OBJ_VIRTUAL)
 		report("Object header", "wrong flag for virtual object.");
-	if (!omap_table && storage_type != APFS_OBJ_PHYSICAL)
+	if (!omap_index && storage_type != APFS_OBJ_PHYSICAL)
 		report("Object header", "wrong flag for physical object.");
 
 	return raw;
@@ -184,11 +239,11 @@ void *read_object(u64 oid, struct htable_entry **omap_table, struct object *obj)
 static void free_cpoint_map(struct htable_entry *entry)
 {
 	struct cpoint_map *map = (struct cpoint_map *)entry;
-	u32 blk_count = map->m_size >> sb->s_blocksize_bits;
+	u32 blk_count = map->m_size >> curr_sb()->s_blocksize_bits;
 	u64 obj_start = map->m_paddr;
 	u64 obj_end = map->m_paddr + blk_count; /* Objects can't wrap, right? */
-	u64 data_start = sb->s_data_base;
-	u64 data_end = sb->s_data_base + sb->s_data_blocks;
+	u64 data_start = curr_sb()->s_data_base;
+	u64 data_end = curr_sb()->s_data_base + curr_sb()->s_data_blocks;
 	u64 valid_start;
 
 	if (!map->m_seen)
@@ -198,30 +253,50 @@ static void free_cpoint_map(struct htable_entry *entry)
 		report("Checkpoint map", "block number is out of range.");
 
 	/* Not all blocks in the data area belong to the current checkpoint */
-	valid_start = sb->s_data_base + sb->s_data_index;
-	if (obj_start >= valid_start && obj_end > valid_start + sb->s_data_len)
+	valid_start = curr_sb()->s_data_base + curr_sb()->s_data_index;
+	if (obj_start >= valid_start && obj_end > valid_start + curr_sb()->s_data_len)
 		report("Checkpoint map", "block number outside valid range.");
 	if (obj_start < valid_start &&
-	    obj_end + sb->s_data_blocks > valid_start + sb->s_data_len)
+	    obj_end + curr_sb()->s_data_blocks > valid_start + curr_sb()->s_data_len)
 		report("Checkpoint map", "block number outside valid range.");
 
 	if (map->m_oid < APFS_OID_RESERVED_COUNT)
 		report("Checkpoint map", "reserved object id.");
-	if (map->m_oid >= sb->s_next_oid)
+	if (map->m_oid >= curr_sb()->s_next_oid)
 		report("Checkpoint map", "unassigned object id.");
-
-	free(entry);
 }
 
 /**
  * free_cpoint_map_table - Free the checkpoint map table and all its entries
  * @table: table to free
  */
-void free_cpoint_map_table(struct htable_entry **table)
+void free_cpoint_map_table(struct htable *table)
 {
 	free_htable(table, free_cpoint_map);
 }
 
+/**
+ * check_cpoint_map_object - Read the object for a checkpoint mapping
+ * @entry: the mapping
+ */
+static void check_cpoint_map_object(struct htable_entry *entry)
+{
+	struct object obj;
+
+	release_block(read_ephemeral_object(entry->h_id, &obj));
+}
+
+/**
+ * check_cpoint_map_objects - Check that all mappings have an ephemeral object
+ *
+ * This is for checkpoints that don't get a full check, where the objects
+ * would otherwise not be read at all.  Their contents are not checked.
+ */
+void check_cpoint_map_objects(void)
+{
+	apply_on_htable(curr_sb()->s_cpoint_map_table, check_cpoint_map_object);
+}
+
 /**
  * get_cpoint_map - Find or create a map structure in the checkpoint map table
  * @oid: ephemeral object id
@@ -233,7 +308,7 @@ struct cpoint_map *get_cpoint_map(u64 oid)
 	struct htable_entry *entry;
 
 	entry = get_htable_entry(oid, sizeof(struct cpoint_map),
-				 sb->s_cpoint_map_table);
+				 curr_sb()->s_cpoint_map_table);
 	return (struct cpoint_map *)entry;
 }
 
@@ -251,8 +326,8 @@ void *read_ephemeral_object(u64 oid, struct object *obj)
 	struct cpoint_map *map;
 	u32 storage_type;
 
-	assert(sb->s_cpoint_map_table);
-	assert(sb->s_xid);
+	assert(curr_sb()->s_cpoint_map_table);
+	assert(curr_sb()->s_xid);
 
 	map = get_cpoint_map(oid);
 	if (!map->m_paddr)
@@ -269,7 +344,7 @@ void *read_ephemeral_object(u64 oid, struct object *obj)
 		report("Ephemeral object", "subtype doesn't match mapping.");
 	if (obj->oid != oid)
 		report("Ephemeral object", "wrong object id.");
-	if (obj->xid != sb->s_xid)
+	if (obj->xid != curr_sb()->s_xid)
 		report("Ephemeral object", "not part of latest transaction.");
 
 	storage_type = parse_object_flags(obj->flags, false);
@@ -8,7 +8,9 @@
 #include <apfs/types.h>
 #include "htable.h"
 
+struct aes_xts_ctx;
 struct apfs_obj_phys;
+struct omap_index;
 struct super_block;
 struct node;
 
@@ -25,11 +27,16 @@ struct object {
 };
 
 extern int obj_verify_csum(struct apfs_obj_phys *obj);
+extern void *read_object_nocheck_crypto(u64 bno, struct object *obj,
+					const struct aes_xts_ctx *key);
 extern void *read_object_nocheck(u64 bno, struct object *obj);
+extern const struct aes_xts_ctx *omap_record_key(struct omap_index *omap_index,
+						 u64 pos);
 extern u32 parse_object_flags(u32 flags, bool encrypted);
-extern void *read_object(u64 oid, struct htable_entry **omap_table,
+extern void *read_object(u64 oid, struct omap_index *omap_index,
 			 struct object *obj);
-extern void free_cpoint_map_table(struct htable_entry **table);
+extern void free_cpoint_map_table(struct htable *table);
+extern void check_cpoint_map_objects(void);
 extern struct cpoint_map *get_cpoint_map(u64 oid);
 extern void *read_ephemeral_object(u64 oid, struct object *obj);
 
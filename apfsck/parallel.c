@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Pool of threads for checks that are independent of each other, such as
+ * separate volumes or snapshots.  Each check runs under a private copy of the
+ * current context, and the updates to the container bitmap are logged until
+ * all checks are done.
+ */
+
+#include <stdlib.h>
+#include <apfs/thread.h>
+#include "apfsck.h"
+#include "parallel.h"
+#include "spaceman.h"
+
+unsigned int check_jobs = 1;
+
+/*
+ * Shared state for the threads of a run_parallel() call
+ */
+struct parallel_pool {
+	void			(*p_fn)(int index, void *arg);
+	void			*p_arg;		/* Argument for @p_fn */
+	struct check_context	*p_parent;	/* Context of the caller */
+	int			p_count;	/* Number of items */
+	int			p_next;		/* Next item to be checked */
+
+	/* Results for each item, merged in order at the end */
+	struct bmap_log		*p_logs;	/* Container bitmap updates */
+	bool			*p_weird;	/* Weird issue reported? */
+};
+
+/**
+ * run_item - Run the check for a single item under a context of its own
+ * @pool:	the pool
+ * @index:	index of the item
+ * @logged:	log the container bitmap updates for the item?
+ *
+ * Returns true if a weird issue was reported for the item.
+ */
+static bool run_item(struct parallel_pool *pool, int index, bool logged)
+{
+	struct check_context *old_ctx = curr_ctx;
+	struct check_context item_ctx = *pool->p_parent;
+
+	if (logged)
+		item_ctx.c_bmap_log = &pool->p_logs[index];
+	item_ctx.c_weird_state = false;
+
+	curr_ctx = &item_ctx;
+	pool->p_fn(index, pool->p_arg);
+	curr_ctx = old_ctx;
+	return item_ctx.c_weird_state;
+}
+
+/**
+ * parallel_worker - Check items from the pool until none are left
+ * @arg: the pool
+ */
+static void *parallel_worker(void *arg)
+{
+	struct parallel_pool *pool = arg;
+	int index;
+
+	while (1) {
+		index = __atomic_fetch_add(&pool->p_next, 1, __ATOMIC_RELAXED);
+		if (index >= pool->p_count)
+			break;
+		pool->p_weird[index] = run_item(pool, index, true /* logged */);
+	}
+	return NULL;
+}
+
+/**
+ * run_parallel - Run a check for each item, on up to check_jobs threads
+ * @count:	number of items
+ * @fn:		function that checks a single item, given its index
+ * @arg:	argument for @fn
+ *
+ * The calling thread takes part in the work.  Once all items are checked,
+ * their container bitmap updates are replayed in item order, so the results
+ * don't depend on the scheduling.
+ */
+void run_parallel(int count, void (*fn)(int index, void *arg), void *arg)
+{
+	struct parallel_pool pool = {0};
+	unsigned int jobs = check_jobs;
+	int index;
+
+	pool.p_fn = fn;
+	pool.p_arg = arg;
+	pool.p_parent = curr_ctx;
+	pool.p_count = count;
+
+	if (jobs > count)
+		jobs = count;
+	if (jobs <= 1) {
+		for (index = 0; index < count; ++index) {
+			if (run_item(&pool, index, false /* logged */))
+				curr_ctx->c_weird_state = true;
+		}
+		return;
+	}
+
+	pool.p_logs = calloc(count, sizeof(*pool.p_logs));
+	pool.p_weird = calloc(count, sizeof(*pool.p_weird));
+	if (!pool.p_logs || !pool.p_weird)
+		system_error();
+
+	run_threads(jobs, parallel_worker, &pool);
+
+	for (index = 0; index < count; ++index) {
+		replay_bmap_log(&pool.p_logs[index]);
+		if (pool.p_weird[index])
+			curr_ctx->c_weird_state = true;
+	}
+
+	free(pool.p_weird);
+	free(pool.p_logs);
+}
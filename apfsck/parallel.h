@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+extern unsigned int check_jobs;	/* Number of threads for the checks */
+
+extern void run_parallel(int count, void (*fn)(int index, void *arg),
+			 void *arg);
+
+#endif	/* _PARALLEL_H */
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Checksum pre-scan for the virtual objects of a volume.  Once the object map
+ * is parsed, all the blocks it maps are read in physical order, with large
+ * sequential reads, and their checksums are verified on up to check_jobs
+ * threads.  The verified blocks are put in the block cache, for as long as
+ * its budget allows, so the traversal that follows finds them there already
+ * verified.  Those that don't fit get verified again when they are read, but
+ * on rotational devices they are still found in the page cache, instead of
+ * seeking all over the place.
+ *
+ * Blocks with a bad checksum are not cached, so that they still get reported
+ * at the usual point of the check.  The pre-scan itself never reports
+ * anything.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <apfs/raw.h>
+#include "apfsck.h"
+#include "btree.h"
+#include "cache.h"
+#include "io.h"
+#include "object.h"
+#include "parallel.h"
+#include "prescan.h"
+#include "stats.h"
+#include "super.h"
+
+/* Maximum length of a single read, in bytes */
+#define PRESCAN_CHUNK_SIZE	(4 << 20)
+/* Largest run of unneeded blocks that is still read, to avoid a seek */
+#define PRESCAN_MAX_GAP		32
+
+bool prescan_enabled;
+
+/*
+ * A large read of a range of blocks, for several of the sorted block numbers
+ */
+struct prescan_chunk {
+	u64	c_first;	/* Position of the first block in the sorted array */
+	u64	c_count;	/* Number of sorted blocks in the chunk */
+	u64	c_bno;		/* First block number to read */
+	u32	c_blocks;	/* Number of blocks to read */
+};
+
+/*
+ * Shared state for the threads of a pre-scan
+ */
+struct prescan_state {
+	u64			*s_bnos;	/* Sorted block numbers */
+	u64			s_count;	/* Number of blocks */
+	struct prescan_chunk	*s_chunks;
+	u64			s_chunk_count;
+};
+
+static int compare_bnos(const void *a, const void *b)
+{
+	u64 bno_a = *(const u64 *)a;
+	u64 bno_b = *(const u64 *)b;
+
+	return bno_a < bno_b ? -1 : bno_a > bno_b;
+}
+
+/**
+ * prescan_chunk - Read a chunk of blocks and verify their checksums
+ * @index:	index of the chunk
+ * @arg:	state of the pre-scan
+ */
+static void prescan_chunk(int index, void *arg)
+{
+	struct prescan_state *state = arg;
+	struct prescan_chunk *chunk = &state->s_chunks[index];
+	void *buf;
+	u64 start;
+	u64 i;
+
+	/* Aligned, in case of direct reads */
+	if (posix_memalign(&buf, curr_sb()->s_blocksize,
+			   (size_t)chunk->c_blocks * curr_sb()->s_blocksize))
+		system_error();
+	io_read(chunk->c_bno, chunk->c_blocks, buf);
+
+	start = stats_now();
+	for (i = chunk->c_first; i < chunk->c_first + chunk->c_count; ++i) {
+		struct apfs_obj_phys *obj;
+
+		obj = buf + (state->s_bnos[i] - chunk->c_bno) * curr_sb()->s_blocksize;
+		if (obj_verify_csum(obj))
+			cache_add_verified(state->s_bnos[i], obj);
+	}
+	stats_add(STAT_CKSUM_BLOCKS, chunk->c_count);
+	stats_add(STAT_CKSUM_NS, stats_now() - start);
+	stats_add(STAT_PRESCAN_BLOCKS, chunk->c_count);
+
+	free(buf);
+}
+
+/**
+ * prescan_split - Split the sorted blocks of a pre-scan into chunks
+ * @state: state of the pre-scan, with the sorted blocks already set
+ */
+static void prescan_split(struct prescan_state *state)
+{
+	u64 max_blocks = PRESCAN_CHUNK_SIZE / curr_sb()->s_blocksize;
+	struct prescan_chunk *chunk = NULL;
+	u64 i;
+
+	/* There can't be more chunks than blocks */
+	state->s_chunks = calloc(state->s_count + 1, sizeof(*state->s_chunks));
+	if (!state->s_chunks)
+		system_error();
+	state->s_chunk_count = 0;
+
+	for (i = 0; i < state->s_count; ++i) {
+		u64 bno = state->s_bnos[i];
+
+		if (chunk && bno - chunk->c_bno < max_blocks &&
+		    bno - (chunk->c_bno + chunk->c_blocks) <= PRESCAN_MAX_GAP) {
+			chunk->c_blocks = bno - chunk->c_bno + 1;
+			++chunk->c_count;
+			continue;
+		}
+		chunk = &state->s_chunks[state->s_chunk_count++];
+		chunk->c_first = i;
+		chunk->c_count = 1;
+		chunk->c_bno = bno;
+		chunk->c_blocks = 1;
+	}
+}
+
+/**
+ * prescan_omap - Verify the checksums of all blocks mapped by an object map
+ * @index: index of the object map records
+ *
+ * Encrypted objects are skipped, since their checksum is for the plaintext.
+ */
+void prescan_omap(struct omap_index *index)
+{
+	struct prescan_state state = {0};
+	u64 *bnos;
+	u64 dev_blocks;
+	u64 i, count;
+
+	bnos = calloc(index->oi_count + 1, sizeof(*bnos));
+	if (!bnos)
+		system_error();
+
+	/* Blocks out of range will get reported later, don't read them here */
+	dev_blocks = get_device_size(curr_sb()->s_blocksize);
+	if (dev_blocks > curr_sb()->s_block_count)
+		dev_blocks = curr_sb()->s_block_count;
+
+	count = 0;
+	for (i = 0; i < index->oi_count; ++i) {
+		u64 bno = index->oi_bnos[i];
+
+		if (index->oi_flags[i] & APFS_OMAP_VAL_ENCRYPTED)
+			continue;
+		if (!bno || bno >= dev_blocks)
+			continue;
+		bnos[count++] = bno;
+	}
+	qsort(bnos, count, sizeof(*bnos), compare_bnos);
+
+	/* Several snapshots may share a block */
+	state.s_bnos = bnos;
+	state.s_count = 0;
+	for (i = 0; i < count; ++i) {
+		if (state.s_count && bnos[state.s_count - 1] == bnos[i])
+			continue;
+		bnos[state.s_count++] = bnos[i];
+	}
+
+	prescan_split(&state);
+	run_parallel(state.s_chunk_count, prescan_chunk, &state);
+
+	free(state.s_chunks);
+	free(bnos);
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _PRESCAN_H
+#define _PRESCAN_H
+
+#include <apfs/types.h>
+
+struct omap_index;
+
+extern bool prescan_enabled;	/* Verify the checksums ahead of time? */
+
+extern void prescan_omap(struct omap_index *index);
+
+#endif	/* _PRESCAN_H */
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Progress reports for long checks.  The parsing code only bumps a few
+ * counters; a separate thread wakes up at regular intervals and writes a line
+ * with the current state.  The reports keep coming while the device is stuck,
+ * so a stall shows up as a read count that stops growing.
+ *
+ * The node and key totals come from the footer of the tree being parsed, so
+ * the estimate is only as good as the footer, and it covers a single tree.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <apfs/raw.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "btree.h"
+#include "progress.h"
+#include "stats.h"
+#include "super.h"
+
+int progress_fd = -1;
+u64 progress_nodes;
+u64 progress_keys;
+u64 progress_bytes;
+
+/* State of the check, as last set by the main thread */
+static int progress_phase = -1;		/* Current phase, or -1 before any */
+static int progress_volume = -1;	/* Current volume, or -1 for none */
+static int progress_tree_type;		/* Type of the current tree, or 0 */
+static u64 progress_expected_nodes;	/* Node count in the tree footer */
+static u64 progress_expected_keys;	/* Key count in the tree footer */
+static u64 progress_tree_start;		/* Time when the tree was started */
+
+static u64 progress_start_ns;		/* Time when the check was started */
+static u64 progress_last_ns;		/* Time of the last report */
+static u64 progress_last_bytes;		/* Bytes read at the last report */
+
+static pthread_t progress_thread;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_wake = PTHREAD_COND_INITIALIZER;
+static bool progress_stop;
+static bool progress_failed;	/* Did a report fail to be written? */
+
+static const char *const progress_tree_names[] = {
+	[0]			= "none",
+	[BTREE_TYPE_OMAP]	= "omap",
+	[BTREE_TYPE_CATALOG]	= "catalog",
+	[BTREE_TYPE_EXTENTREF]	= "extentref",
+	[BTREE_TYPE_SNAP_META]	= "snap_meta",
+	[BTREE_TYPE_FREE_QUEUE]	= "free_queue",
+	[BTREE_TYPE_SNAPSHOTS]	= "omap_snapshots",
+};
+
+/**
+ * progress_clock - Get the current time for the reports, in nanoseconds
+ */
+static u64 progress_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * progress_set_phase - Set the phase shown in the reports
+ * @phase: the phase that starts
+ */
+void progress_set_phase(enum stat_phase phase)
+{
+	int volume = -1;
+
+	if (progress_fd < 0)
+		return;
+	/* These phases are for the whole container */
+	if (curr_vsb() && phase != STAT_CHECKPOINTS && phase != STAT_SPACEMAN)
+		volume = curr_vsb()->v_index;
+	__atomic_store_n(&progress_volume, volume, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_phase, phase, __ATOMIC_RELAXED);
+
+	/* Until the phase gets to a tree, there is nothing to count */
+	__atomic_store_n(&progress_tree_type, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_expected_nodes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_expected_keys, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_nodes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_keys, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * __progress_tree - Start the counts for a new tree
+ * @root: root node of the tree
+ */
+void __progress_tree(struct node *root)
+{
+	struct apfs_btree_info *info;
+
+	info = (void *)root->raw + curr_sb()->s_blocksize - sizeof(*info);
+	__atomic_store_n(&progress_expected_nodes, le64_to_cpu(info->bt_node_count), __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_expected_keys, le64_to_cpu(info->bt_key_count), __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_tree_type, root->btree->type, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_nodes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_keys, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress_tree_start, progress_clock(), __ATOMIC_RELAXED);
+}
+
+/**
+ * progress_report - Write a line with the current state of the check
+ * @done: is the check over?
+ */
+static void progress_report(bool done)
+{
+	u64 now = progress_clock();
+	u64 nodes = __atomic_load_n(&progress_nodes, __ATOMIC_RELAXED);
+	u64 keys = __atomic_load_n(&progress_keys, __ATOMIC_RELAXED);
+	u64 bytes = __atomic_load_n(&progress_bytes, __ATOMIC_RELAXED);
+	u64 expected = __atomic_load_n(&progress_expected_nodes, __ATOMIC_RELAXED);
+	u64 tree_start = __atomic_load_n(&progress_tree_start, __ATOMIC_RELAXED);
+	int phase = __atomic_load_n(&progress_phase, __ATOMIC_RELAXED);
+	int volume = __atomic_load_n(&progress_volume, __ATOMIC_RELAXED);
+	int type = __atomic_load_n(&progress_tree_type, __ATOMIC_RELAXED);
+	char volume_buf[16], line[512];
+	double rate, eta = -1;
+	int len;
+
+	rate = (bytes - progress_last_bytes) / 1048576.0 / ((now - progress_last_ns) / 1e9);
+	progress_last_bytes = bytes;
+	progress_last_ns = now;
+
+	/* Assume that the rest of the tree is parsed at the same pace */
+	if (nodes >= expected)
+		eta = 0;
+	else if (nodes)
+		eta = (now - tree_start) / 1e9 * (expected - nodes) / nodes;
+
+	if (volume >= 0)
+		snprintf(volume_buf, sizeof(volume_buf), "%d", volume);
+	else
+		strcpy(volume_buf, "none");
+
+	len = snprintf(line, sizeof(line),
+		       "progress: elapsed_s=%.1f phase=%s volume=%s tree=%s nodes=%llu expected_nodes=%llu keys=%llu expected_keys=%llu bytes_read=%llu read_mib_s=%.1f eta_s=%.0f\n",
+		       (now - progress_start_ns) / 1e9,
+		       done ? "done" : phase >= 0 ? stats_phase_names[phase] : "start",
+		       volume_buf, progress_tree_names[type],
+		       (unsigned long long)nodes, (unsigned long long)expected,
+		       (unsigned long long)keys,
+		       (unsigned long long)__atomic_load_n(&progress_expected_keys, __ATOMIC_RELAXED),
+		       (unsigned long long)bytes, rate, eta);
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	/*
+	 * A single write, so that the lines don't get mixed with other output.
+	 * If the reader went away, the check still goes on without reports.
+	 */
+	if (write(progress_fd, line, len) != len)
+		progress_failed = true;
+}
+
+/**
+ * progress_worker - Write the reports until the check is over
+ * @arg: unused
+ */
+static void *progress_worker(void *arg)
+{
+	struct timespec deadline;
+	u64 next;
+
+	(void)arg;
+	pthread_mutex_lock(&progress_lock);
+	next = progress_clock() + PROGRESS_INTERVAL_MS * 1000000ULL;
+	while (!progress_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += PROGRESS_INTERVAL_MS / 1000;
+		deadline.tv_nsec += (PROGRESS_INTERVAL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&progress_wake, &progress_lock, &deadline);
+
+		/* Wakeups may be spurious, so check the time */
+		if (progress_stop || progress_clock() < next)
+			continue;
+		if (progress_failed)
+			break;
+		progress_report(false /* done */);
+		next = progress_clock() + PROGRESS_INTERVAL_MS * 1000000ULL;
+	}
+	pthread_mutex_unlock(&progress_lock);
+	return NULL;
+}
+
+/**
+ * progress_start - Start writing progress reports, if requested
+ */
+void progress_start(void)
+{
+	if (progress_fd < 0)
+		return;
+	if (fcntl(progress_fd, F_GETFL) == -1)
+		system_error();
+
+	progress_start_ns = progress_last_ns = progress_clock();
+	progress_stop = false;
+	if (pthread_create(&progress_thread, NULL, progress_worker, NULL))
+		system_error();
+}
+
+/**
+ * progress_end - Stop the reports, with a last one for the finished check
+ */
+void progress_end(void)
+{
+	if (progress_fd < 0)
+		return;
+	pthread_mutex_lock(&progress_lock);
+	progress_stop = true;
+	pthread_cond_signal(&progress_wake);
+	pthread_mutex_unlock(&progress_lock);
+	pthread_join(progress_thread, NULL);
+
+	if (!progress_failed)
+		progress_report(true /* done */);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <apfs/types.h>
+#include "btree.h"
+#include "stats.h"
+
+/* Time between progress reports, in milliseconds */
+#define PROGRESS_INTERVAL_MS	1000
+
+extern int progress_fd;		/* Descriptor for the reports, or -1 for none */
+extern u64 progress_nodes;	/* Nodes parsed for the current tree */
+extern u64 progress_keys;	/* Leaf records parsed for the current tree */
+extern u64 progress_bytes;	/* Bytes read from the device */
+
+extern void progress_start(void);
+extern void progress_set_phase(enum stat_phase phase);
+extern void __progress_tree(struct node *root);
+extern void progress_end(void);
+
+/**
+ * progress_node - Count a node for the progress reports
+ * @node: the node, about to be parsed
+ *
+ * The root of each tree starts a new count.
+ */
+static inline void progress_node(struct node *node)
+{
+	if (progress_fd < 0)
+		return;
+	if (node_is_root(node))
+		__progress_tree(node);
+	__atomic_fetch_add(&progress_nodes, 1, __ATOMIC_RELAXED);
+	if (node_is_leaf(node))
+		__atomic_fetch_add(&progress_keys, node->records, __ATOMIC_RELAXED);
+}
+
+/**
+ * progress_read - Count the bytes read from the device
+ * @len: number of bytes
+ */
+static inline void progress_read(u64 len)
+{
+	if (progress_fd >= 0)
+		__atomic_fetch_add(&progress_bytes, len, __ATOMIC_RELAXED);
+}
+
+#endif	/* _PROGRESS_H */
@@ -8,8 +8,12 @@
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "apfsck.h"
+#include "btree.h"
+#include "cache.h"
+#include "errlog.h"
 #include "htable.h"
 #include "key.h"
+#include "parallel.h"
 #include "snapshot.h"
 #include "super.h"
 
@@ -25,14 +29,14 @@ static void free_snap(struct htable_entry *entry)
 		report("Snapshot", "missing metadata entry.");
 	if (!snap->sn_omap_seen)
 		report("Snapshot", "missing omap entry.");
-	free(entry);
+	free(snap->sn_meta_name);
 }
 
 /**
  * free_snap_table - Free the snapshot hash table and all its entries
  * @table: table to free
  */
-void free_snap_table(struct htable_entry **table)
+void free_snap_table(struct htable *table)
 {
 	free_htable(table, free_snap);
 }
@@ -47,7 +51,7 @@ struct snapshot *get_snapshot(u64 xid)
 {
 	struct htable_entry *entry;
 
-	entry = get_htable_entry(xid, sizeof(struct snapshot), vsb->v_snap_table);
+	entry = get_htable_entry(xid, sizeof(struct snapshot), curr_vsb()->v_snap_table);
 	return (struct snapshot *)entry;
 }
 
@@ -78,47 +82,127 @@ static void parse_snap_name_record(struct apfs_snap_name_key *key, struct apfs_s
 }
 
 /**
- * check_snapshot - Check a whole snapshot
- * @xid:		transaction for the snapshot
- * @vol_bno:		block number for the snapshot volume superblock
- * @extentref_bno:	block number for the snapshot's extentref tree
+ * prepare_snapshot - Run the checks for a snapshot that must be done in order
+ * @check: the snapshot check
+ *
+ * Reads the snapshot's volume superblock and parses its extentref tree.  The
+ * lookups for each snapshot must only see the extentref trees of the ones
+ * that came before, so these are added to the shared list in xid order.
  */
-static void check_snapshot(u64 xid, u64 vol_bno, u64 extentref_bno)
+static void prepare_snapshot(struct snap_check *check)
 {
-	struct volume_superblock *latest_vsb = vsb;
-	u64 latest_xid = sb->s_xid;
+	struct check_context *latest_ctx = curr_ctx;
+	struct volume_superblock *latest_vsb = curr_vsb();
+	struct check_context snap_ctx;
+	struct listed_btree *new = NULL;
 
-	vsb = NULL;
+	/* The snapshot gets its own context, the latest one is left alone */
+	snap_ctx = *latest_ctx;
+	snap_ctx.c_xid = check->sc_xid;
+	snap_ctx.c_vsb = NULL;
+	curr_ctx = &snap_ctx;
 
-	sb->s_xid = xid;
-	vsb = alloc_volume_super(true);
-	/* The list of extref trees is shared by all transactions */
-	vsb->v_snap_extrefs = latest_vsb->v_snap_extrefs;
-	vsb->v_snap_count = latest_vsb->v_snap_count;
-	vsb->v_raw = read_object(vol_bno, NULL, &vsb->v_obj);
-	read_volume_super(latest_vsb->v_index, vsb, &vsb->v_obj);
+	curr_ctx->c_vsb = check->sc_vsb = alloc_volume_super(true);
+	curr_vsb()->v_snap_count = check->sc_index;
+	curr_vsb()->v_raw = read_object(check->sc_vol_bno, NULL, &curr_vsb()->v_obj);
+	read_volume_super(latest_vsb->v_index, &curr_vsb()->v_obj);
 
-	if (vsb->v_extref_oid != 0)
+	if (curr_vsb()->v_extref_oid != 0)
 		report("Snapshot volume superblock", "has extentref tree.");
-	vsb->v_extref_oid = extentref_bno;
+	curr_vsb()->v_extref_oid = check->sc_extentref_bno;
 
-	if (vsb->v_omap_oid != 0)
+	if (curr_vsb()->v_omap_oid != 0)
 		report("Snapshot volume superblock", "has object map.");
-	vsb->v_omap = latest_vsb->v_omap;
-	vsb->v_omap_table = latest_vsb->v_omap_table;
-	omap_htable_clear_seen_for_snap(latest_vsb->v_omap_table);
-	vsb->v_snap_max_xid = latest_vsb->v_snap_max_xid;
+	curr_vsb()->v_omap = latest_vsb->v_omap;
+	curr_vsb()->v_omap_index = latest_vsb->v_omap_index;
+	curr_vsb()->v_omap_seen = alloc_omap_seen(curr_vsb()->v_omap_index);
+	curr_vsb()->v_snap_max_xid = latest_vsb->v_snap_max_xid;
 
-	if (vsb->v_snap_meta_oid != 0)
+	if (curr_vsb()->v_snap_meta_oid != 0)
 		report("Snapshot volume superblock", "has snapshot tree.");
 
+	/* We want the most recent snapshots first */
+	new = calloc(1, sizeof(*new));
+	if (!new)
+		system_error();
+	new->btree = parse_extentref_btree(curr_vsb()->v_extref_oid);
+	new->next = latest_vsb->v_snap_extrefs;
+	curr_vsb()->v_snap_extrefs = latest_vsb->v_snap_extrefs = new;
+
+	latest_ctx->c_weird_state |= snap_ctx.c_weird_state;
+	curr_ctx = latest_ctx;
+}
+
+/**
+ * check_snapshot - Check the rest of a snapshot, under a context of its own
+ * @index:	index of the snapshot in the list of checks
+ * @arg:	the list of checks
+ */
+static void check_snapshot(int index, void *arg)
+{
+	struct snap_check *check = (struct snap_check *)arg + index;
+	struct recovery rec;
+
+	curr_ctx->c_xid = check->sc_xid;
+	curr_ctx->c_vsb = check->sc_vsb;
+
+	if (errlog_limit) {
+		push_recovery(&rec, "snapshot", check->sc_xid, NULL /* key */,
+			      false /* release */);
+		if (setjmp(rec.r_env)) {
+			pop_recovery(&rec);
+			return;
+		}
+	}
 	check_volume_super();
+	if (errlog_limit)
+		pop_recovery(&rec);
+	release_block(curr_vsb()->v_raw);
+	curr_vsb()->v_raw = NULL;
+}
 
-	/* Go back to the latest transaction */
-	sb->s_xid = latest_xid;
-	latest_vsb->v_snap_extrefs = vsb->v_snap_extrefs;
-	latest_vsb->v_block_count += vsb->v_block_count;
-	vsb = latest_vsb; /* TODO: don't leak */
+/**
+ * check_snapshots - Check all the snapshots found in the snapshot tree
+ *
+ * The snapshots are checked on up to check_jobs threads, and their results
+ * are merged into the latest volume superblock in xid order.  If the user
+ * asked for it, only the newest few snapshots are checked.
+ */
+void check_snapshots(void)
+{
+	struct snap_check *checks = curr_vsb()->v_snap_checks;
+	u64 count = curr_vsb()->v_snap_count;
+	u64 first = 0;
+	u64 i;
+
+	/*
+	 * The extentref trees of all snapshots are needed for the extents of
+	 * the newer ones, so only the rest of the check can be skipped.
+	 */
+	for (i = 0; i < count; ++i)
+		prepare_snapshot(&checks[i]);
+
+	/* The checks are in xid order, so the newest snapshots come last */
+	if (scope_snapshots >= 0 && count > scope_snapshots) {
+		first = count - scope_snapshots;
+		for (i = 0; i < first; ++i) {
+			release_block(checks[i].sc_vsb->v_raw);
+			checks[i].sc_vsb->v_raw = NULL;
+			free(checks[i].sc_vsb->v_omap_seen);
+			checks[i].sc_vsb->v_omap_seen = NULL;
+		}
+		curr_vsb()->v_snaps_skipped = true;
+		__atomic_store_n(&curr_sb()->s_partial, true, __ATOMIC_RELAXED);
+	}
+
+	run_parallel(count - first, check_snapshot, checks + first);
+
+	for (i = 0; i < count; ++i) {
+		/* TODO: don't leak the snapshot vsb */
+		curr_vsb()->v_block_count += checks[i].sc_vsb->v_block_count;
+	}
+	free(checks);
+	curr_vsb()->v_snap_checks = NULL;
 }
 
 /**
@@ -132,6 +216,7 @@ static void check_snapshot(u64 xid, u64 vol_bno, u64 extentref_bno)
 static void parse_snap_metadata_record(struct apfs_snap_metadata_key *key, struct apfs_snap_metadata_val *val, int len)
 {
 	struct snapshot *snap = NULL;
+	struct snap_check *check = NULL;
 	u64 snap_xid;
 	int namelen;
 
@@ -162,8 +247,19 @@ static void parse_snap_metadata_record(struct apfs_snap_metadata_key *key, struc
 	if (val->flags)
 		report_unknown("Snapshot flags");
 
-	check_snapshot(snap_xid, le64_to_cpu(val->sblock_oid), le64_to_cpu(val->extentref_tree_oid));
-	++vsb->v_snap_count;
+	/* The snapshot itself is checked once the whole tree is parsed */
+	curr_vsb()->v_snap_checks = realloc(curr_vsb()->v_snap_checks,
+					    (curr_vsb()->v_snap_count + 1) *
+					    sizeof(*curr_vsb()->v_snap_checks));
+	if (!curr_vsb()->v_snap_checks)
+		system_error();
+	check = &curr_vsb()->v_snap_checks[curr_vsb()->v_snap_count];
+	check->sc_index = curr_vsb()->v_snap_count;
+	check->sc_xid = snap_xid;
+	check->sc_vol_bno = le64_to_cpu(val->sblock_oid);
+	check->sc_extentref_bno = le64_to_cpu(val->extentref_tree_oid);
+	check->sc_vsb = NULL;
+	++curr_vsb()->v_snap_count;
 }
 
 /**
@@ -212,10 +308,10 @@ void parse_omap_snap_record(__le64 *key, struct apfs_omap_snapshot *val, int len
 	snap_xid = le64_to_cpu(*key);
 	if (snap_xid == 0)
 		report("Omap snapshot record", "xid is zero.");
-	if (snap_xid >= sb->s_xid)
+	if (snap_xid >= curr_sb()->s_xid)
 		report("Omap snapshot record", "xid is in the future.");
-	if (snap_xid >= vsb->v_snap_max_xid)
-		vsb->v_snap_max_xid = snap_xid;
+	if (snap_xid >= curr_vsb()->v_snap_max_xid)
+		curr_vsb()->v_snap_max_xid = snap_xid;
 	snapshot = get_snapshot(snap_xid);
 	snapshot->sn_omap_seen = true;
 
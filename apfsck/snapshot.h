@@ -21,9 +21,21 @@ struct snapshot {
 };
 #define sn_xid	sn_htable.h_id	/* Transaction id */
 
-extern void free_snap_table(struct htable_entry **table);
+/*
+ * Snapshot found in the snapshot tree, waiting to be checked
+ */
+struct snap_check {
+	u64 sc_index;		/* Position in the snapshot tree */
+	u64 sc_xid;		/* Transaction for the snapshot */
+	u64 sc_vol_bno;		/* Block number for the volume superblock */
+	u64 sc_extentref_bno;	/* Block number for the extentref tree */
+	struct volume_superblock *sc_vsb; /* Volume superblock, once read */
+};
+
+extern void free_snap_table(struct htable *table);
 extern struct snapshot *get_snapshot(u64 xid);
 extern void parse_snap_record(void *key, void *val, int len);
+extern void check_snapshots(void);
 extern void parse_omap_snap_record(__le64 *key, struct apfs_omap_snapshot *val, int len);
 
 #endif	/* _SNAPSHOT_H */
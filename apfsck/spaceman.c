@@ -6,12 +6,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <unistd.h>
+#include <apfs/bitmap.h>
 #include <apfs/parameters.h>
 #include <apfs/raw.h>
 #include "apfsck.h"
 #include "btree.h"
+#include "cache.h"
+#include "cbmap.h"
+#include "hugepage.h"
 #include "key.h"
 #include "object.h"
 #include "spaceman.h"
@@ -23,7 +26,7 @@
  */
 static inline bool block_in_ip(u64 bno)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	u64 start = sm->sm_ip_base;
 	u64 end = start + sm->sm_ip_block_count;
 
@@ -57,17 +60,9 @@ static bool range_in_ip(u64 paddr, u64 length)
  */
 static void bmap_mark_as_used(u64 *bitmap, u64 paddr, u64 length)
 {
-	u64 *byte;
-	u64 flag;
-	u64 i;
-
-	for (i = paddr; i < paddr + length; ++i) {
-		byte = bitmap + i / 64;
-		flag = 1ULL << i % 64;
-		if (*byte & flag)
-			report(NULL /* context */, "A block is used twice.");
-		*byte |= flag;
-	}
+	if (bitmap_test_range_any(bitmap, paddr, length))
+		report(NULL /* context */, "A block is used twice.");
+	bitmap_set_range(bitmap, paddr, length);
 }
 
 /**
@@ -82,8 +77,39 @@ void ip_bmap_mark_as_used(u64 paddr, u64 length)
 {
 	if (!range_in_ip(paddr, length))
 		report(NULL /* context */, "Out-of-range ip block number.");
-	paddr -= sb->s_spaceman.sm_ip_base;
-	bmap_mark_as_used(sb->s_ip_bitmap, paddr, length);
+	paddr -= curr_sb()->s_spaceman.sm_ip_base;
+	bmap_mark_as_used(curr_sb()->s_ip_bitmap, paddr, length);
+}
+
+/**
+ * bmap_log_append - Add a bitmap update to a log
+ * @log:	the log
+ * @paddr:	first block number
+ * @length:	block count
+ */
+static void bmap_log_append(struct bmap_log *log, u64 paddr, u64 length)
+{
+	struct bmap_log_entry *last;
+
+	/* Extents are often allocated in order, so merge when possible */
+	if (log->l_count) {
+		last = &log->l_entries[log->l_count - 1];
+		if (last->e_paddr + last->e_length == paddr) {
+			last->e_length += length;
+			return;
+		}
+	}
+
+	if (log->l_count == log->l_size) {
+		log->l_size = log->l_size ? 2 * log->l_size : 256;
+		log->l_entries = realloc(log->l_entries,
+					 log->l_size * sizeof(*log->l_entries));
+		if (!log->l_entries)
+			system_error();
+	}
+	last = &log->l_entries[log->l_count++];
+	last->e_paddr = paddr;
+	last->e_length = length;
 }
 
 /**
@@ -92,15 +118,42 @@ void ip_bmap_mark_as_used(u64 paddr, u64 length)
  * @length:	block count
  *
  * Checks that the given address range is still marked as free in the
- * container's allocation bitmap, and then switches those bits.
+ * container's allocation bitmap, and then switches those bits.  If the current
+ * context keeps a log, the update is only recorded there for now.
  */
 void container_bmap_mark_as_used(u64 paddr, u64 length)
 {
 	/* Avoid out-of-bounds writes to the allocation bitmap */
-	if (paddr + length > sb->s_block_count || paddr + length < paddr)
+	if (paddr + length > curr_sb()->s_block_count || paddr + length < paddr)
 		report(NULL /* context */, "Out-of-range block number.");
 
-	bmap_mark_as_used(sb->s_bitmap, paddr, length);
+	if (curr_ctx->c_bmap_log) {
+		bmap_log_append(curr_ctx->c_bmap_log, paddr, length);
+		return;
+	}
+	if (cbmap_test_range_any(&curr_sb()->s_bitmap, paddr, length))
+		report(NULL /* context */, "A block is used twice.");
+	cbmap_set_range(&curr_sb()->s_bitmap, paddr, length);
+}
+
+/**
+ * replay_bmap_log - Apply the container bitmap updates from a log
+ * @log: the log, which gets emptied
+ *
+ * The updates may end up in the log of the current context, if it has one.
+ */
+void replay_bmap_log(struct bmap_log *log)
+{
+	u64 i;
+
+	for (i = 0; i < log->l_count; ++i) {
+		struct bmap_log_entry *entry = &log->l_entries[i];
+
+		container_bmap_mark_as_used(entry->e_paddr, entry->e_length);
+	}
+	free(log->l_entries);
+	log->l_entries = NULL;
+	log->l_count = log->l_size = 0;
 }
 
 /**
@@ -113,25 +166,25 @@ void container_bmap_mark_as_used(u64 paddr, u64 length)
  */
 static void parse_spaceman_chunk_counts(struct apfs_spaceman_phys *raw)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	int chunk_info_size = sizeof(struct apfs_chunk_info);
 	int cib_size = sizeof(struct apfs_chunk_info_block);
 	int cab_size = sizeof(struct apfs_cib_addr_block);
 
 	sm->sm_blocks_per_chunk = le32_to_cpu(raw->sm_blocks_per_chunk);
-	if (sm->sm_blocks_per_chunk != 8 * sb->s_blocksize)
+	if (sm->sm_blocks_per_chunk != 8 * curr_sb()->s_blocksize)
 		/* One bitmap block for each chunk */
 		report("Space manager", "wrong count of blocks per chunk.");
 
-	sm->sm_chunks_per_cib = (sb->s_blocksize - cib_size) / chunk_info_size;
+	sm->sm_chunks_per_cib = (curr_sb()->s_blocksize - cib_size) / chunk_info_size;
 	if (le32_to_cpu(raw->sm_chunks_per_cib) != sm->sm_chunks_per_cib)
 		report("Space manager", "wrong count of chunks per cib.");
 
-	sm->sm_cibs_per_cab = (sb->s_blocksize - cab_size) / sizeof(__le64);
+	sm->sm_cibs_per_cab = (curr_sb()->s_blocksize - cab_size) / sizeof(__le64);
 	if (le32_to_cpu(raw->sm_cibs_per_cab) != sm->sm_cibs_per_cab)
 		report("Space manager", "wrong count of cibs per cab.");
 
-	sm->sm_chunk_count = DIV_ROUND_UP(sb->s_block_count,
+	sm->sm_chunk_count = DIV_ROUND_UP(curr_sb()->s_block_count,
 					  sm->sm_blocks_per_chunk);
 	sm->sm_cib_count = DIV_ROUND_UP(sm->sm_chunk_count,
 					sm->sm_chunks_per_cib);
@@ -141,65 +194,70 @@ static void parse_spaceman_chunk_counts(struct apfs_spaceman_phys *raw)
 }
 
 /**
- * read_chunk_bitmap - Read a chunk's bitmap into memory
- * @addr: first block number for the chunk
- * @bmap: block number for the chunk's bitmap, or zero if the chunk is all free
+ * check_chunk_bitmap - Compare a chunk's bitmap against the measured one
+ * @addr:	first block number for the chunk
+ * @bmap:	block number for the chunk's bitmap, or zero if the chunk is free
+ * @blks:	number of blocks in the chunk
  *
- * Returns a pointer to the chunk's bitmap, read into its proper position
- * within the in-memory bitmap for the container.
+ * The bitmap block is checked while it's still in the cache, so the bitmap for
+ * the whole container never needs to be assembled in memory.  This requires
+ * that all blocks in use were already marked in the actual allocation bitmap.
+ * When some volumes or snapshots were left out of the check, their blocks are
+ * missing from the actual bitmap, so it only needs to be a subset.
+ *
+ * Returns the number of free blocks in the chunk.
  */
-static void *read_chunk_bitmap(u64 addr, u64 bmap)
+static u32 check_chunk_bitmap(u64 addr, u64 bmap, u32 blks)
 {
-	struct spaceman *sm = &sb->s_spaceman;
-	ssize_t read_bytes;
-	void *buf, *ret;
-	size_t count;
-	off_t offset;
-	u32 chunk_number;
-
-	assert(sm->sm_bitmap);
+	struct spaceman *sm = &curr_sb()->s_spaceman;
+	u64 bmap_bits = curr_sb()->s_blocksize * 8;
+	const u64 *real_bmap;
+	u64 *chunk_bmap;
+	u64 chunk_number;
+	u64 diff;
+	u32 free_count;
 
-	/* Prevent out-of-bounds writes to sm->sm_bitmap */
+	/* Prevent out-of-bounds reads from curr_sb()->s_bitmap */
 	if (addr & (sm->sm_blocks_per_chunk - 1))
 		report("Chunk-info", "chunk address isn't multiple of size.");
 	chunk_number = addr / sm->sm_blocks_per_chunk;
-	if (addr >= sb->s_block_count)
+	if (addr >= curr_sb()->s_block_count)
 		report("Chunk-info", "chunk address is out of bounds.");
+	real_bmap = cbmap_group_words(&curr_sb()->s_bitmap, chunk_number);
+
+	if (!bmap) { /* The whole chunk is free */
+		if (bitmap_test_range_any(real_bmap, 0, bmap_bits)) {
+			for (diff = 0; !real_bmap[diff / 64]; diff += 64)
+				;
+			diff += __builtin_ctzll(real_bmap[diff / 64]);
+			goto fail;
+		}
+		return blks;
+	}
 
-	ret = buf = sm->sm_bitmap + chunk_number * sb->s_blocksize;
-	if (!bmap) /* The whole chunk is free, so leave this block as zero */
-		return ret;
-
-	count = sb->s_blocksize;
-	offset = bmap * sb->s_blocksize;
-	do {
-		read_bytes = pread(fd, buf, count, offset);
-		if (read_bytes < 0)
-			system_error();
-		buf += read_bytes;
-		count -= read_bytes;
-		offset += read_bytes;
-	} while (read_bytes > 0);
+	chunk_bmap = read_block(bmap);
+	if (!curr_sb()->s_partial) {
+		diff = bitmap_first_diff(chunk_bmap, real_bmap, bmap_bits);
+	} else if (bitmap_is_subset(real_bmap, chunk_bmap, bmap_bits)) {
+		diff = bmap_bits;
+	} else {
+		/* Same as above, but only for blocks missing from the chunk */
+		for (diff = 0; !(real_bmap[diff / 64] & ~chunk_bmap[diff / 64]); diff += 64)
+			;
+		diff += __builtin_ctzll(real_bmap[diff / 64] & ~chunk_bmap[diff / 64]);
+	}
+	free_count = blks - bitmap_count_range(chunk_bmap, 0, bmap_bits);
+	release_block(chunk_bmap);
+	if (diff != bmap_bits)
+		goto fail;
 
 	/* Mark the bitmap block as used in the actual allocation bitmap */
 	ip_bmap_mark_as_used(bmap, 1 /* length */);
-	return ret;
-}
-
-/**
- * count_chunk_free - Count the free blocks in a chunk
- * @bmap: pointer to the chunk's bitmap
- * @blks: number of blocks in the chunk
- */
-static int count_chunk_free(void *bmap, u32 blks)
-{
-	unsigned long long *curr, *end;
-	int free = blks;
+	return free_count;
 
-	end = bmap + sb->s_blocksize;
-	for (curr = bmap; curr < end; ++curr)
-		free -= __builtin_popcountll(*curr);
-	return free;
+fail:
+	report("Space manager", "bad allocation bitmap for block 0x%llx.",
+	       (unsigned long long)(addr + diff));
 }
 
 /**
@@ -214,9 +272,8 @@ static int count_chunk_free(void *bmap, u32 blks)
 static u64 parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
 			    u64 start, u64 *xid)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	u32 block_count;
-	void *bitmap;
 	u32 free_count;
 
 	block_count = le32_to_cpu(chunk->ci_block_count);
@@ -230,10 +287,9 @@ static u64 parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
 
 	if (le64_to_cpu(chunk->ci_addr) != start)
 		report("Chunk-info block", "chunks are not consecutive.");
-	bitmap = read_chunk_bitmap(start, le64_to_cpu(chunk->ci_bitmap_addr));
-
 	free_count = le32_to_cpu(chunk->ci_free_count);
-	if (free_count != count_chunk_free(bitmap, block_count))
+	if (free_count != check_chunk_bitmap(start,
+			le64_to_cpu(chunk->ci_bitmap_addr), block_count))
 		report("Chunk-info", "wrong count of free blocks.");
 	sm->sm_free += free_count;
 
@@ -253,7 +309,7 @@ static u64 parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
  */
 static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	struct object obj;
 	struct apfs_chunk_info_block *cib;
 	u32 chunk_count;
@@ -281,6 +337,14 @@ static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
 		report("Chunk-info block", "too few chunks.");
 	sm->sm_chunks += chunk_count;
 
+	/* Get all the bitmap reads for this cib in flight at once */
+	for (i = 0; i < chunk_count; ++i) {
+		u64 bmap = le64_to_cpu(cib->cib_chunk_info[i].ci_bitmap_addr);
+
+		if (bmap && bmap < curr_sb()->s_block_count)
+			cache_prefetch(bmap);
+	}
+
 	for (i = 0; i < chunk_count; ++i) {
 		bool last_block = false;
 		u64 chunk_xid;
@@ -298,7 +362,7 @@ static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
 	if (obj.xid != max_chunk_xid) /* Cib only changes if a chunk changes */
 		report("Chunk-info block", "xid is too recent.");
 
-	munmap(cib, sb->s_blocksize);
+	release_block(cib);
 	return start;
 }
 
@@ -314,7 +378,7 @@ static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
  */
 static u64 spaceman_val_from_off(struct apfs_spaceman_phys *raw, u32 offset)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	char *value_p = (char *)raw + offset;
 
 	assert(sm->sm_struct_size);
@@ -323,7 +387,7 @@ static u64 spaceman_val_from_off(struct apfs_spaceman_phys *raw, u32 offset)
 		report("Spaceman", "offset is not aligned to 8 bytes.");
 	if (offset < sm->sm_struct_size)
 		report("Spaceman", "offset overlaps with structure.");
-	if (offset >= sb->s_blocksize || offset + sizeof(u64) > sb->s_blocksize)
+	if (offset >= curr_sb()->s_blocksize || offset + sizeof(u64) > curr_sb()->s_blocksize)
 		report("Spaceman", "offset is out of bounds.");
 	return *((u64 *)value_p);
 }
@@ -338,7 +402,7 @@ static u64 spaceman_val_from_off(struct apfs_spaceman_phys *raw, u32 offset)
  */
 static char *spaceman_256_from_off(struct apfs_spaceman_phys *raw, u32 offset)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	char *value_p = (char *)raw + offset;
 	int sz_256 = 256 / 8;
 
@@ -348,7 +412,7 @@ static char *spaceman_256_from_off(struct apfs_spaceman_phys *raw, u32 offset)
 		report("Spaceman", "offset is not aligned to 8 bytes.");
 	if (offset < sm->sm_struct_size)
 		report("Spaceman", "offset overlaps with structure.");
-	if (offset >= sb->s_blocksize || offset + sz_256 > sb->s_blocksize)
+	if (offset >= curr_sb()->s_blocksize || offset + sz_256 > curr_sb()->s_blocksize)
 		report("Spaceman", "offset is out of bounds.");
 	return value_p;
 }
@@ -359,7 +423,7 @@ static char *spaceman_256_from_off(struct apfs_spaceman_phys *raw, u32 offset)
  */
 static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	struct apfs_spaceman_device *dev = &raw->sm_dev[APFS_SD_MAIN];
 	u32 addr_off;
 	u64 start = 0;
@@ -371,7 +435,7 @@ static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
 		report("Spaceman device", "wrong count of chunk-info blocks.");
 	if (le64_to_cpu(dev->sm_chunk_count) != sm->sm_chunk_count)
 		report("Spaceman device", "wrong count of chunks.");
-	if (le64_to_cpu(dev->sm_block_count) != sb->s_block_count)
+	if (le64_to_cpu(dev->sm_block_count) != curr_sb()->s_block_count)
 		report("Spaceman device", "wrong block count.");
 
 	addr_off = le32_to_cpu(dev->sm_addr_offset);
@@ -379,12 +443,20 @@ static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
 		u64 bno = spaceman_val_from_off(raw,
 						addr_off + i * sizeof(u64));
 
+		/* Read the next cib while the bitmaps for this one are checked */
+		if (i + 1 < sm->sm_cib_count) {
+			u64 next = spaceman_val_from_off(raw,
+					addr_off + (i + 1) * sizeof(u64));
+
+			if (next < curr_sb()->s_block_count)
+				cache_prefetch(next);
+		}
 		start = parse_chunk_info_block(bno, i, start);
 	}
 
 	if (sm->sm_chunk_count != sm->sm_chunks)
 		report("Spaceman device", "bad total number of chunks.");
-	if (sb->s_block_count != sm->sm_blocks)
+	if (curr_sb()->s_block_count != sm->sm_blocks)
 		report("Spaceman device", "bad total number of blocks.");
 	if (le64_to_cpu(dev->sm_free_count) != sm->sm_free)
 		report("Spaceman device", "bad total number of free blocks.");
@@ -399,7 +471,7 @@ static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
  */
 static void check_spaceman_tier2_device(struct apfs_spaceman_phys *raw)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	struct apfs_spaceman_device *main_dev = &raw->sm_dev[APFS_SD_MAIN];
 	struct apfs_spaceman_device *dev = &raw->sm_dev[APFS_SD_TIER2];
 	u32 addr_off, main_addr_off;
@@ -429,9 +501,9 @@ static struct alloc_zone *alloc_zone_list = NULL;
 
 static void check_alloc_zone_sanity(u64 start, u64 end)
 {
-	if (start & (sb->s_blocksize - 1))
+	if (start & (curr_sb()->s_blocksize - 1))
 		report("Allocation zone", "start isn't multiple of block size.");
-	if (end & (sb->s_blocksize - 1))
+	if (end & (curr_sb()->s_blocksize - 1))
 		report("Allocation zone", "end isn't multiple of block size.");
 	if (start >= end)
 		report("Allocation zone", "invalid range.");
@@ -549,13 +621,64 @@ static void check_spaceman_datazone(struct apfs_spaceman_datazone_info_phys *dz)
 	}
 }
 
+/**
+ * bmap_log_entry_cmp - Compare two bitmap updates by block number
+ * @a: the first update
+ * @b: the second update
+ */
+static int bmap_log_entry_cmp(const void *a, const void *b)
+{
+	const struct bmap_log_entry *e1 = a, *e2 = b;
+
+	if (e1->e_paddr != e2->e_paddr)
+		return e1->e_paddr < e2->e_paddr ? -1 : 1;
+	return 0;
+}
+
+/**
+ * mark_free_queue_ranges - Mark the ranges of a free queue as used
+ * @sfq: the free queue, already parsed
+ *
+ * Once sorted, overlaps between the ranges are found without touching the
+ * bitmap, and each run of contiguous ranges gets a single bitmap update.
+ */
+static void mark_free_queue_ranges(struct free_queue *sfq)
+{
+	struct bmap_log *log = &sfq->sfq_ranges;
+	struct bmap_log_entry *entries = log->l_entries;
+	u64 start, end;
+	u64 i = 0;
+
+	if (!log->l_count)
+		return;
+	qsort(entries, log->l_count, sizeof(*entries), bmap_log_entry_cmp);
+	while (i < log->l_count) {
+		start = entries[i].e_paddr;
+		end = start + entries[i].e_length;
+		for (++i; i < log->l_count && entries[i].e_paddr <= end; ++i) {
+			if (entries[i].e_paddr < end)
+				report(NULL /* context */, "A block is used twice.");
+			end += entries[i].e_length;
+		}
+
+		if (sfq->sfq_index == APFS_SFQ_IP)
+			ip_bmap_mark_as_used(start, end - start);
+		else
+			container_bmap_mark_as_used(start, end - start);
+	}
+
+	free(log->l_entries);
+	log->l_entries = NULL;
+	log->l_count = log->l_size = 0;
+}
+
 /**
  * check_spaceman_free_queues - Check the spaceman free queues
  * @sfq: pointer to the raw free queue array
  */
 static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	int i;
 
 	if (sfq[APFS_SFQ_TIER2].sfq_count || sfq[APFS_SFQ_TIER2].sfq_tree_oid ||
@@ -572,6 +695,7 @@ static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 
 	sm->sm_ip_fq = parse_free_queue_btree(
 				le64_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_oid), APFS_SFQ_IP);
+	mark_free_queue_ranges(sm->sm_ip_fq);
 	if (le64_to_cpu(sfq[APFS_SFQ_IP].sfq_count) != sm->sm_ip_fq->sfq_count)
 		report("Spaceman free queue", "wrong block count.");
 	if (le64_to_cpu(sfq[APFS_SFQ_IP].sfq_oldest_xid) !=
@@ -580,11 +704,12 @@ static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) <
 					sm->sm_ip_fq->sfq_btree.node_count)
 		report("Spaceman free queue", "node count above limit.");
-	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) != ip_fq_node_limit(sm->sm_chunks))
+	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) != ip_fq_node_limit(sm->sm_chunk_count))
 		report("Spaceman free queue", "wrong node limit.");
 
 	sm->sm_main_fq = parse_free_queue_btree(
 				le64_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_oid), APFS_SFQ_MAIN);
+	mark_free_queue_ranges(sm->sm_main_fq);
 	if (le64_to_cpu(sfq[APFS_SFQ_MAIN].sfq_count) !=
 					sm->sm_main_fq->sfq_count)
 		report("Spaceman free queue", "wrong block count.");
@@ -594,24 +719,11 @@ static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) <
 					sm->sm_main_fq->sfq_btree.node_count)
 		report("Spaceman free queue", "node count above limit.");
-	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) != main_fq_node_limit(sm->sm_blocks))
+	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) !=
+	    main_fq_node_limit(curr_sb()->s_block_count))
 		report("Spaceman free queue", "wrong node limit.");
 }
 
-/**
- * compare_container_bitmaps - Verify the container's allocation bitmap
- * @sm_bmap:	allocation bitmap reported by the space manager
- * @real_bmap:	allocation bitmap assembled by the fsck
- * @chunks:	container chunk count, i.e., block count for the bitmaps
- */
-static void compare_container_bitmaps(u64 *sm_bmap, u64 *real_bmap, u64 chunks)
-{
-	unsigned long long bmap_size = sb->s_blocksize * chunks;
-
-	if (memcmp(sm_bmap, real_bmap, bmap_size) != 0)
-		report("Space manager", "bad allocation bitmap.");
-}
-
 /**
  * check_ip_free_next - Check the free_next field for the internal pool
  * @free_next:	256-bit field to check
@@ -620,14 +732,10 @@ static void compare_container_bitmaps(u64 *sm_bmap, u64 *real_bmap, u64 chunks)
  */
 static void check_ip_free_next(__le16 *free_next, u16 free_head, u16 free_len)
 {
-	int bmap_count = 16;
-	__le16 *expected;
+	const int bmap_count = 16;
+	__le16 expected[16];
 	u32 i;
 
-	expected = calloc(bmap_count, sizeof(*free_next));
-	if (!expected)
-		system_error();
-
 	/*
 	 * Ip bitmap blocks are marked with numbers 1,2,3,...,14,15,0 in
 	 * free_next, except when they are in use: those get overwritten with
@@ -691,8 +799,6 @@ static u64 parse_ip_bitmap_list(struct apfs_spaceman_phys *raw)
 
 	free_next = spaceman_256_from_off(raw, le32_to_cpu(raw->sm_ip_bm_free_next_offset));
 	check_ip_free_next((__le16 *)free_next, free_head, free_length);
-
-	container_bmap_mark_as_used(bmap_base, bmap_length);
 	return bmap_base + bmap_off;
 }
 
@@ -714,10 +820,7 @@ static void check_ip_bitmap_blocks(struct apfs_spaceman_phys *raw)
 		char *bmap;
 		int edge, j;
 
-		bmap = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			    fd, (bmap_base + i) * sb->s_blocksize);
-		if (bmap == MAP_FAILED)
-			system_error();
+		bmap = read_block(bmap_base + i);
 
 		/*
 		 * The edge is the last byte inside the allocation bitmap;
@@ -730,15 +833,30 @@ static void check_ip_bitmap_blocks(struct apfs_spaceman_phys *raw)
 			if (bmap[edge] & flag)
 				report("Internal pool", "non-zeroed bitmap.");
 		}
-		for (j = edge + 1; j < sb->s_blocksize; ++j) {
+		for (j = edge + 1; j < curr_sb()->s_blocksize; ++j) {
 			if (bmap[j])
 				report("Internal pool", "non-zeroed bitmap.");
 		}
 
-		munmap(bmap, sb->s_blocksize);
+		release_block(bmap);
 	}
 }
 
+/**
+ * mark_internal_pool - Mark the internal pool as used in the container bitmap
+ * @raw:	pointer to the raw space manager
+ *
+ * This covers both the pool itself and the area for its bitmaps.  It must be
+ * done before the chunk bitmaps get checked.
+ */
+static void mark_internal_pool(struct apfs_spaceman_phys *raw)
+{
+	container_bmap_mark_as_used(le64_to_cpu(raw->sm_ip_bm_base),
+				    le32_to_cpu(raw->sm_ip_bm_block_count));
+	container_bmap_mark_as_used(le64_to_cpu(raw->sm_ip_base),
+				    le64_to_cpu(raw->sm_ip_block_count));
+}
+
 /**
  * check_internal_pool - Check the internal pool of blocks
  * @raw:	pointer to the raw space manager
@@ -746,28 +864,23 @@ static void check_ip_bitmap_blocks(struct apfs_spaceman_phys *raw)
 static void check_internal_pool(struct apfs_spaceman_phys *raw)
 {
 	u64 *pool_bmap;
-	u64 pool_base = le64_to_cpu(raw->sm_ip_base);
 	u64 pool_blocks = le64_to_cpu(raw->sm_ip_block_count);
-	u64 ip_chunk_count = DIV_ROUND_UP(pool_blocks, 8 * sb->s_blocksize);
+	u64 ip_chunk_count = DIV_ROUND_UP(pool_blocks, 8 * curr_sb()->s_blocksize);
 	u64 xid;
 
-	pool_bmap = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			 fd, parse_ip_bitmap_list(raw) * sb->s_blocksize);
-	if (pool_bmap == MAP_FAILED)
-		system_error();
+	pool_bmap = read_block(parse_ip_bitmap_list(raw));
 
-	if (memcmp(pool_bmap, sb->s_ip_bitmap, ip_chunk_count * sb->s_blocksize))
+	if (memcmp(pool_bmap, curr_sb()->s_ip_bitmap, ip_chunk_count * curr_sb()->s_blocksize))
 		report("Space manager", "bad ip allocation bitmap.");
-	container_bmap_mark_as_used(pool_base, pool_blocks);
 
-	munmap(pool_bmap, sb->s_blocksize);
+	release_block(pool_bmap);
 
 	if (le32_to_cpu(raw->sm_ip_bm_tx_multiplier) !=
 					APFS_SPACEMAN_IP_BM_TX_MULTIPLIER)
 		report("Space manager", "bad tx multiplier for internal pool.");
 
 	xid = spaceman_val_from_off(raw, le32_to_cpu(raw->sm_ip_bm_xid_offset));
-	if (xid > sb->s_xid)
+	if (xid > curr_sb()->s_xid)
 		report("Internal pool", "bad transaction id.");
 
 	check_ip_bitmap_blocks(raw);
@@ -779,7 +892,7 @@ static void check_internal_pool(struct apfs_spaceman_phys *raw)
  */
 void check_spaceman(u64 oid)
 {
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	struct object obj;
 	struct apfs_spaceman_phys *raw;
 	u64 ip_chunk_count;
@@ -794,10 +907,10 @@ void check_spaceman(u64 oid)
 
 	sm->sm_ip_base = le64_to_cpu(raw->sm_ip_base);
 	sm->sm_ip_block_count = le64_to_cpu(raw->sm_ip_block_count);
-	ip_chunk_count = DIV_ROUND_UP(sm->sm_ip_block_count, 8 * sb->s_blocksize);
-	sb->s_ip_bitmap = calloc(ip_chunk_count, sb->s_blocksize);
-	if (!sb->s_ip_bitmap)
-		system_error();
+	ip_chunk_count = DIV_ROUND_UP(sm->sm_ip_block_count, 8 * curr_sb()->s_blocksize);
+	/* The chunk bitmaps and chunk-info blocks are in the internal pool */
+	cache_willneed(sm->sm_ip_base, sm->sm_ip_block_count);
+	curr_sb()->s_ip_bitmap = huge_calloc(ip_chunk_count, curr_sb()->s_blocksize);
 
 	flags = le32_to_cpu(raw->sm_flags);
 	if ((flags & APFS_SM_FLAGS_VALID_MASK) != flags)
@@ -814,20 +927,21 @@ void check_spaceman(u64 oid)
 				     sizeof(raw->sm_version);
 	}
 
-	if (le32_to_cpu(raw->sm_block_size) != sb->s_blocksize)
+	if (le32_to_cpu(raw->sm_block_size) != curr_sb()->s_blocksize)
 		report("Space manager", "wrong block size.");
 	parse_spaceman_chunk_counts(raw);
 
-	/* All bitmaps will need to be read into memory */
-	sm->sm_bitmap = calloc(sm->sm_chunk_count, sb->s_blocksize);
-	if (!sm->sm_bitmap)
-		system_error();
-
+	/*
+	 * The free queues and the internal pool are the last blocks to be
+	 * marked in the container bitmap; after that, each chunk bitmap can
+	 * be verified as soon as it's read.
+	 */
+	check_spaceman_free_queues(raw->sm_fq);
+	mark_internal_pool(raw);
 	parse_spaceman_main_device(raw);
 	check_spaceman_tier2_device(raw);
-	check_spaceman_free_queues(raw->sm_fq);
 	check_internal_pool(raw);
-	free(sb->s_ip_bitmap);
+	huge_free(curr_sb()->s_ip_bitmap);
 
 	if (le64_to_cpu(raw->sm_fs_reserve_block_count) != sm->sm_reserve_block_num)
 		report("Space manager", "wrong block reservation total.");
@@ -835,10 +949,7 @@ void check_spaceman(u64 oid)
 		report("Space manager", "wrong reserve block allocation total.");
 	if (sm->sm_reserve_block_num - sm->sm_reserve_alloc_num > sm->sm_free)
 		report("Space manager", "block reservation not respected.");
-
-	compare_container_bitmaps(sm->sm_bitmap, sb->s_bitmap,
-				  sm->sm_chunk_count);
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 }
 
 /**
@@ -880,17 +991,17 @@ void parse_free_queue_record(struct apfs_spaceman_free_queue_key *key,
 		report("Free queue record", "range should be outside the IP.");
 
 	xid = le64_to_cpu(key->sfqk_xid);
-	if (xid > sb->s_xid)
+	if (xid > curr_sb()->s_xid)
 		report("Free queue record", "bad transaction id.");
 	if (!sfq->sfq_oldest_xid || xid < sfq->sfq_oldest_xid)
 		sfq->sfq_oldest_xid = xid;
 
 	/*
 	 * These blocks are free, but still not marked as such.  The point
-	 * seems to be the preservation of recent checkpoints.
+	 * seems to be the preservation of recent checkpoints.  The records are
+	 * sorted by xid, so their ranges get marked later, in block order.
 	 */
-	if (inside_ip)
-		ip_bmap_mark_as_used(paddr, length);
-	else
-		container_bmap_mark_as_used(paddr, length);
+	if (!inside_ip && (paddr + length > curr_sb()->s_block_count || paddr + length < paddr))
+		report(NULL /* context */, "Out-of-range block number.");
+	bmap_log_append(&sfq->sfq_ranges, paddr, length);
 }
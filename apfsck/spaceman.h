@@ -13,7 +13,6 @@ struct apfs_spaceman_free_queue_key;
 
 /* Space manager data in memory */
 struct spaceman {
-	void *sm_bitmap; /* Allocation bitmap for the whole container */
 	struct free_queue *sm_ip_fq; /* Free queue for internal pool */
 	struct free_queue *sm_main_fq; /* Free queue for main device */
 	int sm_struct_size; /* Size of the spaceman structure on disk */
@@ -36,6 +35,20 @@ struct spaceman {
 	u64 sm_reserve_alloc_num; /* Blocks already alloced by those volumes */
 };
 
+/*
+ * Bitmap updates that are kept aside.  A checker thread keeps them until all
+ * threads are done, and then they are replayed in a predictable order; a free
+ * queue keeps them until its whole tree is parsed, to mark them in bulk.
+ */
+struct bmap_log {
+	struct bmap_log_entry {
+		u64 e_paddr;	/* First block number */
+		u64 e_length;	/* Block count */
+	} *l_entries;
+	u64 l_count;		/* Number of entries in use */
+	u64 l_size;		/* Number of entries allocated */
+};
+
 /*
  * Free queue data in memory.  This is a subclass of struct btree; a free queue
  * btree can simply be cast to a free_queue structure.
@@ -48,8 +61,12 @@ struct free_queue {
 	/* Free queue stats as measured by the fsck */
 	u64 sfq_count;		/* Total count of free blocks in the queue */
 	u64 sfq_oldest_xid;	/* First transaction id in the queue */
+
+	/* Ranges in the queue, to be marked as used once they are all found */
+	struct bmap_log sfq_ranges;
 };
 
+extern void replay_bmap_log(struct bmap_log *log);
 extern void container_bmap_mark_as_used(u64 paddr, u64 length);
 extern void ip_bmap_mark_as_used(u64 paddr, u64 length);
 extern void check_spaceman(u64 oid);
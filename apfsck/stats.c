@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Timers and counters for the work done by the check, to find out where the
+ * time goes for a given container.  Everything is a no-op unless the user
+ * asked for the statistics, and even then the cost is a clock read for each
+ * phase and an atomic add for each counter.  Phases that run in parallel on
+ * several threads have their times added together.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "btree.h"
+#include "progress.h"
+#include "stats.h"
+#include "super.h"
+
+int stats_format;
+bool stats_shape;
+u64 stats_counters[STAT_COUNTER_COUNT];
+
+static u64 stats_phase_ns[STAT_PHASE_COUNT];
+static int stats_tlb_fd = -1;	/* Hardware counter for the TLB misses */
+static struct stat_volume stats_volumes[APFS_NX_MAX_FILE_SYSTEMS];
+
+const char *const stats_phase_names[STAT_PHASE_COUNT] = {
+	[STAT_CHECKPOINTS]	= "checkpoints",
+	[STAT_SPACEMAN]		= "spaceman",
+	[STAT_OMAP]		= "omap",
+	[STAT_CATALOG]		= "catalog",
+	[STAT_EXTENTREF]	= "extentref",
+	[STAT_SNAPSHOTS]	= "snapshots",
+	[STAT_TABLES]		= "tables",
+};
+
+static const char *const stats_counter_names[STAT_COUNTER_COUNT] = {
+	[STAT_BLOCKS_READ]	= "blocks_read",
+	[STAT_BYTES_READ]	= "bytes_read",
+	[STAT_SYSCALLS]		= "syscalls",
+	[STAT_CACHE_HITS]	= "cache_hits",
+	[STAT_CACHE_MISSES]	= "cache_misses",
+	[STAT_PREFETCHES]	= "prefetches",
+	[STAT_CKSUM_BLOCKS]	= "checksum_blocks",
+	[STAT_CKSUM_NS]		= "checksum_ns",
+	[STAT_PRESCAN_BLOCKS]	= "prescan_blocks",
+	[STAT_HTABLE_LOOKUPS]	= "htable_lookups",
+	[STAT_HTABLE_PROBES]	= "htable_probes",
+	[STAT_HTABLE_MAX_PROBE]	= "htable_max_probe",
+	[STAT_HUGE_BYTES]	= "hugepage_bytes",
+	[STAT_HUGE_FALLBACKS]	= "huge_fallbacks",
+	[STAT_DTLB_MISSES]	= "dtlb_misses",
+};
+
+/**
+ * stats_start - Start measuring a check
+ *
+ * Returns the start time, as stats_now() would.  The TLB misses are counted
+ * from here on, for all threads, if the kernel and the hardware allow it.
+ */
+u64 stats_start(void)
+{
+	struct perf_event_attr attr = {0};
+
+	if (!stats_format)
+		return 0;
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		      PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1; /* The threads get added once they exit */
+	stats_tlb_fd = syscall(SYS_perf_event_open, &attr, 0 /* pid */, -1 /* cpu */,
+			       -1 /* group */, PERF_FLAG_FD_CLOEXEC);
+	return stats_now();
+}
+
+/**
+ * stats_read_tlb - Read the TLB misses into their counter, and stop counting
+ */
+static void stats_read_tlb(void)
+{
+	u64 misses;
+
+	/* Not supported, so the counter just stays at zero */
+	if (stats_tlb_fd == -1)
+		return;
+	if (read(stats_tlb_fd, &misses, sizeof(misses)) == sizeof(misses))
+		stats_counters[STAT_DTLB_MISSES] = misses;
+	close(stats_tlb_fd);
+	stats_tlb_fd = -1;
+}
+
+/**
+ * stats_max - Raise one of the counters to a given value, if it's lower
+ * @counter:	the counter
+ * @n:		the value
+ */
+void stats_max(enum stat_counter counter, u64 n)
+{
+	u64 old;
+
+	if (!stats_format)
+		return;
+	old = __atomic_load_n(&stats_counters[counter], __ATOMIC_RELAXED);
+	while (old < n) {
+		if (__atomic_compare_exchange_n(&stats_counters[counter], &old, n, true /* weak */,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/**
+ * stats_start_phase - Start the timer for a phase
+ * @phase: the phase
+ *
+ * Returns the start time, as stats_now() would.  The phase is also shown in
+ * the progress reports from then on.
+ */
+u64 stats_start_phase(enum stat_phase phase)
+{
+	progress_set_phase(phase);
+	return stats_now();
+}
+
+/**
+ * stats_end_phase - Add the time since the start of a phase to its timer
+ * @phase:	the phase
+ * @start:	start time, as returned by stats_now()
+ *
+ * The time is also added to the current volume, if any.
+ */
+void stats_end_phase(enum stat_phase phase, u64 start)
+{
+	u64 elapsed;
+
+	if (!stats_format)
+		return;
+	elapsed = stats_now() - start;
+	__atomic_fetch_add(&stats_phase_ns[phase], elapsed, __ATOMIC_RELAXED);
+	if (curr_vsb())
+		__atomic_fetch_add(&stats_volumes[curr_vsb()->v_index].sv_phase_ns[phase],
+				   elapsed, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_shape_leaf - Add the seek to a leaf to the shape of its tree
+ * @shape:	shape of the tree
+ * @bno:	block number of the leaf
+ *
+ * The leaves must be added in key order.
+ */
+void stats_shape_leaf(struct stat_shape *shape, u64 bno)
+{
+	u64 dist;
+
+	if (shape->sh_last_leaf) {
+		dist = bno > shape->sh_last_leaf ? bno - shape->sh_last_leaf : shape->sh_last_leaf - bno;
+		++shape->sh_seeks[stats_log_bucket(dist)];
+		shape->sh_seek_blocks += dist;
+	} else {
+		shape->sh_first_leaf = bno;
+	}
+	shape->sh_last_leaf = bno;
+}
+
+/**
+ * stats_shape_merge - Add the shape of part of a tree to the whole
+ * @shape:	shape of the tree
+ * @part:	shape of the part, which comes after the rest in key order
+ */
+void stats_shape_merge(struct stat_shape *shape, struct stat_shape *part)
+{
+	int i;
+
+	/* The seek from the last leaf so far to the first one of the part */
+	if (part->sh_first_leaf)
+		stats_shape_leaf(shape, part->sh_first_leaf);
+
+	for (i = 0; i < SHAPE_LEVELS; ++i)
+		shape->sh_levels[i] += part->sh_levels[i];
+	for (i = 0; i < SHAPE_FILL_BUCKETS; ++i)
+		shape->sh_fill[i] += part->sh_fill[i];
+	for (i = 0; i < SHAPE_LOG_BUCKETS; ++i) {
+		shape->sh_key_sizes[i] += part->sh_key_sizes[i];
+		shape->sh_val_sizes[i] += part->sh_val_sizes[i];
+		shape->sh_seeks[i] += part->sh_seeks[i];
+	}
+	shape->sh_space += part->sh_space;
+	shape->sh_used += part->sh_used;
+	shape->sh_free_gap += part->sh_free_gap;
+	shape->sh_free_toc += part->sh_free_toc;
+	shape->sh_free_listed += part->sh_free_listed;
+	shape->sh_seek_blocks += part->sh_seek_blocks;
+	if (part->sh_last_leaf)
+		shape->sh_last_leaf = part->sh_last_leaf;
+}
+
+/**
+ * stats_tree - Get the size of one of the trees of the current volume
+ * @btree: the tree (may be NULL)
+ */
+static struct stat_tree stats_tree(struct btree *btree)
+{
+	struct stat_tree tree = {0};
+
+	if (btree) {
+		tree.t_nodes = btree->node_count;
+		tree.t_keys = btree->key_count;
+		tree.t_shape = btree->shape;
+	}
+	return tree;
+}
+
+/**
+ * stats_volume_trees - Record the label and tree sizes for the current volume
+ *
+ * With several checkpoints, only the last one is kept.
+ */
+void stats_volume_trees(void)
+{
+	struct stat_volume *vol;
+
+	if (!stats_format)
+		return;
+	vol = &stats_volumes[curr_vsb()->v_index];
+	vol->sv_seen = true;
+	/* The on-disk label may lack the null termination if it's corrupted */
+	snprintf(vol->sv_name, sizeof(vol->sv_name), "%.*s",
+		 (int)sizeof(vol->sv_name) - 1, (char *)curr_vsb()->v_raw->apfs_volname);
+	vol->sv_omap = stats_tree(curr_vsb()->v_omap);
+	vol->sv_cat = stats_tree(curr_vsb()->v_cat);
+	vol->sv_extref = stats_tree(curr_vsb()->v_extent_ref);
+}
+
+/**
+ * stats_peak_rss - Get the peak resident set size of the process, in KiB
+ */
+static u64 stats_peak_rss(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+	return usage.ru_maxrss;
+}
+
+/**
+ * print_json_string - Print a string in JSON format, quoted and escaped
+ * @f:		stream to print to
+ * @str:	the string
+ */
+void print_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; ++str) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * hist_len - Get the length of a histogram, without the empty buckets at the end
+ * @hist:	the histogram
+ * @count:	number of buckets
+ */
+static int hist_len(u64 *hist, int count)
+{
+	while (count && !hist[count - 1])
+		--count;
+	return count;
+}
+
+/**
+ * print_json_hist - Print a histogram as a JSON array
+ * @name:	name of the histogram
+ * @hist:	the histogram
+ * @count:	number of buckets
+ */
+static void print_json_hist(const char *name, u64 *hist, int count)
+{
+	int i;
+
+	fprintf(stderr, "\"%s\": [", name);
+	count = hist_len(hist, count);
+	for (i = 0; i < count; ++i)
+		fprintf(stderr, "%s%llu", i ? ", " : "", (unsigned long long)hist[i]);
+	fprintf(stderr, "]");
+}
+
+/**
+ * print_json_shape - Print the shape of a tree in JSON format
+ * @shape: the shape
+ */
+static void print_json_shape(struct stat_shape *shape)
+{
+	fprintf(stderr, ", \"shape\": {");
+	print_json_hist("levels", shape->sh_levels, SHAPE_LEVELS);
+	fprintf(stderr, ", ");
+	print_json_hist("fill", shape->sh_fill, SHAPE_FILL_BUCKETS);
+	fprintf(stderr, ", \"space\": %llu, \"used\": %llu, \"free_gap\": %llu, \"free_toc\": %llu, \"free_listed\": %llu, ",
+		(unsigned long long)shape->sh_space, (unsigned long long)shape->sh_used,
+		(unsigned long long)shape->sh_free_gap, (unsigned long long)shape->sh_free_toc,
+		(unsigned long long)shape->sh_free_listed);
+	print_json_hist("key_sizes", shape->sh_key_sizes, SHAPE_LOG_BUCKETS);
+	fprintf(stderr, ", ");
+	print_json_hist("value_sizes", shape->sh_val_sizes, SHAPE_LOG_BUCKETS);
+	fprintf(stderr, ", ");
+	print_json_hist("leaf_seeks", shape->sh_seeks, SHAPE_LOG_BUCKETS);
+	fprintf(stderr, ", \"seek_blocks\": %llu}", (unsigned long long)shape->sh_seek_blocks);
+}
+
+/**
+ * print_json_tree - Print the size of a tree in JSON format
+ * @name:	name of the tree
+ * @tree:	the size
+ * @last:	is this the last tree for the volume?
+ */
+static void print_json_tree(const char *name, struct stat_tree *tree, bool last)
+{
+	fprintf(stderr, "\"%s\": {\"nodes\": %llu, \"keys\": %llu", name,
+		(unsigned long long)tree->t_nodes, (unsigned long long)tree->t_keys);
+	if (stats_shape)
+		print_json_shape(&tree->t_shape);
+	fprintf(stderr, "}%s", last ? "" : ", ");
+}
+
+/**
+ * stats_print_json - Print all statistics in JSON format
+ * @total: wall time for the whole check, in nanoseconds
+ */
+static void stats_print_json(u64 total)
+{
+	bool first = true;
+	int i, vol;
+
+	fprintf(stderr, "{\"total_ns\": %llu, \"peak_rss_kib\": %llu,\n",
+		(unsigned long long)total, (unsigned long long)stats_peak_rss());
+
+	fprintf(stderr, " \"phases_ns\": {");
+	for (i = 0; i < STAT_PHASE_COUNT; ++i)
+		fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", stats_phase_names[i],
+			(unsigned long long)stats_phase_ns[i]);
+	fprintf(stderr, "},\n");
+
+	fprintf(stderr, " \"counters\": {");
+	for (i = 0; i < STAT_COUNTER_COUNT; ++i)
+		fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", stats_counter_names[i],
+			(unsigned long long)stats_counters[i]);
+	fprintf(stderr, "},\n");
+
+	fprintf(stderr, " \"volumes\": [");
+	for (vol = 0; vol < APFS_NX_MAX_FILE_SYSTEMS; ++vol) {
+		struct stat_volume *sv = &stats_volumes[vol];
+
+		if (!sv->sv_seen)
+			continue;
+		fprintf(stderr, "%s\n  {\"index\": %d, \"name\": ", first ? "" : ",", vol);
+		print_json_string(stderr, sv->sv_name);
+		fprintf(stderr, ", \"phases_ns\": {");
+		for (i = 0; i < STAT_PHASE_COUNT; ++i) {
+			if (i == STAT_CHECKPOINTS || i == STAT_SPACEMAN)
+				continue;
+			fprintf(stderr, "%s\"%s\": %llu", i == STAT_OMAP ? "" : ", ",
+				stats_phase_names[i], (unsigned long long)sv->sv_phase_ns[i]);
+		}
+		fprintf(stderr, "}, \"trees\": {");
+		print_json_tree("omap", &sv->sv_omap, false);
+		print_json_tree("catalog", &sv->sv_cat, false);
+		print_json_tree("extentref", &sv->sv_extref, true);
+		fprintf(stderr, "}}");
+		first = false;
+	}
+	fprintf(stderr, "%s]}\n", first ? "" : "\n ");
+}
+
+/**
+ * print_text_hist - Print the nonempty buckets of a histogram, in a single line
+ * @name:	name of the histogram
+ * @hist:	the histogram
+ * @count:	number of buckets
+ * @scale:	factor for the bucket labels, or zero for powers of two
+ * @unit:	suffix for the bucket labels
+ */
+static void print_text_hist(const char *name, u64 *hist, int count, int scale,
+			    const char *unit)
+{
+	unsigned long long label;
+	bool first = true;
+	int i;
+
+	fprintf(stderr, "    %-14s", name);
+	for (i = 0; i < count; ++i) {
+		if (!hist[i])
+			continue;
+		if (scale)
+			label = (unsigned long long)i * scale;
+		else
+			label = i ? 1ULL << (i - 1) : 0;
+		fprintf(stderr, "%s%llu%s: %llu", first ? " " : ", ", label, unit,
+			(unsigned long long)hist[i]);
+		first = false;
+	}
+	fprintf(stderr, "%s\n", first ? " none" : "");
+}
+
+/**
+ * print_text_shape - Print the shape of a tree in a human-readable format
+ * @name:	name of the tree
+ * @shape:	the shape
+ */
+static void print_text_shape(const char *name, struct stat_shape *shape)
+{
+	u64 seeks = 0, free;
+	int i;
+
+	for (i = 0; i < SHAPE_LOG_BUCKETS; ++i)
+		seeks += shape->sh_seeks[i];
+	free = shape->sh_free_gap + shape->sh_free_toc + shape->sh_free_listed;
+
+	fprintf(stderr, "  %s shape:\n", name);
+	print_text_hist("levels", shape->sh_levels, SHAPE_LEVELS, 1, "");
+	print_text_hist("fill", shape->sh_fill, SHAPE_FILL_BUCKETS, 100 / SHAPE_FILL_BUCKETS, "%");
+	fprintf(stderr, "    %-14s %.1f%% used, free %llu gap %llu toc %llu listed (%.1f%% listed)\n",
+		"space", shape->sh_space ? 100.0 * shape->sh_used / shape->sh_space : 0.0,
+		(unsigned long long)shape->sh_free_gap, (unsigned long long)shape->sh_free_toc,
+		(unsigned long long)shape->sh_free_listed,
+		free ? 100.0 * shape->sh_free_listed / free : 0.0);
+	print_text_hist("key sizes", shape->sh_key_sizes, SHAPE_LOG_BUCKETS, 0, "");
+	print_text_hist("value sizes", shape->sh_val_sizes, SHAPE_LOG_BUCKETS, 0, "");
+	print_text_hist("leaf seeks", shape->sh_seeks, SHAPE_LOG_BUCKETS, 0, "");
+	fprintf(stderr, "    %-14s %.1f blocks\n", "average seek",
+		seeks ? (double)shape->sh_seek_blocks / seeks : 0.0);
+}
+
+/**
+ * stats_print_text - Print all statistics in a human-readable format
+ * @total: wall time for the whole check, in nanoseconds
+ */
+static void stats_print_text(u64 total)
+{
+	int i, vol;
+
+	fprintf(stderr, "Total time: %.3f s, peak memory: %llu KiB\n",
+		total / 1e9, (unsigned long long)stats_peak_rss());
+
+	fprintf(stderr, "Phases (summed over all threads):\n");
+	for (i = 0; i < STAT_PHASE_COUNT; ++i)
+		fprintf(stderr, "  %-16s %12.3f ms\n", stats_phase_names[i], stats_phase_ns[i] / 1e6);
+
+	fprintf(stderr, "Counters:\n");
+	for (i = 0; i < STAT_COUNTER_COUNT; ++i)
+		fprintf(stderr, "  %-16s %15llu\n", stats_counter_names[i],
+			(unsigned long long)stats_counters[i]);
+
+	for (vol = 0; vol < APFS_NX_MAX_FILE_SYSTEMS; ++vol) {
+		struct stat_volume *sv = &stats_volumes[vol];
+
+		if (!sv->sv_seen)
+			continue;
+		fprintf(stderr, "Volume %d (%s):\n", vol, sv->sv_name);
+		for (i = STAT_OMAP; i < STAT_PHASE_COUNT; ++i)
+			fprintf(stderr, "  %-16s %12.3f ms\n", stats_phase_names[i], sv->sv_phase_ns[i] / 1e6);
+		fprintf(stderr, "  %-16s %12llu nodes %12llu keys\n", "omap tree",
+			(unsigned long long)sv->sv_omap.t_nodes, (unsigned long long)sv->sv_omap.t_keys);
+		fprintf(stderr, "  %-16s %12llu nodes %12llu keys\n", "catalog tree",
+			(unsigned long long)sv->sv_cat.t_nodes, (unsigned long long)sv->sv_cat.t_keys);
+		fprintf(stderr, "  %-16s %12llu nodes %12llu keys\n", "extentref tree",
+			(unsigned long long)sv->sv_extref.t_nodes, (unsigned long long)sv->sv_extref.t_keys);
+		if (stats_shape) {
+			print_text_shape("omap tree", &sv->sv_omap.t_shape);
+			print_text_shape("catalog tree", &sv->sv_cat.t_shape);
+			print_text_shape("extentref tree", &sv->sv_extref.t_shape);
+		}
+	}
+}
+
+/**
+ * stats_print - Print all statistics in the format requested by the user
+ * @start: start time for the whole check, as returned by stats_now()
+ *
+ * The statistics go to standard error, so that they don't get mixed with the
+ * reports.
+ */
+void stats_print(u64 start)
+{
+	u64 total = stats_now() - start;
+
+	stats_read_tlb();
+	if (stats_format == STATS_JSON)
+		stats_print_json(total);
+	else if (stats_format == STATS_TEXT)
+		stats_print_text(total);
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include <apfs/raw.h>
+#include <apfs/types.h>
+
+/* Output formats for the statistics */
+#define STATS_NONE	0
+#define STATS_TEXT	1
+#define STATS_JSON	2
+
+/*
+ * Phases of the check that get timed.  Phases for a volume only count the
+ * latest transaction, its snapshots are all added to STAT_SNAPSHOTS.
+ */
+enum stat_phase {
+	STAT_CHECKPOINTS,	/* Checkpoint descriptors and superblocks */
+	STAT_SPACEMAN,		/* Space manager */
+	STAT_OMAP,		/* Object maps of the volumes */
+	STAT_CATALOG,		/* Catalogs of the volumes */
+	STAT_EXTENTREF,		/* Extent reference trees of the volumes */
+	STAT_SNAPSHOTS,		/* Snapshots of the volumes */
+	STAT_TABLES,		/* Final checks on the in-memory tables */
+	STAT_PHASE_COUNT
+};
+
+/*
+ * Counters for the whole run
+ */
+enum stat_counter {
+	STAT_BLOCKS_READ,	/* Blocks read from the device */
+	STAT_BYTES_READ,	/* Bytes read from the device */
+	STAT_SYSCALLS,		/* System calls for reads */
+	STAT_CACHE_HITS,	/* Blocks found in the cache */
+	STAT_CACHE_MISSES,	/* Blocks missing from the cache */
+	STAT_PREFETCHES,	/* Reads started ahead of time */
+	STAT_CKSUM_BLOCKS,	/* Objects with a verified checksum */
+	STAT_CKSUM_NS,		/* Time spent on the checksums */
+	STAT_PRESCAN_BLOCKS,	/* Checksums verified ahead of time */
+	STAT_HTABLE_LOOKUPS,	/* Hash table lookups */
+	STAT_HTABLE_PROBES,	/* Slots probed beyond the first one */
+	STAT_HTABLE_MAX_PROBE,	/* Longest probe sequence */
+	STAT_HUGE_BYTES,	/* Bytes allocated on huge pages */
+	STAT_HUGE_FALLBACKS,	/* Allocations that got regular pages instead */
+	STAT_DTLB_MISSES,	/* Data TLB misses in user space, if measurable */
+	STAT_COUNTER_COUNT
+};
+
+/* Number of buckets for the histograms of the b-tree shape */
+#define SHAPE_LEVELS		16	/* One per level, the last takes the rest */
+#define SHAPE_FILL_BUCKETS	10	/* One per tenth of the node space */
+#define SHAPE_LOG_BUCKETS	40	/* Zero, and then one per power of two */
+
+/*
+ * Shape of a b-tree, for the analytics report.  In the histograms of sizes and
+ * distances, bucket 0 is for zero and bucket n is for [2^(n-1), 2^n).
+ */
+struct stat_shape {
+	u64	sh_levels[SHAPE_LEVELS];	/* Nodes at each level */
+	u64	sh_fill[SHAPE_FILL_BUCKETS];	/* Nodes by fill factor */
+	u64	sh_space;	/* Space for entries in all nodes, in bytes */
+	u64	sh_used;	/* Space taken by the entries */
+	u64	sh_free_gap;	/* Free space between the key and value areas */
+	u64	sh_free_toc;	/* Unused slots in the tables of contents */
+	u64	sh_free_listed;	/* Free space in the free lists */
+	u64	sh_key_sizes[SHAPE_LOG_BUCKETS];	/* Keys by length */
+	u64	sh_val_sizes[SHAPE_LOG_BUCKETS];	/* Leaf values by length */
+	u64	sh_seeks[SHAPE_LOG_BUCKETS];	/* Leaves by distance to the last */
+	u64	sh_seek_blocks;	/* Sum of those distances */
+	u64	sh_first_leaf;	/* Block number of the first leaf, or zero */
+	u64	sh_last_leaf;	/* Block number of the last leaf, or zero */
+};
+
+/*
+ * Size of one of the trees of a volume
+ */
+struct stat_tree {
+	u64			t_nodes;	/* Number of nodes */
+	u64			t_keys;		/* Number of keys */
+	struct stat_shape	t_shape;	/* Only set for the analytics */
+};
+
+/*
+ * Statistics for a single volume
+ */
+struct stat_volume {
+	bool			sv_seen;		/* Was the volume checked? */
+	char			sv_name[APFS_VOLNAME_LEN];	/* Label */
+	u64			sv_phase_ns[STAT_PHASE_COUNT];	/* Phase times */
+	struct stat_tree	sv_omap;		/* Object map */
+	struct stat_tree	sv_cat;			/* Catalog */
+	struct stat_tree	sv_extref;		/* Extent reference tree */
+};
+
+extern int stats_format;	/* Output format for the statistics */
+extern const char *const stats_phase_names[STAT_PHASE_COUNT];
+extern bool stats_shape;	/* Report the shape of the trees? */
+extern u64 stats_counters[STAT_COUNTER_COUNT];
+
+/**
+ * stats_now - Get the current time for one of the timers
+ *
+ * Returns the time in nanoseconds, or zero if no statistics were requested.
+ */
+static inline u64 stats_now(void)
+{
+	struct timespec ts;
+
+	if (!stats_format)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * stats_add - Add to one of the counters
+ * @counter:	the counter
+ * @n:		amount to add
+ */
+static inline void stats_add(enum stat_counter counter, u64 n)
+{
+	if (stats_format)
+		__atomic_fetch_add(&stats_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * stats_log_bucket - Find the histogram bucket for a size or distance
+ * @n: the size or distance
+ */
+static inline int stats_log_bucket(u64 n)
+{
+	int bucket = n ? 64 - __builtin_clzll(n) : 0;
+
+	return bucket < SHAPE_LOG_BUCKETS ? bucket : SHAPE_LOG_BUCKETS - 1;
+}
+
+extern u64 stats_start(void);
+extern void stats_max(enum stat_counter counter, u64 n);
+extern u64 stats_start_phase(enum stat_phase phase);
+extern void stats_end_phase(enum stat_phase phase, u64 start);
+extern void stats_shape_leaf(struct stat_shape *shape, u64 bno);
+extern void stats_shape_merge(struct stat_shape *shape, struct stat_shape *part);
+extern void stats_volume_trees(void);
+extern void stats_print(u64 start);
+extern void print_json_string(FILE *f, const char *str);
+
+#endif	/* _STATS_H */
@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,18 +17,172 @@
 #include <apfs/types.h>
 #include "apfsck.h"
 #include "btree.h"
+#include "cache.h"
 #include "crypto.h"
 #include "dir.h"
+#include "errlog.h"
 #include "extents.h"
 #include "htable.h"
 #include "inode.h"
+#include "io.h"
+#include "journal.h"
 #include "object.h"
+#include "parallel.h"
+#include "prescan.h"
 #include "snapshot.h"
 #include "spaceman.h"
+#include "stats.h"
 #include "super.h"
 
-struct super_block *sb;
-struct volume_superblock *vsb;
+/* Protects the container state that is shared by all volumes */
+static pthread_mutex_t volume_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Volume selected by the user for a scoped check, by one of its attributes
+ */
+struct scope_volume {
+	enum { SCOPE_INDEX, SCOPE_UUID, SCOPE_ROLE } sv_kind;
+	u32 sv_index;		/* Index in the container's volume array */
+	char sv_uuid[16];	/* Volume uuid */
+	u16 sv_role;		/* Volume role */
+};
+
+static struct scope_volume *scope_volumes;
+static int scope_volume_count;
+
+bool scope_container_only;	/* Check only the container structures? */
+bool scope_latest_checkpoint;	/* Check older checkpoints only briefly? */
+long long scope_snapshots = -1;	/* Newest snapshots to check, or -1 for all */
+
+/* Names accepted for each volume role */
+static const struct {
+	const char *name;
+	u16 role;
+} scope_roles[] = {
+	{"none",	APFS_VOL_ROLE_NONE},
+	{"system",	APFS_VOL_ROLE_SYSTEM},
+	{"user",	APFS_VOL_ROLE_USER},
+	{"recovery",	APFS_VOL_ROLE_RECOVERY},
+	{"vm",		APFS_VOL_ROLE_VM},
+	{"preboot",	APFS_VOL_ROLE_PREBOOT},
+	{"installer",	APFS_VOL_ROLE_INSTALLER},
+	{"data",	APFS_VOL_ROLE_DATA},
+	{"baseband",	APFS_VOL_ROLE_BASEBAND},
+	{"update",	APFS_VOL_ROLE_UPDATE},
+	{"xart",	APFS_VOL_ROLE_XART},
+	{"hardware",	APFS_VOL_ROLE_HARDWARE},
+	{"backup",	APFS_VOL_ROLE_BACKUP},
+	{"enterprise",	APFS_VOL_ROLE_ENTERPRISE},
+	{"prelogin",	APFS_VOL_ROLE_PRELOGIN},
+};
+
+/**
+ * parse_scope_uuid - Parse a volume uuid given by the user
+ * @str:	the uuid, as 32 hexadecimal digits with optional dashes
+ * @uuid:	on return, the parsed uuid
+ *
+ * Returns false if @str is not a valid uuid.
+ */
+static bool parse_scope_uuid(const char *str, char uuid[16])
+{
+	int i = 0;
+
+	for (; *str && i < 16; ++i) {
+		if (*str == '-')
+			++str;
+		if (strspn(str, "0123456789abcdefABCDEF") < 2)
+			return false;
+		sscanf(str, "%2hhx", (unsigned char *)&uuid[i]);
+		str += 2;
+	}
+	return i == 16 && !*str;
+}
+
+/**
+ * add_scope_volume - Add a volume to the scope of the check
+ * @spec: index, uuid or role name for the volume
+ *
+ * Returns false if @spec is not valid.
+ */
+bool add_scope_volume(const char *spec)
+{
+	struct scope_volume *sv;
+	char *endptr;
+	unsigned long index;
+	int i;
+
+	scope_volumes = realloc(scope_volumes, (scope_volume_count + 1) * sizeof(*scope_volumes));
+	if (!scope_volumes)
+		system_error();
+	sv = &scope_volumes[scope_volume_count];
+
+	index = strtoul(spec, &endptr, 10);
+	if (*spec && !*endptr) {
+		if (index >= APFS_NX_MAX_FILE_SYSTEMS)
+			return false;
+		sv->sv_kind = SCOPE_INDEX;
+		sv->sv_index = index;
+		++scope_volume_count;
+		return true;
+	}
+
+	for (i = 0; i < sizeof(scope_roles) / sizeof(scope_roles[0]); ++i) {
+		if (strcasecmp(spec, scope_roles[i].name) == 0) {
+			sv->sv_kind = SCOPE_ROLE;
+			sv->sv_role = scope_roles[i].role;
+			++scope_volume_count;
+			return true;
+		}
+	}
+
+	if (!parse_scope_uuid(spec, sv->sv_uuid))
+		return false;
+	sv->sv_kind = SCOPE_UUID;
+	++scope_volume_count;
+	return true;
+}
+
+/**
+ * scope_is_partial - Will some part of the filesystem be left unchecked?
+ */
+bool scope_is_partial(void)
+{
+	return scope_volume_count || scope_container_only || scope_snapshots >= 0;
+}
+
+/**
+ * volume_in_scope - Was the current volume selected for checking?
+ */
+static bool volume_in_scope(void)
+{
+	struct apfs_superblock *vsb_raw = curr_vsb()->v_raw;
+	int i;
+
+	if (scope_container_only)
+		return false;
+	if (!scope_volume_count)
+		return true;
+
+	for (i = 0; i < scope_volume_count; ++i) {
+		struct scope_volume *sv = &scope_volumes[i];
+
+		switch (sv->sv_kind) {
+		case SCOPE_INDEX:
+			if (sv->sv_index == curr_vsb()->v_index)
+				return true;
+			break;
+		case SCOPE_UUID:
+			if (memcmp(sv->sv_uuid, vsb_raw->apfs_vol_uuid, 16) == 0)
+				return true;
+			break;
+		case SCOPE_ROLE:
+			if (sv->sv_role == le16_to_cpu(vsb_raw->apfs_role))
+				return true;
+			break;
+		}
+	}
+	return false;
+}
 
 /**
  * is_power_of_two - Check if a number is a power of two
@@ -61,7 +216,7 @@ static inline unsigned int blksize_bits(unsigned int size)
 /**
  * read_super_copy - Read the copy of the container superblock in block 0
  *
- * Sets sb->s_blocksize and returns a pointer to the raw superblock in memory.
+ * Sets curr_sb()->s_blocksize and returns a pointer to the raw superblock in memory.
  */
 static struct apfs_nx_superblock *read_super_copy(void)
 {
@@ -75,19 +230,24 @@ static struct apfs_nx_superblock *read_super_copy(void)
 	bsize_tmp = APFS_NX_DEFAULT_BLOCK_SIZE;
 
 	msb_raw = mmap(NULL, bsize_tmp, PROT_READ, MAP_PRIVATE,
-		       fd, APFS_NX_BLOCK_NUM * bsize_tmp);
+		       curr_ctx->c_fd, APFS_NX_BLOCK_NUM * bsize_tmp);
 	if (msb_raw == MAP_FAILED)
 		system_error();
-	sb->s_blocksize = le32_to_cpu(msb_raw->nx_block_size);
-	sb->s_blocksize_bits = blksize_bits(sb->s_blocksize);
+	/* Don't let the fault read ahead into the page cache */
+	if (io_direct)
+		madvise(msb_raw, bsize_tmp, MADV_RANDOM);
+	curr_sb()->s_blocksize = le32_to_cpu(msb_raw->nx_block_size);
+	curr_sb()->s_blocksize_bits = blksize_bits(curr_sb()->s_blocksize);
 
-	if (sb->s_blocksize != bsize_tmp) {
+	if (curr_sb()->s_blocksize != bsize_tmp) {
 		munmap(msb_raw, bsize_tmp);
 
-		msb_raw = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			       fd, APFS_NX_BLOCK_NUM * sb->s_blocksize);
+		msb_raw = mmap(NULL, curr_sb()->s_blocksize, PROT_READ, MAP_PRIVATE,
+			       curr_ctx->c_fd, APFS_NX_BLOCK_NUM * curr_sb()->s_blocksize);
 		if (msb_raw == MAP_FAILED)
 			system_error();
+		if (io_direct)
+			madvise(msb_raw, curr_sb()->s_blocksize, MADV_RANDOM);
 	}
 
 	if (le32_to_cpu(msb_raw->nx_magic) != APFS_NX_MAGIC)
@@ -111,24 +271,24 @@ static struct apfs_nx_superblock *read_latest_super(u64 base, u32 blocks)
 	u64 xid = 0;
 	u64 bno;
 
-	assert(sb->s_blocksize);
+	assert(curr_sb()->s_blocksize);
 
 	for (bno = base; bno < base + blocks; ++bno) {
 		struct apfs_nx_superblock *current;
 
-		current = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			       fd, bno * sb->s_blocksize);
-		if (current == MAP_FAILED)
-			system_error();
+		current = read_block(bno);
 
-		if (le32_to_cpu(current->nx_magic) != APFS_NX_MAGIC)
-			continue; /* Not a superblock */
-		if (le64_to_cpu(current->nx_o.o_xid) <= xid)
-			continue; /* Old */
-		if (!obj_verify_csum(&current->nx_o))
-			continue; /* Corrupted */
+		if (le32_to_cpu(current->nx_magic) != APFS_NX_MAGIC ||
+		    le64_to_cpu(current->nx_o.o_xid) <= xid ||
+		    !obj_verify_csum(&current->nx_o)) {
+			/* Not a superblock, old or corrupted */
+			release_block(current);
+			continue;
+		}
 
 		xid = le64_to_cpu(current->nx_o.o_xid);
+		if (latest)
+			release_block(latest);
 		latest = current;
 	}
 
@@ -168,18 +328,18 @@ static void main_super_compare(struct apfs_nx_superblock *desc,
  * get_device_size - Get the block count of the device or image being checked
  * @blocksize: the filesystem blocksize
  */
-static u64 get_device_size(unsigned int blocksize)
+u64 get_device_size(unsigned int blocksize)
 {
 	struct stat buf;
 	u64 size;
 
-	if (fstat(fd, &buf))
+	if (fstat(curr_ctx->c_fd, &buf))
 		system_error();
 
 	if ((buf.st_mode & S_IFMT) == S_IFREG)
 		return buf.st_size / blocksize;
 
-	if (ioctl(fd, BLKGETSIZE64, &size))
+	if (ioctl(curr_ctx->c_fd, BLKGETSIZE64, &size))
 		system_error();
 	return size / blocksize;
 }
@@ -209,7 +369,8 @@ static void check_main_flags(u64 flags)
 		report("Container superblock", "invalid flag in use.");
 	if (flags & (APFS_NX_RESERVED_1 | APFS_NX_RESERVED_2))
 		report("Container superblock", "reserved flag in use.");
-	if (flags & APFS_NX_CRYPTO_SW)
+	/* Without a key encryption key, the volumes can't be decrypted */
+	if ((flags & APFS_NX_CRYPTO_SW) && !crypto_kek_count)
 		report_unknown("Software encryption");
 }
 
@@ -269,7 +430,7 @@ static void check_efi_information(u64 oid)
 	if (!oid) /* Not all containers can be booted from, of course */
 		return;
 
-	efi = read_object(oid, NULL /* omap_table */, &obj);
+	efi = read_object(oid, NULL /* omap_index */, &obj);
 	if (obj.type != APFS_OBJECT_TYPE_EFI_JUMPSTART)
 		report("EFI info", "wrong object type.");
 	if (obj.subtype != APFS_OBJECT_TYPE_INVALID)
@@ -285,7 +446,7 @@ static void check_efi_information(u64 oid)
 
 	num_extents = le32_to_cpu(efi->nej_num_extents);
 	if (sizeof(*efi) + num_extents * sizeof(efi->nej_rec_extents[0]) >
-								sb->s_blocksize)
+								curr_sb()->s_blocksize)
 		report("EFI info", "number of extents cannot fit.");
 	for (i = 0; i < num_extents; ++i) {
 		struct apfs_prange *ext = &efi->nej_rec_extents[i];
@@ -301,12 +462,12 @@ static void check_efi_information(u64 oid)
 	file_length = le32_to_cpu(efi->nej_efi_file_len);
 	if (!file_length)
 		report("EFI info", "driver is empty.");
-	if (file_length > block_count * sb->s_blocksize)
+	if (file_length > block_count * curr_sb()->s_blocksize)
 		report("EFI info", "driver doesn't fit in extents.");
-	if (file_length <= (block_count - 1) * sb->s_blocksize)
+	if (file_length <= (block_count - 1) * curr_sb()->s_blocksize)
 		report("EFI info", "wasted space in driver extents.");
 
-	munmap(efi, sb->s_blocksize);
+	release_block(efi);
 }
 
 /**
@@ -319,8 +480,8 @@ static void check_ephemeral_information(__le64 *info)
 	u64 container_size;
 	int i;
 
-	assert(sb->s_block_count);
-	container_size = sb->s_block_count * sb->s_blocksize;
+	assert(curr_sb()->s_block_count);
+	container_size = curr_sb()->s_block_count * curr_sb()->s_blocksize;
 
 	/* TODO: support for small containers is very important */
 	if (container_size < 128 * 1024 * 1024)
@@ -369,10 +530,10 @@ static void check_software_information(struct apfs_modified_by *formatted_by,
 
 	mods_over = false;
 	end_mod_by = modified_by + APFS_MAX_HIST;
-	xid = sb->s_xid + 1; /* Last possible xid */
+	xid = curr_ctx->c_xid + 1; /* Last possible xid */
 
-	vsb->v_first_xid = le64_to_cpu(formatted_by->last_xid);
-	vsb->v_last_xid = vsb->v_first_xid;
+	curr_vsb()->v_first_xid = le64_to_cpu(formatted_by->last_xid);
+	curr_vsb()->v_last_xid = curr_vsb()->v_first_xid;
 
 	for (; modified_by != end_mod_by; ++modified_by) {
 		length = software_strlen(modified_by->id);
@@ -397,15 +558,15 @@ static void check_software_information(struct apfs_modified_by *formatted_by,
 			       "entries are not in order.");
 		xid = le64_to_cpu(modified_by->last_xid);
 
-		if (xid > vsb->v_last_xid)
-			vsb->v_last_xid = xid;
+		if (xid > curr_vsb()->v_last_xid)
+			curr_vsb()->v_last_xid = xid;
 	}
 
 	length = software_strlen(formatted_by->id);
 	if (!length)
 		report("Volume superblock", "creation information is missing.");
 
-	if (xid <= vsb->v_first_xid)
+	if (xid <= curr_vsb()->v_first_xid)
 		report("Volume creation info", "transaction is too recent.");
 }
 
@@ -421,7 +582,7 @@ static void check_volume_flags(u64 flags)
 		report("Volume superblock", "reserved flag in use.");
 
 	if (!(flags & APFS_FS_UNENCRYPTED))
-		vsb->v_encrypted = true;
+		curr_vsb()->v_encrypted = true;
 	else if (flags & (APFS_FS_EFFACEABLE | APFS_FS_ONEKEY))
 		report("Volume superblock", "inconsistent crypto flags.");
 
@@ -548,23 +709,20 @@ static void check_meta_crypto(struct apfs_wrapped_meta_crypto_state *wmcs)
  */
 static struct volume_group *get_volume_group(char uuid[16])
 {
-	struct volume_group *vg = sb->s_volume_group;
+	struct volume_group *vg = curr_sb()->s_volume_group;
 
 	/* This shouldn't happen according to the reference, but it does */
 	if (uuid_is_null(uuid))
 		report_weird("Volume group uuid");
 
-	if (vg) {
-		if (memcmp(vg->vg_id, uuid, 16) != 0)
-			report_unknown("Two volume groups");
+	if (vg)
 		return vg;
-	}
 
 	vg = calloc(1, sizeof(*vg));
 	if (!vg)
 		system_error();
 	memcpy(vg->vg_id, uuid, 16);
-	sb->s_volume_group = vg;
+	curr_sb()->s_volume_group = vg;
 	return vg;
 }
 
@@ -574,32 +732,50 @@ static struct volume_group *get_volume_group(char uuid[16])
 static void parse_volume_group_info(void)
 {
 	struct volume_group *vg = NULL;
-	char *vg_uuid = vsb->v_raw->apfs_volume_group_id;
+	char *vg_uuid = curr_vsb()->v_raw->apfs_volume_group_id;
+	bool seen;
 
-	if (apfs_volume_is_in_group()) {
-		vg = get_volume_group(vg_uuid);
-		if (vsb->v_in_snapshot)
-			return;
-		if (apfs_is_data_volume_in_group()) {
-			if (vg->vg_data_seen)
-				report("Volume group", "two data volumes.");
-			vg->vg_data_seen = true;
-		} else if (apfs_is_system_volume_in_group()) {
-			if (vg->vg_system_seen)
-				report("Volume group", "two system volumes.");
-			vg->vg_system_seen = true;
-		} else {
-			report("Volume group", "volume is neither data nor system.");
-		}
-	} else {
+	if (!apfs_volume_is_in_group()) {
 		if (!uuid_is_null(vg_uuid))
 			report("Volume group", "member has no feature flag.");
+		return;
+	}
+
+	/*
+	 * Snapshots also look at the volume group, so this needs the lock.  The
+	 * issues get reported only after it's dropped, in case the check goes
+	 * on in collect-all-errors mode.
+	 */
+	pthread_mutex_lock(&volume_shared_lock);
+	vg = get_volume_group(vg_uuid);
+	pthread_mutex_unlock(&volume_shared_lock);
+	if (memcmp(vg->vg_id, vg_uuid, 16) != 0)
+		report_unknown("Two volume groups");
+	if (curr_vsb()->v_in_snapshot)
+		return;
+
+	if (apfs_is_data_volume_in_group()) {
+		pthread_mutex_lock(&volume_shared_lock);
+		seen = vg->vg_data_seen;
+		vg->vg_data_seen = true;
+		pthread_mutex_unlock(&volume_shared_lock);
+		if (seen)
+			report("Volume group", "two data volumes.");
+	} else if (apfs_is_system_volume_in_group()) {
+		pthread_mutex_lock(&volume_shared_lock);
+		seen = vg->vg_system_seen;
+		vg->vg_system_seen = true;
+		pthread_mutex_unlock(&volume_shared_lock);
+		if (seen)
+			report("Volume group", "two system volumes.");
+	} else {
+		report("Volume group", "volume is neither data nor system.");
 	}
 }
 
-static void parse_cloneinfo_epoch(struct volume_superblock *vsb)
+static void parse_cloneinfo_epoch(void)
 {
-	struct apfs_superblock *raw = vsb->v_raw;
+	struct apfs_superblock *raw = curr_vsb()->v_raw;
 	u64 id_epoch, xid;
 
 	/*
@@ -624,7 +800,7 @@ static void parse_cloneinfo_epoch(struct volume_superblock *vsb)
 	}
 
 	if (xid) {
-		if (xid != vsb->v_last_xid)
+		if (xid != curr_vsb()->v_last_xid)
 			report("Volume superblock", "out of date cloneinfo xid");
 	}
 
@@ -633,7 +809,7 @@ static void parse_cloneinfo_epoch(struct volume_superblock *vsb)
 	 * seem to be true for unmodified volumes.
 	 */
 	if (id_epoch && !xid) {
-		if (vsb->v_first_xid != vsb->v_last_xid)
+		if (curr_vsb()->v_first_xid != curr_vsb()->v_last_xid)
 			report("Volume superblock", "cloneinfo epoch with no xid.");
 	}
 }
@@ -641,41 +817,44 @@ static void parse_cloneinfo_epoch(struct volume_superblock *vsb)
 /**
  * read_volume_super - Read the volume superblock and run some checks
  * @vol:	volume number
- * @vsb:	volume superblock struct to receive the results
  * @obj:	volume superblock object
+ *
+ * The results are stored in the volume superblock of the current context.
  */
-void read_volume_super(int vol, struct volume_superblock *vsb, struct object *obj)
+void read_volume_super(int vol, struct object *obj)
 {
 	char *vol_name = NULL;
-	struct spaceman *sm = &sb->s_spaceman;
+	struct spaceman *sm = &curr_sb()->s_spaceman;
 	u64 alloc_count, reserve_blkcnt, quota_blkcnt;
 
-	if (vsb->v_obj.type != APFS_OBJECT_TYPE_FS)
+	if (curr_vsb()->v_obj.type != APFS_OBJECT_TYPE_FS)
 		report("Volume superblock", "wrong object type.");
-	if (vsb->v_obj.subtype != APFS_OBJECT_TYPE_INVALID)
+	if (curr_vsb()->v_obj.subtype != APFS_OBJECT_TYPE_INVALID)
 		report("Volume superblock", "wrong object subtype.");
 
-	vsb->v_index = le32_to_cpu(vsb->v_raw->apfs_fs_index);
-	if (vsb->v_index != vol)
+	curr_vsb()->v_index = le32_to_cpu(curr_vsb()->v_raw->apfs_fs_index);
+	if (curr_vsb()->v_index != vol)
 		report("Volume superblock", "wrong reported volume number.");
-	if (le32_to_cpu(vsb->v_raw->apfs_magic) != APFS_MAGIC)
+	if (le32_to_cpu(curr_vsb()->v_raw->apfs_magic) != APFS_MAGIC)
 		report("Volume superblock", "wrong magic.");
 
-	check_optional_vol_features(le64_to_cpu(vsb->v_raw->apfs_features));
+	check_optional_vol_features(le64_to_cpu(curr_vsb()->v_raw->apfs_features));
 	check_rocompat_vol_features(le64_to_cpu(
-				vsb->v_raw->apfs_readonly_compatible_features));
+				curr_vsb()->v_raw->apfs_readonly_compatible_features));
 	check_incompat_vol_features(le64_to_cpu(
-				vsb->v_raw->apfs_incompatible_features));
+				curr_vsb()->v_raw->apfs_incompatible_features));
 
-	alloc_count = le64_to_cpu(vsb->v_raw->apfs_fs_alloc_count);
-	reserve_blkcnt = le64_to_cpu(vsb->v_raw->apfs_fs_reserve_block_count);
-	quota_blkcnt = le64_to_cpu(vsb->v_raw->apfs_fs_quota_block_count);
+	alloc_count = le64_to_cpu(curr_vsb()->v_raw->apfs_fs_alloc_count);
+	reserve_blkcnt = le64_to_cpu(curr_vsb()->v_raw->apfs_fs_reserve_block_count);
+	quota_blkcnt = le64_to_cpu(curr_vsb()->v_raw->apfs_fs_quota_block_count);
 	if (reserve_blkcnt) {
+		pthread_mutex_lock(&volume_shared_lock);
 		sm->sm_reserve_block_num += reserve_blkcnt;
 		if (alloc_count > reserve_blkcnt)
 			sm->sm_reserve_alloc_num += reserve_blkcnt;
 		else
 			sm->sm_reserve_alloc_num += alloc_count;
+		pthread_mutex_unlock(&volume_shared_lock);
 	}
 	if (quota_blkcnt) {
 		if (alloc_count > quota_blkcnt)
@@ -688,87 +867,94 @@ void read_volume_super(int vol, struct volume_superblock *vsb, struct object *ob
 			report("Volume superblock", "block reserves exceed quota.");
 	}
 
-	check_meta_crypto(&vsb->v_raw->apfs_meta_crypto);
+	check_meta_crypto(&curr_vsb()->v_raw->apfs_meta_crypto);
 
-	vsb->v_next_obj_id = le64_to_cpu(vsb->v_raw->apfs_next_obj_id);
-	if (vsb->v_next_obj_id < APFS_MIN_USER_INO_NUM)
+	curr_vsb()->v_next_obj_id = le64_to_cpu(curr_vsb()->v_raw->apfs_next_obj_id);
+	if (curr_vsb()->v_next_obj_id < APFS_MIN_USER_INO_NUM)
 		report("Volume superblock", "next catalog id is invalid.");
-	vsb->v_next_doc_id = le32_to_cpu(vsb->v_raw->apfs_next_doc_id);
-	if (vsb->v_next_doc_id < APFS_MIN_DOC_ID)
+	curr_vsb()->v_next_doc_id = le32_to_cpu(curr_vsb()->v_raw->apfs_next_doc_id);
+	if (curr_vsb()->v_next_doc_id < APFS_MIN_DOC_ID)
 		report("Volume superblock", "next document id is invalid.");
 
-	vol_name = (char *)vsb->v_raw->apfs_volname;
+	vol_name = (char *)curr_vsb()->v_raw->apfs_volname;
 	if (!*vol_name)
 		report("Volume superblock", "label is missing.");
 	if (strnlen(vol_name, APFS_VOLNAME_LEN) == APFS_VOLNAME_LEN)
 		report("Volume superblock", "name lacks NULL-termination.");
 
-	check_volume_flags(le64_to_cpu(vsb->v_raw->apfs_fs_flags));
-	check_software_information(&vsb->v_raw->apfs_formatted_by,
-				   &vsb->v_raw->apfs_modified_by[0]);
-	check_volume_role(le16_to_cpu(vsb->v_raw->apfs_role));
+	check_volume_flags(le64_to_cpu(curr_vsb()->v_raw->apfs_fs_flags));
+	if (curr_vsb()->v_encrypted &&
+	    (le64_to_cpu(curr_sb()->s_raw->nx_flags) & APFS_NX_CRYPTO_SW)) {
+		curr_vsb()->v_vek = get_volume_key(curr_vsb()->v_raw->apfs_vol_uuid);
+		if (!curr_vsb()->v_vek)
+			report_unknown("Software-encrypted volume with no key");
+	}
+	check_software_information(&curr_vsb()->v_raw->apfs_formatted_by,
+				   &curr_vsb()->v_raw->apfs_modified_by[0]);
+	check_volume_role(le16_to_cpu(curr_vsb()->v_raw->apfs_role));
 
 	/*
 	 * The documentation suggests that other tree types could be possible,
 	 * but I don't understand how that would work.
 	 */
-	if (le32_to_cpu(vsb->v_raw->apfs_root_tree_type) !=
+	if (le32_to_cpu(curr_vsb()->v_raw->apfs_root_tree_type) !=
 				(APFS_OBJ_VIRTUAL | APFS_OBJECT_TYPE_BTREE))
 		report("Volume superblock", "wrong type for catalog tree.");
-	if (le32_to_cpu(vsb->v_raw->apfs_extentref_tree_type) !=
+	if (le32_to_cpu(curr_vsb()->v_raw->apfs_extentref_tree_type) !=
 				(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
 		report("Volume superblock", "wrong type for extentref tree.");
-	if (le32_to_cpu(vsb->v_raw->apfs_snap_meta_tree_type) !=
+	if (le32_to_cpu(curr_vsb()->v_raw->apfs_snap_meta_tree_type) !=
 				(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
 		report("Volume superblock", "wrong type for snapshot tree.");
 
-	if (le16_to_cpu(vsb->v_raw->reserved) != 0)
+	if (le16_to_cpu(curr_vsb()->v_raw->reserved) != 0)
 		report("Volume superblock", "reserved field is in use.");
-	if (le64_to_cpu(vsb->v_raw->apfs_root_to_xid) != 0)
+	if (le64_to_cpu(curr_vsb()->v_raw->apfs_root_to_xid) != 0)
 		report_unknown("Root from snapshot");
-	if (le64_to_cpu(vsb->v_raw->apfs_er_state_oid) != 0)
+	if (le64_to_cpu(curr_vsb()->v_raw->apfs_er_state_oid) != 0)
 		report_unknown("Encryption or decryption in progress");
-	if (le64_to_cpu(vsb->v_raw->apfs_revert_to_xid) != 0)
+	if (le64_to_cpu(curr_vsb()->v_raw->apfs_revert_to_xid) != 0)
 		report_unknown("Revert to a snapshot");
-	if (le64_to_cpu(vsb->v_raw->apfs_revert_to_sblock_oid) != 0)
+	if (le64_to_cpu(curr_vsb()->v_raw->apfs_revert_to_sblock_oid) != 0)
 		report_unknown("Revert to a volume superblock");
 
-	parse_cloneinfo_epoch(vsb);
+	parse_cloneinfo_epoch();
 
-	if (vsb->v_raw->apfs_fext_tree_type && le32_to_cpu(vsb->v_raw->apfs_fext_tree_type) != (APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
+	if (curr_vsb()->v_raw->apfs_fext_tree_type &&
+	    le32_to_cpu(curr_vsb()->v_raw->apfs_fext_tree_type) != (APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
 		report("Volume superblock", "invalid value of fext tree type.");
-	if (vsb->v_raw->apfs_integrity_meta_oid || vsb->v_raw->apfs_fext_tree_oid)
+	if (curr_vsb()->v_raw->apfs_integrity_meta_oid || curr_vsb()->v_raw->apfs_fext_tree_oid)
 		report_unknown("Sealed volume");
 
-	if (vsb->v_raw->reserved_type && le32_to_cpu(vsb->v_raw->reserved_type) != (APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
+	if (curr_vsb()->v_raw->reserved_type &&
+	    le32_to_cpu(curr_vsb()->v_raw->reserved_type) != (APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE))
 		report("Volume superblock", "invalid value of reserved type.");
-	if (vsb->v_raw->reserved_oid)
+	if (curr_vsb()->v_raw->reserved_oid)
 		report("Volume superblock", "reserved oid is set.");
 
 	parse_volume_group_info();
 
-	vsb->v_extref_oid = le64_to_cpu(vsb->v_raw->apfs_extentref_tree_oid);
-	vsb->v_omap_oid = le64_to_cpu(vsb->v_raw->apfs_omap_oid);
-	vsb->v_snap_meta_oid = le64_to_cpu(vsb->v_raw->apfs_snap_meta_tree_oid);
+	curr_vsb()->v_extref_oid = le64_to_cpu(curr_vsb()->v_raw->apfs_extentref_tree_oid);
+	curr_vsb()->v_omap_oid = le64_to_cpu(curr_vsb()->v_raw->apfs_omap_oid);
+	curr_vsb()->v_snap_meta_oid = le64_to_cpu(curr_vsb()->v_raw->apfs_snap_meta_tree_oid);
 }
 
 /**
  * map_volume_super - Find the volume superblock and map it into memory
  * @vol:	volume number
- * @vsb:	volume superblock struct to receive the results
  *
+ * The results are stored in the volume superblock of the current context.
  * Returns the in-memory location of the volume superblock, or NULL if there
  * is no volume with this number.
  */
-static struct apfs_superblock *map_volume_super(int vol,
-						struct volume_superblock *vsb)
+static struct apfs_superblock *map_volume_super(int vol)
 {
-	struct apfs_nx_superblock *msb_raw = sb->s_raw;
+	struct apfs_nx_superblock *msb_raw = curr_sb()->s_raw;
 	u64 vol_id;
 
 	vol_id = le64_to_cpu(msb_raw->nx_fs_oid[vol]);
 	if (vol_id == 0) {
-		if (vol > sb->s_max_vols)
+		if (vol > curr_sb()->s_max_vols)
 			report("Container superblock", "too many volumes.");
 		for (++vol; vol < APFS_NX_MAX_FILE_SYSTEMS; ++vol)
 			if (msb_raw->nx_fs_oid[vol])
@@ -777,9 +963,9 @@ static struct apfs_superblock *map_volume_super(int vol,
 		return NULL;
 	}
 
-	vsb->v_raw = read_object(vol_id, sb->s_omap_table, &vsb->v_obj);
-	read_volume_super(vol, vsb, &vsb->v_obj);
-	return vsb->v_raw;
+	curr_vsb()->v_raw = read_object(vol_id, curr_sb()->s_omap_index, &curr_vsb()->v_obj);
+	read_volume_super(vol, &curr_vsb()->v_obj);
+	return curr_vsb()->v_raw;
 }
 
 static struct object *parse_reaper(u64 oid);
@@ -812,13 +998,14 @@ struct volume_superblock *alloc_volume_super(bool snap)
 	ret->v_in_snapshot = snap;
 
 	if (!snap) {
-		ret->v_omap_table = alloc_htable();
+		ret->v_omap_index = alloc_omap_index();
 		ret->v_snap_table = alloc_htable();
 	}
 	ret->v_extent_table = alloc_htable();
 	ret->v_cnid_table = alloc_htable();
 	ret->v_dstream_table = alloc_htable();
 	ret->v_inode_table = alloc_htable();
+	ret->v_sibling_table = alloc_htable();
 	ret->v_dirstat_table = alloc_htable();
 	ret->v_crypto_table = alloc_htable();
 
@@ -834,10 +1021,10 @@ static void check_snap_meta_ext(u64 oid)
 	if (!oid)
 		return;
 
-	if (vsb->v_snap_max_xid == 0)
+	if (curr_vsb()->v_snap_max_xid == 0)
 		report("Volume superblock", "has extended snap meta but no snapshots.");
 
-	sme = read_object(oid, vsb->v_omap_table, &obj);
+	sme = read_object(oid, curr_vsb()->v_omap_index, &obj);
 	if (obj.type != OBJECT_TYPE_SNAP_META_EXT)
 		report("Extended snapshot metadata", "wrong object type.");
 	if (obj.subtype != APFS_OBJECT_TYPE_INVALID)
@@ -854,10 +1041,10 @@ static void check_snap_meta_ext(u64 oid)
 	 * The current transaction has the same content as the latest snapshot,
 	 * but this may be impossible to check if that snapshot got deleted.
 	 */
-	if (vsb->v_in_snapshot && le64_to_cpu(sme->sme_snap_xid) != sb->s_xid)
+	if (curr_vsb()->v_in_snapshot && le64_to_cpu(sme->sme_snap_xid) != curr_ctx->c_xid)
 		report("Extended snapshot metadata", "wrong transaction id.");
 
-	munmap(sme, sb->s_blocksize);
+	release_block(sme);
 }
 
 /**
@@ -865,67 +1052,92 @@ static void check_snap_meta_ext(u64 oid)
  */
 void check_volume_super(void)
 {
-	struct apfs_superblock *vsb_raw = vsb->v_raw;
-
-	if (!vsb->v_in_snapshot) {
-		vsb->v_omap = parse_omap_btree(vsb->v_omap_oid);
-		vsb->v_snap_meta = parse_snap_meta_btree(vsb->v_snap_meta_oid);
+	struct apfs_superblock *vsb_raw = curr_vsb()->v_raw;
+	unsigned int skips = errlog_skips;
+	u64 start;
+
+	if (!curr_vsb()->v_in_snapshot) {
+		start = stats_start_phase(STAT_OMAP);
+		curr_vsb()->v_omap = parse_omap_btree(curr_vsb()->v_omap_oid);
+		if (prescan_enabled)
+			prescan_omap(curr_vsb()->v_omap_index);
+		stats_end_phase(STAT_OMAP, start);
+		curr_vsb()->v_snap_meta = parse_snap_meta_btree(curr_vsb()->v_snap_meta_oid);
+		start = stats_start_phase(STAT_SNAPSHOTS);
+		check_snapshots();
+		stats_end_phase(STAT_SNAPSHOTS, start);
 	}
 
-	/* The first tree is for the latest xid, the others are for snapshots */
-	if (!vsb->v_in_snapshot) {
-		vsb->v_extent_ref = parse_extentref_btree(vsb->v_extref_oid);
-	} else {
-		/* We want the most recent snapshots first */
-		struct listed_btree *new = NULL;
-
-		new = calloc(1, sizeof(*new));
-		if (!new)
-			system_error();
-		new->btree = parse_extentref_btree(vsb->v_extref_oid);
-		new->next = vsb->v_snap_extrefs;
-		vsb->v_snap_extrefs = new;
+	/*
+	 * The first tree is for the latest xid, the others are for snapshots;
+	 * those must be parsed in order, so check_snapshots() takes care of it.
+	 */
+	if (!curr_vsb()->v_in_snapshot) {
+		start = stats_start_phase(STAT_EXTENTREF);
+		curr_vsb()->v_extent_ref = parse_extentref_btree(curr_vsb()->v_extref_oid);
+		stats_end_phase(STAT_EXTENTREF, start);
 	}
 
-	vsb->v_cat = parse_cat_btree(le64_to_cpu(vsb_raw->apfs_root_tree_oid), vsb->v_omap_table);
+	start = stats_start_phase(STAT_CATALOG);
+	curr_vsb()->v_cat = parse_cat_btree(le64_to_cpu(vsb_raw->apfs_root_tree_oid),
+					    curr_vsb()->v_omap_index);
+	if (!curr_vsb()->v_in_snapshot)
+		stats_end_phase(STAT_CATALOG, start);
 
 	check_snap_meta_ext(le64_to_cpu(vsb_raw->apfs_snap_meta_ext_oid));
 
-	if (!vsb->v_in_snapshot) {
-		free_snap_table(vsb->v_snap_table);
-		vsb->v_snap_table = NULL;
+	/*
+	 * If some subtree was skipped in collect-all-errors mode, its records are
+	 * missing or half parsed, so the cross-checks would make no sense.
+	 */
+	if (errlog_skips != skips)
+		return;
+
+	start = stats_start_phase(STAT_TABLES);
+	if (!curr_vsb()->v_in_snapshot) {
+		free_snap_table(curr_vsb()->v_snap_table);
+		curr_vsb()->v_snap_table = NULL;
+	}
+	free_inode_table(curr_vsb()->v_inode_table);
+	curr_vsb()->v_inode_table = NULL;
+	free_sibling_table(curr_vsb()->v_sibling_table);
+	curr_vsb()->v_sibling_table = NULL;
+	free_dstream_table(curr_vsb()->v_dstream_table);
+	curr_vsb()->v_dstream_table = NULL;
+	free_cnid_table(curr_vsb()->v_cnid_table);
+	curr_vsb()->v_cnid_table = NULL;
+	free_extent_table(curr_vsb()->v_extent_table);
+	curr_vsb()->v_extent_table = NULL;
+	if (!curr_vsb()->v_in_snapshot) {
+		free_omap_index(curr_vsb()->v_omap_index);
+		curr_vsb()->v_omap_index = NULL;
+	} else {
+		free(curr_vsb()->v_omap_seen);
+		curr_vsb()->v_omap_seen = NULL;
 	}
-	free_inode_table(vsb->v_inode_table);
-	vsb->v_inode_table = NULL;
-	free_dstream_table(vsb->v_dstream_table);
-	vsb->v_dstream_table = NULL;
-	free_cnid_table(vsb->v_cnid_table);
-	vsb->v_cnid_table = NULL;
-	free_extent_table(vsb->v_extent_table);
-	vsb->v_extent_table = NULL;
-	if (!vsb->v_in_snapshot) {
-		free_omap_table(vsb->v_omap_table);
-		vsb->v_omap_table = NULL;
+	free_dirstat_table(curr_vsb()->v_dirstat_table);
+	curr_vsb()->v_dirstat_table = NULL;
+	free_crypto_table(curr_vsb()->v_crypto_table);
+	curr_vsb()->v_crypto_table = NULL;
+	if (!curr_vsb()->v_in_snapshot) {
+		stats_end_phase(STAT_TABLES, start);
+		stats_volume_trees();
 	}
-	free_dirstat_table(vsb->v_dirstat_table);
-	vsb->v_dirstat_table = NULL;
-	free_crypto_table(vsb->v_crypto_table);
-	vsb->v_crypto_table = NULL;
 
-	if (!vsb->v_has_root)
+	if (!curr_vsb()->v_has_root)
 		report("Catalog", "the root directory is missing.");
-	if (!vsb->v_has_priv)
+	if (!curr_vsb()->v_has_priv)
 		report("Catalog", "the private directory is missing.");
 
-	if (le64_to_cpu(vsb_raw->apfs_num_files) != vsb->v_file_count) {
+	if (le64_to_cpu(vsb_raw->apfs_num_files) != curr_vsb()->v_file_count) {
 		/* Sometimes this is off by one.  TODO: why? */
 		report_weird("File count in volume superblock");
 	}
-	if (le64_to_cpu(vsb_raw->apfs_num_directories) != vsb->v_dir_count)
+	if (le64_to_cpu(vsb_raw->apfs_num_directories) != curr_vsb()->v_dir_count)
 		report("Volume superblock", "bad directory count.");
-	if (le64_to_cpu(vsb_raw->apfs_num_symlinks) != vsb->v_symlink_count)
+	if (le64_to_cpu(vsb_raw->apfs_num_symlinks) != curr_vsb()->v_symlink_count)
 		report("Volume superblock", "bad symlink count.");
-	if (le64_to_cpu(vsb_raw->apfs_num_other_fsobjects) != vsb->v_special_count)
+	if (le64_to_cpu(vsb_raw->apfs_num_other_fsobjects) != curr_vsb()->v_special_count)
 		report("Volume superblock", "bad special file count.");
 
 	/*
@@ -934,164 +1146,249 @@ void check_volume_super(void)
 	 *
 	 * TODO: check that each snapshot has more snaps than the previous one?
 	 */
-	if (vsb->v_in_snapshot) {
-		if (le64_to_cpu(vsb_raw->apfs_num_snapshots) < vsb->v_snap_count)
+	if (curr_vsb()->v_in_snapshot) {
+		if (le64_to_cpu(vsb_raw->apfs_num_snapshots) < curr_vsb()->v_snap_count)
 			report("Volume superblock", "bad snapshot count.");
 	} else {
-		if (le64_to_cpu(vsb_raw->apfs_num_snapshots) != vsb->v_snap_count)
+		if (le64_to_cpu(vsb_raw->apfs_num_snapshots) != curr_vsb()->v_snap_count)
 			report("Volume superblock", "bad snapshot count.");
 	}
 
 	/*
 	 * The original omap for a snapshot is not preserved, so there is no way
-	 * to know the real value of v_block_count back then.
+	 * to know the real value of v_block_count back then.  The count for the
+	 * latest transaction is also incomplete if some snapshot was skipped.
 	 */
-	if (!vsb->v_in_snapshot) {
-		if (le64_to_cpu(vsb_raw->apfs_fs_alloc_count) != vsb->v_block_count)
+	if (!curr_vsb()->v_in_snapshot && !curr_vsb()->v_snaps_skipped) {
+		if (le64_to_cpu(vsb_raw->apfs_fs_alloc_count) != curr_vsb()->v_block_count)
 			report("Volume superblock", "bad block count.");
 	}
 }
 
 /**
- * check_container - Check the whole container for a given checkpoint
- * @sb: checkpoint superblock
+ * check_volume - Check one of the volumes of the container
+ * @vol:	volume number
+ * @arg:	unused
  */
-static void check_container(struct super_block *sb)
+static void check_volume(int vol, void *arg)
+{
+	struct recovery rec;
+
+	curr_ctx->c_vsb = curr_sb()->s_volumes[vol];
+	if (curr_vsb()->v_skipped) {
+		curr_ctx->c_vsb = NULL;
+		return;
+	}
+	if (errlog_limit) {
+		push_recovery(&rec, "volume", vol, NULL /* key */,
+			      false /* release */);
+		if (setjmp(rec.r_env)) {
+			pop_recovery(&rec);
+			curr_ctx->c_vsb = NULL;
+			return;
+		}
+	}
+
+	if (journal_path)
+		journal_check_volume();
+	else
+		check_volume_super();
+	if (errlog_limit)
+		pop_recovery(&rec);
+	curr_ctx->c_vsb = NULL;
+}
+
+/**
+ * check_container_spaceman - Check the space manager of the container
+ *
+ * In collect-all-errors mode, the issues found here are logged like for the
+ * volumes, but this is the last check for the checkpoint so nothing is really
+ * skipped.
+ */
+static void check_container_spaceman(void)
+{
+	struct recovery rec;
+	u64 oid = le64_to_cpu(curr_sb()->s_raw->nx_spaceman_oid);
+
+	if (!errlog_limit) {
+		check_spaceman(oid);
+		return;
+	}
+
+	push_recovery(&rec, "space manager", oid, NULL /* key */,
+		      false /* release */);
+	if (setjmp(rec.r_env)) {
+		pop_recovery(&rec);
+		return;
+	}
+	check_spaceman(oid);
+	pop_recovery(&rec);
+}
+
+/**
+ * check_container - Check the whole container for the current checkpoint
+ */
+static void check_container(void)
 {
 	int vol;
 	bool reaper_vol_seen = false;
+	u64 start;
+
+	curr_sb()->s_omap_index = alloc_omap_index();
 
-	sb->s_omap_table = alloc_htable();
+	/* Tree traversals jump all over the device */
+	cache_advise(MADV_RANDOM);
 
 	/* Check for corruption in the container object map... */
-	sb->s_omap = parse_omap_btree(le64_to_cpu(sb->s_raw->nx_omap_oid));
+	curr_sb()->s_omap = parse_omap_btree(le64_to_cpu(curr_sb()->s_raw->nx_omap_oid));
 	/* ...and in the reaper */
-	sb->s_reaper = parse_reaper(le64_to_cpu(sb->s_raw->nx_reaper_oid));
+	curr_sb()->s_reaper = parse_reaper(le64_to_cpu(curr_sb()->s_raw->nx_reaper_oid));
 
+	/* Find all the volumes first, the container omap is not thread-safe */
 	for (vol = 0; vol < APFS_NX_MAX_FILE_SYSTEMS; ++vol) {
 		struct apfs_superblock *vsb_raw;
 
-		vsb = alloc_volume_super(false);
+		curr_ctx->c_vsb = alloc_volume_super(false);
 
-		vsb_raw = map_volume_super(vol, vsb);
+		vsb_raw = map_volume_super(vol);
 		if (!vsb_raw) {
-			free(vsb);
+			free(curr_vsb());
 			break;
 		}
-		if (vsb->v_obj.oid == sb->s_reaper_fs_id)
+		if (curr_vsb()->v_obj.oid == curr_sb()->s_reaper_fs_id)
 			reaper_vol_seen = true;
-		check_volume_super();
-		sb->s_volumes[vol] = vsb;
-		vsb = NULL;
+
+		/*
+		 * Volumes out of scope still get mapped, to check the reaper
+		 * and the volume group, and to mark their superblocks as used.
+		 */
+		if (!volume_in_scope()) {
+			curr_vsb()->v_skipped = true;
+			curr_sb()->s_partial = true;
+		}
+		curr_sb()->s_volumes[vol] = curr_vsb();
+		curr_ctx->c_vsb = NULL;
 	}
+	curr_ctx->c_vsb = NULL;
 
 	/* For now we just check that the reaper's volume exists */
-	if (sb->s_reaper_fs_id && !reaper_vol_seen)
+	if (curr_sb()->s_reaper_fs_id && !reaper_vol_seen)
 		report("Reaper", "volume id is invalid.");
 
-	free_omap_table(sb->s_omap_table);
-	sb->s_omap_table = NULL;
+	if (journal_path)
+		journal_load();
+	run_parallel(vol, check_volume, NULL /* arg */);
+
+	free_omap_index(curr_sb()->s_omap_index);
+	curr_sb()->s_omap_index = NULL;
+
+	/* The space manager is read mostly in order */
+	cache_advise(MADV_SEQUENTIAL);
+	start = stats_start_phase(STAT_SPACEMAN);
+	check_container_spaceman();
+	stats_end_phase(STAT_SPACEMAN, start);
+	cache_advise(MADV_NORMAL);
 
-	check_spaceman(le64_to_cpu(sb->s_raw->nx_spaceman_oid));
+	check_volume_group(curr_sb()->s_volume_group);
+	free(curr_sb()->s_volume_group);
+	curr_sb()->s_volume_group = NULL;
 
-	check_volume_group(sb->s_volume_group);
-	free(sb->s_volume_group);
-	sb->s_volume_group = NULL;
+	free_volume_keys();
 }
 
 /**
- * parse_main_super - Parse a container superblock and run generic checks
- * @sb: checkpoint superblock struct to receive the results
+ * parse_main_super - Parse the checkpoint superblock and run generic checks
  */
-static void parse_main_super(struct super_block *sb)
+static void parse_main_super(void)
 {
 	u64 chunk_count;
 	int i;
 
-	assert(sb->s_raw);
+	assert(curr_sb()->s_raw);
 
 	/* This field was already set from the checkpoint mappings */
-	assert(sb->s_xid);
+	assert(curr_sb()->s_xid);
 
-	if (sb->s_xid != le64_to_cpu(sb->s_raw->nx_o.o_xid))
+	if (curr_sb()->s_xid != le64_to_cpu(curr_sb()->s_raw->nx_o.o_xid))
 		report("Container superblock", "inconsistent xid.");
 
-	sb->s_blocksize = le32_to_cpu(sb->s_raw->nx_block_size);
-	if (sb->s_blocksize != APFS_NX_DEFAULT_BLOCK_SIZE)
+	curr_sb()->s_blocksize = le32_to_cpu(curr_sb()->s_raw->nx_block_size);
+	if (curr_sb()->s_blocksize != APFS_NX_DEFAULT_BLOCK_SIZE)
 		report_unknown("Block size other than 4096");
 
-	sb->s_block_count = le64_to_cpu(sb->s_raw->nx_block_count);
-	if (!sb->s_block_count)
+	curr_sb()->s_block_count = le64_to_cpu(curr_sb()->s_raw->nx_block_count);
+	if (!curr_sb()->s_block_count)
 		report("Container superblock", "reports no block count.");
-	if (sb->s_block_count > get_device_size(sb->s_blocksize))
+	if (curr_sb()->s_block_count > get_device_size(curr_sb()->s_blocksize))
 		report("Container superblock", "too many blocks for device.");
 
 	/*
 	 * A chunk is the disk section covered by a single block in the
 	 * allocation bitmap.
 	 */
-	chunk_count = DIV_ROUND_UP(sb->s_block_count, 8 * sb->s_blocksize);
-	sb->s_bitmap = calloc(chunk_count, sb->s_blocksize);
-	if (!sb->s_bitmap)
-		system_error();
-	((char *)sb->s_bitmap)[0] = 0x01; /* Block zero is always used */
+	chunk_count = DIV_ROUND_UP(curr_sb()->s_block_count, 8 * curr_sb()->s_blocksize);
+	cbmap_init(&curr_sb()->s_bitmap, chunk_count * 8 * curr_sb()->s_blocksize,
+		   8 * curr_sb()->s_blocksize, max_memory != 0 /* compress */);
+	cbmap_set_range(&curr_sb()->s_bitmap, 0, 1); /* Block zero is always used */
 
-	sb->s_max_vols = get_max_volumes(sb->s_block_count * sb->s_blocksize);
-	if (sb->s_max_vols != le32_to_cpu(sb->s_raw->nx_max_file_systems))
+	curr_sb()->s_max_vols = get_max_volumes(curr_sb()->s_block_count * curr_sb()->s_blocksize);
+	if (curr_sb()->s_max_vols != le32_to_cpu(curr_sb()->s_raw->nx_max_file_systems))
 		report("Container superblock", "bad maximum volume number.");
 
-	check_main_flags(le64_to_cpu(sb->s_raw->nx_flags));
-	check_optional_main_features(le64_to_cpu(sb->s_raw->nx_features));
+	check_main_flags(le64_to_cpu(curr_sb()->s_raw->nx_flags));
+	check_optional_main_features(le64_to_cpu(curr_sb()->s_raw->nx_features));
 	check_rocompat_main_features(le64_to_cpu(
-				sb->s_raw->nx_readonly_compatible_features));
+				curr_sb()->s_raw->nx_readonly_compatible_features));
 	check_incompat_main_features(le64_to_cpu(
-				sb->s_raw->nx_incompatible_features));
+				curr_sb()->s_raw->nx_incompatible_features));
 
-	if (le32_to_cpu(sb->s_raw->nx_xp_desc_blocks) >> 31 ||
-	    le32_to_cpu(sb->s_raw->nx_xp_data_blocks) >> 31 ||
-	    le64_to_cpu(sb->s_raw->nx_xp_desc_base) >> 63 ||
-	    le64_to_cpu(sb->s_raw->nx_xp_data_base) >> 63)
+	if (le32_to_cpu(curr_sb()->s_raw->nx_xp_desc_blocks) >> 31 ||
+	    le32_to_cpu(curr_sb()->s_raw->nx_xp_data_blocks) >> 31 ||
+	    le64_to_cpu(curr_sb()->s_raw->nx_xp_desc_base) >> 63 ||
+	    le64_to_cpu(curr_sb()->s_raw->nx_xp_data_base) >> 63)
 		report("Container superblock", "has checkpoint tree.");
 
-	sb->s_data_base = le64_to_cpu(sb->s_raw->nx_xp_data_base);
-	sb->s_data_blocks = le32_to_cpu(sb->s_raw->nx_xp_data_blocks);
-	sb->s_data_index = le32_to_cpu(sb->s_raw->nx_xp_data_index);
-	sb->s_data_len = le32_to_cpu(sb->s_raw->nx_xp_data_len);
-	if (sb->s_data_index >= sb->s_data_blocks)
+	curr_sb()->s_data_base = le64_to_cpu(curr_sb()->s_raw->nx_xp_data_base);
+	curr_sb()->s_data_blocks = le32_to_cpu(curr_sb()->s_raw->nx_xp_data_blocks);
+	curr_sb()->s_data_index = le32_to_cpu(curr_sb()->s_raw->nx_xp_data_index);
+	curr_sb()->s_data_len = le32_to_cpu(curr_sb()->s_raw->nx_xp_data_len);
+	if (curr_sb()->s_data_index >= curr_sb()->s_data_blocks)
 		report("Container superblock", "out of range checkpoint data.");
-	if (sb->s_data_len > sb->s_data_blocks)
+	if (curr_sb()->s_data_len > curr_sb()->s_data_blocks)
 		report("Container superblock",
 		       "reports too many blocks of checkpoint data.");
-	if ((sb->s_data_index + sb->s_data_len) % sb->s_data_blocks !=
-	    le32_to_cpu(sb->s_raw->nx_xp_data_next))
+	if ((curr_sb()->s_data_index + curr_sb()->s_data_len) % curr_sb()->s_data_blocks !=
+	    le32_to_cpu(curr_sb()->s_raw->nx_xp_data_next))
 		report("Container superblock",
 		       "wrong length for checkpoint data.");
 
-	if (sb->s_raw->nx_test_type || sb->s_raw->nx_test_oid)
+	if (curr_sb()->s_raw->nx_test_type || curr_sb()->s_raw->nx_test_oid)
 		report("Container superblock", "test field is set.");
-	if (sb->s_raw->nx_blocked_out_prange.pr_block_count)
+	if (curr_sb()->s_raw->nx_blocked_out_prange.pr_block_count)
 		report_unknown("Partition resizing");
 
-	check_efi_information(le64_to_cpu(sb->s_raw->nx_efi_jumpstart));
-	check_ephemeral_information(&sb->s_raw->nx_ephemeral_info[0]);
+	check_efi_information(le64_to_cpu(curr_sb()->s_raw->nx_efi_jumpstart));
+	check_ephemeral_information(&curr_sb()->s_raw->nx_ephemeral_info[0]);
 
 	for (i = 0; i < 16; ++i) {
-		if (sb->s_raw->nx_fusion_uuid[i])
+		if (curr_sb()->s_raw->nx_fusion_uuid[i])
 			report_unknown("Fusion drive");
 	}
 
 	/* Containers with no encryption may still have a value here, why? */
-	check_keybag(le64_to_cpu(sb->s_raw->nx_keylocker.pr_start_paddr), le64_to_cpu(sb->s_raw->nx_keylocker.pr_block_count));
+	check_keybag(le64_to_cpu(curr_sb()->s_raw->nx_keylocker.pr_start_paddr),
+		     le64_to_cpu(curr_sb()->s_raw->nx_keylocker.pr_block_count));
 	/* TODO: actually check all this stuff */
-	container_bmap_mark_as_used(le64_to_cpu(sb->s_raw->nx_mkb_locker.pr_start_paddr), le64_to_cpu(sb->s_raw->nx_mkb_locker.pr_block_count));
+	container_bmap_mark_as_used(le64_to_cpu(curr_sb()->s_raw->nx_mkb_locker.pr_start_paddr),
+				    le64_to_cpu(curr_sb()->s_raw->nx_mkb_locker.pr_block_count));
 
-	if (sb->s_raw->nx_fusion_mt_oid || sb->s_raw->nx_fusion_wbc_oid ||
-	    sb->s_raw->nx_fusion_wbc.pr_start_paddr ||
-	    sb->s_raw->nx_fusion_wbc.pr_block_count)
+	if (curr_sb()->s_raw->nx_fusion_mt_oid || curr_sb()->s_raw->nx_fusion_wbc_oid ||
+	    curr_sb()->s_raw->nx_fusion_wbc.pr_start_paddr ||
+	    curr_sb()->s_raw->nx_fusion_wbc.pr_block_count)
 		report_unknown("Fusion drive");
 
-	sb->s_next_oid = le64_to_cpu(sb->s_raw->nx_next_oid);
-	if (sb->s_xid + 1 != le64_to_cpu(sb->s_raw->nx_next_xid))
+	curr_sb()->s_next_oid = le64_to_cpu(curr_sb()->s_raw->nx_next_oid);
+	if (curr_sb()->s_xid + 1 != le64_to_cpu(curr_sb()->s_raw->nx_next_xid))
 		report("Container superblock", "next transaction id is wrong.");
 }
 
@@ -1111,7 +1408,7 @@ static void parse_cpoint_map(struct apfs_checkpoint_mapping *raw)
 	map->m_paddr = le64_to_cpu(raw->cpm_paddr);
 
 	map->m_size = le32_to_cpu(raw->cpm_size);
-	if (map->m_size != sb->s_blocksize)
+	if (map->m_size != curr_sb()->s_blocksize)
 		report_unknown("Ephemeral objects with more than one block");
 
 	map->m_type = le32_to_cpu(raw->cpm_type);
@@ -1143,10 +1440,10 @@ static u32 parse_cpoint_map_blocks(u64 desc_base, u32 desc_blocks, u32 *index)
 	 * The current superblock hasn't been parsed yet, so this xid would be
 	 * from the previous checkpoint.
 	 */
-	assert(!sb->s_xid);
+	assert(!curr_sb()->s_xid);
 
-	assert(!sb->s_cpoint_map_table);
-	sb->s_cpoint_map_table = alloc_htable();
+	assert(!curr_sb()->s_cpoint_map_table);
+	curr_sb()->s_cpoint_map_table = alloc_htable();
 
 	while (1) {
 		u64 bno = desc_base + *index;
@@ -1164,22 +1461,22 @@ static u32 parse_cpoint_map_blocks(u64 desc_base, u32 desc_blocks, u32 *index)
 			report("Checkpoint map", "wrong object subtype.");
 
 		/* Checkpoint mappings belong to the checkpoint transaction */
-		if (sb->s_xid && obj.xid != sb->s_xid)
+		if (curr_sb()->s_xid && obj.xid != curr_sb()->s_xid)
 			report("Checkpoint map", "inconsistent xid.");
 		if (!obj.xid)
 			report("Checkpoint map", "invalid xid.");
-		sb->s_xid = obj.xid;
+		curr_sb()->s_xid = curr_ctx->c_xid = obj.xid;
 
 		cpm_count = le32_to_cpu(raw->cpm_count);
 		if (sizeof(*raw) + cpm_count * sizeof(raw->cpm_map[0]) >
-								sb->s_blocksize)
+								curr_sb()->s_blocksize)
 			report("Checkpoint maps", "won't fit in block.");
 		for (i = 0; i < cpm_count; ++i)
 			parse_cpoint_map(&raw->cpm_map[i]);
 
 		flags = le32_to_cpu(raw->cpm_flags);
 
-		munmap(raw, sb->s_blocksize);
+		release_block(raw);
 		blk_count++;
 		*index = (*index + 1) % desc_blocks;
 
@@ -1202,15 +1499,18 @@ void parse_filesystem(void)
 	u32 desc_blocks;
 	long long valid_blocks;
 	u32 desc_next, desc_index, index;
+	u64 start;
 
-	sb = calloc(1, sizeof(*sb));
-	if (!sb)
+	curr_ctx->c_sb = calloc(1, sizeof(*curr_ctx->c_sb));
+	if (!curr_sb())
 		system_error();
 
 	/* Read the superblock from the last clean unmount */
 	msb_raw_copy = read_super_copy();
+	cache_init();
 
 	/* We want to mount the latest valid checkpoint among the descriptors */
+	start = stats_start_phase(STAT_CHECKPOINTS);
 	desc_base = le64_to_cpu(msb_raw_copy->nx_xp_desc_base);
 	if (desc_base >> 63 != 0) {
 		/* The highest bit is set when checkpoints are not contiguous */
@@ -1221,6 +1521,8 @@ void parse_filesystem(void)
 	if (desc_blocks > 10000) /* Arbitrary loop limit, is it enough? */
 		report("Block zero", "too many checkpoint descriptors?");
 
+	cache_willneed(desc_base, desc_blocks);
+
 	/* Find the valid range, as reported by the latest descriptor */
 	msb_raw_latest = read_latest_super(desc_base, desc_blocks);
 	desc_next = le32_to_cpu(msb_raw_latest->nx_xp_desc_next);
@@ -1228,12 +1530,14 @@ void parse_filesystem(void)
 	if (desc_next >= desc_blocks || desc_index >= desc_blocks)
 		report("Checkpoint superblock",
 		       "out of range checkpoint descriptors.");
-	munmap(msb_raw_latest, sb->s_blocksize);
+	release_block(msb_raw_latest);
 	msb_raw_latest = NULL;
+	stats_end_phase(STAT_CHECKPOINTS, start);
 
 	/*
 	 * Now go through the valid checkpoints one by one, though it seems
-	 * that cleanly unmounted filesystems only preserve the last one.
+	 * that cleanly unmounted filesystems only preserve the last one.  The
+	 * latest checkpoint comes at the end.
 	 */
 	index = desc_index;
 	valid_blocks = (desc_blocks + desc_next - desc_index) % desc_blocks;
@@ -1243,12 +1547,17 @@ void parse_filesystem(void)
 		u64 bno;
 		u32 map_blocks;
 
+		start = stats_start_phase(STAT_CHECKPOINTS);
+
 		/* Some fields from the previous checkpoint need to be unset */
-		if (sb->s_raw)
-			munmap(sb->s_raw, sb->s_blocksize);
-		sb->s_raw = NULL;
-		sb->s_xid = 0;
-		free(sb->s_bitmap);
+		if (curr_sb()->s_raw)
+			release_block(curr_sb()->s_raw);
+		curr_sb()->s_raw = NULL;
+		curr_sb()->s_xid = curr_ctx->c_xid = 0;
+		cbmap_free(&curr_sb()->s_bitmap);
+		memset(&curr_sb()->s_spaceman, 0, sizeof(curr_sb()->s_spaceman));
+		curr_sb()->s_reaper_fs_id = 0;
+		curr_sb()->s_partial = false;
 
 		/* The checkpoint-mapping blocks come before the superblock */
 		map_blocks = parse_cpoint_map_blocks(desc_base, desc_blocks,
@@ -1270,17 +1579,29 @@ void parse_filesystem(void)
 			report("Checkpoint superblock",
 			       "wrong checkpoint descriptor block count.");
 
-		sb->s_raw = raw;
-		parse_main_super(sb);
+		curr_sb()->s_raw = raw;
+		parse_main_super();
 
 		/* Do this now, after parse_main_super() allocated the bitmap */
 		container_bmap_mark_as_used(desc_base, desc_blocks);
-		container_bmap_mark_as_used(sb->s_data_base, sb->s_data_blocks);
+		container_bmap_mark_as_used(curr_sb()->s_data_base, curr_sb()->s_data_blocks);
 
-		check_container(sb);
+		/*
+		 * Only the superblock of this checkpoint remains in the valid
+		 * range if it's the latest one; the others are just checked as
+		 * far as their own blocks go, if the user asked for that.
+		 */
+		if (scope_latest_checkpoint && valid_blocks > 1) {
+			check_cpoint_map_objects();
+			free_volume_keys();
+			stats_end_phase(STAT_CHECKPOINTS, start);
+		} else {
+			stats_end_phase(STAT_CHECKPOINTS, start);
+			check_container();
+		}
 
-		free_cpoint_map_table(sb->s_cpoint_map_table);
-		sb->s_cpoint_map_table = NULL;
+		free_cpoint_map_table(curr_sb()->s_cpoint_map_table);
+		curr_sb()->s_cpoint_map_table = NULL;
 
 		/* One more block for the checkpoint superblock itself */
 		index = (index + 1) % desc_blocks;
@@ -1290,10 +1611,10 @@ void parse_filesystem(void)
 	if (valid_blocks != 0)
 		report("Block zero", "bad index for checkpoint descriptors.");
 
-	if (!sb->s_raw)
+	if (!curr_sb()->s_raw)
 		report("Checkpoint descriptor area", "no valid superblocks.");
-	main_super_compare(sb->s_raw, msb_raw_copy);
-	munmap(msb_raw_copy, sb->s_blocksize);
+	main_super_compare(curr_sb()->s_raw, msb_raw_copy);
+	munmap(msb_raw_copy, curr_sb()->s_blocksize);
 }
 
 /**
@@ -1320,7 +1641,7 @@ static struct object *parse_reaper(u64 oid)
 		report("Reaper", "wrong object subtype.");
 
 	buffer_size = le32_to_cpu(raw->nr_state_buffer_size);
-	if (buffer_size != sb->s_blocksize - sizeof(*raw))
+	if (buffer_size != curr_sb()->s_blocksize - sizeof(*raw))
 		report("Reaper", "wrong state buffer size.");
 
 	/* Docs on the reaper are very incomplete, so let's hope it's empty */
@@ -1328,7 +1649,7 @@ static struct object *parse_reaper(u64 oid)
 		struct apfs_nx_reap_list_phys *list_raw = NULL;
 		struct object list = {0};
 
-		sb->s_reaper_fs_id = le64_to_cpu(raw->nr_fs_oid);
+		curr_sb()->s_reaper_fs_id = le64_to_cpu(raw->nr_fs_oid);
 
 		if (le64_to_cpu(raw->nr_next_reap_id) <= le64_to_cpu(raw->nr_completed_id))
 			report("Reaper", "next read id before completed.");
@@ -1344,7 +1665,8 @@ static struct object *parse_reaper(u64 oid)
 		if (list.subtype != APFS_OBJECT_TYPE_INVALID)
 			report("Reaper list", "wrong object subtype.");
 
-		if (list_raw->nrl_max != cpu_to_le32((sb->s_blocksize - sizeof(*list_raw)) / sizeof(struct apfs_nx_reap_list_entry)))
+		if (list_raw->nrl_max != cpu_to_le32((curr_sb()->s_blocksize - sizeof(*list_raw)) /
+						     sizeof(struct apfs_nx_reap_list_entry)))
 			report("Reaper list", "wrong maximum entry count.");
 
 		if (list_raw->nrl_next || list_raw->nrl_flags || list_raw->nrl_count)
@@ -1353,7 +1675,7 @@ static struct object *parse_reaper(u64 oid)
 			report_unknown("Nonempty reaper list");
 		/* TODO: nrl_free? */
 
-		munmap(list_raw, sb->s_blocksize);
+		release_block(list_raw);
 	} else {
 		if (raw->nr_completed_id || raw->nr_head || raw->nr_rlcount || raw->nr_type)
 			report("Reaper", "should be empty.");
@@ -1377,6 +1699,6 @@ static struct object *parse_reaper(u64 oid)
 	if (flags & APFS_NR_CONTINUE)
 		report_unknown("Object being reaped");
 
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 	return reaper;
 }
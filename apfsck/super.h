@@ -7,6 +7,7 @@
 
 #include <apfs/raw.h>
 #include <apfs/types.h>
+#include "cbmap.h"
 #include "htable.h"
 #include "object.h"
 #include "spaceman.h"
@@ -33,16 +34,20 @@ struct volume_superblock {
 	struct listed_btree *v_snap_extrefs;	/* Snapshots have their own */
 	struct btree *v_snap_meta;
 	struct btree *v_snapshots;
-	struct htable_entry **v_omap_table;	/* Hash table of omap records */
-	struct htable_entry **v_inode_table;	/* Hash table of all inodes */
-	struct htable_entry **v_dstream_table;	/* Hash table of all dstreams */
-	struct htable_entry **v_cnid_table;	/* Hash table of all cnids */
-	struct htable_entry **v_extent_table;	/* Hash table of all extents */
-	struct htable_entry **v_snap_table;	/* Hash table of all snapshots */
-	struct htable_entry **v_dirstat_table;	/* Hash table of all dir stats */
-	struct htable_entry **v_crypto_table;	/* Hash table of all crypto states */
+	struct omap_index *v_omap_index;	/* Index of omap records */
+	struct htable *v_inode_table;	/* Hash table of all inodes */
+	struct htable *v_sibling_table;	/* Hash table of all sibling links */
+	struct htable *v_dstream_table;	/* Hash table of all dstreams */
+	struct htable *v_cnid_table;	/* Hash table of all cnids */
+	struct htable *v_extent_table;	/* Hash table of all extents */
+	struct htable *v_snap_table;	/* Hash table of all snapshots */
+	struct htable *v_dirstat_table;	/* Hash table of all dir stats */
+	struct htable *v_crypto_table;	/* Hash table of all crypto states */
+	u64 *v_omap_seen;	/* Bitmap: omap records seen by the snapshot */
 
 	bool v_in_snapshot;			/* Is this a snapshot volume? */
+	bool v_skipped;		/* Left out of the scope of the check? */
+	bool v_snaps_skipped;	/* Were some of its snapshots left out? */
 
 	/* Volume stats as measured by the fsck */
 	u64 v_file_count;	/* Number of files */
@@ -65,14 +70,19 @@ struct volume_superblock {
 	u32 v_next_doc_id;	/* Next document identifier to be assigned */
 	u32 v_index;		/* Index in the container's volume array */
 	bool v_encrypted;	/* Is the volume encrypted? */
+	/* Expanded volume encryption key, if under software encryption */
+	const struct aes_xts_ctx *v_vek;
 
 	struct object v_obj;		/* Object holding the volume sb */
+
+	/* Snapshots found in the snapshot tree, not yet checked */
+	struct snap_check *v_snap_checks;
 };
 
 /* Superblock data in memory */
 struct super_block {
 	struct apfs_nx_superblock *s_raw;
-	void *s_bitmap;	/* Allocation bitmap for the whole container */
+	struct cbmap s_bitmap;	/* Allocation bitmap for the whole container */
 	void *s_ip_bitmap; /* Allocation bitmap for the internal pool */
 	struct btree *s_omap;
 	struct object *s_reaper;
@@ -87,14 +97,18 @@ struct super_block {
 	u32 s_data_index; /* Index of first valid block in checkpoint data */
 	u32 s_data_len; /* Number of valid blocks in checkpoint data area */
 	u64 s_reaper_fs_id; /* Volume id reported by the reaper */
+	bool s_partial; /* Were some volumes or snapshots left unchecked? */
 
 	/* Hash table of ephemeral object mappings for the checkpoint */
-	struct htable_entry **s_cpoint_map_table;
+	struct htable *s_cpoint_map_table;
 	/* Hash table of virtual object mappings for the container */
-	struct htable_entry **s_omap_table;
+	struct omap_index *s_omap_index;
 
 	struct spaceman s_spaceman; /* Information about the space manager */
 
+	/* Volume encryption keys unwrapped from the keybag, if any */
+	struct volume_key *s_volume_keys;
+
 	/* Information about the one volume group in the container, if any */
 	struct volume_group *s_volume_group;
 
@@ -118,16 +132,13 @@ struct cpoint_map {
 
 static inline bool apfs_is_case_insensitive(void)
 {
-	extern struct volume_superblock *vsb;
-
-	return (vsb->v_raw->apfs_incompatible_features &
+	return (curr_vsb()->v_raw->apfs_incompatible_features &
 		cpu_to_le64(APFS_INCOMPAT_CASE_INSENSITIVE)) != 0;
 }
 
 static inline bool apfs_is_normalization_insensitive(void)
 {
-	extern struct volume_superblock *vsb;
-	u64 flags = le64_to_cpu(vsb->v_raw->apfs_incompatible_features);
+	u64 flags = le64_to_cpu(curr_vsb()->v_raw->apfs_incompatible_features);
 
 	if (apfs_is_case_insensitive())
 		return true;
@@ -138,14 +149,14 @@ static inline bool apfs_is_normalization_insensitive(void)
 
 static inline bool apfs_volume_is_in_group(void)
 {
-	u64 features = le64_to_cpu(vsb->v_raw->apfs_features);
+	u64 features = le64_to_cpu(curr_vsb()->v_raw->apfs_features);
 
 	return features & APFS_FEATURE_VOLGRP_SYSTEM_INO_SPACE;
 }
 
 static inline u16 apfs_volume_role(void)
 {
-	return le16_to_cpu(vsb->v_raw->apfs_role);
+	return le16_to_cpu(curr_vsb()->v_raw->apfs_role);
 }
 
 static inline bool apfs_is_data_volume_in_group(void)
@@ -179,9 +190,16 @@ static inline bool uuid_is_null(char uuid[16])
 	return true;
 }
 
+extern bool scope_container_only;
+extern bool scope_latest_checkpoint;
+extern long long scope_snapshots;
+
+extern bool add_scope_volume(const char *spec);
+extern bool scope_is_partial(void);
+extern u64 get_device_size(unsigned int blocksize);
 extern void parse_filesystem(void);
 extern struct volume_superblock *alloc_volume_super(bool snap);
-extern void read_volume_super(int vol, struct volume_superblock *vsb, struct object *obj);
+extern void read_volume_super(int vol, struct object *obj);
 extern void check_volume_super(void);
 
 #endif	/* _SUPER_H */
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Traces of the blocks read by a check.  A recorded trace holds the block
+ * numbers in the order they were read, so that a later check of the same
+ * container can have each block prefetched a little before it's needed.
+ *
+ * The trace is split in sections, one for the container in each checkpoint
+ * and one for each volume superblock, identified by their transaction ids.  A
+ * section is only replayed if the same structure is found again; any change
+ * to a volume gets it a new superblock xid, so its stale section is ignored.
+ * Prefetching is only a hint either way, so a trace can't affect the results
+ * of the check, just its speed.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <apfs/checksum.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "cache.h"
+#include "io.h"
+#include "super.h"
+#include "trace.h"
+
+char *trace_record_path;
+char *trace_replay_path;
+
+#define TRACE_MAGIC	0x31454352544b4346ULL	/* "FCKTRCE1" */
+#define TRACE_VERSION	1
+
+/* Number of 64-bit words in the file header, and in each section header */
+#define TRACE_HDR_WORDS	5
+#define TRACE_SEC_WORDS	4
+
+/* Volume index for the sections of the container itself */
+#define TRACE_CONTAINER	(~0ULL)
+
+/* Number of blocks to prefetch ahead of the current position */
+#define TRACE_WINDOW	IO_QUEUE_DEPTH
+
+/*
+ * Blocks read for a single container checkpoint or volume superblock
+ */
+struct trace_section {
+	u64	s_index;	/* Volume index, or TRACE_CONTAINER */
+	u64	s_xid;		/* Transaction id of the superblock */
+	u64	*s_bnos;	/* Block numbers, in the order they were read */
+	u64	s_count;	/* Number of blocks */
+	u64	s_size;		/* Number of blocks allocated for */
+
+	/* Replay state */
+	u64	s_pos;		/* Number of reads seen so far */
+	u64	s_next;		/* Next block to prefetch */
+};
+
+/*
+ * A whole trace, with its sections in the order they were first seen
+ */
+struct trace {
+	struct trace_section	*t_sections;
+	u64			t_count;	/* Number of sections */
+	char			t_uuid[16];	/* Uuid of the container */
+};
+
+static struct trace old_trace, new_trace;
+static bool old_trace_checked;	/* Was the uuid of the old trace checked? */
+static bool new_trace_started;	/* Is the uuid of the new trace set? */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * trace_get_u64 - Read a little-endian word from a buffer
+ * @words:	the buffer
+ * @count:	number of words in the buffer
+ * @pos:	position of the word, gets incremented
+ * @value:	on return, the word
+ *
+ * Returns false if the buffer is over.
+ */
+static bool trace_get_u64(__le64 *words, u64 count, u64 *pos, u64 *value)
+{
+	if (*pos >= count)
+		return false;
+	*value = le64_to_cpu(words[(*pos)++]);
+	return true;
+}
+
+/**
+ * trace_get_varint - Read a variable-length integer from a section
+ * @buf:	start of the packed integers
+ * @len:	length of @buf in bytes
+ * @pos:	position in bytes, gets incremented
+ * @value:	on return, the integer
+ *
+ * Returns false if the integer is cut short.
+ */
+static bool trace_get_varint(u8 *buf, u64 len, u64 *pos, u64 *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (*pos < len && shift < 64) {
+		u8 byte = buf[(*pos)++];
+
+		*value |= (u64)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+		shift += 7;
+	}
+	return false;
+}
+
+/**
+ * trace_add - Append a block number to a trace section
+ * @sec:	the section
+ * @bno:	the block number
+ */
+static void trace_add(struct trace_section *sec, u64 bno)
+{
+	if (sec->s_count == sec->s_size) {
+		sec->s_size = sec->s_size ? 2 * sec->s_size : 256;
+		sec->s_bnos = realloc(sec->s_bnos, sec->s_size * sizeof(*sec->s_bnos));
+		if (!sec->s_bnos)
+			system_error();
+	}
+	sec->s_bnos[sec->s_count++] = bno;
+}
+
+/**
+ * trace_find - Find the section of a trace for a given superblock
+ * @trace:	the trace
+ * @index:	volume index, or TRACE_CONTAINER
+ * @xid:	transaction id of the superblock
+ * @create:	add the section if it's not there?
+ *
+ * Returns NULL if the section doesn't exist and @create is false.
+ */
+static struct trace_section *trace_find(struct trace *trace, u64 index,
+					u64 xid, bool create)
+{
+	struct trace_section *sec;
+	u64 i;
+
+	/* Sections are few, and usually the last one is the one we want */
+	for (i = trace->t_count; i > 0; --i) {
+		sec = &trace->t_sections[i - 1];
+		if (sec->s_index == index && sec->s_xid == xid)
+			return sec;
+	}
+	if (!create)
+		return NULL;
+
+	trace->t_sections = realloc(trace->t_sections,
+				    (trace->t_count + 1) * sizeof(*sec));
+	if (!trace->t_sections)
+		system_error();
+	sec = &trace->t_sections[trace->t_count++];
+	memset(sec, 0, sizeof(*sec));
+	sec->s_index = index;
+	sec->s_xid = xid;
+	return sec;
+}
+
+/**
+ * trace_free - Free the sections of a trace
+ * @trace: the trace
+ */
+static void trace_free(struct trace *trace)
+{
+	u64 i;
+
+	for (i = 0; i < trace->t_count; ++i)
+		free(trace->t_sections[i].s_bnos);
+	free(trace->t_sections);
+	trace->t_sections = NULL;
+	trace->t_count = 0;
+}
+
+/**
+ * trace_parse - Parse the contents of a trace file
+ * @words:	the contents, as 64-bit words
+ * @count:	number of words
+ *
+ * Returns false if the file is corrupted.  The trace is only used once the
+ * whole file was parsed.
+ */
+static bool trace_parse(__le64 *words, u64 count)
+{
+	u64 magic, version, sec_count;
+	u64 pos = 0;
+	u64 i, j;
+
+	if (count < TRACE_HDR_WORDS + 1)
+		return false;
+	if (le64_to_cpu(words[count - 1]) != crc32c(~0, words, (count - 1) * 8))
+		return false;
+	--count;
+
+	trace_get_u64(words, count, &pos, &magic);
+	trace_get_u64(words, count, &pos, &version);
+	if (magic != TRACE_MAGIC || version != TRACE_VERSION)
+		return false;
+	/* The uuid is just copied as is, without byte swapping */
+	memcpy(old_trace.t_uuid, &words[pos], sizeof(old_trace.t_uuid));
+	pos += 2;
+	trace_get_u64(words, count, &pos, &sec_count);
+
+	for (i = 0; i < sec_count; ++i) {
+		struct trace_section *sec;
+		u64 index, xid, bno_count, len;
+		u64 bno = 0, off = 0;
+		u8 *buf;
+
+		if (!trace_get_u64(words, count, &pos, &index) ||
+		    !trace_get_u64(words, count, &pos, &xid) ||
+		    !trace_get_u64(words, count, &pos, &bno_count) ||
+		    !trace_get_u64(words, count, &pos, &len))
+			return false;
+		if (len > (count - pos) * 8)
+			return false;
+
+		/* Each block number is packed as the zigzag delta to the last */
+		buf = (u8 *)&words[pos];
+		sec = trace_find(&old_trace, index, xid, true /* create */);
+		for (j = 0; j < bno_count; ++j) {
+			u64 delta;
+
+			if (!trace_get_varint(buf, len, &off, &delta))
+				return false;
+			bno += (delta >> 1) ^ -(delta & 1);
+			trace_add(sec, bno);
+		}
+		pos += (len + 7) / 8;
+	}
+	return pos == count;
+}
+
+/**
+ * trace_load - Read the trace file to replay, if any
+ *
+ * A trace file that can't be used is just ignored.
+ */
+void trace_load(void)
+{
+	struct stat st;
+	__le64 *words;
+	FILE *file;
+
+	if (!trace_replay_path)
+		return;
+
+	file = fopen(trace_replay_path, "r");
+	if (!file)
+		return;
+	if (fstat(fileno(file), &st))
+		system_error();
+	if (!st.st_size || st.st_size % 8) {
+		fclose(file);
+		return;
+	}
+
+	words = malloc(st.st_size);
+	if (!words)
+		system_error();
+	if (fread(words, st.st_size, 1, file) != 1)
+		system_error();
+	fclose(file);
+
+	if (!trace_parse(words, st.st_size / 8))
+		trace_free(&old_trace);
+	free(words);
+}
+
+/**
+ * trace_replay - Advance the replay of a trace section, after a read
+ * @sec:	the section
+ * @bnos:	on return, the blocks that must be prefetched now
+ *
+ * Returns the number of blocks in @bnos.  Must be called with the trace lock
+ * held, but the prefetches must be started after it's dropped.
+ */
+static int trace_replay(struct trace_section *sec, u64 *bnos)
+{
+	int count = 0;
+
+	/* The first reads of the section will have to wait anyway */
+	if (sec->s_next < sec->s_pos)
+		sec->s_next = sec->s_pos;
+	++sec->s_pos;
+	while (sec->s_next < sec->s_count &&
+	       sec->s_next < sec->s_pos + TRACE_WINDOW)
+		bnos[count++] = sec->s_bnos[sec->s_next++];
+	return count;
+}
+
+/**
+ * __trace_read - Record a block read, and prefetch the ones that came next
+ * @bno: block number
+ *
+ * Reads before the checkpoint superblock is known are only recorded.
+ */
+void __trace_read(u64 bno)
+{
+	struct trace_section *sec;
+	u64 bnos[TRACE_WINDOW + 1];
+	u64 index, xid;
+	int count = 0;
+	int i;
+
+	/* Reads for a volume start once its superblock is in place */
+	if (curr_vsb() && curr_vsb()->v_raw) {
+		index = curr_vsb()->v_index;
+		xid = curr_vsb()->v_obj.xid;
+	} else {
+		index = TRACE_CONTAINER;
+		xid = curr_sb()->s_xid;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_record_path) {
+		if (!new_trace_started && curr_sb()->s_raw) {
+			memcpy(new_trace.t_uuid, curr_sb()->s_raw->nx_uuid,
+			       sizeof(new_trace.t_uuid));
+			new_trace_started = true;
+		}
+		sec = trace_find(&new_trace, index, xid, true /* create */);
+		/* Buffers are often read again right away, don't bother */
+		if (!sec->s_count || sec->s_bnos[sec->s_count - 1] != bno)
+			trace_add(sec, bno);
+	}
+
+	if (old_trace.t_count && curr_sb()->s_raw) {
+		if (!old_trace_checked) {
+			old_trace_checked = true;
+			if (memcmp(old_trace.t_uuid, curr_sb()->s_raw->nx_uuid,
+				   sizeof(old_trace.t_uuid)))
+				trace_free(&old_trace);
+		}
+		sec = trace_find(&old_trace, index, xid, false /* create */);
+		if (sec)
+			count = trace_replay(sec, bnos);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	for (i = 0; i < count; ++i) {
+		if (bnos[i] < curr_sb()->s_block_count)
+			cache_prefetch(bnos[i]);
+	}
+}
+
+/**
+ * trace_put_u64 - Append a little-endian word to a buffer
+ * @words:	pointer to the buffer, reallocated as needed
+ * @count:	number of words in use, gets incremented
+ * @size:	number of words allocated
+ * @value:	the new word
+ */
+static void trace_put_u64(__le64 **words, u64 *count, u64 *size, u64 value)
+{
+	if (*count == *size) {
+		*size = *size ? 2 * *size : 1024;
+		*words = realloc(*words, *size * sizeof(**words));
+		if (!*words)
+			system_error();
+	}
+	(*words)[(*count)++] = cpu_to_le64(value);
+}
+
+/**
+ * trace_pack - Pack the block numbers of a section as variable-length deltas
+ * @sec:	the section
+ * @len:	on return, the length of the packed buffer in bytes
+ *
+ * Returns the packed buffer, zero-padded to a whole number of words.
+ */
+static u8 *trace_pack(struct trace_section *sec, u64 *len)
+{
+	u64 prev = 0;
+	u8 *buf;
+	u64 i;
+
+	/* Ten bytes are enough for any 64-bit integer */
+	buf = calloc(sec->s_count * 10 + 8, 1);
+	if (!buf)
+		system_error();
+
+	*len = 0;
+	for (i = 0; i < sec->s_count; ++i) {
+		int64_t delta = sec->s_bnos[i] - prev;
+		u64 zigzag = ((u64)delta << 1) ^ (u64)(delta >> 63);
+
+		do {
+			u8 byte = zigzag & 0x7f;
+
+			zigzag >>= 7;
+			buf[(*len)++] = byte | (zigzag ? 0x80 : 0);
+		} while (zigzag);
+		prev = sec->s_bnos[i];
+	}
+	return buf;
+}
+
+/**
+ * trace_save - Write the recorded trace, if requested
+ *
+ * The file is written elsewhere first, so that a crash never leaves a partial
+ * file behind.
+ */
+void trace_save(void)
+{
+	__le64 *words = NULL;
+	u64 count = 0, size = 0;
+	char *tmp_path;
+	FILE *file;
+	u64 i, j;
+
+	if (!trace_record_path || !new_trace_started)
+		return;
+
+	trace_put_u64(&words, &count, &size, TRACE_MAGIC);
+	trace_put_u64(&words, &count, &size, TRACE_VERSION);
+	trace_put_u64(&words, &count, &size, 0);
+	trace_put_u64(&words, &count, &size, 0);
+	memcpy(&words[2], new_trace.t_uuid, sizeof(new_trace.t_uuid));
+	trace_put_u64(&words, &count, &size, new_trace.t_count);
+	for (i = 0; i < new_trace.t_count; ++i) {
+		struct trace_section *sec = &new_trace.t_sections[i];
+		u64 len;
+		u8 *buf;
+
+		buf = trace_pack(sec, &len);
+		trace_put_u64(&words, &count, &size, sec->s_index);
+		trace_put_u64(&words, &count, &size, sec->s_xid);
+		trace_put_u64(&words, &count, &size, sec->s_count);
+		trace_put_u64(&words, &count, &size, len);
+		for (j = 0; j < len; j += 8) {
+			__le64 word;
+
+			memcpy(&word, buf + j, 8);
+			trace_put_u64(&words, &count, &size, le64_to_cpu(word));
+		}
+		free(buf);
+	}
+	trace_put_u64(&words, &count, &size, crc32c(~0, words, count * 8));
+
+	tmp_path = malloc(strlen(trace_record_path) + 5);
+	if (!tmp_path)
+		system_error();
+	strcpy(tmp_path, trace_record_path);
+	strcat(tmp_path, ".tmp");
+	file = fopen(tmp_path, "w");
+	if (!file)
+		system_error();
+	if (fwrite(words, count * 8, 1, file) != 1)
+		system_error();
+	if (fflush(file) || fsync(fileno(file)) || fclose(file))
+		system_error();
+	if (rename(tmp_path, trace_record_path))
+		system_error();
+
+	free(tmp_path);
+	free(words);
+	trace_free(&new_trace);
+	trace_free(&old_trace);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <apfs/types.h>
+
+extern char *trace_record_path;	/* Trace file from the -t option, or NULL */
+extern char *trace_replay_path;	/* Trace file from the -T option, or NULL */
+
+extern void trace_load(void);
+extern void __trace_read(u64 bno);
+extern void trace_save(void);
+
+/**
+ * trace_read - Record a block read, and prefetch the ones that came next
+ * @bno: block number
+ */
+static inline void trace_read(u64 bno)
+{
+	if (trace_record_path || trace_replay_path)
+		__trace_read(bno);
+}
+
+#endif	/* _TRACE_H */
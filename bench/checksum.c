@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Throughput benchmark for the checksum implementations in libapfs.  Each one
+ * is first checked against the scalar code, for a few buffer lengths.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <apfs/checksum.h>
+#include <apfs/types.h>
+
+#define BENCH_BLOCK_SIZE	4096
+#define BENCH_BLOCK_COUNT	4096	/* 16 MiB of data */
+#define BENCH_ROUNDS		16
+
+/**
+ * now - Get the current time in seconds, from a monotonic clock
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * fill_random - Fill a buffer with pseudorandom bytes
+ * @buf:	the buffer
+ * @len:	length of the buffer
+ */
+static void fill_random(void *buf, size_t len)
+{
+	u8 *curr = buf;
+	size_t i;
+
+	srandom(0);
+	for (i = 0; i < len; ++i)
+		curr[i] = random();
+}
+
+/**
+ * scalar_fletcher64 - Find the basic implementation of fletcher64()
+ */
+static const struct fletcher64_impl *scalar_fletcher64(void)
+{
+	const struct fletcher64_impl *impl;
+
+	for (impl = fletcher64_impls; impl->name; ++impl) {
+		if (strcmp(impl->name, "scalar") == 0)
+			return impl;
+	}
+	fprintf(stderr, "No scalar implementation of fletcher64()\n");
+	exit(1);
+}
+
+/**
+ * check_fletcher64 - Compare an implementation of fletcher64() to the scalar one
+ * @impl:	the implementation
+ * @data:	a buffer of random data, of at least one block
+ */
+static void check_fletcher64(const struct fletcher64_impl *impl, void *data)
+{
+	static const unsigned long lengths[] = {
+		0, 4, 28, 60, 64, 68, 124, 4096 - 32, 4096,
+	};
+	const struct fletcher64_impl *scalar = scalar_fletcher64();
+	int i;
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+		unsigned long len = lengths[i];
+
+		if (impl->fn(data, len) != scalar->fn(data, len)) {
+			fprintf(stderr, "fletcher64 %s: wrong result for length %lu\n",
+				impl->name, len);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * bench_fletcher64 - Measure the throughput of the fletcher64() implementations
+ * @data: a buffer of random data, of BENCH_BLOCK_COUNT blocks
+ */
+static void bench_fletcher64(void *data)
+{
+	const struct fletcher64_impl *impl;
+
+	for (impl = fletcher64_impls; impl->name; ++impl) {
+		double start, secs;
+		u64 total = 0;
+		int round, i;
+
+		if (!impl->supported()) {
+			printf("fletcher64 %-8s not supported by the cpu\n", impl->name);
+			continue;
+		}
+		check_fletcher64(impl, data);
+
+		start = now();
+		for (round = 0; round < BENCH_ROUNDS; ++round) {
+			for (i = 0; i < BENCH_BLOCK_COUNT; ++i)
+				total += impl->fn(data + i * BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE);
+		}
+		secs = now() - start;
+
+		/* Print the total, so that the compiler can't skip the work */
+		printf("fletcher64 %-8s %8.1f MiB/s  (%016llx)\n", impl->name,
+		       (double)BENCH_ROUNDS * BENCH_BLOCK_COUNT * BENCH_BLOCK_SIZE / secs / (1 << 20),
+		       (unsigned long long)total);
+	}
+}
+
+/**
+ * check_crc32c - Compare an implementation of crc32c() to the table-based one
+ * @impl:	the implementation
+ * @data:	a buffer of random data, of at least one block
+ */
+static void check_crc32c(const struct crc32c_impl *impl, void *data)
+{
+	static const int lengths[] = {0, 1, 3, 4, 7, 8, 9, 15, 255, 4096};
+	const struct crc32c_impl *table = NULL;
+	int i;
+
+	for (table = crc32c_impls; table->name; ++table) {
+		if (strcmp(table->name, "table") == 0)
+			break;
+	}
+	if (!table->name) {
+		fprintf(stderr, "No table implementation of crc32c()\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+		int len = lengths[i];
+
+		/* Also try some misaligned buffers */
+		if (impl->fn(0xFFFFFFFF, data + i, len) !=
+		    table->fn(0xFFFFFFFF, data + i, len)) {
+			fprintf(stderr, "crc32c %s: wrong result for length %d\n",
+				impl->name, len);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * bench_crc32c - Measure the throughput of the crc32c() implementations
+ * @data: a buffer of random data, of BENCH_BLOCK_COUNT blocks
+ *
+ * Dentry names are short, so the buffers used here are short as well.
+ */
+static void bench_crc32c(void *data)
+{
+	const struct crc32c_impl *impl;
+	const int len = 64; /* Sixteen UTF-32 characters */
+
+	for (impl = crc32c_impls; impl->name; ++impl) {
+		double start, secs;
+		u32 total = 0;
+		int round, i;
+
+		if (!impl->supported()) {
+			printf("crc32c     %-8s not supported by the cpu\n", impl->name);
+			continue;
+		}
+		check_crc32c(impl, data);
+
+		start = now();
+		for (round = 0; round < BENCH_ROUNDS; ++round) {
+			for (i = 0; i < BENCH_BLOCK_COUNT * BENCH_BLOCK_SIZE / len; ++i)
+				total += impl->fn(0xFFFFFFFF, data + i * len, len);
+		}
+		secs = now() - start;
+
+		printf("crc32c     %-8s %8.1f MiB/s  (%08x)\n", impl->name,
+		       (double)BENCH_ROUNDS * BENCH_BLOCK_COUNT * BENCH_BLOCK_SIZE / secs / (1 << 20),
+		       total);
+	}
+}
+
+int main(void)
+{
+	void *data;
+
+	data = malloc(BENCH_BLOCK_COUNT * BENCH_BLOCK_SIZE);
+	if (!data) {
+		perror("malloc");
+		return 1;
+	}
+	fill_random(data, BENCH_BLOCK_COUNT * BENCH_BLOCK_SIZE);
+
+	bench_fletcher64(data);
+	bench_crc32c(data);
+
+	free(data);
+	return 0;
+}
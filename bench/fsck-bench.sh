@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+#
+# Throughput benchmark for apfsck, on synthetic images made by mkapfs.  Each
+# image is checked several times, after a warm-up run so that it's always in
+# the page cache; the report has the median and the relative standard
+# deviation of b-tree nodes, records and bytes read per second, along with the
+# median time for each phase.  The catalogs are also walked through the query
+# interface of the library, which must find the same records as apfsck.
+#
+# usage: fsck-bench.sh [-r runs] [-j jobs] [spec...]
+#
+# Each spec is passed to mkapfs -G; the default ones cover wide and deep trees,
+# snapshots, and a file with a huge number of hard links.  The images go in
+# $TMPDIR, and are sparse.
+
+set -e
+
+BENCH_DIR=$(dirname "$0")
+MKAPFS="$BENCH_DIR/../mkapfs/mkapfs"
+APFSCK="$BENCH_DIR/../apfsck/apfsck"
+QUERY="$BENCH_DIR/query-bench"
+IMAGE="${TMPDIR:-/tmp}/apfsck-bench.img"
+IMAGE_SIZE=8G
+
+runs=5
+jobs=1
+while getopts "r:j:" opt; do
+	case $opt in
+	r) runs=$OPTARG ;;
+	j) jobs=$OPTARG ;;
+	*) echo "usage: $0 [-r runs] [-j jobs] [spec...]" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+	set -- "inodes=10000,extents=20000" \
+	       "inodes=200000,extents=400000" \
+	       "inodes=200000,extents=400000,fanout=8" \
+	       "inodes=50000,extents=100000,snapshots=16" \
+	       "inodes=10,links=100000"
+fi
+
+trap 'rm -f "$IMAGE" "$IMAGE".*' EXIT
+
+# Print one field from the JSON statistics of apfsck, summed for all volumes
+json_sum() {
+	grep -o "\"$1\": [0-9]*" "$IMAGE.json" | awk '{ sum += $2 } END { print sum + 0 }'
+}
+
+# Print the sum of the node or key counts for all trees of all volumes
+json_trees() {
+	grep -o "{\"nodes\": [0-9]*, \"keys\": [0-9]*}" "$IMAGE.json" |
+		awk -v field="$1" '{ gsub(/[{},]/, ""); sum += (field == "nodes" ? $2 : $4) }
+				   END { print sum + 0 }'
+}
+
+# Read one value per line and print the median and relative standard deviation
+summarize() {
+	sort -g | awk '{ v[NR] = $1; sum += $1; sq += $1 * $1 }
+		END {
+			med = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+			mean = sum / NR
+			var = sq / NR - mean * mean
+			printf "%12.1f  (+-%4.1f%%)", med, mean ? 100 * sqrt(var > 0 ? var : 0) / mean : 0
+		}'
+}
+
+for spec in "$@"; do
+	rm -f "$IMAGE"
+	truncate -s $IMAGE_SIZE "$IMAGE"
+	"$MKAPFS" -G "$spec" "$IMAGE"
+
+	# Warm-up run, which also makes sure that the image is valid
+	"$APFSCK" -cuw -j "$jobs" "$IMAGE"
+
+	"$QUERY" "$IMAGE" > "$IMAGE.query"
+	"$APFSCK" -S "$IMAGE" 2> "$IMAGE.json"
+	records=$(grep -o '"catalog": {"nodes": [0-9]*, "keys": [0-9]*}' "$IMAGE.json" |
+		  awk '{ gsub(/}/, ""); sum += $5 } END { print sum + 0 }')
+	if [ "$(tail -n 1 "$IMAGE.query")" != "$records" ]; then
+		echo "$spec: the query interface found $(tail -n 1 "$IMAGE.query") catalog records, apfsck found $records" >&2
+		exit 1
+	fi
+
+	: > "$IMAGE.nodes"; : > "$IMAGE.keys"; : > "$IMAGE.mbs"; : > "$IMAGE.phases"
+	i=0
+	while [ $i -lt "$runs" ]; do
+		"$APFSCK" -j "$jobs" -S "$IMAGE" 2> "$IMAGE.json"
+		ns=$(json_sum total_ns)
+		echo "$(json_trees nodes) $ns" | awk '{ print $1 * 1e9 / $2 }' >> "$IMAGE.nodes"
+		echo "$(json_trees keys) $ns" | awk '{ print $1 * 1e9 / $2 }' >> "$IMAGE.keys"
+		echo "$(json_sum bytes_read) $ns" | awk '{ print $1 * 1e3 / $2 }' >> "$IMAGE.mbs"
+		sed -n 's/^ "phases_ns": {\(.*\)},$/\1/p' "$IMAGE.json" >> "$IMAGE.phases"
+		i=$((i + 1))
+	done
+
+	echo "$spec:"
+	sed '$d' "$IMAGE.query" | sed 's/^/  /'
+	echo "  nodes/s   $(summarize < "$IMAGE.nodes")"
+	echo "  records/s $(summarize < "$IMAGE.keys")"
+	echo "  MB/s      $(summarize < "$IMAGE.mbs")"
+	printf "  phases (median ms):"
+	tr -d '"' < "$IMAGE.phases" | tr ',' '\n' | awk -F': ' '
+		{ gsub(/^ +/, "", $1); n = ++count[$1]; t[$1, n] = $2 / 1e6
+		  if (n == 1) order[++names] = $1 }
+		END {
+			for (i = 1; i <= names; ++i) {
+				name = order[i]; n = count[name]
+				for (j = 1; j <= n; ++j) s[j] = t[name, j]
+				asort_n(s, n)
+				printf " %s %.1f", name, n % 2 ? s[(n + 1) / 2] : (s[n / 2] + s[n / 2 + 1]) / 2
+			}
+			printf "\n"
+		}
+		function asort_n(a, n,    i, j, x) {
+			for (i = 2; i <= n; ++i) {
+				x = a[i]
+				for (j = i - 1; j >= 1 && a[j] > x; --j)
+					a[j + 1] = a[j]
+				a[j + 1] = x
+			}
+		}'
+	rm -f "$IMAGE.nodes" "$IMAGE.keys" "$IMAGE.mbs" "$IMAGE.phases" "$IMAGE.query"
+done
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Benchmark for the hash tables of apfsck, with the id patterns they get in
+ * practice: catalog ids that are mostly sequential, and block numbers spread
+ * all over the container.  The table code is linked straight from apfsck, so
+ * the few things it needs from the rest of the checker are stubbed here.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "htable.h"
+#include "stats.h"
+
+#define BENCH_ID_COUNT	(1024 * 1024)
+#define BENCH_ROUNDS	8
+
+/*
+ * Longest probe sequence allowed when the entries of one table are copied to
+ * another, as apfsck does for the inodes and dstreams.  With a good hash this
+ * stays in the tens; it went into the thousands when all tables shared one.
+ */
+#define BENCH_MAX_PROBE	64
+
+/* Entry with the size of a typical inode record */
+struct bench_entry {
+	struct htable_entry	b_htable;
+	u64			b_data[7];
+};
+
+/* The statistics are only turned on for check_rehash() */
+int stats_format;
+u64 stats_counters[STAT_COUNTER_COUNT];
+__thread struct check_context *curr_ctx;
+
+void stats_max(enum stat_counter counter, u64 n)
+{
+	if (stats_format && n > stats_counters[counter])
+		stats_counters[counter] = n;
+}
+
+__attribute__((noreturn)) void system_error(void)
+{
+	perror("htable");
+	exit(1);
+}
+
+__attribute__((noreturn)) void report(const char *context, const char *message, ...)
+{
+	va_list args;
+
+	va_start(args, message);
+	fprintf(stderr, "htable: %s: ", context);
+	vfprintf(stderr, message, args);
+	fputc('\n', stderr);
+	va_end(args);
+	exit(1);
+}
+
+/**
+ * now - Get the current time in seconds, from a monotonic clock
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * make_ids - Put together the list of ids for a benchmark
+ * @ids:	array of BENCH_ID_COUNT ids
+ * @sparse:	spread the ids over a big range, like block numbers?
+ *
+ * Sequential ids still have a few gaps, like the cnids of deleted files.
+ */
+static void make_ids(u64 *ids, bool sparse)
+{
+	u64 id = APFS_MIN_USER_INO_NUM;
+	int i;
+
+	srandom(0);
+	for (i = 0; i < BENCH_ID_COUNT; ++i) {
+		if (sparse)
+			id = ((u64)random() << 20) ^ random();
+		else
+			id += random() % 8 ? 1 : 1 + random() % 16;
+		ids[i] = id;
+	}
+}
+
+/**
+ * check_table - Check that all the ids are found in a table
+ * @table:	the table
+ * @ids:	array of BENCH_ID_COUNT ids, all in the table
+ */
+static void check_table(struct htable *table, u64 *ids)
+{
+	int i;
+
+	for (i = 0; i < BENCH_ID_COUNT; ++i) {
+		struct htable_entry *entry;
+
+		entry = get_htable_entry(ids[i], sizeof(struct bench_entry), table);
+		if (entry->h_id != ids[i]) {
+			fprintf(stderr, "htable: wrong entry for id 0x%llx\n",
+				(unsigned long long)ids[i]);
+			exit(1);
+		}
+	}
+	if (table->t_count != BENCH_ID_COUNT) {
+		fprintf(stderr, "htable: wrong entry count\n");
+		exit(1);
+	}
+}
+
+/* Destination table for copy_entry() */
+static struct htable *rehash_table;
+
+static void copy_entry(struct htable_entry *entry)
+{
+	get_htable_entry(entry->h_id, sizeof(struct bench_entry), rehash_table);
+}
+
+/**
+ * check_rehash - Check the probe lengths when moving entries between tables
+ * @ids:	array of BENCH_ID_COUNT ids
+ * @name:	name of the id pattern, for the report
+ *
+ * The entries are visited in the slot order of the first table, while the
+ * second one is still small.  This is what happens when apfsck goes through
+ * the inode table to fill the cnid table.
+ */
+static void check_rehash(u64 *ids, const char *name)
+{
+	struct htable *table = alloc_htable();
+	u64 max_probe;
+	int i;
+
+	for (i = 0; i < BENCH_ID_COUNT; ++i)
+		get_htable_entry(ids[i], sizeof(struct bench_entry), table);
+
+	stats_format = 1;
+	stats_counters[STAT_HTABLE_MAX_PROBE] = 0;
+	rehash_table = alloc_htable();
+	apply_on_htable(table, copy_entry);
+	max_probe = stats_counters[STAT_HTABLE_MAX_PROBE];
+	stats_format = 0;
+
+	free_htable(rehash_table, NULL);
+	free_htable(table, NULL);
+
+	printf("htable  %-10s rehash max probe %llu\n", name,
+	       (unsigned long long)max_probe);
+	if (max_probe > BENCH_MAX_PROBE) {
+		fprintf(stderr, "htable: probes too long after a rehash\n");
+		exit(1);
+	}
+}
+
+/**
+ * bench_table - Measure insertions and lookups for a list of ids
+ * @ids:	array of BENCH_ID_COUNT ids
+ * @name:	name of the id pattern, for the report
+ */
+static void bench_table(u64 *ids, const char *name)
+{
+	double insert_secs = 0, lookup_secs = 0, start;
+	u64 total = 0;
+	int round, i;
+
+	for (round = 0; round < BENCH_ROUNDS; ++round) {
+		struct htable *table = alloc_htable();
+
+		start = now();
+		for (i = 0; i < BENCH_ID_COUNT; ++i)
+			get_htable_entry(ids[i], sizeof(struct bench_entry), table);
+		insert_secs += now() - start;
+
+		/* Look the ids up in a different order than they were added */
+		start = now();
+		for (i = 0; i < BENCH_ID_COUNT; ++i) {
+			u64 id = ids[(i * 7919ULL) % BENCH_ID_COUNT];
+
+			total += get_htable_entry(id, sizeof(struct bench_entry), table)->h_id;
+		}
+		lookup_secs += now() - start;
+
+		if (round == 0)
+			check_table(table, ids);
+		free_htable(table, NULL);
+	}
+
+	/* Print the total, so that the compiler can't skip the work */
+	printf("htable  %-10s insert %8.2f Mops/s  lookup %8.2f Mops/s  (%08x)\n",
+	       name, (double)BENCH_ROUNDS * BENCH_ID_COUNT / insert_secs / 1e6,
+	       (double)BENCH_ROUNDS * BENCH_ID_COUNT / lookup_secs / 1e6,
+	       (u32)total);
+}
+
+int main(void)
+{
+	u64 *ids;
+
+	ids = malloc(BENCH_ID_COUNT * sizeof(*ids));
+	if (!ids) {
+		perror("malloc");
+		return 1;
+	}
+
+	make_ids(ids, false /* sparse */);
+	bench_table(ids, "sequential");
+	check_rehash(ids, "sequential");
+	make_ids(ids, true /* sparse */);
+	bench_table(ids, "sparse");
+	check_rehash(ids, "sparse");
+
+	free(ids);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Benchmark for the query interface of the library, on an existing image.
+ * The catalog of each volume is walked in full, and then every inode record
+ * is looked up again with a seek, in a scrambled order.  Any record that is
+ * out of order or can't be found again is treated as a failure, so this also
+ * serves as a test; the total number of catalog records is printed last, for
+ * fsck-bench.sh to compare with apfsck.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <apfs/query.h>
+#include <apfs/raw.h>
+#include <apfs/types.h>
+
+/**
+ * now - Get the current time in seconds, from a monotonic clock
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * query_fail - Report the failure of a query and exit
+ * @im:		the image
+ * @what:	what was being done
+ */
+static __attribute__((noreturn)) void query_fail(struct apfs_image *im,
+						 const char *what)
+{
+	fprintf(stderr, "query: %s: %s\n", what,
+		im->im_error ? im->im_error : "inconsistent results");
+	exit(1);
+}
+
+/**
+ * walk_catalog - Go through all records of a catalog, checking their order
+ * @vol:	the volume
+ * @inos:	on return, an array with the inode numbers, to be freed later
+ * @ino_count:	on return, the length of @inos
+ *
+ * Returns the number of records.
+ */
+static u64 walk_catalog(struct apfs_volume *vol, u64 **inos, u64 *ino_count)
+{
+	struct apfs_image *im = vol->v_cat.t_image;
+	struct apfs_query_key prev, curr;
+	struct apfs_cursor cur;
+	struct apfs_record rec;
+	u64 count = 0, size = 1024;
+	int err;
+
+	*inos = malloc(size * sizeof(**inos));
+	if (!*inos) {
+		perror("malloc");
+		exit(1);
+	}
+	*ino_count = 0;
+
+	apfs_cursor_init(&cur, &vol->v_cat);
+	while ((err = apfs_cursor_next(&cur, &rec)) == 0) {
+		if (apfs_read_tree_key(&vol->v_cat, &rec, &curr))
+			query_fail(im, "catalog walk");
+		if (count && apfs_query_keycmp(&prev, &curr) >= 0)
+			query_fail(im, "catalog records out of order");
+		prev = curr;
+		++count;
+
+		if (curr.type != APFS_TYPE_INODE)
+			continue;
+		if (*ino_count == size) {
+			size <<= 1;
+			*inos = realloc(*inos, size * sizeof(**inos));
+			if (!*inos) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		(*inos)[(*ino_count)++] = curr.id;
+	}
+	if (err != -ENODATA)
+		query_fail(im, "catalog walk");
+	return count;
+}
+
+/**
+ * seek_inodes - Look up every inode record of a catalog
+ * @vol:	the volume
+ * @inos:	array of inode numbers found in the catalog
+ * @count:	length of @inos
+ */
+static void seek_inodes(struct apfs_volume *vol, u64 *inos, u64 count)
+{
+	struct apfs_image *im = vol->v_cat.t_image;
+	u64 i;
+
+	for (i = 0; i < count; ++i) {
+		/* Visit the inodes in a different order than the walk */
+		u64 ino = inos[(i * 7919ULL) % count];
+		struct apfs_query_key key = {
+			.id = ino,
+			.type = APFS_TYPE_INODE,
+		};
+		struct apfs_query_key found;
+		struct apfs_cursor cur;
+		struct apfs_record rec;
+
+		apfs_cursor_init(&cur, &vol->v_cat);
+		if (apfs_cursor_seek(&cur, &key) || apfs_cursor_next(&cur, &rec))
+			query_fail(im, "inode lookup");
+		if (apfs_read_tree_key(&vol->v_cat, &rec, &found))
+			query_fail(im, "inode lookup");
+		if (found.id != ino || found.type != APFS_TYPE_INODE)
+			query_fail(im, "inode lookup");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct apfs_image im;
+	u64 total = 0;
+	int index;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s image\n", argv[0]);
+		return 1;
+	}
+	if (apfs_image_open(&im, argv[1]))
+		query_fail(&im, "open");
+
+	for (index = 0; ; ++index) {
+		struct apfs_volume vol;
+		double start, walk_secs, seek_secs;
+		u64 *inos, ino_count, count;
+		int err;
+
+		err = apfs_volume_open(&im, index, &vol);
+		if (err == -ENODATA)
+			break;
+		if (err)
+			query_fail(&im, "volume open");
+
+		start = now();
+		count = walk_catalog(&vol, &inos, &ino_count);
+		walk_secs = now() - start;
+
+		start = now();
+		seek_inodes(&vol, inos, ino_count);
+		seek_secs = now() - start;
+		free(inos);
+
+		printf("query   volume %-3d walk %8.2f Mrec/s  seek %8.2f Kops/s  (%llu records)\n",
+		       index, count / walk_secs / 1e6,
+		       ino_count ? ino_count / seek_secs / 1e3 : 0.0,
+		       (unsigned long long)count);
+		total += count;
+	}
+
+	printf("%llu\n", (unsigned long long)total);
+	apfs_image_close(&im);
+	return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Benchmark for the normalization of filenames in libapfs, comparing the flat
+ * tables for the BMP against the original tries.  The results of both are
+ * first checked to be identical for the whole corpus.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <apfs/types.h>
+#include <apfs/unicode.h>
+
+#define BENCH_NAME_COUNT	(64 * 1024)
+#define BENCH_NAME_LEN		96
+#define BENCH_ROUNDS		8
+
+/* The first words in name_words[] are plain ASCII */
+#define NAME_ASCII_WORDS	14
+
+/*
+ * Pieces of filenames, to be put together into the corpus.  English names
+ * are the most common, but several scripts and precomposed characters show up
+ * as well, along with a few decomposed sequences.
+ */
+static const char *const name_words[] = {
+	"IMG", "Document", "report", "notes", "backup", "Makefile", "README",
+	"photo", "invoice", "draft", "final", "src", "build", "config",
+	"résumé", "Überweisung", "café", "Ñandú", "façade", "Straße",
+	"Документ", "отчёт", "φωτογραφία", "Ελλάδα", "写真", "文書",
+	"資料", "사진", "문서", "ملف", "תמונה", "ファイル", "e\xcc\x81tude",
+	"A\xcc\x8angstro\xcc\x88m", "\xe1\x84\x80\xe1\x85\xa1",
+};
+
+static const char *const name_exts[] = {
+	".jpg", ".txt", ".pdf", ".c", ".h", ".docx", ".png", "", ".tar.gz",
+};
+
+/**
+ * now - Get the current time in seconds, from a monotonic clock
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * build_corpus - Put together a corpus of pseudorandom filenames
+ * @names: array of BENCH_NAME_COUNT buffers of BENCH_NAME_LEN bytes each
+ */
+static void build_corpus(char (*names)[BENCH_NAME_LEN])
+{
+	int word_count = sizeof(name_words) / sizeof(name_words[0]);
+	int ext_count = sizeof(name_exts) / sizeof(name_exts[0]);
+	int i;
+
+	srandom(0);
+	for (i = 0; i < BENCH_NAME_COUNT; ++i) {
+		const char *first, *second;
+
+		/* Half of the names are plain ASCII, like in most volumes */
+		first = name_words[random() % (i % 2 ? word_count : NAME_ASCII_WORDS)];
+		second = name_words[random() % (i % 2 ? word_count : NAME_ASCII_WORDS)];
+		snprintf(names[i], BENCH_NAME_LEN, "%s_%s %ld%s", first, second,
+			 random() % 1000, name_exts[random() % ext_count]);
+	}
+}
+
+/**
+ * normalize_name - Normalize a filename completely
+ * @name:	the filename
+ * @case_fold:	case fold the name?
+ * @out:	buffer for the result, of BENCH_NAME_LEN characters
+ *
+ * Returns a checksum of the normalized characters.
+ */
+static u32 normalize_name(const char *name, bool case_fold, unicode_t *out)
+{
+	struct unicursor cursor;
+	u32 sum = 0;
+	int i;
+
+	init_unicursor(&cursor, name);
+	for (i = 0; i < BENCH_NAME_LEN; ++i) {
+		out[i] = normalize_next(&cursor, case_fold);
+		if (!out[i])
+			break;
+		sum = sum * 31 + out[i];
+	}
+	return sum;
+}
+
+/**
+ * check_tables - Check that the flat tables give the same results as the tries
+ * @names: the corpus
+ */
+static void check_tables(char (*names)[BENCH_NAME_LEN])
+{
+	unicode_t flat[BENCH_NAME_LEN], trie[BENCH_NAME_LEN];
+	int case_fold, i;
+
+	for (case_fold = 0; case_fold < 2; ++case_fold) {
+		for (i = 0; i < BENCH_NAME_COUNT; ++i) {
+			memset(flat, 0, sizeof(flat));
+			memset(trie, 0, sizeof(trie));
+			unicode_flat_tables = true;
+			normalize_name(names[i], case_fold, flat);
+			unicode_flat_tables = false;
+			normalize_name(names[i], case_fold, trie);
+			if (memcmp(flat, trie, sizeof(flat))) {
+				fprintf(stderr, "unicode: wrong result for '%s'\n",
+					names[i]);
+				exit(1);
+			}
+		}
+	}
+}
+
+/**
+ * bench_tables - Measure the normalization speed with each set of tables
+ * @names: the corpus
+ */
+static void bench_tables(char (*names)[BENCH_NAME_LEN])
+{
+	unicode_t out[BENCH_NAME_LEN];
+	int flat, case_fold;
+
+	for (flat = 1; flat >= 0; --flat) {
+		unicode_flat_tables = flat;
+		for (case_fold = 0; case_fold < 2; ++case_fold) {
+			double start, secs;
+			u32 total = 0;
+			int round, i;
+
+			start = now();
+			for (round = 0; round < BENCH_ROUNDS; ++round) {
+				for (i = 0; i < BENCH_NAME_COUNT; ++i)
+					total += normalize_name(names[i], case_fold, out);
+			}
+			secs = now() - start;
+
+			/* Print the total, so that the compiler can't skip the work */
+			printf("normalize  %-5s %-9s %8.2f Mnames/s  (%08x)\n",
+			       flat ? "flat" : "trie", case_fold ? "casefold" : "",
+			       (double)BENCH_ROUNDS * BENCH_NAME_COUNT / secs / 1e6,
+			       total);
+		}
+	}
+}
+
+int main(void)
+{
+	char (*names)[BENCH_NAME_LEN];
+
+	names = malloc(BENCH_NAME_COUNT * sizeof(*names));
+	if (!names) {
+		perror("malloc");
+		return 1;
+	}
+	build_corpus(names);
+
+	check_tables(names);
+	bench_tables(names);
+
+	free(names);
+	return 0;
+}
@@ -3,7 +3,47 @@
 
 #include <apfs/types.h>
 
+/* XTS sectors are always 512 bytes in APFS */
+#define AES_XTS_SECTOR_SIZE	512
+
+/*
+ * Expanded AES-128 key, for either encryption or decryption.  The schedule is
+ * kept in two layouts: words for the table-based code, and plain bytes for
+ * the aes instructions.
+ */
+struct aes_key {
+	u32 k_rk[44];					/* Round key words */
+	u8 k_round[11][16] __attribute__((aligned(16)));	/* Round keys */
+};
+
+/*
+ * Expanded keys for XTS-AES-128 decryption
+ */
+struct aes_xts_ctx {
+	struct aes_key x_data;	/* Decryption key for the data */
+	struct aes_key x_tweak;	/* Encryption key for the tweak */
+};
+
+/*
+ * An implementation of AES-128 decryption, for a given instruction set
+ */
+struct aes_impl {
+	const char *name;
+	/* Decrypt a single 16-byte block */
+	void (*decrypt)(const struct aes_key *key, const u8 *cipher, u8 *plain);
+	/* Decrypt some consecutive XTS sectors */
+	void (*xts_decrypt)(const struct aes_xts_ctx *ctx, u64 sector,
+			    const u8 *cipher, u8 *plain, u64 count);
+	bool (*supported)(void);	/* Can the cpu run this? */
+};
+
+/* All implementations built in, from best to worst; end with a NULL name */
+extern const struct aes_impl aes_impls[];
+
 int aes_unwrap(const u8 *kek, int n, const u8 *cipher, u8 *plain);
+void aes_xts_init(struct aes_xts_ctx *ctx, const u8 *key1, const u8 *key2);
+void aes_xts_wipe(struct aes_xts_ctx *ctx);
+void aes_xts_decrypt_sectors(const struct aes_xts_ctx *ctx, u64 sector, const u8 *cipher, u64 len, u8 *plain);
 int aes_xts_decrypt(const u8 *key1, const u8 *key2, u64 tweak, const u8 *cipher, int len, u8 *plain);
 
 #endif /* _AES_H */
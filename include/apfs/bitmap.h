@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <apfs/types.h>
+
+/* Number of 64-bit words needed for a bitmap of the given length in bits */
+#define BITMAP_WORDS(nbits)	(((nbits) + 63) / 64)
+
+/*
+ * Bit number i of a bitmap is bit (i % 64) of word (i / 64).  On little-endian
+ * machines this matches the layout of the on-disk allocation bitmaps.
+ */
+
+extern void bitmap_set_range(u64 *bmap, u64 start, u64 len);
+extern void bitmap_clear_range(u64 *bmap, u64 start, u64 len);
+extern bool bitmap_test_range_any(const u64 *bmap, u64 start, u64 len);
+extern u64 bitmap_count_range(const u64 *bmap, u64 start, u64 len);
+extern bool bitmap_is_subset(const u64 *sub, const u64 *super, u64 nbits);
+extern u64 bitmap_first_diff(const u64 *bmap1, const u64 *bmap2, u64 nbits);
+
+#endif	/* _BITMAP_H */
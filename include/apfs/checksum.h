@@ -7,7 +7,30 @@
 
 #include <apfs/types.h>
 
+/*
+ * An implementation of crc32c, for a given instruction set
+ */
+struct crc32c_impl {
+	const char *name;
+	u32 (*fn)(u32 crc, const void *buf, int size);
+	bool (*supported)(void);	/* Can the cpu run this? */
+};
+
+/*
+ * An implementation of the Fletcher-64 checksum, for a given instruction set
+ */
+struct fletcher64_impl {
+	const char *name;
+	u64 (*fn)(void *addr, unsigned long len);
+	bool (*supported)(void);	/* Can the cpu run this? */
+};
+
+/* All implementations built in, from best to worst; end with a NULL name */
+extern const struct crc32c_impl crc32c_impls[];
+extern const struct fletcher64_impl fletcher64_impls[];
+
 extern u32 crc32c(u32 crc, const void *buf, int size);
+extern u32 crc32c_utf32(u32 crc, const unicode_t *chars, int count);
 extern u64 fletcher64(void *addr, unsigned long len);
 
 #endif /* _CHECKSUM_H */
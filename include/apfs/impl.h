@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Runtime dispatch between the implementations of an algorithm.  Each one has
+ * a table of implementations, from best to worst, that ends with an entry with
+ * a NULL name.  Every entry has a supported() callback, and the last real one
+ * must be portable, so that it's always supported.
+ */
+
+#ifndef _IMPL_H
+#define _IMPL_H
+
+/**
+ * pick_impl - Get the best entry of an implementation table for the cpu
+ * @impls: the table
+ *
+ * The result only depends on the cpu, so several threads may pick at once and
+ * store the result without locks: they will all agree on it.
+ */
+#define pick_impl(impls)					\
+({								\
+	typeof(&(impls)[0]) __impl = (impls);			\
+								\
+	while (!__impl->supported())				\
+		++__impl;					\
+	__impl;							\
+})
+
+#endif	/* _IMPL_H */
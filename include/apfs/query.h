@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Read-only access to the trees of a container, for tools other than the fsck.
+ * Nothing here runs any consistency checks beyond what is needed to stay in
+ * bounds: broken structures are reported with -EIO, and the reason is left in
+ * the im_error field of the image.
+ */
+
+#ifndef _QUERY_H
+#define _QUERY_H
+
+#include <apfs/raw.h>
+#include <apfs/types.h>
+
+/* Maximum depth of the b-trees that can be walked */
+#define APFS_QUERY_MAX_DEPTH	12
+
+/* Tree types, which decide how the keys are decoded */
+#define APFS_QUERY_OMAP		1	/* Object map */
+#define APFS_QUERY_CATALOG	2	/* Catalog of a volume */
+#define APFS_QUERY_EXTENTREF	3	/* Extent reference tree of a volume */
+
+struct apfs_image;
+
+/*
+ * Decoded fields of a key, in the order used to sort the trees.  The layout
+ * is the same as the in-memory keys of apfsck.
+ */
+struct apfs_query_key {
+	u64		id;
+	u64		number;	/* Xid, extent offset or name hash */
+	const char	*name;	/* On-disk name string, or NULL */
+	u8		type;	/* Record type (0 for the omap) */
+};
+
+/*
+ * A record in a b-tree node.  The pointers go straight into the mapped image,
+ * so the record remains valid until the image is closed.
+ */
+struct apfs_record {
+	const void	*r_key;
+	const void	*r_val;
+	u16		r_key_len;
+	u16		r_val_len;
+	u64		r_bno;		/* Block number of the node */
+};
+
+/*
+ * A b-tree ready for queries
+ */
+struct apfs_tree {
+	struct apfs_image *t_image;
+	const struct apfs_btree_node_phys *t_root;
+	int		t_type;		/* APFS_QUERY_OMAP, ... */
+	bool		t_hashed;	/* Are the dentry keys hashed? */
+	u16		t_key_size;	/* Key size for fixed size nodes */
+	u16		t_val_size;	/* Value size for fixed size leaf nodes */
+
+	/* Object map for the child nodes, or NULL if they are physical */
+	struct apfs_tree *t_omap;
+	u64		t_xid;		/* Transaction for the omap lookups */
+};
+
+/*
+ * A volume of the container
+ */
+struct apfs_volume {
+	const struct apfs_superblock *v_raw;
+	u64		v_bno;		/* Block number of the superblock */
+	struct apfs_tree v_omap;
+	struct apfs_tree v_cat;
+	struct apfs_tree v_extref;
+};
+
+/*
+ * A container image, for the latest valid checkpoint
+ */
+struct apfs_image {
+	int		im_fd;
+	const void	*im_map;	/* Whole image, mapped read-only */
+	u64		im_map_len;
+	u32		im_blocksize;
+	u64		im_block_count;
+
+	const struct apfs_nx_superblock *im_nx;	/* Checkpoint superblock */
+	u64		im_xid;		/* Transaction of the checkpoint */
+	struct apfs_tree im_omap;	/* Container object map */
+
+	const char	*im_error;	/* Reason for the last -EIO */
+};
+
+/*
+ * Position in a b-tree.  Cursors hold no resources, so they can be dropped at
+ * any point without cleanup.
+ */
+struct apfs_cursor {
+	struct apfs_tree *c_tree;
+	int		c_depth;	/* Level of the current node */
+	const struct apfs_btree_node_phys *c_nodes[APFS_QUERY_MAX_DEPTH];
+	u32		c_index[APFS_QUERY_MAX_DEPTH];	/* Next entry per level */
+};
+
+extern int apfs_image_open(struct apfs_image *im, const char *path);
+extern void apfs_image_close(struct apfs_image *im);
+extern const void *apfs_image_block(struct apfs_image *im, u64 bno);
+extern const void *apfs_image_object(struct apfs_image *im, u64 bno);
+extern int apfs_volume_open(struct apfs_image *im, int index,
+			    struct apfs_volume *vol);
+
+extern int apfs_read_omap_key(const void *raw, int size,
+			      struct apfs_query_key *key);
+extern int apfs_read_cat_key(const void *raw, int size, bool hashed,
+			     struct apfs_query_key *key);
+extern int apfs_read_extentref_key(const void *raw, int size,
+				   struct apfs_query_key *key);
+extern int apfs_read_tree_key(struct apfs_tree *tree,
+			      const struct apfs_record *rec,
+			      struct apfs_query_key *key);
+extern int apfs_query_keycmp(const struct apfs_query_key *k1,
+			     const struct apfs_query_key *k2);
+
+extern int apfs_omap_lookup(struct apfs_tree *omap, u64 oid, u64 xid,
+			    u64 *bno);
+extern void apfs_cursor_init(struct apfs_cursor *cur, struct apfs_tree *tree);
+extern int apfs_cursor_seek(struct apfs_cursor *cur,
+			    const struct apfs_query_key *key);
+extern int apfs_cursor_next(struct apfs_cursor *cur, struct apfs_record *rec);
+
+#endif	/* _QUERY_H */
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <pthread.h>
+
+/*
+ * Group of worker threads that all run the same function
+ */
+struct thread_group {
+	pthread_t	*tg_threads;	/* The threads that were started */
+	unsigned int	tg_count;	/* Length of @tg_threads */
+};
+
+extern void start_threads(struct thread_group *group, unsigned int count,
+			  void *(*fn)(void *), void *arg);
+extern void join_threads(struct thread_group *group);
+extern void run_threads(unsigned int jobs, void *(*fn)(void *), void *arg);
+
+#endif	/* _THREAD_H */
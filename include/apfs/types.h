@@ -16,6 +16,7 @@
 
 #define EAGAIN	1
 #define ENODATA	2
+#define EIO	3
 
 #define __packed	__attribute__((packed))
 
@@ -18,6 +18,9 @@ struct unicursor {
 	u8 last_ccc;		/* CCC of the last character returned */
 };
 
+extern bool unicode_flat_tables;	/* Use the flat tables for the BMP? */
+
+extern bool is_ascii_string(const char *str);
 extern void init_unicursor(struct unicursor *cursor, const char *utf8str);
 extern unicode_t normalize_next(struct unicursor *cursor, bool case_fold);
 
@@ -3,12 +3,14 @@
  * packed into a single file and modified slightly to build here.
  *
  * Also includes an XTS decryption implementation, very similar to the one
- * from apfs-fuse <https://github.com/sgan81/apfs-fuse>.
+ * from apfs-fuse <https://github.com/sgan81/apfs-fuse>, and faster versions
+ * of both that use the aes instructions of x86 and arm64.
  */
 
 #include <stdlib.h>
 #include <string.h>
 #include <apfs/aes.h>
+#include <apfs/impl.h>
 #include <apfs/types.h>
 
 
@@ -68,8 +70,6 @@ static inline u32 rotr(u32 val, int bits)
 (ct)[0] = (u8)((st) >> 24); (ct)[1] = (u8)((st) >> 16); \
 (ct)[2] = (u8)((st) >>  8); (ct)[3] = (u8)(st); }
 
-#define AES_PRIV_SIZE (4 * 4 * 15 + 4)
-#define AES_PRIV_NR_POS (4 * 15)
 
 
 
@@ -971,22 +971,6 @@ static int rijndaelKeySetupDec(u32 rk[], const u8 cipherKey[], int keyBits)
 	return Nr;
 }
 
-static void * aes_decrypt_init(const u8 *key, size_t len)
-{
-	u32 *rk;
-	int res;
-	rk = malloc(AES_PRIV_SIZE);
-	if (rk == NULL)
-		return NULL;
-	res = rijndaelKeySetupDec(rk, key, len * 8);
-	if (res < 0) {
-		free(rk);
-		return NULL;
-	}
-	rk[AES_PRIV_NR_POS] = res;
-	return rk;
-}
-
 static void rijndaelDecrypt(const u32 rk[/*44*/], int Nr, const u8 ct[16],
 			    u8 pt[16])
 {
@@ -1062,18 +1046,6 @@ d##3 = TD0(s##3) ^ TD1(s##2) ^ TD2(s##1) ^ TD3(s##0) ^ rk[4 * i + 3]
 	PUTU32(pt + 12, s3);
 }
 
-static void aes_decrypt(void *ctx, const u8 *crypt, u8 *plain)
-{
-	u32 *rk = ctx;
-	rijndaelDecrypt(ctx, rk[AES_PRIV_NR_POS], crypt, plain);
-}
-
-
-static void aes_decrypt_deinit(void *ctx)
-{
-	memset(ctx, 0, AES_PRIV_SIZE);
-	free(ctx);
-}
 
 
 
@@ -1170,36 +1142,322 @@ d##3 = TE0(s##3) ^ TE1(s##0) ^ TE2(s##1) ^ TE3(s##2) ^ rk[4 * i + 3]
 }
 
 
-static void * aes_encrypt_init(const u8 *key, size_t len)
+
+
+
+
+
+/*
+ * Hardware implementations of AES-128 decryption and XTS, with runtime
+ * dispatch.  The key schedules always come from the code above, so the round
+ * keys for the aes instructions are just those same words as bytes; for
+ * decryption this is the equivalent inverse cipher, as the instructions need.
+ *
+ * Like the rest of the XTS code, this is only for little-endian archs.
+ */
+
+#define AES_ROUNDS	10	/* All keys in APFS are 128 bits long */
+
+/* Number of 16-byte blocks in an XTS sector */
+#define XTS_SECTOR_BLOCKS	(AES_XTS_SECTOR_SIZE / 16)
+
+/**
+ * aes_key_setup - Expand an AES-128 key
+ * @key:	the expanded key
+ * @raw:	the 128-bit raw key
+ * @dec:	expand for decryption?
+ */
+static void aes_key_setup(struct aes_key *key, const u8 *raw, bool dec)
+{
+	int i;
+
+	if (dec)
+		rijndaelKeySetupDec(key->k_rk, raw, 128);
+	else
+		rijndaelKeySetupEnc(key->k_rk, raw, 128);
+	for (i = 0; i < 4 * (AES_ROUNDS + 1); ++i)
+		PUTU32(key->k_round[i / 4] + 4 * (i % 4), key->k_rk[i]);
+}
+
+static void gf_mul(uint64_t *tweak)
+{
+	uint8_t c1;
+	uint8_t c2;
+
+	c1 = (tweak[0] & 0x8000000000000000ULL) ? 1 : 0;
+	c2 = (tweak[1] & 0x8000000000000000ULL) ? 0x87 : 0;
+
+	tweak[0] = (tweak[0] << 1) ^ c2;
+	tweak[1] = (tweak[1] << 1) | c1;
+}
+
+static void xor128(const u8 *num1, const u8 *num2, u8 *result)
+{
+	int i;
+
+	for (i = 0; i < 16; ++i)
+		result[i] = num1[i] ^ num2[i];
+}
+
+static void aes_decrypt_table(const struct aes_key *key, const u8 *cipher,
+			      u8 *plain)
+{
+	rijndaelDecrypt(key->k_rk, AES_ROUNDS, cipher, plain);
+}
+
+/*
+ * After reading the XTS implementation from apfs-fuse <https://github.com/sgan81/apfs-fuse>,
+ * I tried to make my own independent implementation in case I ever needed to
+ * use it for proprietary stuff. I failed because I had the original too fresh
+ * in my mind, so I gave up and even copied some stuff verbatim. Keep in mind
+ * this is all GPLv2 code.
+ */
+static void aes_xts_table(const struct aes_xts_ctx *ctx, u64 sector,
+			  const u8 *cipher, u8 *plain, u64 count)
 {
-	u32 *rk;
-	int res;
-
-	rk = malloc(AES_PRIV_SIZE);
-	if (rk == NULL)
-		return NULL;
-	res = rijndaelKeySetupEnc(rk, key, len * 8);
-	if (res < 0) {
-		free(rk);
-		return NULL;
+	u64 i;
+
+	for (i = 0; i < count; ++i, ++sector) {
+		u8 enc_tweak[16] = {0};
+		int j;
+
+		*(__le64 *)enc_tweak = cpu_to_le64(sector);
+
+		rijndaelEncrypt(ctx->x_tweak.k_rk, AES_ROUNDS, enc_tweak, enc_tweak);
+		for (j = 0; j < XTS_SECTOR_BLOCKS; ++j) {
+			u64 off = i * AES_XTS_SECTOR_SIZE + j * 16;
+			u8 pp[16], cc[16];
+
+			xor128(cipher + off, enc_tweak, cc);
+			rijndaelDecrypt(ctx->x_data.k_rk, AES_ROUNDS, cc, pp);
+			xor128(pp, enc_tweak, plain + off);
+			gf_mul((uint64_t *)enc_tweak);
+		}
 	}
-	rk[AES_PRIV_NR_POS] = res;
-	return rk;
 }
 
+static bool aes_table_supported(void)
+{
+	return true;
+}
+
+/*
+ * The hardware versions decrypt XTS_LANES blocks at a time, so that the
+ * latency of each aes instruction is hidden behind the others.  The tweaks
+ * for the next blocks get computed while those are in flight.
+ */
+#define XTS_LANES	8
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <wmmintrin.h>
+
+/**
+ * xts_next_tweak_sse - Multiply an XTS tweak by x in GF(2^128)
+ * @t: the tweak
+ *
+ * Each 64-bit half is shifted on its own, so the carries from bits 63 and 127
+ * are found with an arithmetic shift of the dwords that hold them.
+ */
+__attribute__((target("sse2")))
+static inline __m128i xts_next_tweak_sse(__m128i t)
+{
+	const __m128i mask = _mm_set_epi32(0, 1, 0, 0x87);
+	__m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+
+	return _mm_xor_si128(_mm_slli_epi64(t, 1), _mm_and_si128(carry, mask));
+}
 
-static int aes_encrypt(void *ctx, const u8 *plain, u8 *crypt)
+__attribute__((target("aes,sse2")))
+static void aes_decrypt_aesni(const struct aes_key *key, const u8 *cipher,
+			      u8 *plain)
 {
-	u32 *rk = ctx;
-	rijndaelEncrypt(ctx, rk[AES_PRIV_NR_POS], plain, crypt);
-	return 0;
+	__m128i b = _mm_loadu_si128((const __m128i *)cipher);
+	int r;
+
+	b = _mm_xor_si128(b, _mm_load_si128((const __m128i *)key->k_round[0]));
+	for (r = 1; r < AES_ROUNDS; ++r)
+		b = _mm_aesdec_si128(b, _mm_load_si128((const __m128i *)key->k_round[r]));
+	b = _mm_aesdeclast_si128(b, _mm_load_si128((const __m128i *)key->k_round[r]));
+	_mm_storeu_si128((__m128i *)plain, b);
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_xts_aesni(const struct aes_xts_ctx *ctx, u64 sector,
+			  const u8 *cipher, u8 *plain, u64 count)
+{
+	__m128i dk[AES_ROUNDS + 1], ek[AES_ROUNDS + 1];
+	const __m128i *in = (const __m128i *)cipher;
+	__m128i *out = (__m128i *)plain;
+	u64 i;
+	int r;
+
+	for (r = 0; r <= AES_ROUNDS; ++r) {
+		dk[r] = _mm_load_si128((const __m128i *)ctx->x_data.k_round[r]);
+		ek[r] = _mm_load_si128((const __m128i *)ctx->x_tweak.k_round[r]);
+	}
+
+	for (i = 0; i < count; ++i, ++sector) {
+		__m128i t = _mm_set_epi64x(0, sector);
+		int j, k;
+
+		t = _mm_xor_si128(t, ek[0]);
+		for (r = 1; r < AES_ROUNDS; ++r)
+			t = _mm_aesenc_si128(t, ek[r]);
+		t = _mm_aesenclast_si128(t, ek[r]);
+
+		for (j = 0; j < XTS_SECTOR_BLOCKS; j += XTS_LANES) {
+			__m128i tw[XTS_LANES], b[XTS_LANES];
+
+			for (k = 0; k < XTS_LANES; ++k) {
+				tw[k] = t;
+				t = xts_next_tweak_sse(t);
+				b[k] = _mm_loadu_si128(in++);
+				b[k] = _mm_xor_si128(b[k], _mm_xor_si128(tw[k], dk[0]));
+			}
+			for (r = 1; r < AES_ROUNDS; ++r) {
+				for (k = 0; k < XTS_LANES; ++k)
+					b[k] = _mm_aesdec_si128(b[k], dk[r]);
+			}
+			for (k = 0; k < XTS_LANES; ++k) {
+				b[k] = _mm_aesdeclast_si128(b[k], dk[r]);
+				_mm_storeu_si128(out++, _mm_xor_si128(b[k], tw[k]));
+			}
+		}
+	}
+}
+
+static bool aes_aesni_supported(void)
+{
+	return __builtin_cpu_supports("aes");
+}
+
+#endif	/* __x86_64__ || __i386__ */
+
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+/**
+ * xts_next_tweak_neon - Multiply an XTS tweak by x in GF(2^128)
+ * @t: the tweak
+ */
+__attribute__((target("+crypto")))
+static inline uint8x16_t xts_next_tweak_neon(uint8x16_t t)
+{
+	uint64x2_t t64 = vreinterpretq_u64_u8(t);
+	u64 lo = vgetq_lane_u64(t64, 0);
+	u64 hi = vgetq_lane_u64(t64, 1);
+	u64 new_lo = (lo << 1) ^ ((hi >> 63) ? 0x87 : 0);
+	u64 new_hi = (hi << 1) | (lo >> 63);
+
+	return vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(new_lo),
+						 vcreate_u64(new_hi)));
+}
+
+/*
+ * The aese/aesd instructions add the round key before the other steps, not
+ * after, so the first key goes in the first instruction and the last one is
+ * added at the end instead.
+ */
+
+__attribute__((target("+crypto")))
+static void aes_decrypt_armv8(const struct aes_key *key, const u8 *cipher,
+			      u8 *plain)
+{
+	uint8x16_t b = vld1q_u8(cipher);
+	int r;
+
+	for (r = 0; r < AES_ROUNDS - 1; ++r)
+		b = vaesimcq_u8(vaesdq_u8(b, vld1q_u8(key->k_round[r])));
+	b = vaesdq_u8(b, vld1q_u8(key->k_round[r]));
+	b = veorq_u8(b, vld1q_u8(key->k_round[r + 1]));
+	vst1q_u8(plain, b);
+}
+
+__attribute__((target("+crypto")))
+static void aes_xts_armv8(const struct aes_xts_ctx *ctx, u64 sector,
+			  const u8 *cipher, u8 *plain, u64 count)
+{
+	uint8x16_t dk[AES_ROUNDS + 1], ek[AES_ROUNDS + 1];
+	u64 i;
+	int r;
+
+	for (r = 0; r <= AES_ROUNDS; ++r) {
+		dk[r] = vld1q_u8(ctx->x_data.k_round[r]);
+		ek[r] = vld1q_u8(ctx->x_tweak.k_round[r]);
+	}
+
+	for (i = 0; i < count; ++i, ++sector) {
+		uint8x16_t t;
+		int j, k;
+
+		t = vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(sector),
+						      vcreate_u64(0)));
+		for (r = 0; r < AES_ROUNDS - 1; ++r)
+			t = vaesmcq_u8(vaeseq_u8(t, ek[r]));
+		t = veorq_u8(vaeseq_u8(t, ek[r]), ek[r + 1]);
+
+		for (j = 0; j < XTS_SECTOR_BLOCKS; j += XTS_LANES) {
+			uint8x16_t tw[XTS_LANES], b[XTS_LANES];
+
+			for (k = 0; k < XTS_LANES; ++k) {
+				tw[k] = t;
+				t = xts_next_tweak_neon(t);
+				b[k] = veorq_u8(vld1q_u8(cipher), tw[k]);
+				cipher += 16;
+			}
+			for (r = 0; r < AES_ROUNDS - 1; ++r) {
+				for (k = 0; k < XTS_LANES; ++k)
+					b[k] = vaesimcq_u8(vaesdq_u8(b[k], dk[r]));
+			}
+			for (k = 0; k < XTS_LANES; ++k) {
+				b[k] = veorq_u8(vaesdq_u8(b[k], dk[r]), dk[r + 1]);
+				vst1q_u8(plain, veorq_u8(b[k], tw[k]));
+				plain += 16;
+			}
+		}
+	}
+}
+
+static bool aes_armv8_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_AES;
 }
 
+#endif	/* __aarch64__ */
+
+/* Available implementations, from best to worst */
+const struct aes_impl aes_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "aesni", aes_decrypt_aesni, aes_xts_aesni, aes_aesni_supported },
+#endif
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{ "armv8", aes_decrypt_armv8, aes_xts_armv8, aes_armv8_supported },
+#endif
+	{ "table", aes_decrypt_table, aes_xts_table, aes_table_supported },
+	{ NULL, NULL, NULL, NULL },
+};
 
-static void aes_encrypt_deinit(void *ctx)
+/* Implementation in use, picked on the first call */
+static const struct aes_impl *aes_impl_in_use;
+
+/**
+ * aes_impl - Get the best implementation of AES for the cpu
+ */
+static const struct aes_impl *aes_impl(void)
 {
-	memset(ctx, 0, AES_PRIV_SIZE);
-	free(ctx);
+	const struct aes_impl *impl;
+
+	impl = __atomic_load_n(&aes_impl_in_use, __ATOMIC_RELAXED);
+	if (impl)
+		return impl;
+
+	impl = pick_impl(aes_impls);
+	__atomic_store_n(&aes_impl_in_use, impl, __ATOMIC_RELAXED);
+	return impl;
 }
 
 
@@ -1226,18 +1484,17 @@ static void aes_encrypt_deinit(void *ctx)
  */
 int aes_unwrap(const u8 *kek, int n, const u8 *cipher, u8 *plain)
 {
+	const struct aes_impl *impl = aes_impl();
+	struct aes_key key;
 	u8 a[8], *r, b[16];
 	int i, j;
-	void *ctx;
 
 	/* 1) Initialize variables. */
 	memcpy(a, cipher, 8);
 	r = plain;
 	memcpy(r, cipher + 8, 8 * n);
 
-	ctx = aes_decrypt_init(kek, 16);
-	if (ctx == NULL)
-		return -1;
+	aes_key_setup(&key, kek, true /* dec */);
 
 	/* 2) Compute intermediate values.
 	 * For j = 5 to 0
@@ -1253,13 +1510,13 @@ int aes_unwrap(const u8 *kek, int n, const u8 *cipher, u8 *plain)
 			b[7] ^= n * j + i;
 
 			memcpy(b + 8, r, 8);
-			aes_decrypt(ctx, b, b);
+			impl->decrypt(&key, b, b);
 			memcpy(a, b, 8);
 			memcpy(r, b + 8, 8);
 			r -= 8;
 		}
 	}
-	aes_decrypt_deinit(ctx);
+	memset(&key, 0, sizeof(key));
 
 	/* 3) Output results.
 	 *
@@ -1279,33 +1536,47 @@ int aes_unwrap(const u8 *kek, int n, const u8 *cipher, u8 *plain)
 
 
 /*
- * After reading the XTS implementation from apfs-fuse <https://github.com/sgan81/apfs-fuse>,
- * I tried to make my own independent implementation in case I ever needed to
- * use it for proprietary stuff. I failed because I had the original too fresh
- * in my mind, so I gave up and even copied some stuff verbatim. Keep in mind
- * this is all GPLv2 code.
- *
- * This is only for little-endian archs, like all code in the fsck.
+ * XTS-AES-128 decryption, on top of the implementations above.
  */
 
-static void gf_mul(uint64_t *tweak)
+/**
+ * aes_xts_init - Expand the keys for XTS-AES-128 decryption
+ * @ctx:	the expanded keys
+ * @key1:	the primary 128-bit encryption key
+ * @key2:	the 128-bit encryption key for the tweak
+ *
+ * The same keys can then be used for any number of sectors.
+ */
+void aes_xts_init(struct aes_xts_ctx *ctx, const u8 *key1, const u8 *key2)
 {
-	uint8_t c1;
-	uint8_t c2;
-
-	c1 = (tweak[0] & 0x8000000000000000ULL) ? 1 : 0;
-	c2 = (tweak[1] & 0x8000000000000000ULL) ? 0x87 : 0;
-
-	tweak[0] = (tweak[0] << 1) ^ c2;
-	tweak[1] = (tweak[1] << 1) | c1;
+	aes_key_setup(&ctx->x_data, key1, true /* dec */);
+	aes_key_setup(&ctx->x_tweak, key2, false /* dec */);
 }
 
-static void xor128(const u8 *num1, const u8 *num2, u8 *result)
+/**
+ * aes_xts_wipe - Erase the expanded keys for XTS-AES-128
+ * @ctx: the expanded keys
+ */
+void aes_xts_wipe(struct aes_xts_ctx *ctx)
 {
-	int i;
+	memset(ctx, 0, sizeof(*ctx));
+	__asm__ __volatile__("" : : "r"(ctx) : "memory");
+}
 
-	for (i = 0; i < 16; ++i)
-		result[i] = num1[i] ^ num2[i];
+/**
+ * aes_xts_decrypt_sectors - Decrypt consecutive sectors using XTS-AES-128
+ * @ctx:	the expanded keys
+ * @sector:	number of the first sector, used for the tweak
+ * @cipher:	the ciphertext
+ * @len:	length of @cipher in bytes, a multiple of the sector size
+ * @plain:	buffer for the plaintext
+ *
+ * This is for whole blocks or extents, so that the cost of each call gets
+ * spread over many sectors.
+ */
+void aes_xts_decrypt_sectors(const struct aes_xts_ctx *ctx, u64 sector, const u8 *cipher, u64 len, u8 *plain)
+{
+	aes_impl()->xts_decrypt(ctx, sector, cipher, plain, len / AES_XTS_SECTOR_SIZE);
 }
 
 /**
@@ -1321,40 +1592,12 @@ static void xor128(const u8 *num1, const u8 *num2, u8 *result)
  */
 int aes_xts_decrypt(const u8 *key1, const u8 *key2, u64 tweak, const u8 *cipher, int len, u8 *plain)
 {
-	void *ctx1 = NULL, *ctx2 = NULL;
-	int i, sector_count;
-	int ret = -1;
-
-	ctx1 = aes_decrypt_init(key1, 16);
-	ctx2 = aes_encrypt_init(key2, 16);
-	if (!ctx1 || !ctx2)
-		goto fail;
-
-	sector_count = len / 512;
-	for (i = 0; i < sector_count; ++i) {
-		u8 enc_tweak[16] = {0};
-		int j;
-
-		*(__le64 *)enc_tweak = cpu_to_le64(tweak);
-
-		aes_encrypt(ctx2, enc_tweak, enc_tweak);
-		for (j = 0; j < 512 / 16; ++j) {
-			int off = i * 512 + j * 16;
-			u8 pp[16], cc[16];
+	struct aes_xts_ctx ctx;
 
-			xor128(cipher + off, enc_tweak, cc);
-			aes_decrypt(ctx1, cc, pp);
-			xor128(pp, enc_tweak, plain + off);
-			gf_mul((uint64_t *)enc_tweak);
-		}
-		tweak++;
-	}
-	ret = 0;
-
-fail:
-	if (ctx2)
-		aes_encrypt_deinit(ctx2);
-	if (ctx1)
-		aes_decrypt_deinit(ctx1);
-	return ret;
+	if (len < 0)
+		return -1;
+	aes_xts_init(&ctx, key1, key2);
+	aes_xts_decrypt_sectors(&ctx, tweak, cipher, len, plain);
+	aes_xts_wipe(&ctx);
+	return 0;
 }
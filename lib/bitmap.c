@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <string.h>
+#include <apfs/bitmap.h>
+#include <apfs/types.h>
+
+/**
+ * first_word_mask - Mask for the bits of a range that fall in its first word
+ * @start:	first bit of the range
+ * @len:	length of the range, must be nonzero
+ */
+static inline u64 first_word_mask(u64 start, u64 len)
+{
+	u64 mask = ~0ULL << (start & 63);
+
+	if ((start & 63) + len < 64)
+		mask &= ~(~0ULL << ((start & 63) + len));
+	return mask;
+}
+
+/**
+ * last_word_mask - Mask for the bits of a range that fall in its last word
+ * @end: first bit after the range, must not be a multiple of 64
+ */
+static inline u64 last_word_mask(u64 end)
+{
+	return ~(~0ULL << (end & 63));
+}
+
+/*
+ * All the range operations below split the range in three: the bits in the
+ * first word, the words that are covered completely, and the bits in the
+ * last word.  The middle part is where long ranges spend their time, so that
+ * is done a whole word (or, through libc, a whole vector) at a time.
+ */
+
+/**
+ * bitmap_set_range - Set a range of bits in a bitmap
+ * @bmap:	the bitmap
+ * @start:	first bit to set
+ * @len:	number of bits to set
+ */
+void bitmap_set_range(u64 *bmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 first, last;
+
+	if (!len)
+		return;
+	first = start >> 6;
+	last = (end - 1) >> 6;
+
+	if (first == last) {
+		bmap[first] |= first_word_mask(start, len);
+		return;
+	}
+	bmap[first] |= first_word_mask(start, 64 - (start & 63));
+	memset(bmap + first + 1, 0xFF, (last - first - 1) * sizeof(*bmap));
+	bmap[last] |= (end & 63) ? last_word_mask(end) : ~0ULL;
+}
+
+/**
+ * bitmap_clear_range - Clear a range of bits in a bitmap
+ * @bmap:	the bitmap
+ * @start:	first bit to clear
+ * @len:	number of bits to clear
+ */
+void bitmap_clear_range(u64 *bmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 first, last;
+
+	if (!len)
+		return;
+	first = start >> 6;
+	last = (end - 1) >> 6;
+
+	if (first == last) {
+		bmap[first] &= ~first_word_mask(start, len);
+		return;
+	}
+	bmap[first] &= ~first_word_mask(start, 64 - (start & 63));
+	memset(bmap + first + 1, 0, (last - first - 1) * sizeof(*bmap));
+	bmap[last] &= (end & 63) ? ~last_word_mask(end) : 0;
+}
+
+/**
+ * bitmap_test_range_any - Check if any bit in a range of a bitmap is set
+ * @bmap:	the bitmap
+ * @start:	first bit to check
+ * @len:	number of bits to check
+ */
+bool bitmap_test_range_any(const u64 *bmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 first, last, i;
+	u64 acc = 0;
+
+	if (!len)
+		return false;
+	first = start >> 6;
+	last = (end - 1) >> 6;
+
+	if (first == last)
+		return bmap[first] & first_word_mask(start, len);
+
+	if (bmap[first] & first_word_mask(start, 64 - (start & 63)))
+		return true;
+	if (bmap[last] & ((end & 63) ? last_word_mask(end) : ~0ULL))
+		return true;
+
+	/* Accumulate four words at a time, so the loop can be vectorized */
+	for (i = first + 1; i + 4 <= last; i += 4) {
+		acc |= bmap[i] | bmap[i + 1] | bmap[i + 2] | bmap[i + 3];
+		if (acc)
+			return true;
+	}
+	for (; i < last; ++i)
+		acc |= bmap[i];
+	return acc != 0;
+}
+
+/**
+ * bitmap_count_range - Count the set bits in a range of a bitmap
+ * @bmap:	the bitmap
+ * @start:	first bit to count
+ * @len:	number of bits to count
+ */
+u64 bitmap_count_range(const u64 *bmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 first, last, i;
+	u64 count = 0;
+
+	if (!len)
+		return 0;
+	first = start >> 6;
+	last = (end - 1) >> 6;
+
+	if (first == last)
+		return __builtin_popcountll(bmap[first] & first_word_mask(start, len));
+
+	count += __builtin_popcountll(bmap[first] & first_word_mask(start, 64 - (start & 63)));
+	for (i = first + 1; i < last; ++i)
+		count += __builtin_popcountll(bmap[i]);
+	count += __builtin_popcountll(bmap[last] & ((end & 63) ? last_word_mask(end) : ~0ULL));
+	return count;
+}
+
+/**
+ * bitmap_is_subset - Check that all bits set in a bitmap are set in another
+ * @sub:	the bitmap that should be contained in @super
+ * @super:	the bitmap that should contain @sub
+ * @nbits:	number of bits to check, starting from zero
+ */
+bool bitmap_is_subset(const u64 *sub, const u64 *super, u64 nbits)
+{
+	u64 words = nbits >> 6;
+	u64 i;
+
+	for (i = 0; i < words; ++i) {
+		if (sub[i] & ~super[i])
+			return false;
+	}
+	if (nbits & 63)
+		return !(sub[words] & ~super[words] & last_word_mask(nbits));
+	return true;
+}
+
+/**
+ * bitmap_first_diff - Find the first bit that differs between two bitmaps
+ * @bmap1:	the first bitmap
+ * @bmap2:	the second bitmap
+ * @nbits:	number of bits to compare, starting from zero
+ *
+ * Returns the number of the first bit that is set in only one of the bitmaps,
+ * or @nbits if they match.
+ */
+u64 bitmap_first_diff(const u64 *bmap1, const u64 *bmap2, u64 nbits)
+{
+	u64 words = nbits >> 6;
+	u64 i, diff;
+
+	/* The common case is that they match, and memcmp() is fast for that */
+	if (memcmp(bmap1, bmap2, words * sizeof(*bmap1)) == 0) {
+		i = words;
+	} else {
+		for (i = 0; i < words; ++i) {
+			if (bmap1[i] != bmap2[i])
+				break;
+		}
+	}
+
+	if (i == words) {
+		if (!(nbits & 63))
+			return nbits;
+		diff = (bmap1[i] ^ bmap2[i]) & last_word_mask(nbits);
+		if (!diff)
+			return nbits;
+	} else {
+		diff = bmap1[i] ^ bmap2[i];
+	}
+	return (i << 6) + __builtin_ctzll(diff);
+}
@@ -3,6 +3,7 @@
  */
 
 #include <apfs/checksum.h>
+#include <apfs/impl.h>
 #include <apfs/types.h>
 
 /*
@@ -79,7 +80,7 @@ static const u32 crc32Table[256] = {
 	0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-u32 crc32c(u32 crc, const void *buf, int size)
+static u32 crc32c_table(u32 crc, const void *buf, int size)
 {
 	const u8 *p = buf;
 
@@ -89,24 +90,149 @@ u32 crc32c(u32 crc, const void *buf, int size)
 	return crc;
 }
 
+static bool crc32c_table_supported(void)
+{
+	return true;
+}
+
+/*
+ * The crc32 instructions of x86 and arm64 use the same polynomial as the
+ * table, and they also leave the initial and final inversions to software.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const void *buf, int size)
+{
+	const u8 *p = buf;
+
+#ifdef __x86_64__
+	u64 crc64 = crc;
+
+	for (; size >= 8; size -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, *(const u64 *)p);
+	crc = crc64;
+#endif
+	for (; size >= 4; size -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, *(const u32 *)p);
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+static bool crc32c_sse42_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#endif	/* __x86_64__ || __i386__ */
+
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("+crc")))
+static u32 crc32c_armv8(u32 crc, const void *buf, int size)
+{
+	const u8 *p = buf;
+
+	for (; size >= 8; size -= 8, p += 8)
+		crc = __crc32cd(crc, *(const u64 *)p);
+	for (; size >= 4; size -= 4, p += 4)
+		crc = __crc32cw(crc, *(const u32 *)p);
+	while (size--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static bool crc32c_armv8_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+
+#endif	/* __aarch64__ */
+
+/* Available implementations, from best to worst */
+const struct crc32c_impl crc32c_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "sse4.2", crc32c_sse42, crc32c_sse42_supported },
+#endif
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{ "armv8", crc32c_armv8, crc32c_armv8_supported },
+#endif
+	{ "table", crc32c_table, crc32c_table_supported },
+	{ NULL, NULL, NULL },
+};
+
+static u32 crc32c_resolve(u32 crc, const void *buf, int size);
+
+/* Implementation in use, picked on the first call */
+static u32 (*crc32c_fn)(u32 crc, const void *buf, int size) = crc32c_resolve;
+
+/**
+ * crc32c_resolve - Pick the best implementation for the cpu, and run it
+ * @crc:	initial value
+ * @buf:	address of the buffer
+ * @size:	length of the buffer
+ */
+static u32 crc32c_resolve(u32 crc, const void *buf, int size)
+{
+	const struct crc32c_impl *impl = pick_impl(crc32c_impls);
+
+	__atomic_store_n(&crc32c_fn, impl->fn, __ATOMIC_RELAXED);
+	return impl->fn(crc, buf, size);
+}
+
+u32 crc32c(u32 crc, const void *buf, int size)
+{
+	return __atomic_load_n(&crc32c_fn, __ATOMIC_RELAXED)(crc, buf, size);
+}
+
+/**
+ * crc32c_utf32 - Update a crc32c with a string of UTF-32 characters
+ * @crc:	initial value
+ * @chars:	array of characters, in cpu endianness
+ * @count:	number of characters
+ *
+ * The characters are hashed in little-endian order, so this can be used for
+ * the dentry hashes of any host.  Returns the updated crc.
+ */
+u32 crc32c_utf32(u32 crc, const unicode_t *chars, int count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return crc32c(crc, chars, count * sizeof(*chars));
+#else
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		__le32 le = cpu_to_le32(chars[i]);
+
+		crc = crc32c(crc, &le, sizeof(le));
+	}
+	return crc;
+#endif
+}
+
 /*
  * Implementation of the Fletcher-64 checksum, as used in APFS.
  *
  * Author: Gabriel Krisman Bertazi <krisman@collabora.co.uk>
  * Based on the Fletcher64 implementation from linux/drivers/nvdimm.
  */
-u64 fletcher64(void *addr, unsigned long len)
+
+/**
+ * fletcher64_finish - Compute the checksum from the two running sums
+ * @sum1:	sum of all the words
+ * @sum2:	sum of all the partial values of @sum1
+ */
+static u64 fletcher64_finish(u64 sum1, u64 sum2)
 {
-	__le32 *buff = addr;
-	u64 sum1 = 0;
-	u64 sum2 = 0;
 	u64 c1, c2;
-	int i;
-
-	for (i = 0; i < len/sizeof(u32); i++) {
-		sum1 += le32_to_cpu(buff[i]);
-		sum2 += sum1;
-	}
 
 	c1 = sum1 + sum2;
 	c1 = 0xFFFFFFFF - c1 % 0xFFFFFFFF;
@@ -115,3 +241,219 @@ u64 fletcher64(void *addr, unsigned long len)
 
 	return (c2 << 32) | c1;
 }
+
+/**
+ * fletcher64_tail - Add words to the running sums, one at a time
+ * @buff:	first word to add
+ * @count:	number of words
+ * @sum1:	running sum of the words
+ * @sum2:	running sum of the values of @sum1
+ */
+static inline void fletcher64_tail(__le32 *buff, unsigned long count,
+				   u64 *sum1, u64 *sum2)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		*sum1 += le32_to_cpu(buff[i]);
+		*sum2 += *sum1;
+	}
+}
+
+static u64 fletcher64_scalar(void *addr, unsigned long len)
+{
+	u64 sum1 = 0;
+	u64 sum2 = 0;
+
+	fletcher64_tail(addr, len / sizeof(u32), &sum1, &sum2);
+	return fletcher64_finish(sum1, sum2);
+}
+
+/*
+ * The vector implementations split the words among N lanes, so that lane l
+ * gets words l, l + N, l + 2N...  For n = N * m words, each lane keeps a sum
+ * a[l] of its words, and a sum b[l] of the partial values of a[l].  Word j is
+ * added (m - j / N) times to b[j % N], but (n - j) times to sum2, so
+ *
+ *	sum1 = Σ a[l]
+ *	sum2 = N * Σ b[l] - Σ l * a[l]
+ *
+ * All of this is exact modulo 2^64, like the scalar sums.  The lane sums only
+ * need to be reduced at the end, and the remaining words are added one by one.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static u64 fletcher64_avx2(void *addr, unsigned long len)
+{
+	__le32 *buff = addr;
+	unsigned long count = len / sizeof(u32);
+	unsigned long blocks = count / 8;
+	__m256i a_lo = _mm256_setzero_si256(), b_lo = _mm256_setzero_si256();
+	__m256i a_hi = _mm256_setzero_si256(), b_hi = _mm256_setzero_si256();
+	u64 a[8], b[8];
+	u64 sum1 = 0, sum2 = 0;
+	unsigned long i;
+	int l;
+
+	for (i = 0; i < blocks; i++) {
+		__m256i words = _mm256_loadu_si256((__m256i *)(buff + 8 * i));
+		__m256i lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(words));
+		__m256i hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(words, 1));
+
+		a_lo = _mm256_add_epi64(a_lo, lo);
+		a_hi = _mm256_add_epi64(a_hi, hi);
+		b_lo = _mm256_add_epi64(b_lo, a_lo);
+		b_hi = _mm256_add_epi64(b_hi, a_hi);
+	}
+
+	_mm256_storeu_si256((__m256i *)a, a_lo);
+	_mm256_storeu_si256((__m256i *)(a + 4), a_hi);
+	_mm256_storeu_si256((__m256i *)b, b_lo);
+	_mm256_storeu_si256((__m256i *)(b + 4), b_hi);
+	for (l = 0; l < 8; l++) {
+		sum1 += a[l];
+		sum2 += 8 * b[l] - l * a[l];
+	}
+
+	fletcher64_tail(buff + 8 * blocks, count - 8 * blocks, &sum1, &sum2);
+	return fletcher64_finish(sum1, sum2);
+}
+
+static bool fletcher64_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f")))
+static u64 fletcher64_avx512(void *addr, unsigned long len)
+{
+	__le32 *buff = addr;
+	unsigned long count = len / sizeof(u32);
+	unsigned long blocks = count / 16;
+	__m512i a_lo = _mm512_setzero_si512(), b_lo = _mm512_setzero_si512();
+	__m512i a_hi = _mm512_setzero_si512(), b_hi = _mm512_setzero_si512();
+	u64 a[16], b[16];
+	u64 sum1 = 0, sum2 = 0;
+	unsigned long i;
+	int l;
+
+	for (i = 0; i < blocks; i++) {
+		__m512i words = _mm512_loadu_si512(buff + 16 * i);
+		__m512i lo = _mm512_cvtepu32_epi64(_mm512_castsi512_si256(words));
+		__m512i hi = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(words, 1));
+
+		a_lo = _mm512_add_epi64(a_lo, lo);
+		a_hi = _mm512_add_epi64(a_hi, hi);
+		b_lo = _mm512_add_epi64(b_lo, a_lo);
+		b_hi = _mm512_add_epi64(b_hi, a_hi);
+	}
+
+	_mm512_storeu_si512(a, a_lo);
+	_mm512_storeu_si512(a + 8, a_hi);
+	_mm512_storeu_si512(b, b_lo);
+	_mm512_storeu_si512(b + 8, b_hi);
+	for (l = 0; l < 16; l++) {
+		sum1 += a[l];
+		sum2 += 16 * b[l] - l * a[l];
+	}
+
+	fletcher64_tail(buff + 16 * blocks, count - 16 * blocks, &sum1, &sum2);
+	return fletcher64_finish(sum1, sum2);
+}
+
+static bool fletcher64_avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+#endif	/* __x86_64__ || __i386__ */
+
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+#include <arm_neon.h>
+
+static u64 fletcher64_neon(void *addr, unsigned long len)
+{
+	__le32 *buff = addr;
+	unsigned long count = len / sizeof(u32);
+	unsigned long blocks = count / 4;
+	uint64x2_t a_lo = vdupq_n_u64(0), b_lo = vdupq_n_u64(0);
+	uint64x2_t a_hi = vdupq_n_u64(0), b_hi = vdupq_n_u64(0);
+	u64 a[4], b[4];
+	u64 sum1 = 0, sum2 = 0;
+	unsigned long i;
+	int l;
+
+	for (i = 0; i < blocks; i++) {
+		uint32x4_t words = vld1q_u32((const u32 *)buff + 4 * i);
+
+		a_lo = vaddw_u32(a_lo, vget_low_u32(words));
+		a_hi = vaddw_u32(a_hi, vget_high_u32(words));
+		b_lo = vaddq_u64(b_lo, a_lo);
+		b_hi = vaddq_u64(b_hi, a_hi);
+	}
+
+	vst1q_u64(a, a_lo);
+	vst1q_u64(a + 2, a_hi);
+	vst1q_u64(b, b_lo);
+	vst1q_u64(b + 2, b_hi);
+	for (l = 0; l < 4; l++) {
+		sum1 += a[l];
+		sum2 += 4 * b[l] - l * a[l];
+	}
+
+	fletcher64_tail(buff + 4 * blocks, count - 4 * blocks, &sum1, &sum2);
+	return fletcher64_finish(sum1, sum2);
+}
+
+static bool fletcher64_neon_supported(void)
+{
+	return true; /* Always there on arm64 */
+}
+
+#endif	/* __aarch64__ */
+
+static bool fletcher64_scalar_supported(void)
+{
+	return true;
+}
+
+/* Available implementations, from best to worst */
+const struct fletcher64_impl fletcher64_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx512", fletcher64_avx512, fletcher64_avx512_supported },
+	{ "avx2", fletcher64_avx2, fletcher64_avx2_supported },
+#endif
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{ "neon", fletcher64_neon, fletcher64_neon_supported },
+#endif
+	{ "scalar", fletcher64_scalar, fletcher64_scalar_supported },
+	{ NULL, NULL, NULL },
+};
+
+static u64 fletcher64_resolve(void *addr, unsigned long len);
+
+/* Implementation in use, picked on the first call */
+static u64 (*fletcher64_fn)(void *addr, unsigned long len) = fletcher64_resolve;
+
+/**
+ * fletcher64_resolve - Pick the best implementation for the cpu, and run it
+ * @addr:	address of the buffer
+ * @len:	length of the buffer
+ */
+static u64 fletcher64_resolve(void *addr, unsigned long len)
+{
+	const struct fletcher64_impl *impl = pick_impl(fletcher64_impls);
+
+	__atomic_store_n(&fletcher64_fn, impl->fn, __ATOMIC_RELAXED);
+	return impl->fn(addr, len);
+}
+
+u64 fletcher64(void *addr, unsigned long len)
+{
+	return __atomic_load_n(&fletcher64_fn, __ATOMIC_RELAXED)(addr, len);
+}
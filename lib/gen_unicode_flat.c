@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Build-time generator for the flat unicode tables.  It walks the tries from
+ * unicode.c for every character in the BMP, and prints two-level tables for
+ * them: a page index, plus the distinct dense pages of 256 values each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNICODE_GEN
+#include "unicode.c"
+
+#define FLAT_PAGE_SIZE	256
+#define FLAT_PAGE_COUNT	(PLANE_SIZE / FLAT_PAGE_SIZE)
+
+/*
+ * Flat table under construction, with values of up to 16 bits
+ */
+struct flat_table {
+	u16	pages[FLAT_PAGE_COUNT][FLAT_PAGE_SIZE];	/* Distinct pages */
+	int	page_count;				/* Number of pages */
+	u8	index[FLAT_PAGE_COUNT];			/* Page for each range */
+};
+
+/**
+ * trie_value - Get the raw value stored in a trie for a character
+ * @trie:	the trie
+ * @key:	the character
+ * @is_ccc:	true if this is the ccc trie
+ *
+ * Returns the value in the same encoding as the trie leaves, or zero.
+ */
+static u16 trie_value(void *trie, unicode_t key, bool is_ccc)
+{
+	u16 pos = 0;
+	u8 ccc;
+	int len;
+
+	if (is_ccc) {
+		trie_find(trie, key, &ccc, true /* is_ccc */);
+		return ccc;
+	}
+	len = trie_find(trie, key, &pos, false /* is_ccc */);
+	if (!len)
+		return 0;
+	return pos << TRIE_POS_SHIFT | len;
+}
+
+/**
+ * build_flat_table - Build the flat table for a trie
+ * @table:	table to fill
+ * @trie:	the trie
+ * @is_ccc:	true if this is the ccc trie
+ */
+static void build_flat_table(struct flat_table *table, void *trie, bool is_ccc)
+{
+	int page, i;
+
+	memset(table, 0, sizeof(*table));
+	for (page = 0; page < FLAT_PAGE_COUNT; ++page) {
+		u16 *curr = table->pages[table->page_count];
+
+		for (i = 0; i < FLAT_PAGE_SIZE; ++i)
+			curr[i] = trie_value(trie, page * FLAT_PAGE_SIZE + i,
+					     is_ccc);
+
+		/* Most pages are empty, or repeated; only keep one copy */
+		for (i = 0; i < table->page_count; ++i) {
+			if (!memcmp(table->pages[i], curr,
+				    sizeof(table->pages[i])))
+				break;
+		}
+		if (i == table->page_count)
+			++table->page_count;
+		if (table->page_count > 255) {
+			fprintf(stderr, "Too many distinct pages\n");
+			exit(1);
+		}
+		table->index[page] = i;
+	}
+}
+
+/**
+ * print_flat_table - Print the C definitions for a flat table
+ * @table:	the table
+ * @name:	prefix for the array names
+ * @is_ccc:	true if this is the ccc table, which only needs a byte per value
+ */
+static void print_flat_table(struct flat_table *table, const char *name,
+			     bool is_ccc)
+{
+	int page, i;
+
+	printf("static const u8 %s_flat_index[%d] = {", name, FLAT_PAGE_COUNT);
+	for (i = 0; i < FLAT_PAGE_COUNT; ++i)
+		printf("%s0x%02x,", i % 8 ? " " : "\n\t", table->index[i]);
+	printf("\n};\n\n");
+
+	printf("static const %s %s_flat_pages[][%d] = {\n",
+	       is_ccc ? "u8" : "u16", name, FLAT_PAGE_SIZE);
+	for (page = 0; page < table->page_count; ++page) {
+		printf("\t{ /* Page 0x%02x */", page);
+		for (i = 0; i < FLAT_PAGE_SIZE; ++i) {
+			if (is_ccc)
+				printf("%s0x%02x,", i % 8 ? " " : "\n\t\t",
+				       table->pages[page][i]);
+			else
+				printf("%s0x%04x,", i % 8 ? " " : "\n\t\t",
+				       table->pages[page][i]);
+		}
+		printf("\n\t},\n");
+	}
+	printf("};\n\n");
+}
+
+int main(void)
+{
+	static struct flat_table table;
+
+	printf("/*\n * Generated by gen_unicode_flat from the tries in unicode.c, do not edit.\n");
+	printf(" *\n * Copyright (C) 1991-2018 Unicode, Inc.  All rights reserved.  Distributed\n");
+	printf(" * under the Terms of Use in http://www.unicode.org/copyright.html.\n */\n\n");
+
+	build_flat_table(&table, nfd_trie, false /* is_ccc */);
+	print_flat_table(&table, "nfd", false /* is_ccc */);
+	build_flat_table(&table, cf_trie, false /* is_ccc */);
+	print_flat_table(&table, "cf", false /* is_ccc */);
+	build_flat_table(&table, ccc_trie, true /* is_ccc */);
+	print_flat_table(&table, "ccc", true /* is_ccc */);
+	return 0;
+}
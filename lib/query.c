@@ -0,0 +1,851 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Read-only queries on a container image.  The whole image is mapped, so the
+ * records can be handed out as pointers into the page cache and nothing needs
+ * to be copied or released.  The key decoders only check what they need to
+ * stay in bounds, and they return errors instead of exiting; apfsck uses them
+ * as well, and does its own checks on top.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <apfs/checksum.h>
+#include <apfs/query.h>
+#include <apfs/raw.h>
+#include <apfs/types.h>
+
+/**
+ * query_error - Record the reason for a failed query
+ * @im:		the image
+ * @reason:	short explanation
+ *
+ * Returns -EIO, so that callers can just return the result.
+ */
+static int query_error(struct apfs_image *im, const char *reason)
+{
+	im->im_error = reason;
+	return -EIO;
+}
+
+/**
+ * apfs_image_block - Get a block of the image
+ * @im:		the image
+ * @bno:	block number
+ *
+ * Returns a pointer to the block in the mapping, or NULL if it's out of
+ * bounds.
+ */
+const void *apfs_image_block(struct apfs_image *im, u64 bno)
+{
+	if (bno >= im->im_block_count) {
+		query_error(im, "block number is out of bounds");
+		return NULL;
+	}
+	return (const char *)im->im_map + bno * im->im_blocksize;
+}
+
+/**
+ * apfs_image_object - Get an object of the image, verifying its checksum
+ * @im:		the image
+ * @bno:	block number for the object
+ *
+ * Returns a pointer to the object in the mapping, or NULL in case of failure.
+ */
+const void *apfs_image_object(struct apfs_image *im, u64 bno)
+{
+	const struct apfs_obj_phys *obj = apfs_image_block(im, bno);
+
+	if (!obj)
+		return NULL;
+	if (le64_to_cpu(obj->o_cksum) !=
+	    fletcher64((char *)obj + APFS_MAX_CKSUM_SIZE,
+		       im->im_blocksize - APFS_MAX_CKSUM_SIZE)) {
+		query_error(im, "bad checksum for object");
+		return NULL;
+	}
+	return obj;
+}
+
+/**
+ * image_object_of_type - Get an object of the image, checking its type
+ * @im:		the image
+ * @bno:	block number for the object
+ * @type:	expected object type, without the flags
+ */
+static const void *image_object_of_type(struct apfs_image *im, u64 bno,
+					u32 type)
+{
+	const struct apfs_obj_phys *obj = apfs_image_object(im, bno);
+
+	if (!obj)
+		return NULL;
+	if ((le32_to_cpu(obj->o_type) & APFS_OBJECT_TYPE_MASK) != type) {
+		query_error(im, "wrong object type");
+		return NULL;
+	}
+	return obj;
+}
+
+/**
+ * apfs_read_omap_key - Decode an on-disk object map key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @key:	key structure to store the result
+ *
+ * Returns 0 on success, or -EIO if the key is malformed.
+ */
+int apfs_read_omap_key(const void *raw, int size, struct apfs_query_key *key)
+{
+	const struct apfs_omap_key *raw_key = raw;
+
+	if (size != sizeof(*raw_key))
+		return -EIO;
+	key->id = le64_to_cpu(raw_key->ok_oid);
+	key->type = 0;
+	key->number = le64_to_cpu(raw_key->ok_xid);
+	key->name = NULL;
+	return 0;
+}
+
+/**
+ * read_key_name - Decode the name of a key, making sure it's null-terminated
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @hdr_len:	length of the key before the name
+ * @name_len:	length of the name, as reported by the key
+ * @key:	key structure to store the result
+ */
+static int read_key_name(const void *raw, int size, int hdr_len, int name_len,
+			 struct apfs_query_key *key)
+{
+	if (name_len == 0 || size != hdr_len + name_len)
+		return -EIO;
+	if (*((const char *)raw + size - 1) != 0)
+		return -EIO;
+	key->name = (const char *)raw + hdr_len;
+	return 0;
+}
+
+/**
+ * apfs_read_cat_key - Decode an on-disk catalog key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @hashed:	are the dentry keys hashed in this volume?
+ * @key:	key structure to store the result
+ *
+ * Returns 0 on success, or -EIO if the key is malformed.
+ */
+int apfs_read_cat_key(const void *raw, int size, bool hashed,
+		      struct apfs_query_key *key)
+{
+	const struct apfs_key_header *hdr = raw;
+	u64 obj_id_and_type;
+
+	if (size < sizeof(*hdr))
+		return -EIO;
+	obj_id_and_type = le64_to_cpu(hdr->obj_id_and_type);
+	key->id = obj_id_and_type & APFS_OBJ_ID_MASK;
+	key->type = (obj_id_and_type & APFS_OBJ_TYPE_MASK) >> APFS_OBJ_TYPE_SHIFT;
+	key->number = 0;
+	key->name = NULL;
+
+	if (!key->type || key->type > APFS_TYPE_MAX_VALID)
+		return -EIO;
+
+	switch (key->type) {
+	case APFS_TYPE_DIR_REC:
+		if (hashed) {
+			const struct apfs_drec_hashed_key *raw_key = raw;
+			u32 len_and_hash;
+
+			if (size < sizeof(*raw_key))
+				return -EIO;
+			len_and_hash = le32_to_cpu(raw_key->name_len_and_hash);
+			/* The filename length is ignored for the ordering */
+			key->number = len_and_hash & ~0x3FFU;
+			return read_key_name(raw, size, sizeof(*raw_key),
+					     len_and_hash & 0x3FFU, key);
+		} else {
+			const struct apfs_drec_key *raw_key = raw;
+
+			if (size < sizeof(*raw_key))
+				return -EIO;
+			return read_key_name(raw, size, sizeof(*raw_key),
+					     le16_to_cpu(raw_key->name_len), key);
+		}
+	case APFS_TYPE_XATTR: {
+		const struct apfs_xattr_key *raw_key = raw;
+
+		if (size < sizeof(*raw_key))
+			return -EIO;
+		return read_key_name(raw, size, sizeof(*raw_key),
+				     le16_to_cpu(raw_key->name_len), key);
+	}
+	case APFS_TYPE_FILE_EXTENT: {
+		const struct apfs_file_extent_key *raw_key = raw;
+
+		if (size != sizeof(*raw_key))
+			return -EIO;
+		key->number = le64_to_cpu(raw_key->logical_addr);
+		return 0;
+	}
+	case APFS_TYPE_SIBLING_LINK: {
+		const struct apfs_sibling_link_key *raw_key = raw;
+
+		if (size != sizeof(*raw_key))
+			return -EIO;
+		key->number = le64_to_cpu(raw_key->sibling_id);
+		return 0;
+	}
+	case APFS_TYPE_EXTENT:
+	case APFS_TYPE_SNAP_METADATA:
+	case APFS_TYPE_SNAP_NAME:
+		/* These belong to other trees */
+		return -EIO;
+	default:
+		/* All other key types are just the header */
+		return size == sizeof(*hdr) ? 0 : -EIO;
+	}
+}
+
+/**
+ * apfs_read_extentref_key - Decode an on-disk extent reference key
+ * @raw:	pointer to the raw key
+ * @size:	size of the raw key
+ * @key:	key structure to store the result
+ *
+ * Returns 0 on success, or -EIO if the key is malformed.
+ */
+int apfs_read_extentref_key(const void *raw, int size,
+			    struct apfs_query_key *key)
+{
+	const struct apfs_phys_ext_key *raw_key = raw;
+	u64 obj_id_and_type;
+
+	if (size != sizeof(*raw_key))
+		return -EIO;
+	obj_id_and_type = le64_to_cpu(raw_key->hdr.obj_id_and_type);
+	key->id = obj_id_and_type & APFS_OBJ_ID_MASK;
+	key->type = (obj_id_and_type & APFS_OBJ_TYPE_MASK) >> APFS_OBJ_TYPE_SHIFT;
+	key->number = 0;
+	key->name = NULL;
+	return key->type == APFS_TYPE_EXTENT ? 0 : -EIO;
+}
+
+/**
+ * apfs_read_tree_key - Decode the key of a record, according to its tree
+ * @tree:	the tree
+ * @rec:	the record
+ * @key:	key structure to store the result
+ *
+ * Returns 0 on success, or -EIO if the key is malformed.
+ */
+int apfs_read_tree_key(struct apfs_tree *tree, const struct apfs_record *rec,
+		       struct apfs_query_key *key)
+{
+	int err;
+
+	switch (tree->t_type) {
+	case APFS_QUERY_OMAP:
+		err = apfs_read_omap_key(rec->r_key, rec->r_key_len, key);
+		break;
+	case APFS_QUERY_CATALOG:
+		err = apfs_read_cat_key(rec->r_key, rec->r_key_len,
+					tree->t_hashed, key);
+		break;
+	default:
+		err = apfs_read_extentref_key(rec->r_key, rec->r_key_len, key);
+		break;
+	}
+	if (err)
+		return query_error(tree->t_image, "malformed key");
+	return 0;
+}
+
+/**
+ * apfs_query_keycmp - Compare two keys
+ * @k1, @k2:	keys to compare
+ *
+ * returns   0 if @k1 and @k2 are equal
+ *	   < 0 if @k1 comes before @k2 in the btree
+ *	   > 0 if @k1 comes after @k2 in the btree
+ */
+int apfs_query_keycmp(const struct apfs_query_key *k1,
+		      const struct apfs_query_key *k2)
+{
+	if (k1->id != k2->id)
+		return k1->id < k2->id ? -1 : 1;
+	if (k1->type != k2->type)
+		return k1->type < k2->type ? -1 : 1;
+	if (k1->number != k2->number)
+		return k1->number < k2->number ? -1 : 1;
+	if (!k1->name || !k2->name)
+		return !k1->name ? (k2->name ? -1 : 0) : 1;
+	return strcmp(k1->name, k2->name);
+}
+
+/**
+ * node_is_leaf - Check if a b-tree node is a leaf
+ * @node: the node
+ */
+static inline bool node_is_leaf(const struct apfs_btree_node_phys *node)
+{
+	return le16_to_cpu(node->btn_level) == 0;
+}
+
+/**
+ * node_check - Check that the table of contents of a node is in bounds
+ * @im:		the image
+ * @node:	the node
+ */
+static int node_check(struct apfs_image *im,
+		      const struct apfs_btree_node_phys *node)
+{
+	u16 flags = le16_to_cpu(node->btn_flags);
+	u32 toc_off = sizeof(*node) + le16_to_cpu(node->btn_table_space.off);
+	u32 toc_len = le16_to_cpu(node->btn_table_space.len);
+	u32 val_end = im->im_blocksize;
+	u32 entry_size;
+
+	if (flags & APFS_BTNODE_ROOT)
+		val_end -= sizeof(struct apfs_btree_info);
+	if (toc_off + toc_len > val_end)
+		return query_error(im, "table of contents is out of bounds");
+
+	entry_size = flags & APFS_BTNODE_FIXED_KV_SIZE ?
+		     sizeof(struct apfs_kvoff) : sizeof(struct apfs_kvloc);
+	if ((u64)le32_to_cpu(node->btn_nkeys) * entry_size > toc_len)
+		return query_error(im, "too many records for table of contents");
+	/* Only a root that is also a leaf may be empty */
+	if (!node->btn_nkeys && (!(flags & APFS_BTNODE_ROOT) || !node_is_leaf(node)))
+		return query_error(im, "empty b-tree node");
+	if (le16_to_cpu(node->btn_level) >= APFS_QUERY_MAX_DEPTH)
+		return query_error(im, "b-tree is too deep");
+	return 0;
+}
+
+/**
+ * node_record - Locate one of the records of a node
+ * @tree:	the tree
+ * @node:	the node, already checked
+ * @index:	number of the record
+ * @rec:	on return, the record
+ *
+ * Returns 0 on success, or -EIO if the record is out of bounds.
+ */
+static int node_record(struct apfs_tree *tree,
+		       const struct apfs_btree_node_phys *node, u32 index,
+		       struct apfs_record *rec)
+{
+	struct apfs_image *im = tree->t_image;
+	u16 flags = le16_to_cpu(node->btn_flags);
+	u32 toc_off = sizeof(*node) + le16_to_cpu(node->btn_table_space.off);
+	u32 key_start = toc_off + le16_to_cpu(node->btn_table_space.len);
+	u32 val_end = im->im_blocksize;
+	u32 koff, klen, voff, vlen;
+
+	/* Only the root has a footer */
+	if (flags & APFS_BTNODE_ROOT)
+		val_end -= sizeof(struct apfs_btree_info);
+
+	if (flags & APFS_BTNODE_FIXED_KV_SIZE) {
+		const struct apfs_kvoff *entry;
+
+		entry = (const struct apfs_kvoff *)((const char *)node + toc_off) + index;
+		koff = le16_to_cpu(entry->k);
+		klen = tree->t_key_size;
+		voff = le16_to_cpu(entry->v);
+		vlen = node_is_leaf(node) ? tree->t_val_size : sizeof(__le64);
+		/* A free-space queue record may have no value */
+		if (voff == APFS_BTOFF_INVALID)
+			voff = vlen = 0;
+	} else {
+		const struct apfs_kvloc *entry;
+
+		entry = (const struct apfs_kvloc *)((const char *)node + toc_off) + index;
+		koff = le16_to_cpu(entry->k.off);
+		klen = le16_to_cpu(entry->k.len);
+		voff = le16_to_cpu(entry->v.off);
+		vlen = le16_to_cpu(entry->v.len);
+	}
+
+	/* Keys go forward from the table, values backwards from the end */
+	if (key_start + koff + klen > val_end)
+		return query_error(im, "key is out of bounds");
+	if (voff > val_end - key_start || vlen > voff)
+		return query_error(im, "value is out of bounds");
+
+	rec->r_key = (const char *)node + key_start + koff;
+	rec->r_key_len = klen;
+	rec->r_val = vlen ? (const char *)node + val_end - voff : NULL;
+	rec->r_val_len = vlen;
+	rec->r_bno = ((const char *)node - (const char *)im->im_map) / im->im_blocksize;
+	return 0;
+}
+
+/**
+ * node_find - Find the last record of a node that comes at or before a key
+ * @tree:	the tree
+ * @node:	the node, already checked
+ * @key:	the key to look for
+ * @index:	on return, the index of the record, or -1 if there is none
+ * @exact:	on return, does the record match @key exactly?
+ *
+ * Returns 0 on success, or -EIO in case of failure.
+ */
+static int node_find(struct apfs_tree *tree,
+		     const struct apfs_btree_node_phys *node,
+		     const struct apfs_query_key *key, int *index, bool *exact)
+{
+	u32 lo = 0, hi = le32_to_cpu(node->btn_nkeys);
+	struct apfs_record rec;
+	struct apfs_query_key curr;
+	int cmp = 1, err;
+
+	*exact = false;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+
+		err = node_record(tree, node, mid, &rec);
+		if (err)
+			return err;
+		err = apfs_read_tree_key(tree, &rec, &curr);
+		if (err)
+			return err;
+
+		cmp = apfs_query_keycmp(&curr, key);
+		if (cmp <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+		if (!cmp)
+			break;
+	}
+	*index = (int)lo - 1;
+	*exact = cmp == 0;
+	return 0;
+}
+
+/**
+ * read_node - Read a node of a b-tree
+ * @tree:	the tree
+ * @oid:	object id for the node
+ * @level:	expected level for the node, or -1 for the root
+ *
+ * Returns the node, or NULL in case of failure.
+ */
+static const struct apfs_btree_node_phys *read_node(struct apfs_tree *tree,
+						    u64 oid, int level)
+{
+	struct apfs_image *im = tree->t_image;
+	const struct apfs_btree_node_phys *node;
+	u64 bno = oid;
+	int err;
+
+	if (tree->t_omap) {
+		err = apfs_omap_lookup(tree->t_omap, oid, tree->t_xid, &bno);
+		if (err == -ENODATA)
+			query_error(im, "node is missing from the object map");
+		if (err)
+			return NULL;
+	}
+
+	node = apfs_image_object(im, bno);
+	if (!node)
+		return NULL;
+	if (le64_to_cpu(node->btn_o.o_oid) != oid) {
+		query_error(im, "wrong object id for node");
+		return NULL;
+	}
+	if (node_check(im, node))
+		return NULL;
+	if (level >= 0 && le16_to_cpu(node->btn_level) != level) {
+		query_error(im, "wrong level for node");
+		return NULL;
+	}
+	return node;
+}
+
+/**
+ * child_node - Read the child node for an index record
+ * @tree:	the tree
+ * @parent:	the parent node
+ * @rec:	the index record
+ *
+ * Returns the node, or NULL in case of failure.
+ */
+static const struct apfs_btree_node_phys *
+child_node(struct apfs_tree *tree, const struct apfs_btree_node_phys *parent,
+	   const struct apfs_record *rec)
+{
+	if (rec->r_val_len != sizeof(__le64)) {
+		query_error(tree->t_image, "wrong size for index record");
+		return NULL;
+	}
+	return read_node(tree, le64_to_cpu(*(const __le64 *)rec->r_val),
+			 le16_to_cpu(parent->btn_level) - 1);
+}
+
+/**
+ * apfs_omap_lookup - Find the block for a virtual object
+ * @omap:	the object map
+ * @oid:	the virtual object id
+ * @xid:	latest transaction id to consider
+ * @bno:	on return, the block number
+ *
+ * Returns 0 on success, -ENODATA if no mapping exists, or -EIO in case of
+ * failure.
+ */
+int apfs_omap_lookup(struct apfs_tree *omap, u64 oid, u64 xid, u64 *bno)
+{
+	const struct apfs_btree_node_phys *node = omap->t_root;
+	const struct apfs_omap_val *val;
+	struct apfs_query_key key, found;
+	struct apfs_record rec;
+	bool exact;
+	int index, err;
+
+	key.id = oid;
+	key.type = 0;
+	key.number = xid;
+	key.name = NULL;
+
+	for (;;) {
+		err = node_find(omap, node, &key, &index, &exact);
+		if (err)
+			return err;
+		if (index < 0)
+			return -ENODATA;
+		err = node_record(omap, node, index, &rec);
+		if (err)
+			return err;
+		if (node_is_leaf(node))
+			break;
+		node = child_node(omap, node, &rec);
+		if (!node)
+			return -EIO;
+	}
+
+	err = apfs_read_tree_key(omap, &rec, &found);
+	if (err)
+		return err;
+	if (found.id != oid)
+		return -ENODATA;
+	if (rec.r_val_len != sizeof(*val))
+		return query_error(omap->t_image, "wrong size for omap value");
+	val = rec.r_val;
+	if (le32_to_cpu(val->ov_flags) & APFS_OMAP_VAL_DELETED)
+		return -ENODATA;
+	*bno = le64_to_cpu(val->ov_paddr);
+	return 0;
+}
+
+/**
+ * tree_init - Set up the structure for a b-tree
+ * @tree:	the structure to set up
+ * @im:		the image
+ * @oid:	object id for the root node
+ * @type:	type of tree (APFS_QUERY_OMAP, ...)
+ * @omap:	object map for the nodes, or NULL if they are physical
+ * @xid:	transaction id for the omap lookups
+ */
+static int tree_init(struct apfs_tree *tree, struct apfs_image *im, u64 oid,
+		     int type, struct apfs_tree *omap, u64 xid)
+{
+	const struct apfs_btree_info *info;
+
+	memset(tree, 0, sizeof(*tree));
+	tree->t_image = im;
+	tree->t_type = type;
+	tree->t_omap = omap;
+	tree->t_xid = xid;
+
+	tree->t_root = read_node(tree, oid, -1 /* level */);
+	if (!tree->t_root)
+		return -EIO;
+	if (!(le16_to_cpu(tree->t_root->btn_flags) & APFS_BTNODE_ROOT))
+		return query_error(im, "root node lacks the flag");
+
+	info = (const void *)((const char *)tree->t_root + im->im_blocksize -
+			      sizeof(*info));
+	tree->t_key_size = le32_to_cpu(info->bt_fixed.bt_key_size);
+	tree->t_val_size = le32_to_cpu(info->bt_fixed.bt_val_size);
+	return 0;
+}
+
+/**
+ * image_latest_checkpoint - Find the latest valid checkpoint superblock
+ * @im: the image, with the block zero superblock already checked
+ *
+ * Only contiguous checkpoint descriptor areas are supported.
+ */
+static int image_latest_checkpoint(struct apfs_image *im)
+{
+	const struct apfs_nx_superblock *nx = im->im_nx;
+	u32 desc_blocks = le32_to_cpu(nx->nx_xp_desc_blocks);
+	u64 desc_base = le64_to_cpu(nx->nx_xp_desc_base);
+	u32 i;
+
+	if (desc_blocks >> 31)
+		return query_error(im, "checkpoint descriptor tree not supported");
+
+	for (i = 0; i < desc_blocks; ++i) {
+		const struct apfs_nx_superblock *curr;
+
+		curr = apfs_image_block(im, desc_base + i);
+		if (!curr)
+			return -EIO;
+		if ((le32_to_cpu(curr->nx_o.o_type) & APFS_OBJECT_TYPE_MASK) !=
+		    APFS_OBJECT_TYPE_NX_SUPERBLOCK)
+			continue;
+		if (le32_to_cpu(curr->nx_magic) != APFS_NX_MAGIC)
+			continue;
+		if (le64_to_cpu(curr->nx_o.o_xid) <= im->im_xid)
+			continue;
+		if (!apfs_image_object(im, desc_base + i))
+			continue; /* Interrupted checkpoint, most likely */
+		im->im_nx = curr;
+		im->im_xid = le64_to_cpu(curr->nx_o.o_xid);
+	}
+	im->im_error = NULL;
+	return 0;
+}
+
+/**
+ * apfs_image_open - Open a container image for queries
+ * @im:		image structure to set up
+ * @path:	path to the image file or device
+ *
+ * Returns 0 on success, or -EIO in case of failure.  Even if it fails, the
+ * caller must call apfs_image_close() when done.
+ */
+int apfs_image_open(struct apfs_image *im, const char *path)
+{
+	const struct apfs_nx_superblock *nx;
+	const struct apfs_omap_phys *omap;
+	off_t len;
+	u32 blocksize;
+
+	memset(im, 0, sizeof(*im));
+	im->im_fd = open(path, O_RDONLY);
+	if (im->im_fd < 0)
+		return query_error(im, "failed to open the image");
+
+	/* Unlike fstat(), this also works for block devices */
+	len = lseek(im->im_fd, 0, SEEK_END);
+	if (len < APFS_NX_DEFAULT_BLOCK_SIZE)
+		return query_error(im, "image is too small");
+	im->im_map = mmap(NULL, len, PROT_READ, MAP_SHARED, im->im_fd, 0);
+	if (im->im_map == MAP_FAILED) {
+		im->im_map = NULL;
+		return query_error(im, "failed to map the image");
+	}
+	im->im_map_len = len;
+
+	nx = im->im_map;
+	if (le32_to_cpu(nx->nx_magic) != APFS_NX_MAGIC)
+		return query_error(im, "not an apfs container");
+	blocksize = le32_to_cpu(nx->nx_block_size);
+	if (blocksize < APFS_NX_DEFAULT_BLOCK_SIZE || blocksize > 65536 ||
+	    (blocksize & (blocksize - 1)))
+		return query_error(im, "invalid block size");
+	im->im_blocksize = blocksize;
+	im->im_block_count = len / blocksize;
+	if (!apfs_image_object(im, APFS_NX_BLOCK_NUM))
+		return -EIO;
+
+	im->im_nx = nx;
+	im->im_xid = le64_to_cpu(nx->nx_o.o_xid);
+	if (image_latest_checkpoint(im))
+		return -EIO;
+
+	omap = image_object_of_type(im, le64_to_cpu(im->im_nx->nx_omap_oid),
+				    APFS_OBJECT_TYPE_OMAP);
+	if (!omap)
+		return -EIO;
+	return tree_init(&im->im_omap, im, le64_to_cpu(omap->om_tree_oid),
+			 APFS_QUERY_OMAP, NULL /* omap */, 0 /* xid */);
+}
+
+/**
+ * apfs_image_close - Release all resources held by an image
+ * @im: the image
+ *
+ * The records found with the image can't be used after this.
+ */
+void apfs_image_close(struct apfs_image *im)
+{
+	if (im->im_map)
+		munmap((void *)im->im_map, im->im_map_len);
+	if (im->im_fd >= 0)
+		close(im->im_fd);
+	im->im_map = NULL;
+	im->im_fd = -1;
+}
+
+/**
+ * apfs_volume_open - Find a volume of the container, and its trees
+ * @im:		the image
+ * @index:	index of the volume in the container superblock
+ * @vol:	volume structure to set up
+ *
+ * Returns 0 on success, -ENODATA if there is no volume for @index, or -EIO in
+ * case of failure.  Encrypted volumes are not supported.
+ */
+int apfs_volume_open(struct apfs_image *im, int index, struct apfs_volume *vol)
+{
+	const struct apfs_superblock *raw;
+	const struct apfs_omap_phys *omap;
+	u64 oid, bno, incompat;
+	struct apfs_tree *cat_omap;
+	int err;
+
+	memset(vol, 0, sizeof(*vol));
+	if (index < 0 || index >= APFS_NX_MAX_FILE_SYSTEMS ||
+	    index >= le32_to_cpu(im->im_nx->nx_max_file_systems))
+		return -ENODATA;
+	oid = le64_to_cpu(im->im_nx->nx_fs_oid[index]);
+	if (!oid)
+		return -ENODATA;
+
+	err = apfs_omap_lookup(&im->im_omap, oid, im->im_xid, &bno);
+	if (err == -ENODATA)
+		return query_error(im, "volume is missing from the object map");
+	if (err)
+		return err;
+	raw = image_object_of_type(im, bno, APFS_OBJECT_TYPE_FS);
+	if (!raw)
+		return -EIO;
+	if (le32_to_cpu(raw->apfs_magic) != APFS_MAGIC)
+		return query_error(im, "wrong magic for volume superblock");
+	if (!(le64_to_cpu(raw->apfs_fs_flags) & APFS_FS_UNENCRYPTED))
+		return query_error(im, "encrypted volumes are not supported");
+	vol->v_raw = raw;
+	vol->v_bno = bno;
+
+	omap = image_object_of_type(im, le64_to_cpu(raw->apfs_omap_oid),
+				    APFS_OBJECT_TYPE_OMAP);
+	if (!omap)
+		return -EIO;
+	err = tree_init(&vol->v_omap, im, le64_to_cpu(omap->om_tree_oid),
+			APFS_QUERY_OMAP, NULL /* omap */, 0 /* xid */);
+	if (err)
+		return err;
+
+	cat_omap = NULL;
+	if ((le32_to_cpu(raw->apfs_root_tree_type) & APFS_OBJ_STORAGETYPE_MASK) ==
+	    APFS_OBJ_VIRTUAL)
+		cat_omap = &vol->v_omap;
+	err = tree_init(&vol->v_cat, im, le64_to_cpu(raw->apfs_root_tree_oid),
+			APFS_QUERY_CATALOG, cat_omap, im->im_xid);
+	if (err)
+		return err;
+	incompat = le64_to_cpu(raw->apfs_incompatible_features);
+	vol->v_cat.t_hashed = incompat & (APFS_INCOMPAT_CASE_INSENSITIVE |
+					  APFS_INCOMPAT_NORMALIZATION_INSENSITIVE);
+
+	return tree_init(&vol->v_extref, im,
+			 le64_to_cpu(raw->apfs_extentref_tree_oid),
+			 APFS_QUERY_EXTENTREF, NULL /* omap */, 0 /* xid */);
+}
+
+/**
+ * apfs_cursor_init - Set up a cursor at the first record of a tree
+ * @cur:	the cursor
+ * @tree:	the tree
+ */
+void apfs_cursor_init(struct apfs_cursor *cur, struct apfs_tree *tree)
+{
+	cur->c_tree = tree;
+	cur->c_depth = 0;
+	cur->c_nodes[0] = tree->t_root;
+	cur->c_index[0] = 0;
+}
+
+/**
+ * apfs_cursor_seek - Move a cursor to the first record at or after a key
+ * @cur:	the cursor, after apfs_cursor_init()
+ * @key:	the key to look for
+ *
+ * The record itself is returned by the next call to apfs_cursor_next().
+ * Returns 0 on success, or -EIO in case of failure.
+ */
+int apfs_cursor_seek(struct apfs_cursor *cur, const struct apfs_query_key *key)
+{
+	struct apfs_tree *tree = cur->c_tree;
+	const struct apfs_btree_node_phys *node = tree->t_root;
+	struct apfs_record rec;
+	bool exact;
+	int index, err;
+
+	cur->c_depth = 0;
+	for (;;) {
+		cur->c_nodes[cur->c_depth] = node;
+		err = node_find(tree, node, key, &index, &exact);
+		if (err)
+			return err;
+
+		if (node_is_leaf(node)) {
+			cur->c_index[cur->c_depth] = exact ? index : index + 1;
+			return 0;
+		}
+
+		/* The key may still be in the subtree of the previous record */
+		if (index < 0)
+			index = 0;
+		cur->c_index[cur->c_depth] = index + 1;
+		err = node_record(tree, node, index, &rec);
+		if (err)
+			return err;
+		node = child_node(tree, node, &rec);
+		if (!node)
+			return -EIO;
+		++cur->c_depth;
+	}
+}
+
+/**
+ * apfs_cursor_next - Get the record under a cursor, and move past it
+ * @cur:	the cursor
+ * @rec:	on return, the record
+ *
+ * Returns 0 on success, -ENODATA if there are no more records, or -EIO in case
+ * of failure.
+ */
+int apfs_cursor_next(struct apfs_cursor *cur, struct apfs_record *rec)
+{
+	struct apfs_tree *tree = cur->c_tree;
+	const struct apfs_btree_node_phys *node;
+	int err;
+
+	for (;;) {
+		u32 index = cur->c_index[cur->c_depth];
+
+		node = cur->c_nodes[cur->c_depth];
+		if (index >= le32_to_cpu(node->btn_nkeys)) {
+			if (cur->c_depth == 0)
+				return -ENODATA;
+			--cur->c_depth;
+			continue;
+		}
+		++cur->c_index[cur->c_depth];
+
+		err = node_record(tree, node, index, rec);
+		if (err)
+			return err;
+		if (node_is_leaf(node))
+			return 0;
+
+		if (cur->c_depth + 1 >= APFS_QUERY_MAX_DEPTH)
+			return query_error(tree->t_image, "b-tree is too deep");
+		node = child_node(tree, node, rec);
+		if (!node)
+			return -EIO;
+		++cur->c_depth;
+		cur->c_nodes[cur->c_depth] = node;
+		cur->c_index[cur->c_depth] = 0;
+	}
+}
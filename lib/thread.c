@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Worker threads for the tools.  The work is always handed out from a shared
+ * queue, so a thread that can't be created is not an error: the others will
+ * just work harder.
+ */
+
+#include <stdlib.h>
+#include <apfs/thread.h>
+
+/**
+ * start_threads - Start up to @count threads running the same function
+ * @group:	group to hold the threads
+ * @count:	number of threads wanted
+ * @fn:		function for the threads to run
+ * @arg:	argument for @fn
+ *
+ * On return, @group->tg_count is the number of threads actually running; it
+ * may be zero.
+ */
+void start_threads(struct thread_group *group, unsigned int count,
+		   void *(*fn)(void *), void *arg)
+{
+	unsigned int i;
+
+	group->tg_count = 0;
+	group->tg_threads = count ? calloc(count, sizeof(*group->tg_threads)) : NULL;
+	if (!group->tg_threads)
+		return;
+
+	for (i = 0; i < count; ++i) {
+		if (pthread_create(&group->tg_threads[i], NULL, fn, arg))
+			break;
+		++group->tg_count;
+	}
+}
+
+/**
+ * join_threads - Wait for all threads of a group to finish, and clean up
+ * @group: the group
+ */
+void join_threads(struct thread_group *group)
+{
+	unsigned int i;
+
+	for (i = 0; i < group->tg_count; ++i)
+		pthread_join(group->tg_threads[i], NULL);
+	free(group->tg_threads);
+	group->tg_threads = NULL;
+	group->tg_count = 0;
+}
+
+/**
+ * run_threads - Run a function on up to @jobs threads, and wait for them
+ * @jobs:	number of threads wanted, including the caller
+ * @fn:		function for the threads to run
+ * @arg:	argument for @fn
+ *
+ * The calling thread takes part in the work, so @fn runs at least once.
+ */
+void run_threads(unsigned int jobs, void *(*fn)(void *), void *arg)
+{
+	struct thread_group group;
+
+	start_threads(&group, jobs > 1 ? jobs - 1 : 0, fn, arg);
+	fn(arg);
+	join_threads(&group);
+}
@@ -6,8 +6,15 @@
  */
 
 #include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 #include <apfs/unicode.h>
 
+/* The flat tables are built from the tries by gen_unicode_flat */
+#ifndef UNICODE_GEN
+#include "unicode_flat.h"
+#endif
+
 /*
  * To reuse the implementation from the kernel module, we first
  * need to copy some code from linux/fs/nls/nls_base.c
@@ -135,6 +142,75 @@ static int trie_find(void *trie, unicode_t key, void *result, bool is_ccc)
 	return node & TRIE_SIZE_MASK;
 }
 
+/* Use the flat tables for the BMP?  Only the benchmarks turn this off. */
+bool unicode_flat_tables = true;
+
+/**
+ * flat_find - Look up a value in a pair of flat tables for the BMP
+ * @index:	page index
+ * @pages:	dense pages, each holding trie values for 256 characters
+ * @key:	search key, which must be inside the BMP
+ * @pos:	on return, the position of the value in the value array
+ *
+ * Returns the length of the value (0 if it doesn't exist).
+ */
+static inline int flat_find(const u8 *index, const u16 (*pages)[256],
+			    unicode_t key, u16 *pos)
+{
+	u16 node = pages[index[key >> 8]][key & 0xFF];
+
+	*pos = node >> TRIE_POS_SHIFT;
+	return node & TRIE_SIZE_MASK;
+}
+
+/**
+ * nfd_find - Look up the canonical decomposition of a character
+ * @key:	the character
+ * @pos:	on return, the position of the value in nfd_values
+ *
+ * Returns the length of the decomposition (0 if it doesn't exist).
+ */
+static int nfd_find(unicode_t key, u16 *pos)
+{
+#ifndef UNICODE_GEN
+	if (likely(key < PLANE_SIZE && unicode_flat_tables))
+		return flat_find(nfd_flat_index, nfd_flat_pages, key, pos);
+#endif
+	return trie_find(nfd_trie, key, pos, false /* is_ccc */);
+}
+
+/**
+ * cf_find - Look up the case folding of a character
+ * @key:	the character
+ * @pos:	on return, the position of the value in cf_values
+ *
+ * Returns the length of the case folding (0 if it doesn't exist).
+ */
+static int cf_find(unicode_t key, u16 *pos)
+{
+#ifndef UNICODE_GEN
+	if (likely(key < PLANE_SIZE && unicode_flat_tables))
+		return flat_find(cf_flat_index, cf_flat_pages, key, pos);
+#endif
+	return trie_find(cf_trie, key, pos, false /* is_ccc */);
+}
+
+/**
+ * ccc_find - Look up the canonical combining class of a character
+ * @key: the character
+ */
+static u8 ccc_find(unicode_t key)
+{
+	u8 ccc;
+
+#ifndef UNICODE_GEN
+	if (likely(key < PLANE_SIZE && unicode_flat_tables))
+		return ccc_flat_pages[ccc_flat_index[key >> 8]][key & 0xFF];
+#endif
+	trie_find(ccc_trie, key, &ccc, true /* is_ccc */);
+	return ccc;
+}
+
 /**
  * init_unicursor - Initialize a unicursor structure
  * @cursor:	cursor to initialize
@@ -148,6 +224,47 @@ void init_unicursor(struct unicursor *cursor, const char *utf8str)
 	cursor->last_ccc = 0;
 }
 
+#define ASCII_ONES	0x0101010101010101ULL
+#define ASCII_HIGHS	0x8080808080808080ULL
+
+/**
+ * is_ascii_string - Check if a null-terminated string is plain ASCII
+ * @str: the string
+ *
+ * Most filenames fit in ASCII, and they don't need the tries for their
+ * normalization.  This checks eight bytes at a time; the reads are aligned,
+ * so they never cross into a page the string doesn't reach.
+ */
+bool is_ascii_string(const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+
+	for (; (uintptr_t)s & 7; ++s) {
+		if (!*s)
+			return true;
+		if (!isascii(*s))
+			return false;
+	}
+
+	while (1) {
+		u64 word, zeros;
+
+		memcpy(&word, s, sizeof(word));
+		zeros = (word - ASCII_ONES) & ~word & ASCII_HIGHS;
+		if (!zeros && !(word & ASCII_HIGHS)) {
+			s += sizeof(word);
+			continue;
+		}
+		/* Either the end or a non-ASCII byte is in this word */
+		for (;; ++s) {
+			if (!*s)
+				return true;
+			if (!isascii(*s))
+				return false;
+		}
+	}
+}
+
 #define HANGUL_S_BASE	0xac00
 #define HANGUL_L_BASE	0x1100
 #define HANGUL_V_BASE	0x1161
@@ -234,7 +351,7 @@ static unicode_t normalize_char(unicode_t utf32char, int off, bool case_fold)
 	if (is_precomposed_hangul(utf32char)) /* Hangul has no case */
 		return decompose_hangul(utf32char, off);
 
-	ret = trie_find(nfd_trie, utf32char, &pos, false /* is_ccc */);
+	ret = nfd_find(utf32char, &pos);
 	if (!ret) {
 		/* The decomposition is just the same character */
 		nfd_len = 1;
@@ -253,7 +370,7 @@ static unicode_t normalize_char(unicode_t utf32char, int off, bool case_fold)
 	for (; nfd_len > 0; nfd++, nfd_len--) {
 		int cf_len;
 
-		ret = trie_find(cf_trie, *nfd, &pos, false /* is_ccc */);
+		ret = cf_find(*nfd, &pos);
 		if (!ret) {
 			/* The case folding is just the same character */
 			cf_len = 1;
@@ -301,7 +418,7 @@ static int get_normalization_length(const char *utf8str, bool case_fold)
 			if (utf32norm == NORM_END)
 				break;
 
-			trie_find(ccc_trie, utf32norm, &ccc, true /* is_ccc */);
+			ccc = ccc_find(utf32norm);
 
 			if (ccc != 0)
 				starters_over = true;
@@ -363,7 +480,7 @@ new_starter:
 			if (utf32norm == NORM_END)
 				break;
 
-			trie_find(ccc_trie, utf32norm, &ccc, true /* is_ccc */);
+			ccc = ccc_find(utf32norm);
 
 			if (ccc >= min_ccc || ccc < cursor->last_ccc)
 				continue;
@@ -5,9 +5,10 @@
 #include <stdlib.h>
 #include <apfs/raw.h>
 #include "btree.h"
-#include "dir.h"
+#include "io.h"
 #include "mkapfs.h"
 #include "object.h"
+#include "spaceman.h"
 
 /* Constants used in managing the size of a node's table of contents */
 #define BTREE_TOC_ENTRY_INCREMENT	8
@@ -18,8 +19,7 @@
  * @info:	pointer to the on-disk info footer
  * @subtype:	subtype of the root node, i.e., tree type
  *
- * Should only be called for the free queues, the snapshot metadata tree, and
- * the extent reference tree.
+ * Should only be called for the free queues.
  */
 static void set_empty_btree_info(struct apfs_btree_info *info, u32 subtype)
 {
@@ -83,8 +83,8 @@ static int min_table_size(u32 type)
  * @oid:	object id to use
  * @subtype:	subtype of the root node, i.e., tree type
  *
- * Should only be called for the free queues, the snapshot metadata tree, and
- * the extent reference tree.
+ * Should only be called for the free queues, which are ephemeral and have a
+ * fixed location; other trees are made with a builder.
  */
 void make_empty_btree_root(u64 bno, u64 oid, u32 subtype)
 {
@@ -126,195 +126,418 @@ void make_empty_btree_root(u64 bno, u64 oid, u32 subtype)
 		type |= APFS_OBJ_PHYSICAL;
 	set_object_header(&root->btn_o, oid, type, subtype);
 
-	munmap(root, param->blocksize);
+	release_blocks(root);
 }
 
 /**
- * set_omap_info - Set the info footer for an object map node
- * @info:	pointer to the on-disk info footer
- * @nkeys:	number of records in the omap
+ * btree_footer_flags - Get the flags for the info footer of a b-tree
+ * @subtype: tree type
  */
-static void set_omap_info(struct apfs_btree_info *info, int nkeys)
+static u32 btree_footer_flags(u32 subtype)
 {
-	info->bt_fixed.bt_flags = cpu_to_le32(APFS_BTREE_PHYSICAL);
-	info->bt_fixed.bt_node_size = cpu_to_le32(param->blocksize);
-	info->bt_fixed.bt_key_size = cpu_to_le32(sizeof(struct apfs_omap_key));
-	info->bt_fixed.bt_val_size = cpu_to_le32(sizeof(struct apfs_omap_val));
-	info->bt_longest_key = cpu_to_le32(sizeof(struct apfs_omap_key));
-	info->bt_longest_val = cpu_to_le32(sizeof(struct apfs_omap_val));
-	info->bt_key_count = cpu_to_le64(nkeys);
-	info->bt_node_count = cpu_to_le64(1); /* Only one node: the root */
+	switch (subtype) {
+	case APFS_OBJECT_TYPE_OMAP:
+	case APFS_OBJECT_TYPE_OMAP_SNAPSHOT:
+		return APFS_BTREE_PHYSICAL;
+	case APFS_OBJECT_TYPE_FSTREE:
+		return APFS_BTREE_KV_NONALIGNED;
+	default:
+		return APFS_BTREE_PHYSICAL | APFS_BTREE_KV_NONALIGNED;
+	}
 }
 
 /**
- * make_omap_root - Make the root node of an object map
- * @bno:	block number to use
- * @is_vol:	is this the object map for a volume?
+ * init_btree_builder - Prepare to build a b-tree from the bottom up
+ * @bb:		the builder
+ * @subtype:	tree type
+ * @omap:	builder for the object map, if the tree is virtual; else NULL
+ * @first_oid:	object id for the first node, if the tree is virtual
  */
-static void make_omap_root(u64 bno, bool is_vol)
+void init_btree_builder(struct btree_builder *bb, u32 subtype,
+			struct btree_builder *omap, u64 first_oid)
 {
-	struct apfs_btree_node_phys *root = get_zeroed_block(bno);
-	struct apfs_omap_key *key;
-	struct apfs_omap_val *val;
-	struct apfs_kvoff *kvoff;
-	int toc_len, key_len, val_len, free_len;
-	int head_len = sizeof(*root);
-	int info_len = sizeof(struct apfs_btree_info);
+	memset(bb, 0, sizeof(*bb));
+	bb->bb_subtype = subtype;
+	bb->bb_omap = omap;
+	bb->bb_next_oid = first_oid;
+
+	/* Only these trees have fixed key/value sizes, for now */
+	if (subtype == APFS_OBJECT_TYPE_OMAP) {
+		bb->bb_key_size = sizeof(struct apfs_omap_key);
+		bb->bb_val_size = sizeof(struct apfs_omap_val);
+	} else if (subtype == APFS_OBJECT_TYPE_OMAP_SNAPSHOT) {
+		bb->bb_key_size = sizeof(__le64);
+		bb->bb_val_size = sizeof(struct apfs_omap_snapshot);
+	}
+}
+
+/**
+ * btree_level_space - Get the space for the records of a node in the tree
+ *
+ * This is the same for all nodes, so that any of them could end up as the
+ * root; the footer left unused by the others is small enough not to matter.
+ */
+static int btree_level_space(void)
+{
+	return param->blocksize - sizeof(struct apfs_btree_node_phys) -
+	       sizeof(struct apfs_btree_info);
+}
+
+/**
+ * btree_toc_len - Get the size of the table of contents for a node
+ * @bb:		the builder
+ * @level:	level of the node
+ * @nkeys:	number of records in the node
+ */
+static int btree_toc_len(struct btree_builder *bb, int level, int nkeys)
+{
+	int val_size;
+
+	/*
+	 * Trees with fixed key/value sizes preallocate the whole table; as in
+	 * min_table_size(), the footer of the root is ignored for this.
+	 */
+	if (bb->bb_key_size) {
+		int space = param->blocksize - sizeof(struct apfs_btree_node_phys);
+
+		val_size = level ? sizeof(__le64) : bb->bb_val_size;
+		nkeys = space / (bb->bb_key_size + val_size + sizeof(struct apfs_kvoff));
+		return nkeys * sizeof(struct apfs_kvoff);
+	}
+
+	nkeys = ROUND_UP(nkeys, BTREE_TOC_ENTRY_INCREMENT);
+	if (!nkeys)
+		nkeys = BTREE_TOC_ENTRY_INCREMENT;
+	return nkeys * sizeof(struct apfs_kvloc);
+}
+
+/**
+ * btree_level_has_room - Check if a record fits in the open node of a level
+ * @bb:		the builder
+ * @level:	level of the node
+ * @key_len:	length of the key
+ * @val_len:	length of the value
+ */
+static bool btree_level_has_room(struct btree_builder *bb, int level,
+				 int key_len, int val_len)
+{
+	struct btree_level *lvl = &bb->bb_levels[level];
+	int needed;
+
+	if (param->fanout && lvl->nkeys >= param->fanout)
+		return false;
+
+	needed = btree_toc_len(bb, level, lvl->nkeys + 1);
+	needed += lvl->key_len + key_len + lvl->val_len + val_len;
+	return needed <= btree_level_space();
+}
+
+/**
+ * set_btree_info - Set the info footer for the root of a finished b-tree
+ * @bb:		the builder
+ * @info:	pointer to the on-disk info footer
+ */
+static void set_btree_info(struct btree_builder *bb,
+			   struct apfs_btree_info *info)
+{
+	info->bt_fixed.bt_flags = cpu_to_le32(btree_footer_flags(bb->bb_subtype));
+	info->bt_fixed.bt_node_size = cpu_to_le32(param->blocksize);
+	info->bt_fixed.bt_key_size = cpu_to_le32(bb->bb_key_size);
+	info->bt_fixed.bt_val_size = cpu_to_le32(bb->bb_val_size);
 
-	root->btn_flags = cpu_to_le16(APFS_BTNODE_ROOT | APFS_BTNODE_LEAF |
-				      APFS_BTNODE_FIXED_KV_SIZE);
-
-	/* The mkfs will need only one record on each omap */
-	root->btn_nkeys = cpu_to_le32(1);
-	toc_len = min_table_size(APFS_OBJECT_TYPE_OMAP);
-	key_len = 1 * sizeof(*key);
-	val_len = 1 * sizeof(*val);
-
-	/* Location of the one record */
-	key = (void *)root + head_len + toc_len;
-	val = (void *)root + param->blocksize - info_len - val_len;
-	kvoff = (void *)root + head_len;
-	kvoff->k = 0;
-	kvoff->v = cpu_to_le16(val_len);
-
-	/* Set the key and value for the one record */
-	if (is_vol) {
-		/* Map for the catalog root */
-		key->ok_oid = cpu_to_le64(FIRST_VOL_CAT_ROOT_OID);
-		val->ov_paddr = cpu_to_le64(FIRST_VOL_CAT_ROOT_BNO);
+	if (bb->bb_key_size) {
+		info->bt_longest_key = cpu_to_le32(bb->bb_key_size);
+		info->bt_longest_val = cpu_to_le32(bb->bb_val_size);
 	} else {
-		/* Map for the one volume superblock */
-		key->ok_oid = cpu_to_le64(FIRST_VOL_OID);
-		val->ov_paddr = cpu_to_le64(FIRST_VOL_BNO);
+		info->bt_longest_key = cpu_to_le32(bb->bb_longest_key);
+		info->bt_longest_val = cpu_to_le32(bb->bb_longest_val);
 	}
-	key->ok_xid = cpu_to_le64(MKFS_XID);
-	val->ov_size = cpu_to_le32(param->blocksize); /* Only size supported */
+	info->bt_key_count = cpu_to_le64(bb->bb_key_count);
+	info->bt_node_count = cpu_to_le64(bb->bb_node_count);
+}
 
-	root->btn_table_space.off = 0;
-	root->btn_table_space.len = cpu_to_le16(toc_len);
+/**
+ * btree_open_level - Add a new level to the top of a b-tree under construction
+ * @bb: the builder
+ */
+static void btree_open_level(struct btree_builder *bb)
+{
+	struct btree_level *lvl;
+
+	if (bb->bb_depth == BTREE_MAX_DEPTH)
+		fatal("b-tree is too deep");
+	lvl = &bb->bb_levels[bb->bb_depth];
+
+	lvl->keys = malloc(param->blocksize);
+	lvl->vals = malloc(param->blocksize);
+	lvl->toc = malloc(param->blocksize);
+	if (!lvl->keys || !lvl->vals || !lvl->toc)
+		system_error();
+	++bb->bb_depth;
+}
 
-	free_len = param->blocksize -
-		   head_len - toc_len - key_len - val_len - info_len;
-	root->btn_free_space.off = cpu_to_le16(key_len);
-	root->btn_free_space.len = cpu_to_le16(free_len);
+static void btree_level_add(struct btree_builder *bb, int level, void *key,
+			    int key_len, void *val, int val_len);
+
+/**
+ * btree_flush_level - Write the open node of a level to disk
+ * @bb:		the builder
+ * @level:	level of the node
+ * @is_root:	is this the root of the tree?
+ *
+ * Unless the node is the root, its first key gets added to the level above.
+ * Returns the object id of the node.
+ */
+static u64 btree_flush_level(struct btree_builder *bb, int level, bool is_root)
+{
+	struct btree_level *lvl = &bb->bb_levels[level];
+	struct apfs_btree_node_phys *node;
+	bool fixed = bb->bb_key_size;
+	int head_len = sizeof(*node);
+	int info_len = is_root ? sizeof(struct apfs_btree_info) : 0;
+	void *key_area, *val_area_end;
+	int toc_len, free_len, i;
+	u64 bno, oid;
+	u32 type;
+	u16 flags;
+
+	bno = alloc_blocks(1);
+	oid = bb->bb_omap ? bb->bb_next_oid++ : bno;
+	node = get_zeroed_block(bno);
+
+	flags = 0;
+	if (is_root)
+		flags |= APFS_BTNODE_ROOT;
+	if (level == 0)
+		flags |= APFS_BTNODE_LEAF;
+	if (fixed)
+		flags |= APFS_BTNODE_FIXED_KV_SIZE;
+	node->btn_flags = cpu_to_le16(flags);
+	node->btn_level = cpu_to_le16(level);
+	node->btn_nkeys = cpu_to_le32(lvl->nkeys);
+
+	toc_len = btree_toc_len(bb, level, lvl->nkeys);
+	node->btn_table_space.off = 0;
+	node->btn_table_space.len = cpu_to_le16(toc_len);
+
+	/* The value offsets are from the end, so they don't depend on a footer */
+	for (i = 0; i < lvl->nkeys; ++i) {
+		struct apfs_kvloc *entry = &lvl->toc[i];
+
+		if (fixed) {
+			struct apfs_kvoff *kvoff = (struct apfs_kvoff *)node->btn_data + i;
+
+			kvoff->k = entry->k.off;
+			kvoff->v = entry->v.off;
+		} else {
+			((struct apfs_kvloc *)node->btn_data)[i] = *entry;
+		}
+	}
+	key_area = (void *)node + head_len + toc_len;
+	memcpy(key_area, lvl->keys, lvl->key_len);
+	val_area_end = (void *)node + param->blocksize - info_len;
+	memcpy(val_area_end - lvl->val_len,
+	       lvl->vals + param->blocksize - lvl->val_len, lvl->val_len);
+
+	free_len = param->blocksize - head_len - toc_len - lvl->key_len -
+		   lvl->val_len - info_len;
+	node->btn_free_space.off = cpu_to_le16(lvl->key_len);
+	node->btn_free_space.len = cpu_to_le16(free_len);
 
 	/* No fragmentation */
-	root->btn_key_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
-	root->btn_key_free_list.len = 0;
-	root->btn_val_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
-	root->btn_val_free_list.len = 0;
+	node->btn_key_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
+	node->btn_key_free_list.len = 0;
+	node->btn_val_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
+	node->btn_val_free_list.len = 0;
+
+	++bb->bb_node_count;
+	++lvl->node_count;
+	if (level == 0)
+		bb->bb_key_count += lvl->nkeys;
+	if (is_root)
+		set_btree_info(bb, (void *)node + param->blocksize - info_len);
+
+	type = is_root ? APFS_OBJECT_TYPE_BTREE : APFS_OBJECT_TYPE_BTREE_NODE;
+	type |= bb->bb_omap ? APFS_OBJ_VIRTUAL : APFS_OBJ_PHYSICAL;
+	set_object_header(&node->btn_o, oid, type, bb->bb_subtype);
+	release_blocks(node);
+
+	if (bb->bb_omap)
+		btree_add_omap_record(bb->bb_omap, oid, bno);
+
+	if (!is_root) {
+		__le64 child = cpu_to_le64(oid);
+		int first_key_len = fixed ? bb->bb_key_size : le16_to_cpu(lvl->toc[0].k.len);
+
+		btree_level_add(bb, level + 1, lvl->keys, first_key_len,
+				&child, sizeof(child));
+	}
 
-	set_omap_info((void *)root + param->blocksize - info_len, 1);
-	set_object_header(&root->btn_o, bno,
-			  APFS_OBJECT_TYPE_BTREE | APFS_OBJ_PHYSICAL,
-			  APFS_OBJECT_TYPE_OMAP);
-	munmap(root, param->blocksize);
+	lvl->nkeys = lvl->key_len = lvl->val_len = 0;
+	return oid;
 }
 
 /**
- * make_omap_btree - Make an object map
- * @bno:	block number to use
- * @is_vol:	is this the object map for a volume?
+ * btree_level_add - Add a record to the open node of a level
+ * @bb:		the builder
+ * @level:	level of the node
+ * @key:	the key
+ * @key_len:	length of the key
+ * @val:	the value
+ * @val_len:	length of the value
+ *
+ * If the open node is full, it gets written and a new one is opened.
  */
-void make_omap_btree(u64 bno, bool is_vol)
+static void btree_level_add(struct btree_builder *bb, int level, void *key,
+			    int key_len, void *val, int val_len)
 {
-	struct apfs_omap_phys *omap = get_zeroed_block(bno);
+	struct btree_level *lvl;
+	struct apfs_kvloc *entry;
 
-	if (!is_vol)
-		omap->om_flags = cpu_to_le32(APFS_OMAP_MANUALLY_MANAGED);
-	omap->om_tree_type = cpu_to_le32(APFS_OBJECT_TYPE_BTREE |
-					 APFS_OBJ_PHYSICAL);
-	omap->om_snapshot_tree_type = cpu_to_le32(APFS_OBJECT_TYPE_BTREE |
-						  APFS_OBJ_PHYSICAL);
-	if (is_vol) {
-		omap->om_tree_oid = cpu_to_le64(FIRST_VOL_OMAP_ROOT_BNO);
-		make_omap_root(FIRST_VOL_OMAP_ROOT_BNO, is_vol);
-	} else {
-		omap->om_tree_oid = cpu_to_le64(MAIN_OMAP_ROOT_BNO);
-		make_omap_root(MAIN_OMAP_ROOT_BNO, is_vol);
+	if (level == bb->bb_depth)
+		btree_open_level(bb);
+	lvl = &bb->bb_levels[level];
+
+	if (!btree_level_has_room(bb, level, key_len, val_len)) {
+		if (!lvl->nkeys)
+			fatal("b-tree record is too big");
+		btree_flush_level(bb, level, false /* is_root */);
 	}
 
-	set_object_header(&omap->om_o, bno,
-			  APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_OMAP,
-			  APFS_OBJECT_TYPE_INVALID);
-	munmap(omap, param->blocksize);
+	entry = &lvl->toc[lvl->nkeys];
+	entry->k.off = cpu_to_le16(lvl->key_len);
+	entry->k.len = cpu_to_le16(key_len);
+	memcpy(lvl->keys + lvl->key_len, key, key_len);
+	lvl->key_len += key_len;
+
+	lvl->val_len += val_len;
+	entry->v.off = cpu_to_le16(lvl->val_len);
+	entry->v.len = cpu_to_le16(val_len);
+	memcpy(lvl->vals + param->blocksize - lvl->val_len, val, val_len);
+
+	++lvl->nkeys;
+	if (key_len > bb->bb_longest_key)
+		bb->bb_longest_key = key_len;
+	if (level == 0 && val_len > bb->bb_longest_val)
+		bb->bb_longest_val = val_len;
 }
 
 /**
- * set_cat_info - Set the info footer for a catalog root node
- * @info:	pointer to the on-disk info footer
+ * btree_add_record - Add a leaf record to a b-tree under construction
+ * @bb:		the builder
+ * @key:	the key
+ * @key_len:	length of the key
+ * @val:	the value
+ * @val_len:	length of the value
+ *
+ * The records must be added in key order.
  */
-static void set_cat_info(struct apfs_btree_info *info)
+void btree_add_record(struct btree_builder *bb, void *key, int key_len,
+		      void *val, int val_len)
 {
-	int drec_keysz = param->norm_sensitive ? sizeof(struct apfs_drec_key) :
-						 sizeof(struct apfs_drec_hashed_key);
-	int maxkey = drec_keysz + strlen("private-dir") + 1;
-	int maxval = sizeof(struct apfs_inode_val) +
-		     sizeof(struct apfs_xf_blob) + sizeof(struct apfs_x_field) +
-		     ROUND_UP(strlen("private-dir") + 1, 8);
-
-	info->bt_fixed.bt_flags = cpu_to_le32(APFS_BTREE_KV_NONALIGNED);
-	info->bt_fixed.bt_node_size = cpu_to_le32(param->blocksize);
+	btree_level_add(bb, 0 /* level */, key, key_len, val, val_len);
+}
 
-	info->bt_longest_key = cpu_to_le32(maxkey);
-	info->bt_longest_val = cpu_to_le32(maxval);
-	info->bt_key_count = cpu_to_le64(4); /* Two records for each dir */
-	info->bt_node_count = cpu_to_le64(1); /* Only one node: the root */
+/**
+ * btree_add_omap_record - Add a record to an object map under construction
+ * @omap:	builder for the object map
+ * @oid:	virtual object id
+ * @bno:	block number for the object
+ *
+ * All objects are mapped for the first transaction.
+ */
+void btree_add_omap_record(struct btree_builder *omap, u64 oid, u64 bno)
+{
+	struct apfs_omap_key key;
+	struct apfs_omap_val val = {0};
+
+	key.ok_oid = cpu_to_le64(oid);
+	key.ok_xid = cpu_to_le64(MKFS_XID);
+	val.ov_size = cpu_to_le32(param->blocksize); /* Only size supported */
+	val.ov_paddr = cpu_to_le64(bno);
+	btree_add_record(omap, &key, sizeof(key), &val, sizeof(val));
 }
 
 /**
- * make_cat_root - Make the root node of a catalog tree
- * @bno: block number to use
- * @oid: object id
+ * finish_btree - Write the remaining nodes of a b-tree under construction
+ * @bb: the builder
  *
- * Creates a root node with two records: the root and private directories.
+ * Returns the object id of the root.
  */
-void make_cat_root(u64 bno, u64 oid)
+u64 finish_btree(struct btree_builder *bb)
 {
-	struct apfs_btree_node_phys *root = get_zeroed_block(bno);
-	struct apfs_kvloc *kvloc;
-	void *key, *key_area, *val_end, *val_area_end;
-	int toc_len, key_len, free_len, val_len;
-	int head_len = sizeof(*root);
-	int info_len = sizeof(struct apfs_btree_info);
+	u64 root_oid;
+	int level;
+
+	/* An empty tree is just an empty root */
+	if (!bb->bb_depth)
+		btree_open_level(bb);
+
+	/* Each flush adds a record to the level above, until the root */
+	for (level = 0; level < bb->bb_depth - 1; ++level)
+		btree_flush_level(bb, level, false /* is_root */);
+	root_oid = btree_flush_level(bb, level, true /* is_root */);
+
+	for (level = 0; level < bb->bb_depth; ++level) {
+		free(bb->bb_levels[level].keys);
+		free(bb->bb_levels[level].vals);
+		free(bb->bb_levels[level].toc);
+	}
+	return root_oid;
+}
 
-	root->btn_flags = cpu_to_le16(APFS_BTNODE_ROOT | APFS_BTNODE_LEAF);
+/**
+ * make_omap_snapshots - Make the snapshot tree for the object map of a volume
+ * @omap: the on-disk object map
+ *
+ * Returns the number of nodes in the tree.
+ */
+static u64 make_omap_snapshots(struct apfs_omap_phys *omap)
+{
+	struct btree_builder snap_tree;
+	u64 xid;
 
-	/* The two dentry records and their inodes */
-	root->btn_nkeys = cpu_to_le32(4);
-	toc_len = min_table_size(APFS_OBJECT_TYPE_FSTREE);
-	root->btn_table_space.off = 0;
-	root->btn_table_space.len = cpu_to_le16(toc_len);
+	init_btree_builder(&snap_tree, APFS_OBJECT_TYPE_OMAP_SNAPSHOT, NULL, 0);
+	for (xid = MKFS_XID; xid < MKFS_XID + param->syn_snapshots; ++xid) {
+		struct apfs_omap_snapshot val = {0};
+		__le64 key = cpu_to_le64(xid);
 
-	kvloc = (void *)root + head_len;
-	key = key_area = (void *)root + head_len + toc_len;
-	val_end = val_area_end = (void *)root + param->blocksize - info_len;
-
-	make_special_dir_dentry(APFS_PRIV_DIR_INO_NUM, "private-dir", &kvloc,
-				key_area, &key, val_area_end, &val_end);
-	make_special_dir_dentry(APFS_ROOT_DIR_INO_NUM, "root", &kvloc,
-				key_area, &key, val_area_end, &val_end);
-	make_special_dir_inode(APFS_ROOT_DIR_INO_NUM, "root", &kvloc,
-			       key_area, &key, val_area_end, &val_end);
-	make_special_dir_inode(APFS_PRIV_DIR_INO_NUM, "private-dir", &kvloc,
-			       key_area, &key, val_area_end, &val_end);
-
-	key_len = key - key_area;
-	val_len = val_area_end - val_end;
-	free_len = param->blocksize -
-		   head_len - toc_len - key_len - val_len - info_len;
-	root->btn_free_space.off = cpu_to_le16(key_len);
-	root->btn_free_space.len = cpu_to_le16(free_len);
+		btree_add_record(&snap_tree, &key, sizeof(key), &val, sizeof(val));
+	}
+	omap->om_snapshot_tree_oid = cpu_to_le64(finish_btree(&snap_tree));
+	omap->om_snap_count = cpu_to_le32(param->syn_snapshots);
+	omap->om_most_recent_snap = cpu_to_le64(xid - 1);
+	return snap_tree.bb_node_count;
+}
 
-	/* No fragmentation */
-	root->btn_key_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
-	root->btn_key_free_list.len = 0;
-	root->btn_val_free_list.off = cpu_to_le16(APFS_BTOFF_INVALID);
-	root->btn_val_free_list.len = 0;
+/**
+ * make_omap_btree - Make an object map
+ * @bno:	block number to use
+ * @is_vol:	is this the object map for a volume?
+ * @tree:	builder for the tree, with all the records already added
+ *
+ * Returns the number of blocks used by the object map.
+ */
+u64 make_omap_btree(u64 bno, bool is_vol, struct btree_builder *tree)
+{
+	struct apfs_omap_phys *omap = get_zeroed_block(bno);
+	u64 blocks = 1;
 
-	set_cat_info((void *)root + param->blocksize - info_len);
-	set_object_header(&root->btn_o, oid,
-			  APFS_OBJECT_TYPE_BTREE | APFS_OBJ_VIRTUAL,
-			  APFS_OBJECT_TYPE_FSTREE);
-	munmap(root, param->blocksize);
+	if (!is_vol)
+		omap->om_flags = cpu_to_le32(APFS_OMAP_MANUALLY_MANAGED);
+	omap->om_tree_type = cpu_to_le32(APFS_OBJECT_TYPE_BTREE |
+					 APFS_OBJ_PHYSICAL);
+	omap->om_snapshot_tree_type = cpu_to_le32(APFS_OBJECT_TYPE_BTREE |
+						  APFS_OBJ_PHYSICAL);
+	omap->om_tree_oid = cpu_to_le64(finish_btree(tree));
+	blocks += tree->bb_node_count;
+
+	if (is_vol && param->syn_snapshots)
+		blocks += make_omap_snapshots(omap);
+
+	set_object_header(&omap->om_o, bno,
+			  APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_OMAP,
+			  APFS_OBJECT_TYPE_INVALID);
+	release_blocks(omap);
+	return blocks;
 }
@@ -7,8 +7,54 @@
 
 #include <apfs/types.h>
 
+/* Maximum number of levels for a b-tree built by mkapfs */
+#define BTREE_MAX_DEPTH	32
+
+struct apfs_kvloc;
+
+/*
+ * Open node for one level of a b-tree under construction
+ */
+struct btree_level {
+	void		*keys;		/* Keys of the records, in order */
+	void		*vals;		/* Values of the records, from the end */
+	struct apfs_kvloc *toc;		/* Table of contents of the node */
+	int		nkeys;		/* Number of records in the node */
+	int		key_len;	/* Total length of the keys */
+	int		val_len;	/* Total length of the values */
+	u64		node_count;	/* Nodes already written for the level */
+};
+
+/*
+ * A b-tree built from the bottom up, with records that come in key order.
+ * Each level has a single open node; once it's full it gets written to disk,
+ * and its first key is added to the level above.  The root is the last node
+ * to be written, when the tree is finished.
+ */
+struct btree_builder {
+	u32			bb_subtype;	/* Tree type */
+	int			bb_key_size;	/* Size of the keys, if fixed */
+	int			bb_val_size;	/* Size of the leaf values, if fixed */
+	struct btree_builder	*bb_omap;	/* Object map, for a virtual tree */
+	u64			bb_next_oid;	/* Next oid for a virtual node */
+
+	int			bb_depth;	/* Number of levels so far */
+	struct btree_level	bb_levels[BTREE_MAX_DEPTH];
+
+	/* Totals for the info footer */
+	u64			bb_key_count;
+	u64			bb_node_count;
+	u32			bb_longest_key;
+	u32			bb_longest_val;
+};
+
 extern void make_empty_btree_root(u64 bno, u64 oid, u32 subtype);
-extern void make_omap_btree(u64 bno, bool is_vol);
-extern void make_cat_root(u64 bno, u64 oid);
+extern void init_btree_builder(struct btree_builder *bb, u32 subtype,
+			       struct btree_builder *omap, u64 first_oid);
+extern void btree_add_record(struct btree_builder *bb, void *key, int key_len,
+			     void *val, int val_len);
+extern void btree_add_omap_record(struct btree_builder *omap, u64 oid, u64 bno);
+extern u64 finish_btree(struct btree_builder *bb);
+extern u64 make_omap_btree(u64 bno, bool is_vol, struct btree_builder *tree);
 
 #endif	/* _BTREE_H */
@@ -2,14 +2,22 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h> /* The macros for the inode mode */
 #include <sys/types.h>
 #include <unistd.h>
 #include <apfs/checksum.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
+#include <apfs/unicode.h>
+#include "btree.h"
 #include "dir.h"
+#include "load.h"
 #include "mkapfs.h"
+#include "spaceman.h"
 
 /**
  * set_key_header - Set the cnid and type on a catalog key
@@ -45,6 +53,23 @@ static int make_unhashed_dentry_key(u64 ino, char *name,
 	return sizeof(*key) + len;
 }
 
+/**
+ * dentry_hash - Get the hash for a dentry key
+ * @name: directory name
+ */
+u32 dentry_hash(const char *name)
+{
+	struct unicursor cursor;
+	bool case_fold = !param->case_sensitive;
+	unicode_t utf32[APFS_NAME_LEN];
+	int i = 0;
+
+	init_unicursor(&cursor, name);
+	while ((utf32[i] = normalize_next(&cursor, case_fold)))
+		++i;
+	return (crc32c_utf32(0xFFFFFFFF, utf32, i) & 0x3FFFFF) << 10;
+}
+
 /**
  * make_hashed_dentry_key - Make a hashed dentry key
  * @ino:	inode number for the parent
@@ -57,32 +82,24 @@ static int make_hashed_dentry_key(u64 ino, char *name,
 				  struct apfs_drec_hashed_key *key)
 {
 	u32 len;
-	u32 hash = 0xFFFFFFFF;
-	u32 utf32;
 
 	set_key_header(ino, APFS_TYPE_DIR_REC, &key->hdr);
 	strcpy((char *)key->name, name);
 
 	len = strlen(name) + 1; /* The null termination is counted */
-
-	/* Special directories don't have unicode characters in their names */
-	for (utf32 = *name; utf32; utf32 = *++name)
-		hash = crc32c(hash, &utf32, sizeof(utf32));
-	hash = (hash & 0x3FFFFF) << 10;
-
-	key->name_len_and_hash = cpu_to_le32(hash | len);
+	key->name_len_and_hash = cpu_to_le32(dentry_hash(name) | len);
 	return sizeof(*key) + len;
 }
 
 /**
- * make_special_dentry_key - Make the dentry key for a special directory
+ * make_dentry_key - Make the key for a dentry record
  * @ino:	inode number for the parent
  * @name:	directory name
  * @key:	key space to use
  *
  * Returns the length of the key.
  */
-static int make_special_dentry_key(u64 ino, char *name, void *key)
+static int make_dentry_key(u64 ino, char *name, void *key)
 {
 	if (param->norm_sensitive)
 		return make_unhashed_dentry_key(ino, name, key);
@@ -91,142 +108,686 @@ static int make_special_dentry_key(u64 ino, char *name, void *key)
 }
 
 /**
- * make_special_dentry_val - Make the dentry value for a special directory
- * @ino:	inode number for the directory
- * @val_end:	end of the value space to use
+ * make_dentry_val - Make the value for a dentry record
+ * @ino:	inode number for the file
+ * @mode:	file mode
+ * @sibling_id:	sibling id for the hard link, or zero if none
+ * @val:	value space to use, with room for the sibling id xfield
  *
  * Returns the length of the value.
  */
-static int make_special_dentry_val(u64 ino, struct apfs_drec_val *val_end)
+static int make_dentry_val(u64 ino, u16 mode, u64 sibling_id,
+			   struct apfs_drec_val *val)
 {
-	struct apfs_drec_val *val = (void *)val_end - sizeof(*val);
+	struct apfs_xf_blob *xblob;
+	struct apfs_x_field *xfield;
 
+	memset(val, 0, sizeof(*val));
 	val->file_id = cpu_to_le64(ino);
 	val->date_added = cpu_to_le64(get_timestamp());
-	val->flags = cpu_to_le16(S_IFDIR >> 12);
+	val->flags = cpu_to_le16((mode & S_IFMT) >> 12);
+	if (!sibling_id)
+		return sizeof(*val);
 
-	return sizeof(*val);
+	xblob = (struct apfs_xf_blob *)val->xfields;
+	xblob->xf_num_exts = cpu_to_le16(1);
+	xblob->xf_used_data = cpu_to_le16(sizeof(__le64));
+	xfield = (struct apfs_x_field *)xblob->xf_data;
+	xfield->x_type = APFS_DREC_EXT_TYPE_SIBLING_ID;
+	xfield->x_flags = 0;
+	xfield->x_size = cpu_to_le16(sizeof(__le64));
+	*(__le64 *)(xfield + 1) = cpu_to_le64(sibling_id);
+
+	return sizeof(*val) + sizeof(*xblob) + sizeof(*xfield) + sizeof(__le64);
 }
 
 /**
- * make_special_inode_key - Make the inode key for a special directory
- * @ino:	inode number for the directory
+ * make_inode_key - Make the key for an inode record
+ * @ino:	inode number
  * @key:	key space to use
  *
  * Returns the length of the key.
  */
-static int make_special_inode_key(u64 ino, struct apfs_inode_key *key)
+static int make_inode_key(u64 ino, struct apfs_inode_key *key)
 {
 	set_key_header(ino, APFS_TYPE_INODE, &key->hdr);
 	return sizeof(*key);
 }
 
 /**
- * make_special_inode_val - Make the inode value for a special directory
- * @ino:	inode number for the directory
- * @name:	directory name
- * @val_end:	end of the value space to use
+ * make_inode_val - Make the value for an inode record
+ * @ino:	inode number
+ * @attrs:	attributes for the inode
+ * @val:	value space to use, with room for the biggest possible inode
  *
  * Returns the length of the value.
  */
-static int make_special_inode_val(u64 ino, char *name,
-				  struct apfs_inode_val *val_end)
+static int make_inode_val(u64 ino, struct inode_attrs *attrs,
+			  struct apfs_inode_val *val)
 {
-	struct apfs_inode_val *val = (void *)val_end - sizeof(*val);
 	struct apfs_xf_blob *xblob;
-	struct apfs_x_field *name_xfield;
-	int namelen, padded_namelen, i_len;
-
-	namelen = strlen(name) + 1;
+	struct apfs_x_field *xfield;
+	struct apfs_dstream *dstream;
+	u16 filetype = attrs->mode & S_IFMT;
+	bool has_rdev = filetype == S_IFCHR || filetype == S_IFBLK;
+	int namelen, padded_namelen, xcount;
+	void *xdata_start, *xdata;
+
+	namelen = strlen(attrs->name) + 1;
 	padded_namelen = ROUND_UP(namelen, 8);
-	i_len = sizeof(*val) + sizeof(*xblob) +
-		sizeof(*name_xfield) + padded_namelen;
-	val = (void *)val_end - i_len;
+	xcount = 1 + (attrs->size != 0) + has_rdev;
+	memset(val, 0, sizeof(*val) + sizeof(*xblob) + xcount * sizeof(*xfield) +
+		       padded_namelen + sizeof(*dstream));
 
-	val->parent_id = cpu_to_le64(APFS_ROOT_DIR_PARENT);
+	val->parent_id = cpu_to_le64(attrs->parent);
 	val->private_id = cpu_to_le64(ino);
 
-	/* Should this be the exact same as the dentry timetamp? */
-	val->create_time = val->mod_time = val->change_time =
-			   val->access_time = cpu_to_le64(get_timestamp());
+	val->create_time = cpu_to_le64(attrs->create_time);
+	val->mod_time = cpu_to_le64(attrs->mod_time);
+	val->change_time = cpu_to_le64(attrs->change_time);
+	val->access_time = cpu_to_le64(attrs->access_time);
 
+	val->nchildren = cpu_to_le32(attrs->count); /* Same field as nlink */
 	val->default_protection_class =
 				cpu_to_le32(APFS_PROTECTION_CLASS_DIR_NONE);
 
-	/* TODO: allow the user to override these fields */
-	val->owner = cpu_to_le32(geteuid());
-	val->group = cpu_to_le32(getegid());
-	val->mode = cpu_to_le16(0755 | S_IFDIR);
+	val->owner = cpu_to_le32(attrs->owner);
+	val->group = cpu_to_le32(attrs->group);
+	val->mode = cpu_to_le16(attrs->mode);
 
 	xblob = (struct apfs_xf_blob *)val->xfields;
-	xblob->xf_num_exts = cpu_to_le16(1); /* Just the primary name */
-	xblob->xf_used_data = cpu_to_le16(padded_namelen);
+	xblob->xf_num_exts = cpu_to_le16(xcount);
+	xfield = (struct apfs_x_field *)xblob->xf_data;
+	xdata = xdata_start = xfield + xcount;
+
+	/* The primary name always comes first */
+	xfield->x_type = APFS_INO_EXT_TYPE_NAME;
+	xfield->x_flags = APFS_XF_DO_NOT_COPY;
+	xfield->x_size = cpu_to_le16(namelen);
+	strcpy(xdata, attrs->name);
+	xdata += padded_namelen;
+	++xfield;
+
+	if (attrs->size) {
+		u64 alloced_size = ROUND_UP(attrs->size, param->blocksize);
+
+		xfield->x_type = APFS_INO_EXT_TYPE_DSTREAM;
+		xfield->x_flags = APFS_XF_SYSTEM_FIELD;
+		xfield->x_size = cpu_to_le16(sizeof(*dstream));
+		dstream = xdata;
+		dstream->size = cpu_to_le64(attrs->size);
+		dstream->alloced_size = cpu_to_le64(alloced_size);
+		xdata += sizeof(*dstream);
+		++xfield;
+	}
+
+	if (has_rdev) {
+		xfield->x_type = APFS_INO_EXT_TYPE_RDEV;
+		xfield->x_flags = 0;
+		xfield->x_size = cpu_to_le16(sizeof(__le32));
+		*(__le32 *)xdata = cpu_to_le32(attrs->rdev);
+		xdata += ROUND_UP(sizeof(__le32), 8);
+	}
+
+	xblob->xf_used_data = cpu_to_le16(xdata - xdata_start);
+	return xdata - (void *)val;
+}
+
+/**
+ * set_default_attrs - Set the attributes for an inode made from scratch
+ * @attrs:	attributes to set
+ * @parent:	inode number for the parent
+ * @name:	filename
+ * @mode:	file mode
+ * @count:	child count for a directory, link count for a file
+ * @size:	size of the data stream, or zero if none
+ */
+static void set_default_attrs(struct inode_attrs *attrs, u64 parent, char *name,
+			      u16 mode, u32 count, u64 size)
+{
+	memset(attrs, 0, sizeof(*attrs));
+	attrs->parent = parent;
+	attrs->name = name;
+	attrs->mode = mode;
+	attrs->count = count;
+	attrs->size = size;
+
+	/* Should this be the exact same as the dentry timetamp? */
+	attrs->create_time = attrs->mod_time = attrs->change_time =
+			     attrs->access_time = get_timestamp();
+
+	/* TODO: allow the user to override these fields */
+	attrs->owner = geteuid();
+	attrs->group = getegid();
+}
+
+/* Biggest possible inode value: the name, dstream and device xfields */
+#define MAX_INODE_VAL_SIZE	(sizeof(struct apfs_inode_val) + \
+				 sizeof(struct apfs_xf_blob) + \
+				 3 * sizeof(struct apfs_x_field) + \
+				 ROUND_UP(APFS_NAME_LEN + 1, 8) + \
+				 sizeof(struct apfs_dstream) + 8)
+
+/* Biggest possible dentry key */
+#define MAX_DENTRY_KEY_SIZE	(sizeof(struct apfs_drec_hashed_key) + \
+				 APFS_NAME_LEN + 1)
+
+/* Biggest possible dentry value: the sibling id xfield */
+#define MAX_DENTRY_VAL_SIZE	(sizeof(struct apfs_drec_val) + \
+				 sizeof(struct apfs_xf_blob) + \
+				 sizeof(struct apfs_x_field) + sizeof(__le64))
+
+/**
+ * add_dentry_record - Add a dentry record to the catalog
+ * @cat:	catalog under construction
+ * @parent:	inode number for the parent
+ * @name:	filename
+ * @ino:	inode number for the file
+ * @mode:	file mode
+ * @sibling_id:	sibling id for the hard link, or zero if none
+ */
+static void add_dentry_record(struct btree_builder *cat, u64 parent,
+			      char *name, u64 ino, u16 mode, u64 sibling_id)
+{
+	u64 key[DIV_ROUND_UP(MAX_DENTRY_KEY_SIZE, 8)];
+	u64 val[DIV_ROUND_UP(MAX_DENTRY_VAL_SIZE, 8)];
+	int key_len, val_len;
+
+	key_len = make_dentry_key(parent, name, key);
+	val_len = make_dentry_val(ino, mode, sibling_id,
+				  (struct apfs_drec_val *)val);
+	btree_add_record(cat, key, key_len, val, val_len);
+}
+
+/**
+ * add_inode_record - Add an inode record to the catalog
+ * @cat:	catalog under construction
+ * @ino:	inode number
+ * @attrs:	attributes for the inode
+ */
+static void add_inode_record(struct btree_builder *cat, u64 ino,
+			     struct inode_attrs *attrs)
+{
+	struct apfs_inode_key key;
+	u64 val[DIV_ROUND_UP(MAX_INODE_VAL_SIZE, 8)];
+	int key_len, val_len;
+
+	key_len = make_inode_key(ino, &key);
+	val_len = make_inode_val(ino, attrs, (struct apfs_inode_val *)val);
+	btree_add_record(cat, &key, key_len, val, val_len);
+}
+
+/**
+ * add_new_inode_record - Add the inode record for a file made from scratch
+ * @cat:	catalog under construction
+ * @ino:	inode number
+ * @parent:	inode number for the parent
+ * @name:	filename
+ * @mode:	file mode
+ * @count:	child count for a directory, link count for a file
+ * @size:	size of the data stream, or zero if none
+ */
+static void add_new_inode_record(struct btree_builder *cat, u64 ino, u64 parent,
+				 char *name, u16 mode, u32 count, u64 size)
+{
+	struct inode_attrs attrs;
+
+	set_default_attrs(&attrs, parent, name, mode, count, size);
+	add_inode_record(cat, ino, &attrs);
+}
+
+/**
+ * add_symlink_record - Add the xattr record for the target of a symlink
+ * @cat:	catalog under construction
+ * @ino:	inode number for the symlink
+ * @target:	target path
+ */
+static void add_symlink_record(struct btree_builder *cat, u64 ino, char *target)
+{
+	struct {
+		struct apfs_xattr_key k;
+		char name[sizeof(APFS_XATTR_NAME_SYMLINK)];
+	} __packed key;
+	struct {
+		struct apfs_xattr_val v;
+		char target[APFS_XATTR_MAX_EMBEDDED_SIZE];
+	} __packed val;
+	int len = strlen(target) + 1;
+
+	/* Checked already by the scan of the source tree */
+	assert(len <= APFS_XATTR_MAX_EMBEDDED_SIZE);
+
+	set_key_header(ino, APFS_TYPE_XATTR, &key.k.hdr);
+	key.k.name_len = cpu_to_le16(sizeof(APFS_XATTR_NAME_SYMLINK));
+	strcpy(key.name, APFS_XATTR_NAME_SYMLINK);
+
+	val.v.flags = cpu_to_le16(APFS_XATTR_DATA_EMBEDDED |
+				  APFS_XATTR_FILE_SYSTEM_OWNED);
+	val.v.xdata_len = cpu_to_le16(len);
+	strcpy(val.target, target);
+	btree_add_record(cat, &key, sizeof(key), &val, sizeof(val.v) + len);
+}
+
+/**
+ * add_dstream_id_record - Add the reference count record for a data stream
+ * @cat:	catalog under construction
+ * @id:		id of the data stream
+ */
+static void add_dstream_id_record(struct btree_builder *cat, u64 id)
+{
+	struct apfs_dstream_id_key dstream_key;
+	struct apfs_dstream_id_val dstream_val;
+
+	set_key_header(id, APFS_TYPE_DSTREAM_ID, &dstream_key.hdr);
+	dstream_val.refcnt = cpu_to_le32(1);
+	btree_add_record(cat, &dstream_key, sizeof(dstream_key),
+			 &dstream_val, sizeof(dstream_val));
+}
+
+/**
+ * add_extent_records - Add the records for a new extent of a data stream
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ * @id:		id of the data stream
+ * @addr:	logical address of the extent in the data stream
+ * @bno:	first physical block of the extent
+ * @blocks:	length of the extent, in blocks
+ *
+ * The physical extents must be added in order of block number.
+ */
+static void add_extent_records(struct btree_builder *cat,
+			       struct btree_builder *extref, u64 id, u64 addr,
+			       u64 bno, u64 blocks)
+{
+	struct apfs_file_extent_key ext_key;
+	struct apfs_file_extent_val ext_val;
+	struct apfs_phys_ext_key pext_key;
+	struct apfs_phys_ext_val pext_val;
+
+	set_key_header(id, APFS_TYPE_FILE_EXTENT, &ext_key.hdr);
+	ext_key.logical_addr = cpu_to_le64(addr);
+	ext_val.len_and_flags = cpu_to_le64(blocks * param->blocksize);
+	ext_val.phys_block_num = cpu_to_le64(bno);
+	ext_val.crypto_id = 0;
+	btree_add_record(cat, &ext_key, sizeof(ext_key),
+			 &ext_val, sizeof(ext_val));
+
+	set_key_header(bno, APFS_TYPE_EXTENT, &pext_key.hdr);
+	pext_val.len_and_kind = cpu_to_le64((u64)APFS_KIND_NEW << APFS_PEXT_KIND_SHIFT | blocks);
+	pext_val.owning_obj_id = cpu_to_le64(id);
+	pext_val.refcnt = cpu_to_le32(1);
+	btree_add_record(extref, &pext_key, sizeof(pext_key),
+			 &pext_val, sizeof(pext_val));
+}
+
+/**
+ * add_dstream_records - Add the records for a data stream of one-block extents
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ * @id:		id of the data stream
+ * @extents:	number of extents
+ *
+ * The blocks for the extents are allocated here, but their contents are never
+ * written.
+ */
+static void add_dstream_records(struct btree_builder *cat,
+				struct btree_builder *extref, u64 id,
+				u64 extents)
+{
+	u64 i;
+
+	add_dstream_id_record(cat, id);
+
+	/* Blocks are allocated in order, so the physical extents are sorted */
+	for (i = 0; i < extents; ++i)
+		add_extent_records(cat, extref, id, i * param->blocksize,
+				   alloc_blocks(1), 1);
+}
+
+/* Length of the names for the synthetic files, with the null termination */
+#define SYNTHETIC_NAME_LEN	15
+
+/* Total number of synthetic dentries: one per file, plus the extra links */
+#define SYNTHETIC_DENTRIES	(param->syn_inodes + param->syn_links)
+
+/* Sibling id for the first link to the first file, if it has hard links */
+#define SYNTHETIC_SIBLING_ID	(APFS_MIN_USER_INO_NUM + param->syn_inodes)
+
+/**
+ * synthetic_name - Get the name for one of the synthetic dentries
+ * @index:	index of the dentry
+ * @buf:	buffer of SYNTHETIC_NAME_LEN bytes
+ *
+ * The first dentries are for the files, and the rest are the extra hard links
+ * to the first file.  The names all have the same length, and the prefix for
+ * the links sorts after the one for the files, so comparing them is the same
+ * as comparing their indices.  Returns @buf.
+ */
+static char *synthetic_name(u32 index, char *buf)
+{
+	if (index < param->syn_inodes)
+		snprintf(buf, SYNTHETIC_NAME_LEN, "file%010u", index);
+	else
+		snprintf(buf, SYNTHETIC_NAME_LEN, "link%010u",
+			 (u32)(index - param->syn_inodes));
+	return buf;
+}
+
+/**
+ * synthetic_sibling_id - Get the sibling id for one of the synthetic dentries
+ * @index: index of the dentry
+ *
+ * Returns zero if the dentry is not a hard link.  The original dentry of the
+ * first file gets the lowest sibling id, so it remains the primary link.
+ */
+static u64 synthetic_sibling_id(u32 index)
+{
+	if (!param->syn_links)
+		return 0;
+	if (index == 0)
+		return SYNTHETIC_SIBLING_ID;
+	if (index < param->syn_inodes)
+		return 0;
+	return SYNTHETIC_SIBLING_ID + 1 + index - param->syn_inodes;
+}
+
+/**
+ * synthetic_ino - Get the inode number for one of the synthetic dentries
+ * @index: index of the dentry
+ */
+static u64 synthetic_ino(u32 index)
+{
+	if (index < param->syn_inodes)
+		return APFS_MIN_USER_INO_NUM + index;
+	return APFS_MIN_USER_INO_NUM;
+}
 
-	name_xfield = (struct apfs_x_field *)xblob->xf_data;
-	name_xfield->x_type = APFS_INO_EXT_TYPE_NAME;
-	name_xfield->x_flags = APFS_XF_DO_NOT_COPY;
-	name_xfield->x_size = cpu_to_le16(namelen);
+/*
+ * Position of one of the synthetic dentries in the catalog
+ */
+struct dentry_order {
+	u32	hash;	/* Hash for the key, or zero if unhashed */
+	u32	index;	/* Index of the dentry */
+};
+
+/**
+ * dentry_order_cmp - Compare two synthetic dentries by position in the catalog
+ * @a:	first dentry
+ * @b:	second dentry
+ */
+static int dentry_order_cmp(const void *a, const void *b)
+{
+	const struct dentry_order *d1 = a, *d2 = b;
 
-	strcpy((char *)val_end - padded_namelen, name);
-	return i_len;
+	if (d1->hash != d2->hash)
+		return d1->hash < d2->hash ? -1 : 1;
+	if (d1->index != d2->index)
+		return d1->index < d2->index ? -1 : 1;
+	return 0;
 }
 
 /**
- * make_special_dir_inode - Make inode record for an empty special dir
- * @ino:		inode number for the directory
- * @name:		directory name
- * @next_toc:		next available toc entry (updated on return)
- * @key_area:		start of the key area
- * @key:		start of the available key area (updated on return)
- * @val_area_end:	end of the value area
- * @val_end:		end of the available value area (updated on return)
+ * add_root_dentries - Add the dentry records for all the synthetic files
+ * @cat: catalog under construction
  */
-void make_special_dir_inode(u64 ino, char *name, struct apfs_kvloc **next_toc,
-			    void *key_area, void **key,
-			    void *val_area_end, void **val_end)
+static void add_root_dentries(struct btree_builder *cat)
 {
-	struct apfs_kvloc *kvloc = *next_toc;
-	int len;
+	struct dentry_order *order;
+	char name[SYNTHETIC_NAME_LEN];
+	u32 i;
+
+	if (!SYNTHETIC_DENTRIES)
+		return;
+	order = calloc(SYNTHETIC_DENTRIES, sizeof(*order));
+	if (!order)
+		system_error();
+
+	for (i = 0; i < SYNTHETIC_DENTRIES; ++i) {
+		order[i].index = i;
+		if (!param->norm_sensitive)
+			order[i].hash = dentry_hash(synthetic_name(i, name));
+	}
+	qsort(order, SYNTHETIC_DENTRIES, sizeof(*order), dentry_order_cmp);
+
+	for (i = 0; i < SYNTHETIC_DENTRIES; ++i) {
+		u32 index = order[i].index;
+
+		add_dentry_record(cat, APFS_ROOT_DIR_INO_NUM,
+				  synthetic_name(index, name),
+				  synthetic_ino(index), S_IFREG,
+				  synthetic_sibling_id(index));
+	}
+	free(order);
+}
 
-	len = make_special_inode_key(ino, *key);
-	kvloc->k.off = cpu_to_le16(*key - key_area);
-	kvloc->k.len = cpu_to_le16(len);
-	*key += len;
+/**
+ * add_sibling_link_record - Add the sibling link record for a hard link
+ * @cat:	catalog under construction
+ * @ino:	inode number for the file
+ * @sibling_id:	sibling id for the link
+ * @parent:	inode number for the parent of the link
+ * @name:	filename for the link
+ */
+static void add_sibling_link_record(struct btree_builder *cat, u64 ino,
+				    u64 sibling_id, u64 parent, char *name)
+{
+	struct apfs_sibling_link_key key;
+	struct {
+		struct apfs_sibling_val v;
+		char name[APFS_NAME_LEN + 1];
+	} __packed val;
+	int len = strlen(name) + 1;
+
+	set_key_header(ino, APFS_TYPE_SIBLING_LINK, &key.hdr);
+	key.sibling_id = cpu_to_le64(sibling_id);
+	val.v.parent_id = cpu_to_le64(parent);
+	val.v.name_len = cpu_to_le16(len);
+	strcpy(val.name, name);
+	btree_add_record(cat, &key, sizeof(key), &val, sizeof(val.v) + len);
+}
 
-	len = make_special_inode_val(ino, name, *val_end);
-	kvloc->v.off = cpu_to_le16(val_area_end - *val_end + len);
-	kvloc->v.len = cpu_to_le16(len);
-	*val_end -= len;
+/**
+ * add_sibling_map_record - Add the sibling map record for a hard link
+ * @cat:	catalog under construction
+ * @sibling_id:	sibling id for the link
+ * @ino:	inode number for the file
+ */
+static void add_sibling_map_record(struct btree_builder *cat, u64 sibling_id,
+				   u64 ino)
+{
+	struct apfs_sibling_map_key key;
+	struct apfs_sibling_map_val val;
 
-	++*next_toc;
+	set_key_header(sibling_id, APFS_TYPE_SIBLING_MAP, &key.hdr);
+	val.file_id = cpu_to_le64(ino);
+	btree_add_record(cat, &key, sizeof(key), &val, sizeof(val));
 }
 
 /**
- * make_special_dir_dentry - Make dentry record for an empty special dir
- * @ino:		inode number for the directory
- * @name:		directory name
- * @next_toc:		next available toc entry (updated on return)
- * @key_area:		start of the key area
- * @key:		start of the available key area (updated on return)
- * @val_area_end:	end of the value area
- * @val_end:		end of the available value area (updated on return)
+ * add_synthetic_records - Add the records for the root and synthetic files
+ * @vsb:	volume superblock, to report the files and their blocks
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ *
+ * The synthetic files all go in the root, and the extents are spread among
+ * them as evenly as possible.  The extra hard links, if any, all belong to
+ * the first file; their sibling ids come right after the inode numbers, so the
+ * sibling maps go at the end of the catalog.
  */
-void make_special_dir_dentry(u64 ino, char *name, struct apfs_kvloc **next_toc,
-			     void *key_area, void **key,
-			     void *val_area_end, void **val_end)
+static void add_synthetic_records(struct apfs_superblock *vsb,
+				  struct btree_builder *cat,
+				  struct btree_builder *extref)
 {
-	struct apfs_kvloc *kvloc = *next_toc;
-	int len;
+	char name[SYNTHETIC_NAME_LEN];
+	u64 per_file = 0, extra = 0;
+	u64 next_obj_id;
+	u32 i, j;
+
+	if (param->syn_inodes) {
+		per_file = param->syn_extents / param->syn_inodes;
+		extra = param->syn_extents % param->syn_inodes;
+	}
+
+	add_new_inode_record(cat, APFS_ROOT_DIR_INO_NUM, APFS_ROOT_DIR_PARENT,
+			     "root", 0755 | S_IFDIR, SYNTHETIC_DENTRIES, 0);
+	add_root_dentries(cat);
+	add_new_inode_record(cat, APFS_PRIV_DIR_INO_NUM, APFS_ROOT_DIR_PARENT,
+			     "private-dir", 0755 | S_IFDIR, 0, 0);
+
+	for (i = 0; i < param->syn_inodes; ++i) {
+		u64 ino = APFS_MIN_USER_INO_NUM + i;
+		u64 extents = per_file + (i < extra);
+		u32 nlink = i ? 1 : 1 + param->syn_links;
+
+		add_new_inode_record(cat, ino, APFS_ROOT_DIR_INO_NUM,
+				     synthetic_name(i, name), 0644 | S_IFREG,
+				     nlink, extents * param->blocksize);
+		if (nlink > 1) {
+			add_sibling_link_record(cat, ino, synthetic_sibling_id(0),
+						APFS_ROOT_DIR_INO_NUM,
+						synthetic_name(0, name));
+			for (j = param->syn_inodes; j < SYNTHETIC_DENTRIES; ++j)
+				add_sibling_link_record(cat, ino, synthetic_sibling_id(j),
+							APFS_ROOT_DIR_INO_NUM,
+							synthetic_name(j, name));
+		}
+		if (extents)
+			add_dstream_records(cat, extref, ino, extents);
+	}
+
+	next_obj_id = APFS_MIN_USER_INO_NUM + param->syn_inodes;
+	if (param->syn_links) {
+		add_sibling_map_record(cat, synthetic_sibling_id(0), synthetic_ino(0));
+		for (j = param->syn_inodes; j < SYNTHETIC_DENTRIES; ++j)
+			add_sibling_map_record(cat, synthetic_sibling_id(j),
+					       synthetic_ino(j));
+		next_obj_id = synthetic_sibling_id(SYNTHETIC_DENTRIES - 1) + 1;
+	}
+
+	vsb->apfs_num_files = cpu_to_le64(param->syn_inodes);
+	vsb->apfs_next_obj_id = cpu_to_le64(next_obj_id);
+	vsb->apfs_fs_alloc_count = cpu_to_le64(le64_to_cpu(vsb->apfs_fs_alloc_count) +
+					       param->syn_extents);
+}
 
-	len = make_special_dentry_key(APFS_ROOT_DIR_PARENT, name, *key);
-	kvloc->k.off = cpu_to_le16(*key - key_area);
-	kvloc->k.len = cpu_to_le16(len);
-	*key += len;
+/**
+ * add_source_inode_records - Add all records for an inode from the source tree
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ * @index:	index of the inode in the source tree
+ *
+ * The blocks for the data are allocated here, in a single extent, but they
+ * are only written later by copy_source_data().  Returns the block count.
+ */
+static u64 add_source_inode_records(struct btree_builder *cat,
+				    struct btree_builder *extref, u64 index)
+{
+	struct src_inode *inode = &src_inodes[index];
+	struct inode_attrs *attrs = &inode->s_attrs;
+	u64 ino = src_ino(index);
+	u64 blocks = 0;
+	u32 i;
+
+	add_inode_record(cat, ino, attrs);
+	if (inode->s_target)
+		add_symlink_record(cat, ino, inode->s_target);
+
+	if (attrs->size) {
+		blocks = DIV_ROUND_UP(attrs->size, param->blocksize);
+		inode->s_bno = alloc_blocks(blocks);
+		add_dstream_id_record(cat, ino);
+		add_extent_records(cat, extref, ino, 0 /* addr */,
+				   inode->s_bno, blocks);
+	}
+
+	/* The scan already sorted the children in dentry key order */
+	if ((attrs->mode & S_IFMT) == S_IFDIR) {
+		for (i = 0; i < attrs->count; ++i) {
+			u64 child = inode->s_first_child + i;
+
+			add_dentry_record(cat, ino, src_inodes[child].s_attrs.name,
+					  src_ino(child),
+					  src_inodes[child].s_attrs.mode, 0);
+		}
+	}
+	return blocks;
+}
 
-	len = make_special_dentry_val(ino, *val_end);
-	kvloc->v.off = cpu_to_le16(val_area_end - *val_end + len);
-	kvloc->v.len = cpu_to_le16(len);
-	*val_end -= len;
+/**
+ * add_source_records - Add the records for the root and the source tree
+ * @vsb:	volume superblock, to report the files and their blocks
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ *
+ * The inode numbers follow the order of the scan, so they are visited here in
+ * that same order.
+ */
+static void add_source_records(struct apfs_superblock *vsb,
+			       struct btree_builder *cat,
+			       struct btree_builder *extref)
+{
+	u64 files = 0, dirs = 0, symlinks = 0, others = 0, blocks;
+	u64 index;
+
+	blocks = add_source_inode_records(cat, extref, 0 /* root */);
+	add_new_inode_record(cat, APFS_PRIV_DIR_INO_NUM, APFS_ROOT_DIR_PARENT,
+			     "private-dir", 0755 | S_IFDIR, 0, 0);
+
+	for (index = 1; index < src_inode_count; ++index) {
+		switch (src_inodes[index].s_attrs.mode & S_IFMT) {
+		case S_IFREG:
+			++files;
+			break;
+		case S_IFDIR:
+			++dirs;
+			break;
+		case S_IFLNK:
+			++symlinks;
+			break;
+		default:
+			++others;
+		}
+		blocks += add_source_inode_records(cat, extref, index);
+	}
+
+	vsb->apfs_num_files = cpu_to_le64(files);
+	vsb->apfs_num_directories = cpu_to_le64(dirs);
+	vsb->apfs_num_symlinks = cpu_to_le64(symlinks);
+	vsb->apfs_num_other_fsobjects = cpu_to_le64(others);
+	vsb->apfs_next_obj_id = cpu_to_le64(src_ino(src_inode_count));
+	vsb->apfs_fs_alloc_count = cpu_to_le64(le64_to_cpu(vsb->apfs_fs_alloc_count) +
+					       blocks);
+}
 
-	++*next_toc;
+/**
+ * make_catalog - Add all the records for the catalog of a new volume
+ * @vsb:	volume superblock, to report the files and their blocks
+ * @cat:	catalog under construction
+ * @extref:	extent reference tree under construction
+ *
+ * Besides the root and private directories, the catalog gets the source tree
+ * or the synthetic files requested by the user, if any.  The records must be
+ * added in key order.
+ */
+void make_catalog(struct apfs_superblock *vsb, struct btree_builder *cat,
+		  struct btree_builder *extref)
+{
+	/* Both special directories have the same parent, so sort by hash */
+	if (param->norm_sensitive ||
+	    dentry_hash("private-dir") < dentry_hash("root")) {
+		add_dentry_record(cat, APFS_ROOT_DIR_PARENT, "private-dir",
+				  APFS_PRIV_DIR_INO_NUM, S_IFDIR, 0);
+		add_dentry_record(cat, APFS_ROOT_DIR_PARENT, "root",
+				  APFS_ROOT_DIR_INO_NUM, S_IFDIR, 0);
+	} else {
+		add_dentry_record(cat, APFS_ROOT_DIR_PARENT, "root",
+				  APFS_ROOT_DIR_INO_NUM, S_IFDIR, 0);
+		add_dentry_record(cat, APFS_ROOT_DIR_PARENT, "private-dir",
+				  APFS_PRIV_DIR_INO_NUM, S_IFDIR, 0);
+	}
+
+	if (param->src_dir)
+		add_source_records(vsb, cat, extref);
+	else
+		add_synthetic_records(vsb, cat, extref);
 }
@@ -7,13 +7,29 @@
 
 #include <apfs/types.h>
 
-extern void make_special_dir_dentry(u64 ino, char *name,
-				    struct apfs_kvloc **next_toc,
-				    void *key_area, void **key,
-				    void *val_area_end, void **val_end);
-extern void make_special_dir_inode(u64 ino, char *name,
-				   struct apfs_kvloc **next_toc,
-				   void *key_area, void **key,
-				   void *val_area_end, void **val_end);
+struct apfs_superblock;
+struct btree_builder;
+
+/*
+ * Attributes for a new inode record
+ */
+struct inode_attrs {
+	u64	parent;		/* Inode number for the parent */
+	char	*name;		/* Filename */
+	u64	size;		/* Size of the data stream, or zero if none */
+	u64	create_time;	/* Timestamps, in nanoseconds */
+	u64	mod_time;
+	u64	change_time;
+	u64	access_time;
+	u32	count;		/* Child count for a directory, nlink for a file */
+	u32	owner;		/* User id */
+	u32	group;		/* Group id */
+	u32	rdev;		/* Device identifier, for device files */
+	u16	mode;		/* File mode */
+};
+
+extern u32 dentry_hash(const char *name);
+extern void make_catalog(struct apfs_superblock *vsb, struct btree_builder *cat,
+			 struct btree_builder *extref);
 
 #endif	/* _DIR_H */
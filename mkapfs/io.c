@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Writes to the device.  The blocks for all structures are first put together
+ * in memory, and later written in order in a few big batches, so formatting
+ * a device takes a handful of sequential writes and a single sync.
+ *
+ * Disk areas that are just wiped don't go through memory at all: the fastest
+ * method that works for the device is found on the first call, and remembered
+ * for the rest.  The kernel can zero ranges of block devices and image files
+ * on its own, so the zeroes only get written by hand as a last resort.
+ */
+
+#define _GNU_SOURCE	/* For fallocate() */
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <apfs/types.h>
+#include "io.h"
+#include "mkapfs.h"
+
+/* Methods to wipe a range of the device, from best to worst */
+enum zero_method {
+	ZERO_UNKNOWN,		/* Not yet decided */
+	ZERO_BLKZEROOUT,	/* Block device that can zero ranges itself */
+	ZERO_BLKDISCARD,	/* Block device where discarded ranges read zero */
+	ZERO_PUNCH_HOLE,	/* Image file with support for holes */
+	ZERO_RANGE,		/* Image file that can zero ranges without holes */
+	ZERO_WRITE,		/* Write the zeroes by hand */
+};
+
+static enum zero_method zero_method;
+
+/* Size of the buffer of zeroes, for when they must be written by hand */
+#define ZERO_BUF_SIZE	(1024 * 1024)
+
+static void *zero_buf;
+
+/**
+ * zero_with_writes - Wipe a range of the device by writing zeroes to it
+ * @start:	offset of the range, in bytes
+ * @len:	length of the range, in bytes
+ */
+static void zero_with_writes(u64 start, u64 len)
+{
+	if (!zero_buf) {
+		/* Aligned to the page, just in case the device needs it */
+		if (posix_memalign(&zero_buf, sysconf(_SC_PAGESIZE), ZERO_BUF_SIZE))
+			system_error();
+		memset(zero_buf, 0, ZERO_BUF_SIZE);
+	}
+
+	while (len) {
+		size_t count = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+		ssize_t ret;
+
+		ret = pwrite(fd, zero_buf, count, start);
+		if (ret <= 0)
+			system_error();
+		start += ret;
+		len -= ret;
+	}
+}
+
+/**
+ * zero_with_method - Try to wipe a range of the device with a given method
+ * @method:	the method
+ * @start:	offset of the range, in bytes
+ * @len:	length of the range, in bytes
+ *
+ * Returns 0 on success, or -1 if the method is not supported for the device.
+ */
+static int zero_with_method(enum zero_method method, u64 start, u64 len)
+{
+	u64 range[2] = {start, len};
+	int discard_zeroes = 0;
+
+	switch (method) {
+	case ZERO_BLKZEROOUT:
+		return ioctl(fd, BLKZEROOUT, range);
+	case ZERO_BLKDISCARD:
+		/* Discarded blocks may keep their old contents otherwise */
+		if (ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) || !discard_zeroes)
+			return -1;
+		return ioctl(fd, BLKDISCARD, range);
+	case ZERO_PUNCH_HOLE:
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len);
+	case ZERO_RANGE:
+		return fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, start, len);
+	default:
+		zero_with_writes(start, len);
+		return 0;
+	}
+}
+
+/**
+ * first_zero_method - Get the first method worth trying for the device
+ */
+static enum zero_method first_zero_method(void)
+{
+	struct stat buf;
+
+	if (fstat(fd, &buf))
+		system_error();
+	if ((buf.st_mode & S_IFMT) == S_IFBLK)
+		return ZERO_BLKZEROOUT;
+	if ((buf.st_mode & S_IFMT) == S_IFREG)
+		return ZERO_PUNCH_HOLE;
+	return ZERO_WRITE;
+}
+
+/**
+ * zero_blocks - Wipe a range of blocks on the device
+ * @bno:	first block number
+ * @count:	number of blocks
+ *
+ * This goes straight to the device, so it must not be used on blocks that
+ * were already staged with get_zeroed_blocks().
+ */
+void zero_blocks(u64 bno, u64 count)
+{
+	u64 start = bno * param->blocksize;
+	u64 len = count * param->blocksize;
+
+	if (!count)
+		return;
+	if (len / count != param->blocksize)
+		fatal("overflow detected on disk area wipe");
+
+	if (zero_method == ZERO_UNKNOWN)
+		zero_method = first_zero_method();
+
+	/* Methods that fail once won't work later either, so skip them */
+	while (zero_with_method(zero_method, start, len)) {
+		if (zero_method == ZERO_BLKDISCARD || zero_method == ZERO_RANGE)
+			zero_method = ZERO_WRITE;
+		else
+			++zero_method;
+	}
+}
+
+/*
+ * Contiguous blocks under construction, kept in memory until they get written
+ */
+struct staged_blocks {
+	u64	s_bno;		/* First block number */
+	u64	s_count;	/* Number of blocks */
+	void	*s_data;	/* Contents of the blocks */
+	bool	s_done;		/* Were the blocks released by their builder? */
+};
+
+static struct staged_blocks *staged;	/* Blocks in construction order */
+static u64 staged_count;		/* Number of entries in @staged */
+static u64 staged_size;			/* Number of entries allocated for */
+static u64 staged_done_bytes;		/* Size of the released blocks */
+
+/* Released blocks are written once they take up this much memory */
+#define STAGING_LIMIT	(64 * 1024 * 1024)
+
+/* Alignment for the staged blocks, enough for direct i/o */
+#define STAGING_ALIGN	4096
+
+/**
+ * get_zeroed_blocks - Get a staging buffer for contiguous filesystem blocks
+ * @bno:	first block number
+ * @count:	number of blocks
+ *
+ * Returns a zeroed buffer for the blocks; the caller must release it with
+ * release_blocks() once it's done, and then the blocks will be written at
+ * some point.  The buffer should never be freed by the caller.
+ */
+void *get_zeroed_blocks(u64 bno, u64 count)
+{
+	struct staged_blocks *new;
+	size_t size = param->blocksize * count;
+	void *blocks;
+
+	if (!count || size / count != param->blocksize)
+		fatal("overflow detected on disk area mapping");
+	if (bno >= param->block_count || count > param->block_count - bno)
+		fatal("disk area is out of bounds");
+
+	if (posix_memalign(&blocks, STAGING_ALIGN, size))
+		system_error();
+	memset(blocks, 0, size);
+
+	if (staged_count == staged_size) {
+		staged_size = staged_size ? staged_size << 1 : 256;
+		staged = realloc(staged, staged_size * sizeof(*staged));
+		if (!staged)
+			system_error();
+	}
+	new = &staged[staged_count++];
+	new->s_bno = bno;
+	new->s_count = count;
+	new->s_data = blocks;
+	new->s_done = false;
+	return blocks;
+}
+
+/**
+ * get_zeroed_block - Get a staging buffer for a filesystem block
+ * @bno: block number
+ *
+ * Returns a zeroed buffer for the block, to be released with release_blocks().
+ */
+void *get_zeroed_block(u64 bno)
+{
+	return get_zeroed_blocks(bno, 1);
+}
+
+/**
+ * pwritev_all - Write a list of buffers to the device, retrying short writes
+ * @iov:	the buffers
+ * @iovcnt:	number of buffers
+ * @offset:	offset on the device
+ *
+ * The list of buffers may get modified.
+ */
+static void pwritev_all(struct iovec *iov, int iovcnt, u64 offset)
+{
+	while (iovcnt) {
+		ssize_t ret = pwritev(fd, iov, iovcnt, offset);
+
+		if (ret <= 0)
+			system_error();
+		offset += ret;
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/**
+ * staged_blocks_cmp - Compare two staged entries by block number
+ * @a:	first entry
+ * @b:	second entry
+ */
+static int staged_blocks_cmp(const void *a, const void *b)
+{
+	const struct staged_blocks *s1 = a, *s2 = b;
+
+	if (s1->s_bno != s2->s_bno)
+		return s1->s_bno < s2->s_bno ? -1 : 1;
+	return 0;
+}
+
+/**
+ * write_done_blocks - Write all released blocks to the device, and free them
+ *
+ * The blocks are sorted first, and each run of consecutive ones goes in a
+ * single call to pwritev().
+ */
+static void write_done_blocks(void)
+{
+	struct iovec iov[IOV_MAX];
+	u64 done = 0, kept = 0, i;
+	u64 run_start = 0, next_bno = 0;
+	int iovcnt = 0;
+
+	/* The entries still in construction stay at the start, in order */
+	for (i = 0; i < staged_count; ++i) {
+		struct staged_blocks tmp = staged[i];
+
+		if (tmp.s_done)
+			continue;
+		staged[i] = staged[kept];
+		staged[kept++] = tmp;
+	}
+	done = staged_count - kept;
+	qsort(staged + kept, done, sizeof(*staged), staged_blocks_cmp);
+
+	for (i = kept; i < staged_count; ++i) {
+		struct staged_blocks *curr = &staged[i];
+
+		if (iovcnt && (curr->s_bno != next_bno || iovcnt == IOV_MAX)) {
+			pwritev_all(iov, iovcnt, run_start * param->blocksize);
+			iovcnt = 0;
+		}
+		if (!iovcnt)
+			run_start = curr->s_bno;
+		iov[iovcnt].iov_base = curr->s_data;
+		iov[iovcnt].iov_len = curr->s_count * param->blocksize;
+		++iovcnt;
+		next_bno = curr->s_bno + curr->s_count;
+	}
+	if (iovcnt)
+		pwritev_all(iov, iovcnt, run_start * param->blocksize);
+
+	for (i = kept; i < staged_count; ++i)
+		free(staged[i].s_data);
+	staged_count = kept;
+	staged_done_bytes = 0;
+}
+
+/**
+ * release_blocks - Let a staging buffer be written to the device
+ * @blocks: buffer returned by get_zeroed_blocks()
+ *
+ * The buffer must not be used after this.  Buffers are usually released soon
+ * after they are requested, so the search starts from the latest.
+ */
+void release_blocks(void *blocks)
+{
+	u64 i = staged_count;
+
+	while (i--) {
+		struct staged_blocks *curr = &staged[i];
+
+		if (curr->s_data != blocks || curr->s_done)
+			continue;
+		curr->s_done = true;
+		staged_done_bytes += curr->s_count * param->blocksize;
+		if (staged_done_bytes >= STAGING_LIMIT)
+			write_done_blocks();
+		return;
+	}
+	fatal("released blocks were never staged");
+}
+
+/**
+ * finish_writes - Write all remaining blocks and sync the device
+ *
+ * All staging buffers must have been released by now.
+ */
+void finish_writes(void)
+{
+	write_done_blocks();
+	if (staged_count)
+		fatal("some staged blocks were never released");
+	free(staged);
+	staged = NULL;
+	staged_size = 0;
+
+	if (fdatasync(fd))
+		system_error();
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _IO_H
+#define _IO_H
+
+#include <apfs/types.h>
+
+extern void zero_blocks(u64 bno, u64 count);
+extern void *get_zeroed_blocks(u64 bno, u64 count);
+extern void *get_zeroed_block(u64 bno);
+extern void release_blocks(void *blocks);
+extern void finish_writes(void);
+
+#endif	/* _IO_H */
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Planning of the fixed areas of the container.  The checkpoint areas grow
+ * with the device, within reasonable limits, while the size of the internal
+ * pool is given by the number of chunks, so it grows on its own.
+ */
+
+#include <stdlib.h>
+#include <apfs/raw.h>
+#include <apfs/types.h>
+#include "layout.h"
+#include "mkapfs.h"
+#include "spaceman.h"
+
+struct layout *layout;
+
+/*
+ * Limits for the size of the checkpoint areas.  Each checkpoint takes two
+ * descriptor blocks (the superblock and the mappings), and four data blocks
+ * for the ephemeral objects made by mkapfs, but the kernel needs room for
+ * several checkpoints in flight, and its space manager grows with big
+ * containers.
+ */
+#define CPOINT_DESC_MIN_BLOCKS	8
+#define CPOINT_DESC_MAX_BLOCKS	512
+#define CPOINT_DATA_MIN_BLOCKS	64
+#define CPOINT_DATA_MAX_BLOCKS	32768
+
+/* All containers seen so far keep sixteen bitmaps for the internal pool */
+#define IP_BMAP_COUNT		16
+
+/**
+ * clamp_blocks - Keep a block count inside the given limits
+ * @blocks:	the block count
+ * @min:	lower limit
+ * @max:	upper limit
+ */
+static inline u64 clamp_blocks(u64 blocks, u64 min, u64 max)
+{
+	if (blocks < min)
+		return min;
+	if (blocks > max)
+		return max;
+	return blocks;
+}
+
+/**
+ * plan_spaceman_counts - Set the counts of chunks and of their info blocks
+ */
+static void plan_spaceman_counts(void)
+{
+	int chunk_info_size = sizeof(struct apfs_chunk_info);
+	int cib_size = sizeof(struct apfs_chunk_info_block);
+	int cab_size = sizeof(struct apfs_cib_addr_block);
+	u32 max_direct_cibs;
+
+	layout->blocks_per_chunk = 8 * param->blocksize; /* One bitmap block each */
+	layout->chunks_per_cib = (param->blocksize - cib_size) / chunk_info_size;
+	layout->cibs_per_cab = (param->blocksize - cab_size) / sizeof(__le64);
+
+	layout->chunk_count = DIV_ROUND_UP(param->block_count, layout->blocks_per_chunk);
+	layout->cib_count = DIV_ROUND_UP(layout->chunk_count, layout->chunks_per_cib);
+
+	/*
+	 * Without cabs, the spaceman must have room for the addresses of all
+	 * main device cibs, plus an extra offset for tier 2.
+	 */
+	max_direct_cibs = (param->blocksize - CIB_ADDR_BASE_OFF) / sizeof(__le64) - 1;
+	layout->cab_count = 0;
+	if (layout->cib_count > max_direct_cibs)
+		layout->cab_count = DIV_ROUND_UP(layout->cib_count, layout->cibs_per_cab);
+}
+
+/**
+ * plan_layout - Decide the placement and size of the fixed container areas
+ *
+ * Must be called once the block count and block size are known, before any
+ * block gets written.  The areas are, in order: the checkpoint descriptors,
+ * the checkpoint data, the internal pool bitmaps and the internal pool.
+ */
+void plan_layout(void)
+{
+	u64 desc_blocks, data_blocks;
+
+	layout = calloc(1, sizeof(*layout));
+	if (!layout)
+		system_error();
+
+	plan_spaceman_counts();
+	if (layout->cab_count)
+		fatal("large containers are not yet supported");
+
+	/* Roughly one descriptor per 16 MiB, and one data block per 2 MiB */
+	desc_blocks = clamp_blocks(param->block_count >> 12, CPOINT_DESC_MIN_BLOCKS,
+				   CPOINT_DESC_MAX_BLOCKS);
+	desc_blocks = ROUND_UP(desc_blocks, 2); /* Whole checkpoints only */
+	data_blocks = clamp_blocks(param->block_count >> 9, CPOINT_DATA_MIN_BLOCKS,
+				   CPOINT_DATA_MAX_BLOCKS);
+
+	layout->cpoint_desc_base = APFS_NX_BLOCK_NUM + 1;
+	layout->cpoint_desc_blocks = desc_blocks;
+	layout->cpoint_data_base = layout->cpoint_desc_base + desc_blocks;
+
+	/*
+	 * Physical objects have their block number as oid, so they can't go
+	 * in the first blocks; let the checkpoint data take that space.
+	 */
+	if (layout->cpoint_data_base + data_blocks + IP_BMAP_COUNT < APFS_OID_RESERVED_COUNT)
+		data_blocks = APFS_OID_RESERVED_COUNT - IP_BMAP_COUNT - layout->cpoint_data_base;
+	layout->cpoint_data_blocks = data_blocks;
+
+	/* The pool needs three blocks per chunk and cib, as in all images */
+	layout->ip_bmap_base = layout->cpoint_data_base + data_blocks;
+	layout->ip_bmap_blocks = IP_BMAP_COUNT;
+	layout->ip_base = layout->ip_bmap_base + IP_BMAP_COUNT;
+	layout->ip_blocks = (layout->chunk_count + layout->cib_count) * 3;
+
+	/* There is no support for multiblock bitmaps in the internal pool */
+	if (layout->ip_blocks > 8 * param->blocksize)
+		fatal("large containers are not yet supported");
+
+	layout->first_alloc_bno = layout->ip_base + layout->ip_blocks;
+	if (layout->first_alloc_bno >= param->block_count)
+		fatal("device is too small for the container layout");
+}
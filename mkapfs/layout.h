@@ -0,0 +1,10 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+extern void plan_layout(void);
+
+#endif	/* _LAYOUT_H */
@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Bulk load of a directory tree into the new volume.  The whole tree is first
+ * scanned into memory, breadth-first, so that the children of each directory
+ * get consecutive inode numbers in the order of their dentry keys; that way
+ * the catalog can be built in a single ordered pass, with full leaves.  The
+ * file data is copied at the very end, each file to a single extent.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <apfs/raw.h>
+#include <apfs/thread.h>
+#include <apfs/types.h>
+#include <apfs/unicode.h>
+#include "dir.h"
+#include "load.h"
+#include "mkapfs.h"
+
+struct src_inode *src_inodes;
+u64 src_inode_count;
+static u64 src_inode_size;	/* Number of entries allocated for */
+
+/* The device itself may be inside the source tree, but it can't be copied */
+static dev_t device_dev;
+static ino_t device_ino;
+
+/**
+ * source_error - Print a system error message for a source path and exit
+ * @path: the path
+ */
+static __attribute__((noreturn)) void source_error(const char *path)
+{
+	perror(path);
+	exit(1);
+}
+
+/**
+ * new_src_inode - Add a new entry at the end of the source inode array
+ *
+ * Returns the index of the entry, which starts zeroed.  Pointers into the
+ * array become invalid after this.
+ */
+static u64 new_src_inode(void)
+{
+	if (src_inode_count == src_inode_size) {
+		src_inode_size = src_inode_size ? src_inode_size << 1 : 1024;
+		src_inodes = realloc(src_inodes, src_inode_size * sizeof(*src_inodes));
+		if (!src_inodes)
+			system_error();
+	}
+	memset(&src_inodes[src_inode_count], 0, sizeof(*src_inodes));
+	return src_inode_count++;
+}
+
+/**
+ * src_index - Get the index in the source array for an inode number
+ * @ino: the inode number
+ */
+static inline u64 src_index(u64 ino)
+{
+	if (ino == APFS_ROOT_DIR_INO_NUM)
+		return 0;
+	return ino - APFS_MIN_USER_INO_NUM + 1;
+}
+
+/**
+ * src_path - Build the path to an entry of the source tree
+ * @index:	index of the entry
+ * @buf:	buffer of PATH_MAX bytes for the result
+ *
+ * Returns the length of the path.
+ */
+static int src_path(u64 index, char *buf)
+{
+	struct inode_attrs *attrs = &src_inodes[index].s_attrs;
+	int len, namelen;
+
+	if (!index) {
+		len = strlen(param->src_dir);
+		if (len >= PATH_MAX)
+			fatal("source path is too long");
+		strcpy(buf, param->src_dir);
+		return len;
+	}
+
+	len = src_path(src_index(attrs->parent), buf);
+	namelen = strlen(attrs->name);
+	if (len + 1 + namelen >= PATH_MAX)
+		fatal("source path is too long");
+	buf[len++] = '/';
+	strcpy(buf + len, attrs->name);
+	return len + namelen;
+}
+
+/**
+ * timespec_to_ns - Convert a timestamp from a stat buffer to nanoseconds
+ * @ts: the timestamp
+ */
+static inline u64 timespec_to_ns(struct timespec *ts)
+{
+	return (u64)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/**
+ * set_src_attrs - Set the inode attributes for an entry of the source tree
+ * @attrs:	attributes to set
+ * @st:		stat buffer for the entry
+ *
+ * The child count for directories is set later, when they are scanned.  Files
+ * with several hard links are copied as independent files.
+ */
+static void set_src_attrs(struct inode_attrs *attrs, struct stat *st)
+{
+	attrs->mode = st->st_mode;
+	attrs->owner = st->st_uid;
+	attrs->group = st->st_gid;
+
+	/* Linux has no creation time in struct stat */
+	attrs->create_time = attrs->mod_time = timespec_to_ns(&st->st_mtim);
+	attrs->change_time = timespec_to_ns(&st->st_ctim);
+	attrs->access_time = timespec_to_ns(&st->st_atim);
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG:
+		attrs->size = st->st_size;
+		attrs->count = 1;
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		/* Same encoding of the device numbers as in xnu */
+		attrs->rdev = major(st->st_rdev) << 24 | (minor(st->st_rdev) & 0xFFFFFF);
+		/* fallthrough */
+	case S_IFLNK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		attrs->count = 1;
+		break;
+	}
+}
+
+/**
+ * read_src_symlink - Read the target of a symlink from the source tree
+ * @dirfd:	file descriptor for the parent directory
+ * @name:	filename
+ * @path:	full path, for error messages
+ *
+ * Returns the target in a newly allocated buffer.
+ */
+static char *read_src_symlink(int dirfd, const char *name, const char *path)
+{
+	char target[APFS_XATTR_MAX_EMBEDDED_SIZE];
+	ssize_t len;
+	char *result;
+
+	len = readlinkat(dirfd, name, target, sizeof(target));
+	if (len < 0)
+		source_error(path);
+	/* The target goes in an embedded xattr, with its null termination */
+	if (len >= sizeof(target))
+		fatal("symlink target is too long");
+	target[len] = 0;
+
+	result = strdup(target);
+	if (!result)
+		system_error();
+	return result;
+}
+
+/**
+ * src_dentry_cmp - Compare two children of a directory by dentry key order
+ * @a:	first entry
+ * @b:	second entry
+ */
+static int src_dentry_cmp(const void *a, const void *b)
+{
+	const struct src_inode *i1 = a, *i2 = b;
+
+	if (i1->s_hash != i2->s_hash)
+		return i1->s_hash < i2->s_hash ? -1 : 1;
+	return strcmp(i1->s_attrs.name, i2->s_attrs.name);
+}
+
+/**
+ * names_collide - Check if two filenames are the same for the volume
+ * @name1:	first filename
+ * @name2:	second filename
+ *
+ * Only relevant for volumes that are insensitive to normalization, where
+ * different byte strings may refer to the same file.
+ */
+static bool names_collide(const char *name1, const char *name2)
+{
+	struct unicursor cursor1, cursor2;
+	bool case_fold = !param->case_sensitive;
+	unicode_t c1, c2;
+
+	init_unicursor(&cursor1, name1);
+	init_unicursor(&cursor2, name2);
+	do {
+		c1 = normalize_next(&cursor1, case_fold);
+		c2 = normalize_next(&cursor2, case_fold);
+		if (c1 != c2)
+			return false;
+	} while (c1);
+	return true;
+}
+
+/**
+ * scan_src_directory - Add all children of a directory to the source array
+ * @index: index of the directory
+ *
+ * The children are sorted by dentry key right away; they have no children of
+ * their own in the array yet, so they can still be moved around.
+ */
+static void scan_src_directory(u64 index)
+{
+	char path[PATH_MAX];
+	struct dirent *dentry;
+	u64 first = src_inode_count, count, i;
+	int pathlen;
+	DIR *dir;
+
+	pathlen = src_path(index, path);
+	dir = opendir(path);
+	if (!dir)
+		source_error(path);
+
+	while (1) {
+		struct inode_attrs *attrs;
+		struct stat st;
+		u64 child;
+
+		dentry = readdir(dir);
+		if (!dentry)
+			break;
+		if (!strcmp(dentry->d_name, ".") || !strcmp(dentry->d_name, ".."))
+			continue;
+
+		if (pathlen + 1 + strlen(dentry->d_name) >= PATH_MAX)
+			fatal("source path is too long");
+		sprintf(path + pathlen, "/%s", dentry->d_name);
+		if (fstatat(dirfd(dir), dentry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			source_error(path);
+		if (st.st_dev == device_dev && st.st_ino == device_ino)
+			fatal("the device is inside the source tree");
+
+		child = new_src_inode();
+		attrs = &src_inodes[child].s_attrs;
+		attrs->parent = src_ino(index);
+		attrs->name = strdup(dentry->d_name);
+		if (!attrs->name)
+			system_error();
+		set_src_attrs(attrs, &st);
+
+		if (S_ISLNK(st.st_mode))
+			src_inodes[child].s_target = read_src_symlink(dirfd(dir), dentry->d_name, path);
+		if (!param->norm_sensitive)
+			src_inodes[child].s_hash = dentry_hash(attrs->name);
+	}
+	path[pathlen] = 0;
+	closedir(dir);
+
+	count = src_inode_count - first;
+	if (count > UINT32_MAX)
+		fatal("too many files in a source directory");
+	src_inodes[index].s_first_child = first;
+	src_inodes[index].s_attrs.count = count;
+
+	qsort(src_inodes + first, count, sizeof(*src_inodes), src_dentry_cmp);
+	if (param->norm_sensitive)
+		return;
+	for (i = first + 1; i < first + count; ++i) {
+		struct src_inode *prev = &src_inodes[i - 1];
+		struct src_inode *curr = &src_inodes[i];
+
+		if (prev->s_hash != curr->s_hash)
+			continue;
+		if (names_collide(prev->s_attrs.name, curr->s_attrs.name)) {
+			fprintf(stderr, "%s: filenames collide in the volume: %s\n",
+				path, curr->s_attrs.name);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * scan_source_tree - Read the whole source tree into memory
+ *
+ * Must be called before the catalog is built, but nothing gets written to
+ * the device here, so any problem with the source is found early.
+ */
+void scan_source_tree(void)
+{
+	struct stat st;
+	u64 index;
+
+	if (fstat(fd, &st))
+		system_error();
+	device_dev = st.st_dev;
+	device_ino = st.st_ino;
+
+	if (lstat(param->src_dir, &st))
+		source_error(param->src_dir);
+	if (!S_ISDIR(st.st_mode))
+		fatal("source is not a directory");
+
+	index = new_src_inode();
+	set_src_attrs(&src_inodes[index].s_attrs, &st);
+	src_inodes[index].s_attrs.parent = APFS_ROOT_DIR_PARENT;
+	src_inodes[index].s_attrs.name = "root";
+
+	/* New entries are added at the end, so this is breadth-first */
+	for (index = 0; index < src_inode_count; ++index) {
+		if (S_ISDIR(src_inodes[index].s_attrs.mode))
+			scan_src_directory(index);
+	}
+}
+
+/* Maximum number of threads to copy the file data */
+#define COPY_MAX_THREADS	16
+
+/* Size of the buffer used by each thread to copy the data */
+#define COPY_BUF_SIZE		(4 * 1024 * 1024)
+
+static u64 copy_next;	/* Index of the next inode to copy */
+
+/**
+ * copy_src_file - Copy the data for a regular file to its extent
+ * @index:	index of the file in the source array
+ * @buf:	buffer of COPY_BUF_SIZE bytes, aligned for direct i/o
+ *
+ * The tail of the last block gets zeroed.
+ */
+static void copy_src_file(u64 index, void *buf)
+{
+	struct src_inode *inode = &src_inodes[index];
+	u64 remaining = inode->s_attrs.size;
+	u64 offset = inode->s_bno * param->blocksize;
+	char path[PATH_MAX];
+	int src_fd;
+
+	src_path(index, path);
+	src_fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (src_fd == -1)
+		source_error(path);
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (remaining) {
+		size_t want = remaining < COPY_BUF_SIZE ? remaining : COPY_BUF_SIZE;
+		size_t got = 0, padded, done;
+		ssize_t ret;
+
+		while (got < want) {
+			ret = read(src_fd, buf + got, want - got);
+			if (ret < 0)
+				source_error(path);
+			if (ret == 0) {
+				fprintf(stderr, "%s: file shrank during the copy\n", path);
+				exit(1);
+			}
+			got += ret;
+		}
+
+		padded = ROUND_UP(got, param->blocksize);
+		memset(buf + got, 0, padded - got);
+		for (done = 0; done < padded; done += ret) {
+			ret = pwrite(fd, buf + done, padded - done, offset + done);
+			if (ret <= 0)
+				system_error();
+		}
+		offset += padded;
+		remaining -= got;
+	}
+	close(src_fd);
+}
+
+/**
+ * copy_worker - Copy files to the device until there are none left
+ * @arg: unused
+ */
+static void *copy_worker(void *arg)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, COPY_BUF_SIZE))
+		system_error();
+
+	while (1) {
+		u64 index = __atomic_fetch_add(&copy_next, 1, __ATOMIC_RELAXED);
+		struct inode_attrs *attrs;
+
+		if (index >= src_inode_count)
+			break;
+		attrs = &src_inodes[index].s_attrs;
+		if (S_ISREG(attrs->mode) && attrs->size)
+			copy_src_file(index, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * copy_source_data - Copy the data for all files of the source tree
+ *
+ * The blocks for each file were allocated in inode order, so the files are
+ * handed out to the threads in that order, and the writes are sequential for
+ * the most part.  The data goes straight to the device, since no metadata
+ * shares its blocks.
+ */
+void copy_source_data(void)
+{
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (jobs > COPY_MAX_THREADS)
+		jobs = COPY_MAX_THREADS;
+	run_threads(jobs > 0 ? jobs : 1, copy_worker, NULL);
+}
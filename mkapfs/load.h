@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _LOAD_H
+#define _LOAD_H
+
+#include <apfs/raw.h>
+#include <apfs/types.h>
+#include "dir.h"
+
+/*
+ * Inode from the source tree, to be copied into the new volume
+ */
+struct src_inode {
+	struct inode_attrs	s_attrs;	/* Attributes for the inode record */
+	char			*s_target;	/* Target path, for symlinks */
+	u64			s_first_child;	/* Index of the first child */
+	u64			s_bno;		/* First block for the data */
+	u32			s_hash;		/* Dentry hash, for sorting */
+};
+
+/*
+ * All inodes from the source tree, in order of inode number.  The children of
+ * each directory are contiguous in the array, and in dentry key order.
+ */
+extern struct src_inode *src_inodes;
+extern u64 src_inode_count;
+
+/**
+ * src_ino - Get the inode number for an entry of the source tree
+ * @index: index of the entry in src_inodes
+ */
+static inline u64 src_ino(u64 index)
+{
+	/* The top of the source tree becomes the root directory */
+	if (!index)
+		return APFS_ROOT_DIR_INO_NUM;
+	return APFS_MIN_USER_INO_NUM + index - 1;
+}
+
+extern void scan_source_tree(void);
+extern void copy_source_data(void);
+
+#endif	/* _LOAD_H */
@@ -2,6 +2,7 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#define _GNU_SOURCE	/* For O_DIRECT */
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <sys/ioctl.h>
@@ -12,6 +13,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <apfs/raw.h>
+#include "io.h"
+#include "layout.h"
+#include "load.h"
 #include "mkapfs.h"
 #include "super.h"
 
@@ -25,7 +29,7 @@ static char *progname;
 static void usage(void)
 {
 	fprintf(stderr,
-		"usage: %s [-L label] [-U UUID] [-u UUID] [-sv] "
+		"usage: %s [-L label] [-U UUID] [-u UUID] [-G spec] [-d srcdir] [-Dsv] "
 		"device [blocks]\n",
 		progname);
 	exit(1);
@@ -138,6 +142,7 @@ static void complete_parameters(void)
 			progname);
 		exit(1);
 	}
+	plan_layout();
 
 	/* Every volume must have a label; use the same default as Apple */
 	if (!param->label || !*param->label)
@@ -149,12 +154,82 @@ static void complete_parameters(void)
 		exit(1);
 	}
 
+	/* The source tree replaces the synthetic files, not the snapshots */
+	if (param->src_dir && param->syn_inodes)
+		fatal("synthetic files can't be added to a source tree");
+
 	if (!param->main_uuid)
 		param->main_uuid = get_random_uuid();
 	if (!param->vol_uuid)
 		param->vol_uuid = get_random_uuid();
 }
 
+/**
+ * parse_synthetic_spec - Parse the description of the synthetic contents
+ * @spec: comma-separated list of "name=value" options
+ *
+ * The contents are meant for benchmarks: the files all go in the root, and
+ * their extents are allocated but never written.
+ */
+static void parse_synthetic_spec(char *spec)
+{
+	enum { SYN_INODES, SYN_EXTENTS, SYN_LINKS, SYN_SNAPSHOTS, SYN_FANOUT };
+	char *const tokens[] = {
+		[SYN_INODES]	= "inodes",
+		[SYN_EXTENTS]	= "extents",
+		[SYN_LINKS]	= "links",
+		[SYN_SNAPSHOTS]	= "snapshots",
+		[SYN_FANOUT]	= "fanout",
+		NULL
+	};
+	char *value, *end;
+	u64 num;
+
+	while (*spec) {
+		int token = getsubopt(&spec, tokens, &value);
+
+		if (token == -1 || !value || !*value)
+			fatal("malformed spec for synthetic contents");
+		num = strtoull(value, &end, 0);
+		if (*end)
+			fatal("malformed spec for synthetic contents");
+
+		switch (token) {
+		case SYN_INODES:
+			/* The root's child count is 32 bits long */
+			if (num > UINT32_MAX)
+				fatal("too many synthetic inodes");
+			param->syn_inodes = num;
+			break;
+		case SYN_EXTENTS:
+			param->syn_extents = num;
+			break;
+		case SYN_LINKS:
+			param->syn_links = num;
+			break;
+		case SYN_SNAPSHOTS:
+			if (num > UINT32_MAX)
+				fatal("too many synthetic snapshots");
+			param->syn_snapshots = num;
+			break;
+		case SYN_FANOUT:
+			if (num < 2 || num > UINT32_MAX)
+				fatal("b-tree fanout must be at least two");
+			param->fanout = num;
+			break;
+		}
+	}
+
+	if (param->syn_extents && !param->syn_inodes)
+		fatal("synthetic extents need some inodes");
+	if (param->syn_links && !param->syn_inodes)
+		fatal("synthetic hard links need some inodes");
+	/* Both the root's child count and the file's link count are 32 bits */
+	if (param->syn_inodes + param->syn_links > UINT32_MAX ||
+	    param->syn_links >= UINT32_MAX)
+		fatal("too many synthetic hard links");
+}
+
 int main(int argc, char *argv[])
 {
 	char *filename;
@@ -165,12 +240,21 @@ int main(int argc, char *argv[])
 		system_error();
 
 	while (1) {
-		int opt = getopt(argc, argv, "L:U:u:szv");
+		int opt = getopt(argc, argv, "DG:L:U:u:d:szv");
 
 		if (opt == -1)
 			break;
 
 		switch (opt) {
+		case 'D':
+			param->direct_io = true;
+			break;
+		case 'G':
+			parse_synthetic_spec(optarg);
+			break;
+		case 'd':
+			param->src_dir = optarg;
+			break;
 		case 'L':
 			param->label = optarg;
 			break;
@@ -203,11 +287,16 @@ int main(int argc, char *argv[])
 		usage();
 	}
 
-	fd = open(filename, O_RDWR);
+	fd = open(filename, param->direct_io ? O_RDWR | O_DIRECT : O_RDWR);
 	if (fd == -1)
 		system_error();
 	complete_parameters();
+	if (param->src_dir)
+		scan_source_tree();
 
 	make_container();
+	if (param->src_dir)
+		copy_source_data();
+	finish_writes();
 	return 0;
 }
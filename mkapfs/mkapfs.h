@@ -6,7 +6,6 @@
 #define _MKAPFS_H
 
 #include <string.h>
-#include <sys/mman.h>
 #include <time.h>
 #include <apfs/raw.h>
 
@@ -19,95 +18,87 @@ struct parameters {
 	char		*vol_uuid;	/* Volume UUID in standard format */
 	bool		case_sensitive;	/* Is the filesystem case-sensitive? */
 	bool		norm_sensitive;	/* Is it normalization-sensitive? */
+	bool		direct_io;	/* Bypass the page cache for writes? */
+	char		*src_dir;	/* Directory tree to copy into the volume */
+
+	/* Synthetic contents for the volume, mostly for benchmarks */
+	u64		syn_inodes;	/* Number of regular files to create */
+	u64		syn_extents;	/* Number of extents, shared by the files */
+	u64		syn_links;	/* Extra hard links to the first file */
+	u32		syn_snapshots;	/* Number of snapshots to take */
+	u32		fanout;		/* Maximum records per node (or zero) */
+};
+
+/*
+ * Placement and size of the fixed areas of the container, planned from the
+ * device size by plan_layout().  They all come one after the other, at the
+ * start of the device; everything else gets allocated in order after them.
+ */
+struct layout {
+	u64	cpoint_desc_base;	/* First checkpoint descriptor block */
+	u32	cpoint_desc_blocks;	/* Size of the checkpoint descriptor area */
+	u64	cpoint_data_base;	/* First checkpoint data block */
+	u32	cpoint_data_blocks;	/* Size of the checkpoint data area */
+	u64	ip_bmap_base;		/* First internal pool bitmap */
+	u32	ip_bmap_blocks;		/* Internal pool bitmap count */
+	u64	ip_base;		/* Start of the internal pool */
+	u64	ip_blocks;		/* Size of the internal pool */
+	u64	first_alloc_bno;	/* First block after the fixed areas */
+
+	u32	blocks_per_chunk;	/* Blocks covered by each chunk bitmap */
+	u32	chunks_per_cib;		/* Chunks described by each cib */
+	u32	cibs_per_cab;		/* Cibs listed in each cib address block */
+	u64	chunk_count;		/* Number of chunks in the container */
+	u32	cib_count;		/* Number of chunk-info blocks */
+	u32	cab_count;		/* Number of cib address blocks */
 };
 
 /* String to identify the program and its version */
 #define MKFS_ID_STRING	"mkapfs for linux, version 0.1"
 
-/* Hardcoded transaction ids */
+/*
+ * Hardcoded transaction ids: the volume is made by the first transaction, and
+ * each snapshot gets a transaction of its own after that.  The checkpoint and
+ * its ephemeral objects belong to the last transaction.
+ */
 #define MKFS_XID	1
+#define CPOINT_XID	(MKFS_XID + param->syn_snapshots)
 
 /* Hardcoded object ids */
 #define	SPACEMAN_OID		APFS_OID_RESERVED_COUNT
 #define REAPER_OID		(SPACEMAN_OID + 1)
 #define FIRST_VOL_OID		(REAPER_OID + 1)
-#define FIRST_VOL_CAT_ROOT_OID	(FIRST_VOL_OID + 1)
-#define	IP_FREE_QUEUE_OID	(FIRST_VOL_CAT_ROOT_OID + 1)
+#define	IP_FREE_QUEUE_OID	(FIRST_VOL_OID + 1)
 #define MAIN_FREE_QUEUE_OID	(IP_FREE_QUEUE_OID + 1)
+#define FIRST_VOL_CAT_OID	(MAIN_FREE_QUEUE_OID + 1) /* Others follow */
 
-/*
- * Constants describing the checkpoint areas; these are hardcoded for now, but
- * should actually change with the container size.
- */
-#define CPOINT_DESC_BASE	(APFS_NX_BLOCK_NUM + 1)
-#define CPOINT_DESC_BLOCKS	64
-#define CPOINT_DATA_BASE	(CPOINT_DESC_BASE + CPOINT_DESC_BLOCKS)
-#define CPOINT_DATA_BLOCKS	5904
-
-/*
- * Constants describing the internal pool; these are hardcoded for now, but
- * should actually change with the container size.
- */
-#define IP_BMAP_BASE	21000				/* First ip bitmap */
-#define IP_BMAP_BLOCKS	16				/* Ip bitmap count */
-#define IP_BASE		(IP_BMAP_BASE + IP_BMAP_BLOCKS)	/* Start of pool */
-
-/* Hardcoded block numbers */
+/* Hardcoded block numbers, at the start of each checkpoint area */
 #define CPOINT_MAP_BNO			CPOINT_DESC_BASE
 #define CPOINT_SB_BNO			(CPOINT_DESC_BASE + 1)
 #define REAPER_BNO			CPOINT_DATA_BASE
 #define SPACEMAN_BNO			(CPOINT_DATA_BASE + 1)
 #define	IP_FREE_QUEUE_BNO		(CPOINT_DATA_BASE + 2)
 #define MAIN_FREE_QUEUE_BNO		(CPOINT_DATA_BASE + 3)
-#define MAIN_OMAP_BNO			20000
-#define MAIN_OMAP_ROOT_BNO		20001
-#define FIRST_VOL_BNO			20002
-#define FIRST_VOL_OMAP_BNO		20003
-#define FIRST_VOL_OMAP_ROOT_BNO		20004
-#define FIRST_VOL_CAT_ROOT_BNO		20005
-#define FIRST_VOL_EXTREF_ROOT_BNO	20006
-#define FIRST_VOL_SNAP_ROOT_BNO		20007
+
+/* Shorthands for the fixed areas of the container */
+#define CPOINT_DESC_BASE	(layout->cpoint_desc_base)
+#define CPOINT_DESC_BLOCKS	(layout->cpoint_desc_blocks)
+#define CPOINT_DATA_BASE	(layout->cpoint_data_base)
+#define CPOINT_DATA_BLOCKS	(layout->cpoint_data_blocks)
+#define IP_BMAP_BASE		(layout->ip_bmap_base)
+#define IP_BMAP_BLOCKS		(layout->ip_bmap_blocks)
+#define IP_BASE			(layout->ip_base)
+#define IP_BLOCKS		(layout->ip_blocks)
+#define FIRST_ALLOC_BNO		(layout->first_alloc_bno)
 
 /* Declarations for global variables */
 extern struct parameters *param;	/* Filesystem parameters */
+extern struct layout *layout;		/* Layout of the container */
 extern int fd;				/* File descriptor for the device */
 
 extern __attribute__((noreturn)) void system_error(void);
 extern __attribute__((noreturn)) void fatal(const char *message);
 
-/**
- * get_zeroed_blocks - Map and zero contiguous filesystem blocks
- * @bno:	first block number
- * @count:	number of blocks
- *
- * Returns a pointer to the mapped area; the caller must unmap it after use.
- */
-static inline void *get_zeroed_blocks(u64 bno, u64 count)
-{
-	void *blocks;
-	size_t size = param->blocksize * count;
-
-	if (size / count != param->blocksize)
-		fatal("overflow detected on disk area mapping");
-
-	blocks = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, bno * param->blocksize);
-	if (blocks == MAP_FAILED)
-		system_error();
-	memset(blocks, 0, size);
-	return blocks;
-}
-
-/**
- * get_zeroed_block - Map and zero a filesystem block
- * @bno: block number
- *
- * Returns a pointer to the mapped block; the caller must unmap it after use.
- */
-static inline void *get_zeroed_block(u64 bno)
-{
-	return get_zeroed_blocks(bno, 1);
-}
-
 /**
  * get_timestamp - Get the current time in nanoseconds
  *
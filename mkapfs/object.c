@@ -3,7 +3,6 @@
  */
 
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <apfs/checksum.h>
 #include <apfs/raw.h>
 #include "mkapfs.h"
@@ -17,7 +16,8 @@
  * @subtype:	object subtype
  *
  * All other fields of the object headed by @obj must be set in advance by
- * the caller, otherwise the checksum won't be correct.
+ * the caller, otherwise the checksum won't be correct.  The checkpoint and its
+ * ephemeral objects get the last transaction id, everything else the first.
  */
 void set_object_header(struct apfs_obj_phys *obj, u64 oid, u32 type,
 		       u32 subtype)
@@ -26,7 +26,11 @@ void set_object_header(struct apfs_obj_phys *obj, u64 oid, u32 type,
 	int after_cksum_len = param->blocksize - APFS_MAX_CKSUM_SIZE;
 
 	obj->o_oid = cpu_to_le64(oid);
-	obj->o_xid = cpu_to_le64(MKFS_XID);
+	if ((type & APFS_OBJ_EPHEMERAL) ||
+	    (type & APFS_OBJECT_TYPE_MASK) == APFS_OBJECT_TYPE_CHECKPOINT_MAP)
+		obj->o_xid = cpu_to_le64(CPOINT_XID);
+	else
+		obj->o_xid = cpu_to_le64(MKFS_XID);
 	obj->o_type = cpu_to_le32(type);
 	obj->o_subtype = cpu_to_le32(subtype);
 
@@ -4,106 +4,73 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <apfs/bitmap.h>
 #include <apfs/parameters.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "btree.h"
+#include "io.h"
 #include "mkapfs.h"
 #include "object.h"
 #include "spaceman.h"
 
 /* Extra information about the space manager */
 static struct spaceman_info {
-	u64 chunk_count;
-	u32 cib_count;
-	u64 ip_blocks;
-
 	u64 used_blocks_end;	/* Block right after the last one we allocate */
 	u64 used_chunks_end;	/* Chunk right after the last one we allocate */
 
 	u64 first_chunk_bmap;	/* Block number for the first chunk's bitmap */
 	u64 first_cib;		/* Block number for first chunk-info block */
-} sm_info;
 
-/**
- * blocks_per_chunk - Calculate the number of blocks per chunk
- */
-static inline u32 blocks_per_chunk(void)
-{
-	return 8 * param->blocksize; /* One bitmap block for each chunk */
-}
+	u64 *bmap;		/* Mapped allocation bitmaps for the chunks */
+} sm_info;
 
 /**
- * chunks_per_cib - Calculate the number of chunks per chunk-info block
+ * prepare_spaceman - Plan the space manager, before any block gets allocated
  */
-static inline u32 chunks_per_cib(void)
+void prepare_spaceman(void)
 {
-	int chunk_info_size = sizeof(struct apfs_chunk_info);
-	int cib_size = sizeof(struct apfs_chunk_info_block);
-
-	return (param->blocksize - cib_size) / chunk_info_size;
+	sm_info.used_blocks_end = FIRST_ALLOC_BNO;
 }
 
 /**
- * cibs_per_cab - Calculate the count of chunk-info blocks per cib address block
+ * alloc_blocks - Allocate contiguous blocks for an object or for file data
+ * @count: number of blocks
+ *
+ * Returns the first block number.  Blocks are handed out in increasing order,
+ * right after the fixed areas of the container; the extent reference tree is
+ * built in the same order.
  */
-static inline u32 cibs_per_cab(void)
+u64 alloc_blocks(u64 count)
 {
-	int cab_size = sizeof(struct apfs_cib_addr_block);
+	u64 bno = sm_info.used_blocks_end;
 
-	return (param->blocksize - cab_size) / sizeof(__le64);
+	if (count > param->block_count || bno > param->block_count - count)
+		fatal("device is not big enough for the volume contents");
+	sm_info.used_blocks_end += count;
+	return bno;
 }
 
-#define MIN(X, Y) ((X) <= (Y) ? (X) : (Y))
-
 /**
  * count_used_blocks_in_chunk - Calculate number of allocated blocks in a chunk
  * @chunkno:	chunk number to check
+ *
+ * Must be called after the allocation bitmaps are set.
  */
 static u32 count_used_blocks_in_chunk(u64 chunkno)
 {
-	u32 first_chunk_ip_blocks;
-
 	if (chunkno >= sm_info.used_chunks_end)
 		return 0;
-
-	/* The internal pool may not fit whole in the chunk */
-	first_chunk_ip_blocks = MIN(sm_info.ip_blocks, blocks_per_chunk() - IP_BASE);
-
-	if (chunkno == 0) {
-		u32 blocks = 0;
-
-		/* This stuff always goes in the first chunk */
-		blocks += 1;			/* Block zero */
-		blocks += CPOINT_DESC_BLOCKS;	/* Checkpoint descriptor blocks */
-		blocks += CPOINT_DATA_BLOCKS;	/* Checkpoint data blocks */
-		blocks += 2;			/* Container object map and its root */
-		blocks += 6;			/* Volume superblock and its trees */
-		blocks += IP_BMAP_BLOCKS;	/* Internal pool bitmap blocks */
-
-		blocks += first_chunk_ip_blocks;
-		return blocks;
-	}
-
-	/* Later chunks are only needed for the rest of the internal pool */
-	if (chunkno != sm_info.used_chunks_end - 1)
-		return blocks_per_chunk();
-
-	/* Last chunk */
-	return (sm_info.ip_blocks - first_chunk_ip_blocks) % blocks_per_chunk();
+	return bitmap_count_range(sm_info.bmap, chunkno * layout->blocks_per_chunk,
+				  layout->blocks_per_chunk);
 }
 
 /**
  * count_used_blocks - Calculate the number of blocks used by the mkfs
  */
-static u32 count_used_blocks(void)
+static u64 count_used_blocks(void)
 {
-	u32 blocks = 0;
-	u64 chunkno;
-
-	for (chunkno = 0; chunkno < sm_info.used_chunks_end; ++chunkno)
-		blocks += count_used_blocks_in_chunk(chunkno);
-	return blocks;
+	return bitmap_count_range(sm_info.bmap, 0, sm_info.used_chunks_end * layout->blocks_per_chunk);
 }
 
 /**
@@ -114,23 +81,17 @@ static u32 count_used_blocks(void)
  */
 static void bmap_mark_as_used(u64 *bitmap, u64 paddr, u64 length)
 {
-	u64 *byte;
-	u64 flag;
-	u64 i;
-
-	for (i = paddr; i < paddr + length; ++i) {
-		byte = bitmap + i / 64;
-		flag = 1ULL << i % 64;
-		*byte |= flag;
-	}
+	bitmap_set_range(bitmap, paddr, length);
 }
 
 /**
- * make_alloc_bitmap - Make the allocation bitmap for the first chunk
+ * make_alloc_bitmap - Make the allocation bitmaps for the chunks in use
+ *
+ * The bitmaps are left mapped in @sm_info.bmap, for the block counts.
  */
 static void make_alloc_bitmap(void)
 {
-	void *bmap = get_zeroed_blocks(sm_info.first_chunk_bmap, sm_info.used_chunks_end);
+	u64 *bmap = get_zeroed_blocks(sm_info.first_chunk_bmap, sm_info.used_chunks_end);
 
 	/* Block zero */
 	bmap_mark_as_used(bmap, 0, 1);
@@ -138,16 +99,14 @@ static void make_alloc_bitmap(void)
 	bmap_mark_as_used(bmap, CPOINT_DESC_BASE, CPOINT_DESC_BLOCKS);
 	/* Checkpoint data blocks */
 	bmap_mark_as_used(bmap, CPOINT_DATA_BASE, CPOINT_DATA_BLOCKS);
-	/* Container object map and its root */
-	bmap_mark_as_used(bmap, MAIN_OMAP_BNO, 2);
-	/* Volume superblock and its trees */
-	bmap_mark_as_used(bmap, FIRST_VOL_BNO, 6);
 	/* Internal pool bitmap blocks */
 	bmap_mark_as_used(bmap, IP_BMAP_BASE, IP_BMAP_BLOCKS);
 	/* Internal pool blocks */
-	bmap_mark_as_used(bmap, IP_BASE, sm_info.ip_blocks);
+	bmap_mark_as_used(bmap, IP_BASE, IP_BLOCKS);
+	/* Everything allocated after the fixed areas */
+	bmap_mark_as_used(bmap, FIRST_ALLOC_BNO, sm_info.used_blocks_end - FIRST_ALLOC_BNO);
 
-	munmap(bmap, sm_info.used_chunks_end * param->blocksize);
+	sm_info.bmap = bmap;
 }
 
 /*
@@ -157,7 +116,6 @@ static void make_alloc_bitmap(void)
 #define BITMAP_XID_OFF		0x150	/* Transaction id for the ip bitmap */
 #define BITMAP_OFF		0x158	/* Address of the ip bitmap */
 #define BITMAP_FREE_NEXT_OFF	0x160	/* No idea */
-#define CIB_ADDR_BASE_OFF	0x180	/* First cib address for main device */
 
 /**
  * make_chunk_info - Write a chunk info structure
@@ -169,17 +127,17 @@ static void make_alloc_bitmap(void)
 static u64 make_chunk_info(struct apfs_chunk_info *chunk, u64 start)
 {
 	u64 remaining_blocks = param->block_count - start;
-	u64 chunkno = start / blocks_per_chunk();
+	u64 chunkno = start / layout->blocks_per_chunk;
 	u32 block_count, free_count;
 
 	chunk->ci_xid = cpu_to_le64(MKFS_XID);
 	chunk->ci_addr = cpu_to_le64(start);
 
 	/* Later chunks are just holes */
-	if (start < sm_info.used_blocks_end)
+	if (chunkno < sm_info.used_chunks_end)
 		chunk->ci_bitmap_addr = cpu_to_le64(sm_info.first_chunk_bmap + chunkno);
 
-	block_count = blocks_per_chunk();
+	block_count = layout->blocks_per_chunk;
 	if (remaining_blocks < block_count) /* This is the final chunk */
 		block_count = remaining_blocks;
 	chunk->ci_block_count = cpu_to_le32(block_count);
@@ -205,7 +163,7 @@ static u64 make_chunk_info_block(u64 bno, int index, u64 start)
 	int i;
 
 	cib->cib_index = cpu_to_le32(index);
-	for (i = 0; i < chunks_per_cib(); ++i) {
+	for (i = 0; i < layout->chunks_per_cib; ++i) {
 		if (start == param->block_count) /* No more chunks in device */
 			break;
 		start = make_chunk_info(&cib->cib_chunk_info[i], start);
@@ -215,7 +173,7 @@ static u64 make_chunk_info_block(u64 bno, int index, u64 start)
 	set_object_header(&cib->cib_o, bno,
 			  APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_SPACEMAN_CIB,
 			  APFS_OBJECT_TYPE_INVALID);
-	munmap(cib, param->blocksize);
+	release_blocks(cib);
 
 	return start;
 }
@@ -227,26 +185,16 @@ static u64 make_chunk_info_block(u64 bno, int index, u64 start)
 static void make_devices(struct apfs_spaceman_phys *sm)
 {
 	struct apfs_spaceman_device *dev = &sm->sm_dev[APFS_SD_MAIN];
-	u64 chunk_count = DIV_ROUND_UP(param->block_count, blocks_per_chunk());
-	u32 cib_count = DIV_ROUND_UP(chunk_count, chunks_per_cib());
+	u32 cib_count = layout->cib_count;
 	u64 start = 0;
 	__le64 *cib_addr;
 	int i;
 
-	/*
-	 * We must have room for the addresses of all main device cibs, plus
-	 * an extra offset for tier 2.
-	 */
-	if (cib_count + 1 >
-	    (param->blocksize - CIB_ADDR_BASE_OFF) / sizeof(__le64)) {
-		printf("Large containers are not yet supported.\n");
-		exit(1);
-	}
-
+	/* The layout planner already rejected containers that need cabs */
 	dev->sm_block_count = cpu_to_le64(param->block_count);
-	dev->sm_chunk_count = cpu_to_le64(chunk_count);
+	dev->sm_chunk_count = cpu_to_le64(layout->chunk_count);
 	dev->sm_cib_count = cpu_to_le32(cib_count);
-	dev->sm_cab_count = 0; /* Not supported, hence the block count limit */
+	dev->sm_cab_count = cpu_to_le32(layout->cab_count);
 	dev->sm_free_count = cpu_to_le64(param->block_count -
 					 count_used_blocks());
 
@@ -273,7 +221,7 @@ static void make_ip_free_queue(struct apfs_spaceman_free_queue *fq)
 	make_empty_btree_root(IP_FREE_QUEUE_BNO, IP_FREE_QUEUE_OID,
 			      APFS_OBJECT_TYPE_SPACEMAN_FREE_QUEUE);
 	fq->sfq_oldest_xid = 0;	/* Is this correct? */
-	fq->sfq_tree_node_limit = cpu_to_le16(ip_fq_node_limit(sm_info.chunk_count));
+	fq->sfq_tree_node_limit = cpu_to_le16(ip_fq_node_limit(layout->chunk_count));
 }
 
 /**
@@ -297,11 +245,11 @@ static void make_ip_bitmap(void)
 	void *bmap = get_zeroed_block(IP_BMAP_BASE);
 
 	/* Chunk-info blocks */
-	bmap_mark_as_used(bmap, sm_info.first_cib - IP_BASE, sm_info.cib_count);
+	bmap_mark_as_used(bmap, sm_info.first_cib - IP_BASE, layout->cib_count);
 	/* Allocation bitmap block */
 	bmap_mark_as_used(bmap, sm_info.first_chunk_bmap - IP_BASE, sm_info.used_chunks_end);
 
-	munmap(bmap, param->blocksize);
+	release_blocks(bmap);
 }
 
 /**
@@ -329,20 +277,18 @@ static void make_ip_bm_free_next(__le16 *addr)
  */
 static void make_internal_pool(struct apfs_spaceman_phys *sm)
 {
-	int i;
 	__le64 *addr;
 
 	sm->sm_ip_bm_tx_multiplier =
 				cpu_to_le32(APFS_SPACEMAN_IP_BM_TX_MULTIPLIER);
-	sm->sm_ip_block_count = cpu_to_le64(sm_info.ip_blocks);
+	sm->sm_ip_block_count = cpu_to_le64(IP_BLOCKS);
 	sm->sm_ip_base = cpu_to_le64(IP_BASE);
 	/* No support for multiblock bitmaps */
 	sm->sm_ip_bm_size_in_blocks = cpu_to_le32(1);
 
 	sm->sm_ip_bm_block_count = cpu_to_le32(IP_BMAP_BLOCKS);
 	sm->sm_ip_bm_base = cpu_to_le64(IP_BMAP_BASE);
-	for (i = 0; i < IP_BMAP_BLOCKS; ++i) /* We use no blocks from the ip */
-		munmap(get_zeroed_block(IP_BMAP_BASE + i), param->blocksize);
+	zero_blocks(IP_BMAP_BASE, IP_BMAP_BLOCKS); /* We use no blocks from the ip */
 
 	/* Current bitmap is the first, so the offset is left at zero */
 	sm->sm_ip_bitmap_offset = cpu_to_le32(BITMAP_OFF);
@@ -368,13 +314,8 @@ void make_spaceman(u64 bno, u64 oid)
 {
 	struct apfs_spaceman_phys *sm = get_zeroed_block(bno);
 
-	sm_info.chunk_count = DIV_ROUND_UP(param->block_count, blocks_per_chunk());
-	sm_info.cib_count = DIV_ROUND_UP(sm_info.chunk_count, chunks_per_cib());
-	sm_info.ip_blocks = (sm_info.chunk_count + sm_info.cib_count) * 3;
-
-	/* Only the ip size matters, all other used blocks come before it */
-	sm_info.used_blocks_end = IP_BASE + sm_info.ip_blocks;
-	sm_info.used_chunks_end = DIV_ROUND_UP(sm_info.used_blocks_end, blocks_per_chunk());
+	/* All other blocks must be allocated by now */
+	sm_info.used_chunks_end = DIV_ROUND_UP(sm_info.used_blocks_end, layout->blocks_per_chunk);
 
 	/*
 	 * Put the chunk bitmaps at the beginning of the internal pool, and
@@ -384,18 +325,20 @@ void make_spaceman(u64 bno, u64 oid)
 	sm_info.first_cib = sm_info.first_chunk_bmap + sm_info.used_chunks_end;
 
 	sm->sm_block_size = cpu_to_le32(param->blocksize);
-	sm->sm_blocks_per_chunk = cpu_to_le32(blocks_per_chunk());
-	sm->sm_chunks_per_cib = cpu_to_le32(chunks_per_cib());
-	sm->sm_cibs_per_cab = cpu_to_le32(cibs_per_cab());
+	sm->sm_blocks_per_chunk = cpu_to_le32(layout->blocks_per_chunk);
+	sm->sm_chunks_per_cib = cpu_to_le32(layout->chunks_per_cib);
+	sm->sm_cibs_per_cab = cpu_to_le32(layout->cibs_per_cab);
 
+	make_alloc_bitmap();
 	make_devices(sm);
 	make_ip_free_queue(&sm->sm_fq[APFS_SFQ_IP]);
 	make_main_free_queue(&sm->sm_fq[APFS_SFQ_MAIN]);
 	make_internal_pool(sm);
-	make_alloc_bitmap();
+	release_blocks(sm_info.bmap);
+	sm_info.bmap = NULL;
 
 	set_object_header(&sm->sm_o, oid,
 			  APFS_OBJ_EPHEMERAL | APFS_OBJECT_TYPE_SPACEMAN,
 			  APFS_OBJECT_TYPE_INVALID);
-	munmap(sm, param->blocksize);
+	release_blocks(sm);
 }
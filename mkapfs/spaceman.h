@@ -5,6 +5,13 @@
 #ifndef _SPACEMAN_H
 #define _SPACEMAN_H
 
+#include <apfs/types.h>
+
+/* Offset of the first cib address for the main device, in the spaceman */
+#define CIB_ADDR_BASE_OFF	0x180
+
+extern void prepare_spaceman(void);
+extern u64 alloc_blocks(u64 count);
 extern void make_spaceman(u64 bno, u64 oid);
 
 #endif	/* _SPACEMAN_H */
@@ -8,6 +8,8 @@
 #include <string.h>
 #include <apfs/raw.h>
 #include "btree.h"
+#include "dir.h"
+#include "io.h"
 #include "mkapfs.h"
 #include "object.h"
 #include "spaceman.h"
@@ -37,22 +39,6 @@ static void set_uuid(char *field, char *uuid)
 	exit(1);
 }
 
-/**
- * zero_area - Wipe an area on disk
- * @start:	first block of the area
- * @blocks:	block count for the area
- */
-static void zero_area(u64 start, u64 blocks)
-{
-	u64 bno;
-	void *block;
-
-	for (bno = start; bno < start + blocks; ++bno) {
-		block = get_zeroed_block(bno);
-		munmap(block, param->blocksize);
-	}
-}
-
 /**
  * set_checkpoint_areas - Set all sb fields describing the checkpoint areas
  * @sb: pointer to the superblock copy on disk
@@ -120,14 +106,119 @@ static void set_meta_crypto(struct apfs_wrapped_meta_crypto_state *wmcs)
 	wmcs->key_revision = cpu_to_le16(1);
 }
 
+/* Length of the names for the synthetic snapshots, with the null termination */
+#define SNAP_NAME_LEN	14
+
+/**
+ * make_snap_meta_tree - Make the snapshot metadata tree for a volume
+ * @snap_bnos:	block numbers for the volume superblocks of the snapshots
+ * @oldest:	extent reference tree for the oldest snapshot, already filled
+ * @vsb:	the volume superblock
+ *
+ * The other snapshots get empty extent reference trees.  Returns the number of
+ * blocks used by the trees, not counting the volume superblocks.
+ */
+static u64 make_snap_meta_tree(u64 *snap_bnos, struct btree_builder *oldest,
+			       struct apfs_superblock *vsb)
+{
+	struct btree_builder snap_meta;
+	u64 blocks = 0;
+	u32 i;
+
+	init_btree_builder(&snap_meta, APFS_OBJECT_TYPE_SNAPMETATREE, NULL, 0);
+
+	/* The metadata records come first, sorted by xid */
+	for (i = 0; i < param->syn_snapshots; ++i) {
+		struct btree_builder extref;
+		struct apfs_snap_metadata_key key;
+		struct {
+			struct apfs_snap_metadata_val v;
+			char name[SNAP_NAME_LEN];
+		} __packed val = {0};
+		u64 xid = MKFS_XID + i;
+		int namelen;
+
+		if (i == 0) {
+			val.v.extentref_tree_oid = cpu_to_le64(finish_btree(oldest));
+			blocks += oldest->bb_node_count;
+		} else {
+			init_btree_builder(&extref, APFS_OBJECT_TYPE_BLOCKREFTREE, NULL, 0);
+			val.v.extentref_tree_oid = cpu_to_le64(finish_btree(&extref));
+			blocks += extref.bb_node_count;
+		}
+
+		key.hdr.obj_id_and_type = cpu_to_le64((u64)APFS_TYPE_SNAP_METADATA << APFS_OBJ_TYPE_SHIFT | xid);
+		val.v.sblock_oid = cpu_to_le64(snap_bnos[i]);
+		val.v.create_time = val.v.change_time = cpu_to_le64(get_timestamp());
+		val.v.extentref_tree_type = cpu_to_le32(APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_BTREE);
+		namelen = snprintf(val.name, SNAP_NAME_LEN, "snap%08u", i) + 1;
+		val.v.name_len = cpu_to_le16(namelen);
+		btree_add_record(&snap_meta, &key, sizeof(key), &val, sizeof(val.v) + namelen);
+	}
+
+	/* The names all have the same length, so they are sorted by xid too */
+	for (i = 0; i < param->syn_snapshots; ++i) {
+		struct {
+			struct apfs_snap_name_key k;
+			char name[SNAP_NAME_LEN];
+		} __packed key;
+		struct apfs_snap_name_val val;
+		int namelen;
+
+		key.k.hdr.obj_id_and_type = cpu_to_le64((u64)APFS_TYPE_SNAP_NAME << APFS_OBJ_TYPE_SHIFT |
+							(~0ULL & APFS_OBJ_ID_MASK));
+		namelen = snprintf(key.name, SNAP_NAME_LEN, "snap%08u", i) + 1;
+		key.k.name_len = cpu_to_le16(namelen);
+		val.snap_xid = cpu_to_le64(MKFS_XID + i);
+		btree_add_record(&snap_meta, &key, sizeof(key.k) + namelen, &val, sizeof(val));
+	}
+
+	vsb->apfs_snap_meta_tree_oid = cpu_to_le64(finish_btree(&snap_meta));
+	vsb->apfs_num_snapshots = cpu_to_le64(param->syn_snapshots);
+	return blocks + snap_meta.bb_node_count;
+}
+
+/**
+ * make_snapshot_supers - Make the volume superblocks for the snapshots
+ * @snap_bnos:	block numbers to use
+ * @vsb:	the finished volume superblock for the latest transaction
+ *
+ * All the snapshots share the catalog and object map of the latest transaction,
+ * since nothing changed in between.
+ */
+static void make_snapshot_supers(u64 *snap_bnos, struct apfs_superblock *vsb)
+{
+	u32 i;
+
+	for (i = 0; i < param->syn_snapshots; ++i) {
+		struct apfs_superblock *snap = get_zeroed_block(snap_bnos[i]);
+
+		memcpy(snap, vsb, sizeof(*snap));
+		snap->apfs_omap_oid = 0;
+		snap->apfs_extentref_tree_oid = 0;
+		snap->apfs_snap_meta_tree_oid = 0;
+		snap->apfs_num_snapshots = cpu_to_le64(i); /* The older ones */
+		set_object_header(&snap->apfs_o, snap_bnos[i],
+				  APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_FS,
+				  APFS_OBJECT_TYPE_INVALID);
+		release_blocks(snap);
+	}
+}
+
 /**
  * make_volume - Make a volume
  * @bno: block number for the volume superblock
  * @oid: object id for the volume superblock
+ *
+ * Returns the next object id available after the catalog nodes.
  */
-static void make_volume(u64 bno, u64 oid)
+static u64 make_volume(u64 bno, u64 oid)
 {
 	struct apfs_superblock *vsb = get_zeroed_block(bno);
+	struct btree_builder omap, cat, extref, oldest_extref;
+	u64 *snap_bnos = NULL;
+	u64 omap_bno, blocks;
+	u32 i;
 
 	vsb->apfs_magic = cpu_to_le32(APFS_MAGIC);
 
@@ -144,9 +235,6 @@ static void make_volume(u64 bno, u64 oid)
 	/* Encryption is not supported, but this still needs to be set */
 	set_meta_crypto(&vsb->apfs_meta_crypto);
 
-	/* We won't create any user inodes */
-	vsb->apfs_next_obj_id = cpu_to_le64(APFS_MIN_USER_INO_NUM);
-
 	set_uuid(vsb->apfs_vol_uuid, param->vol_uuid);
 	vsb->apfs_fs_flags = cpu_to_le64(APFS_FS_UNENCRYPTED);
 
@@ -165,27 +253,46 @@ static void make_volume(u64 bno, u64 oid)
 	vsb->apfs_snap_meta_tree_type = cpu_to_le32(APFS_OBJ_PHYSICAL |
 						    APFS_OBJECT_TYPE_BTREE);
 
-	vsb->apfs_omap_oid = cpu_to_le64(FIRST_VOL_OMAP_BNO);
-	make_omap_btree(FIRST_VOL_OMAP_BNO, true /* is_vol */);
-	vsb->apfs_root_tree_oid = cpu_to_le64(FIRST_VOL_CAT_ROOT_OID);
-	make_cat_root(FIRST_VOL_CAT_ROOT_BNO, FIRST_VOL_CAT_ROOT_OID);
+	if (param->syn_snapshots) {
+		snap_bnos = calloc(param->syn_snapshots, sizeof(*snap_bnos));
+		if (!snap_bnos)
+			system_error();
+		for (i = 0; i < param->syn_snapshots; ++i)
+			snap_bnos[i] = alloc_blocks(1);
+	}
 
-	/* The snapshot metadata and extent reference trees are empty */
-	vsb->apfs_extentref_tree_oid = cpu_to_le64(FIRST_VOL_EXTREF_ROOT_BNO);
-	make_empty_btree_root(FIRST_VOL_EXTREF_ROOT_BNO,
-			      FIRST_VOL_EXTREF_ROOT_BNO,
-			      APFS_OBJECT_TYPE_BLOCKREFTREE);
-	vsb->apfs_snap_meta_tree_oid = cpu_to_le64(FIRST_VOL_SNAP_ROOT_BNO);
-	make_empty_btree_root(FIRST_VOL_SNAP_ROOT_BNO, FIRST_VOL_SNAP_ROOT_BNO,
-			      APFS_OBJECT_TYPE_SNAPMETATREE);
+	/* The catalog nodes are the only virtual objects in the volume */
+	init_btree_builder(&omap, APFS_OBJECT_TYPE_OMAP, NULL, 0);
+	init_btree_builder(&cat, APFS_OBJECT_TYPE_FSTREE, &omap, FIRST_VOL_CAT_OID);
+	init_btree_builder(&extref, APFS_OBJECT_TYPE_BLOCKREFTREE, NULL, 0);
+	init_btree_builder(&oldest_extref, APFS_OBJECT_TYPE_BLOCKREFTREE, NULL, 0);
 
-	/* The root nodes of all four trees, plus the object map structure */
-	vsb->apfs_fs_alloc_count = cpu_to_le64(5);
+	/*
+	 * The extents already existed when the oldest snapshot was taken, so
+	 * that's where their references go; the later trees can see that one.
+	 */
+	make_catalog(vsb, &cat, param->syn_snapshots ? &oldest_extref : &extref);
+	vsb->apfs_root_tree_oid = cpu_to_le64(finish_btree(&cat));
+	vsb->apfs_extentref_tree_oid = cpu_to_le64(finish_btree(&extref));
+	blocks = cat.bb_node_count + extref.bb_node_count;
+
+	blocks += make_snap_meta_tree(snap_bnos, &oldest_extref, vsb);
+
+	omap_bno = alloc_blocks(1);
+	vsb->apfs_omap_oid = cpu_to_le64(omap_bno);
+	blocks += make_omap_btree(omap_bno, true /* is_vol */, &omap);
+
+	/* The data blocks were already counted by make_catalog() */
+	vsb->apfs_fs_alloc_count = cpu_to_le64(le64_to_cpu(vsb->apfs_fs_alloc_count) + blocks);
 
 	set_object_header(&vsb->apfs_o, oid,
 			  APFS_OBJ_VIRTUAL | APFS_OBJECT_TYPE_FS,
 			  APFS_OBJECT_TYPE_INVALID);
-	munmap(vsb, param->blocksize);
+
+	make_snapshot_supers(snap_bnos, vsb);
+	free(snap_bnos);
+	release_blocks(vsb);
+	return cat.bb_next_oid;
 }
 
 /**
@@ -239,7 +346,7 @@ static void make_cpoint_map_block(u64 bno)
 	set_object_header(&block->cpm_o, bno,
 			  APFS_OBJ_PHYSICAL | APFS_OBJECT_TYPE_CHECKPOINT_MAP,
 			  APFS_OBJECT_TYPE_INVALID);
-	munmap(block, param->blocksize);
+	release_blocks(block);
 }
 
 /**
@@ -255,7 +362,7 @@ static void make_cpoint_superblock(u64 bno, struct apfs_nx_superblock *sb_copy)
 	struct apfs_nx_superblock *sb = get_zeroed_block(bno);
 
 	memcpy(sb, sb_copy, sizeof(*sb));
-	munmap(sb, param->blocksize);
+	release_blocks(sb);
 }
 
 /**
@@ -275,7 +382,7 @@ static void make_empty_reaper(u64 bno, u64 oid)
 	set_object_header(&reaper->nr_o, oid,
 			  APFS_OBJ_EPHEMERAL | APFS_OBJECT_TYPE_NX_REAPER,
 			  APFS_OBJECT_TYPE_INVALID);
-	munmap(reaper, param->blocksize);
+	release_blocks(reaper);
 }
 
 /**
@@ -284,7 +391,12 @@ static void make_empty_reaper(u64 bno, u64 oid)
 void make_container(void)
 {
 	struct apfs_nx_superblock *sb_copy;
+	struct btree_builder omap;
 	u64 size = param->blocksize * param->block_count;
+	u64 omap_bno, vol_bno, next_oid;
+
+	/* Nothing can be allocated before this */
+	prepare_spaceman();
 
 	sb_copy = get_zeroed_block(APFS_NX_BLOCK_NUM);
 
@@ -298,22 +410,31 @@ void make_container(void)
 
 	set_uuid(sb_copy->nx_uuid, param->main_uuid);
 
-	/* Leave some room for the objects created by the mkfs */
-	sb_copy->nx_next_oid = cpu_to_le64(APFS_OID_RESERVED_COUNT + 100);
-	sb_copy->nx_next_xid = cpu_to_le64(MKFS_XID + 1);
-
 	set_checkpoint_areas(sb_copy);
 
-	sb_copy->nx_spaceman_oid = cpu_to_le64(SPACEMAN_OID);
-	make_spaceman(SPACEMAN_BNO, SPACEMAN_OID);
 	sb_copy->nx_reaper_oid = cpu_to_le64(REAPER_OID);
 	make_empty_reaper(REAPER_BNO, REAPER_OID);
-	sb_copy->nx_omap_oid = cpu_to_le64(MAIN_OMAP_BNO);
-	make_omap_btree(MAIN_OMAP_BNO, false /* is_vol */);
 
 	sb_copy->nx_max_file_systems = cpu_to_le32(get_max_volumes(size));
 	sb_copy->nx_fs_oid[0] = cpu_to_le64(FIRST_VOL_OID);
-	make_volume(FIRST_VOL_BNO, FIRST_VOL_OID);
+	vol_bno = alloc_blocks(1);
+	next_oid = make_volume(vol_bno, FIRST_VOL_OID);
+
+	init_btree_builder(&omap, APFS_OBJECT_TYPE_OMAP, NULL, 0);
+	btree_add_omap_record(&omap, FIRST_VOL_OID, vol_bno);
+	omap_bno = alloc_blocks(1);
+	sb_copy->nx_omap_oid = cpu_to_le64(omap_bno);
+	make_omap_btree(omap_bno, false /* is_vol */, &omap);
+
+	/* Leave some room for the objects created by the mkfs */
+	if (next_oid < APFS_OID_RESERVED_COUNT + 100)
+		next_oid = APFS_OID_RESERVED_COUNT + 100;
+	sb_copy->nx_next_oid = cpu_to_le64(next_oid);
+	sb_copy->nx_next_xid = cpu_to_le64(CPOINT_XID + 1);
+
+	/* The space manager goes last, once all blocks are allocated */
+	sb_copy->nx_spaceman_oid = cpu_to_le64(SPACEMAN_OID);
+	make_spaceman(SPACEMAN_BNO, SPACEMAN_OID);
 
 	set_ephemeral_info(&sb_copy->nx_ephemeral_info[0]);
 
@@ -325,9 +446,9 @@ void make_container(void)
 	 * If the disk was ever formatted as APFS, valid checkpoint superblocks
 	 * may still remain.  Wipe the area to avoid mounting them by mistake.
 	 */
-	zero_area(CPOINT_DESC_BASE, CPOINT_DESC_BLOCKS);
+	zero_blocks(CPOINT_DESC_BASE, CPOINT_DESC_BLOCKS);
 	make_cpoint_map_block(CPOINT_MAP_BNO);
 	make_cpoint_superblock(CPOINT_SB_BNO, sb_copy);
 
-	munmap(sb_copy, param->blocksize);
+	release_blocks(sb_copy);
 }